@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017-2019 The GalaxyCash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Measure how a node's socket handler scales with the number of connected peers.
+
+Opens increasing numbers of loopback connections to a running regtest node,
+completes the version handshake on each, and then measures ping round trips
+across all of them. Run it once against a node started with -socketevents=epoll
+and once with -socketevents=select to compare the backends, e.g.
+
+    galaxycashd -regtest -listen -maxconnections=4000 -socketevents=epoll
+    contrib/devtools/connection-bench.py --steps 100,500,1000,2000
+"""
+
+import argparse
+import hashlib
+import random
+import resource
+import selectors
+import socket
+import struct
+import sys
+import time
+
+PROTOCOL_VERSION = 94440
+MAGIC = {
+    'main': bytes([0x4e, 0xe6, 0xe6, 0x4e]),
+    'test': bytes([0x4e, 0xe6, 0xe6, 0x4e]),
+    'regtest': bytes([0xcb, 0xf2, 0xc0, 0xef]),
+}
+DEFAULT_PORT = {'main': 7604, 'test': 17604, 'regtest': 27604}
+
+
+def sha256d(data):
+    return hashlib.sha256(hashlib.sha256(data).digest()).digest()
+
+
+def ser_string(s):
+    assert len(s) < 253
+    return bytes([len(s)]) + s
+
+
+def ser_addr(host, port):
+    return struct.pack('<Q', 0) + b'\x00' * 10 + b'\xff\xff' + socket.inet_aton(host) + struct.pack('>H', port)
+
+
+def make_message(magic, command, payload):
+    return (magic + command.encode('ascii').ljust(12, b'\x00') + struct.pack('<I', len(payload)) +
+            sha256d(payload)[:4] + payload)
+
+
+def version_payload(host, port):
+    return (struct.pack('<iQq', PROTOCOL_VERSION, 0, int(time.time())) + ser_addr(host, port) + ser_addr('0.0.0.0', 0) +
+            struct.pack('<Q', random.getrandbits(64)) + ser_string(b'/connection-bench:0.1/') + struct.pack('<i?', 0, False))
+
+
+class Peer:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = b''
+        self.handshake = False
+        self.ping_nonce = None
+        self.ping_sent = 0.0
+
+    def messages(self):
+        """Yield the (command, payload) of every complete message in the buffer."""
+        while len(self.buf) >= 24:
+            length = struct.unpack('<I', self.buf[16:20])[0]
+            if len(self.buf) < 24 + length:
+                return
+            command = self.buf[4:16].rstrip(b'\x00').decode('ascii', 'replace')
+            payload = self.buf[24:24 + length]
+            self.buf = self.buf[24 + length:]
+            yield command, payload
+
+
+def pump(sel, peers, magic, until, timeout):
+    """Service readable peers until until() is true or timeout expires; returns ping latencies."""
+    latencies = []
+    deadline = time.time() + timeout
+    while not until() and time.time() < deadline:
+        for key, _ in sel.select(timeout=0.1):
+            peer = key.data
+            try:
+                data = peer.sock.recv(65536)
+            except (BlockingIOError, InterruptedError):
+                continue
+            except OSError:
+                data = b''
+            if not data:
+                sel.unregister(peer.sock)
+                peers.remove(peer)
+                continue
+            peer.buf += data
+            for command, payload in peer.messages():
+                if command == 'version':
+                    peer.sock.sendall(make_message(magic, 'verack', b''))
+                elif command == 'verack':
+                    peer.handshake = True
+                elif command == 'ping':
+                    peer.sock.sendall(make_message(magic, 'pong', payload))
+                elif command == 'pong' and peer.ping_nonce is not None and payload[:8] == peer.ping_nonce:
+                    latencies.append(time.time() - peer.ping_sent)
+                    peer.ping_nonce = None
+    return latencies
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--chain', choices=sorted(MAGIC), default='regtest')
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, help='P2P port of the node (default: the chain default)')
+    parser.add_argument('--steps', default='50,100,250,500,1000', help='comma separated peer counts to measure at')
+    parser.add_argument('--rounds', type=int, default=5, help='ping rounds per step')
+    args = parser.parse_args()
+
+    magic = MAGIC[args.chain]
+    port = args.port or DEFAULT_PORT[args.chain]
+    steps = [int(n) for n in args.steps.split(',')]
+
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, max(soft, max(steps) + 64)), hard))
+
+    sel = selectors.DefaultSelector()
+    peers = []
+    print('%8s %10s %10s %10s %12s' % ('peers', 'connect/s', 'p50 ms', 'p99 ms', 'pings/s'))
+    for target in steps:
+        start = time.time()
+        added = 0
+        while len(peers) < target:
+            try:
+                sock = socket.create_connection((args.host, port), timeout=10)
+            except OSError as e:
+                print('connection %d failed: %s' % (len(peers) + 1, e), file=sys.stderr)
+                return 1
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            sock.sendall(make_message(magic, 'version', version_payload(args.host, port)))
+            sock.setblocking(False)
+            peer = Peer(sock)
+            sel.register(sock, selectors.EVENT_READ, peer)
+            peers.append(peer)
+            added += 1
+        pump(sel, peers, magic, lambda: all(p.handshake for p in peers), 60)
+        connect_rate = added / max(time.time() - start, 1e-9)
+        if len(peers) < target or not all(p.handshake for p in peers):
+            print('only %d of %d peers completed the handshake; is -maxconnections high enough?' %
+                  (sum(p.handshake for p in peers), target), file=sys.stderr)
+            return 1
+
+        latencies = []
+        start = time.time()
+        for _ in range(args.rounds):
+            for peer in peers:
+                peer.ping_nonce = struct.pack('<Q', random.getrandbits(64))
+                peer.ping_sent = time.time()
+                peer.sock.sendall(make_message(magic, 'ping', peer.ping_nonce))
+            latencies += pump(sel, peers, magic, lambda: all(p.ping_nonce is None for p in peers), 60)
+        elapsed = max(time.time() - start, 1e-9)
+        print('%8d %10.1f %10.2f %10.2f %12.1f' % (len(peers), connect_rate, percentile(latencies, 0.5) * 1000,
+                                                 percentile(latencies, 0.99) * 1000, len(latencies) / elapsed))
+
+    for peer in peers:
+        peer.sock.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
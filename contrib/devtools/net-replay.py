@@ -0,0 +1,407 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017-2019 The GalaxyCash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Record P2P message streams from a node, and replay them into another one through fake loopback peers.
+
+The record command connects to a node as an ordinary peer, asks it for headers,
+blocks, sporks, the masternode list and its mempool, fetches everything it
+announces, and writes the messages it receives to a capture file:
+
+    contrib/devtools/net-replay.py record --chain test --host 10.0.0.5 --blocks 500 --duration 600 testnet.cap
+
+The replay command opens --peers connections to a node, completes the
+handshake on each, and sends every peer the captured messages at their
+recorded pace (scaled by --speed), delayed by --latency +- --jitter ms and with
+a --loss fraction of them dropped. Each message is followed by a ping; as a
+peer's messages are processed in order, the time until its pong comes back is
+the processing latency of that message, queueing included. At the end it
+reports messages/s, bytes/s, latency percentiles per command and, given the
+node's --pid, its memory growth:
+
+    galaxycashd -regtest -listen -maxconnections=200
+    contrib/devtools/net-replay.py replay --peers 50 --latency 20 --jitter 10 --loss 0.01 --pid $(pidof galaxycashd) testnet.cap
+
+Capture files are a sequence of records, each an 8 byte little-endian
+microsecond offset from the start of the capture followed by the message as
+it was received (24 byte header and payload). Messages are reframed with the
+magic of --chain on replay, so a capture taken on testnet can be replayed into
+a regtest node.
+"""
+
+import argparse
+import hashlib
+import heapq
+import random
+import resource
+import selectors
+import socket
+import struct
+import sys
+import time
+
+PROTOCOL_VERSION = 94440
+MAGIC = {
+    'main': bytes([0x4e, 0xe6, 0xe6, 0x4e]),
+    'test': bytes([0x4e, 0xe6, 0xe6, 0x4e]),
+    'regtest': bytes([0xcb, 0xf2, 0xc0, 0xef]),
+}
+DEFAULT_PORT = {'main': 7604, 'test': 17604, 'regtest': 27604}
+
+# getdata/inv types, see GetDataMsg in src/protocol.h
+MSG_TX = 1
+MSG_BLOCK = 2
+MSG_SPORK = 4
+MSG_MASTERNODE_WINNER = 7
+MSG_MASTERNODE_ANNOUNCE = 10
+MSG_MASTERNODE_PING = 11
+FETCH_TYPES = (MSG_TX, MSG_BLOCK, MSG_SPORK, MSG_MASTERNODE_WINNER, MSG_MASTERNODE_ANNOUNCE, MSG_MASTERNODE_PING)
+
+# Handshake and keepalive messages are generated by the harness itself, not replayed
+SKIP_COMMANDS = {'version', 'verack', 'ping', 'pong', 'sendheaders', 'sendcmpct', 'feefilter', 'reject'}
+
+
+def sha256d(data):
+    return hashlib.sha256(hashlib.sha256(data).digest()).digest()
+
+
+def ser_compact_size(n):
+    if n < 253:
+        return bytes([n])
+    if n <= 0xffff:
+        return b'\xfd' + struct.pack('<H', n)
+    if n <= 0xffffffff:
+        return b'\xfe' + struct.pack('<I', n)
+    return b'\xff' + struct.pack('<Q', n)
+
+
+def deser_compact_size(data, pos):
+    n = data[pos]
+    if n < 253:
+        return n, pos + 1
+    size = {253: 2, 254: 4, 255: 8}[n]
+    return int.from_bytes(data[pos + 1:pos + 1 + size], 'little'), pos + 1 + size
+
+
+def ser_string(s):
+    return ser_compact_size(len(s)) + s
+
+
+def ser_addr(host, port):
+    return struct.pack('<Q', 0) + b'\x00' * 10 + b'\xff\xff' + socket.inet_aton(host) + struct.pack('>H', port)
+
+
+def make_message(magic, command, payload):
+    return (magic + command.encode('ascii').ljust(12, b'\x00') + struct.pack('<I', len(payload)) +
+            sha256d(payload)[:4] + payload)
+
+
+def version_payload(host, port, agent):
+    return (struct.pack('<iQq', PROTOCOL_VERSION, 0, int(time.time())) + ser_addr(host, port) + ser_addr('0.0.0.0', 0) +
+            struct.pack('<Q', random.getrandbits(64)) + ser_string(agent) + struct.pack('<i?', 0, True))
+
+
+def inv_payload(invs):
+    return ser_compact_size(len(invs)) + b''.join(struct.pack('<I', t) + h for t, h in invs)
+
+
+def deser_inv(payload):
+    count, pos = deser_compact_size(payload, 0)
+    invs = []
+    for _ in range(count):
+        invs.append((struct.unpack('<I', payload[pos:pos + 4])[0], payload[pos + 4:pos + 36]))
+        pos += 36
+    return invs
+
+
+def get_rss_kib(pid):
+    """Resident set size of a process in KiB, or None if it cannot be read."""
+    try:
+        with open('/proc/%d/status' % pid, encoding='ascii') as f:
+            for line in f:
+                if line.startswith('VmRSS:'):
+                    return int(line.split()[1])
+    except (OSError, ValueError):
+        pass
+    return None
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+class Peer:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = b''
+        self.out = b''
+        self.handshake = False
+        self.pings = {}
+
+    def messages(self):
+        """Yield the (raw message, command, payload) of every complete message in the buffer."""
+        while len(self.buf) >= 24:
+            length = struct.unpack('<I', self.buf[16:20])[0]
+            if len(self.buf) < 24 + length:
+                return
+            raw = self.buf[:24 + length]
+            command = self.buf[4:16].rstrip(b'\x00').decode('ascii', 'replace')
+            self.buf = self.buf[24 + length:]
+            yield raw, command, raw[24:]
+
+    def send(self, data):
+        self.out += data
+        self.flush()
+
+    def flush(self):
+        while self.out:
+            try:
+                sent = self.sock.send(self.out)
+            except (BlockingIOError, InterruptedError):
+                return
+            self.out = self.out[sent:]
+
+
+def connect(host, port, magic, agent):
+    sock = socket.create_connection((host, port), timeout=10)
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    sock.sendall(make_message(magic, 'version', version_payload(host, port, agent)))
+    sock.setblocking(False)
+    return Peer(sock)
+
+
+def read_capture(path):
+    records = []
+    with open(path, 'rb') as f:
+        while True:
+            head = f.read(8 + 24)
+            if len(head) < 8 + 24:
+                break
+            offset = struct.unpack('<Q', head[:8])[0]
+            length = struct.unpack('<I', head[8 + 16:8 + 20])[0]
+            payload = f.read(length)
+            if len(payload) < length:
+                break
+            command = head[8 + 4:8 + 16].rstrip(b'\x00').decode('ascii', 'replace')
+            if command not in SKIP_COMMANDS:
+                records.append((offset, command, payload))
+    return records
+
+
+def record(args):
+    magic = MAGIC[args.chain]
+    port = args.port or DEFAULT_PORT[args.chain]
+    peer = connect(args.host, port, magic, b'/net-replay:0.1/')
+    sel = selectors.DefaultSelector()
+    sel.register(peer.sock, selectors.EVENT_READ)
+
+    requested = set()
+    blocks_wanted = args.blocks
+    counts = {}
+    start = time.time()
+    deadline = start + args.duration
+    with open(args.capture, 'wb') as out:
+        while time.time() < deadline:
+            if not sel.select(timeout=0.5):
+                continue
+            try:
+                data = peer.sock.recv(1 << 20)
+            except (BlockingIOError, InterruptedError):
+                continue
+            if not data:
+                print('node closed the connection', file=sys.stderr)
+                break
+            peer.buf += data
+            for raw, command, payload in peer.messages():
+                out.write(struct.pack('<Q', int((time.time() - start) * 1e6)) + raw)
+                counts[command] = counts.get(command, 0) + 1
+                if command == 'version':
+                    peer.send(make_message(magic, 'verack', b''))
+                elif command == 'verack':
+                    # Headers and block invs from genesis: a locator of unknown hashes forks off at genesis
+                    locator = struct.pack('<IB', PROTOCOL_VERSION, 1) + b'\x00' * 64
+                    peer.send(make_message(magic, 'getheaders', locator))
+                    peer.send(make_message(magic, 'getblocks', locator))
+                    peer.send(make_message(magic, 'getsporks', b''))
+                    # An empty CTxIn asks for the whole masternode list
+                    peer.send(make_message(magic, 'dseg', b'\x00' * 32 + b'\xff' * 4 + b'\x00' + b'\xff' * 4))
+                    peer.send(make_message(magic, 'mempool', b''))
+                    peer.send(make_message(magic, 'getaddr', b''))
+                elif command == 'ping':
+                    peer.send(make_message(magic, 'pong', payload))
+                elif command == 'inv':
+                    wanted = []
+                    for t, h in deser_inv(payload):
+                        if t not in FETCH_TYPES or (t, h) in requested:
+                            continue
+                        if t == MSG_BLOCK:
+                            if blocks_wanted <= 0:
+                                continue
+                            blocks_wanted -= 1
+                        wanted.append((t, h))
+                    requested.update(wanted)
+                    if wanted:
+                        peer.send(make_message(magic, 'getdata', inv_payload(wanted)))
+    peer.sock.close()
+
+    print('recorded %d messages in %.0fs' % (sum(counts.values()), time.time() - start))
+    for command in sorted(counts):
+        print('%12s %8d' % (command, counts[command]))
+    return 0
+
+
+def replay(args):
+    magic = MAGIC[args.chain]
+    port = args.port or DEFAULT_PORT[args.chain]
+    records = read_capture(args.capture)
+    if not records:
+        print('no messages to replay in %s' % args.capture, file=sys.stderr)
+        return 1
+    rng = random.Random(args.seed)
+
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, max(soft, args.peers + 64)), hard))
+
+    sel = selectors.DefaultSelector()
+    peers = []
+    for _ in range(args.peers):
+        try:
+            peer = connect(args.host, port, magic, b'/net-replay:0.1/')
+        except OSError as e:
+            print('connection %d failed: %s' % (len(peers) + 1, e), file=sys.stderr)
+            return 1
+        sel.register(peer.sock, selectors.EVENT_READ, peer)
+        peers.append(peer)
+
+    latencies = {}
+
+    def pump(timeout):
+        for key, _ in sel.select(timeout=timeout):
+            peer = key.data
+            try:
+                data = peer.sock.recv(1 << 20)
+            except (BlockingIOError, InterruptedError):
+                continue
+            except OSError:
+                data = b''
+            if not data:
+                print('node closed a connection', file=sys.stderr)
+                sel.unregister(peer.sock)
+                peers.remove(peer)
+                continue
+            peer.buf += data
+            for _, command, payload in peer.messages():
+                if command == 'version':
+                    peer.send(make_message(magic, 'verack', b''))
+                elif command == 'verack':
+                    peer.handshake = True
+                elif command == 'ping':
+                    peer.send(make_message(magic, 'pong', payload))
+                elif command == 'pong' and payload[:8] in peer.pings:
+                    sent_command, sent = peer.pings.pop(payload[:8])
+                    latencies.setdefault(sent_command, []).append(time.time() - sent)
+        for peer in peers:
+            peer.flush()
+
+    deadline = time.time() + 60
+    while not all(p.handshake for p in peers) and time.time() < deadline:
+        pump(0.1)
+    if len(peers) < args.peers or not all(p.handshake for p in peers):
+        print('only %d of %d peers completed the handshake; is -maxconnections high enough?' %
+              (sum(p.handshake for p in peers), args.peers), file=sys.stderr)
+        return 1
+
+    rss_start = get_rss_kib(args.pid) if args.pid else None
+
+    # Every peer sends every message once; schedule them all up front as (due time, sequence, peer, record)
+    start = time.time()
+    schedule = []
+    dropped = 0
+    for n, peer in enumerate(peers):
+        for i, (offset, command, payload) in enumerate(records):
+            if rng.random() < args.loss:
+                dropped += 1
+                continue
+            delay = max(0.0, args.latency + rng.uniform(-args.jitter, args.jitter)) / 1000
+            due = start + offset / 1e6 / args.speed + delay
+            schedule.append((due, n * len(records) + i, peer, command, payload))
+    heapq.heapify(schedule)
+
+    sent_messages = 0
+    sent_bytes = 0
+    while schedule:
+        now = time.time()
+        while schedule and schedule[0][0] <= now:
+            _, _, peer, command, payload = heapq.heappop(schedule)
+            if peer not in peers:
+                continue
+            nonce = struct.pack('<Q', rng.getrandbits(64))
+            peer.pings[nonce] = (command, time.time())
+            message = make_message(magic, command, payload)
+            peer.send(message + make_message(magic, 'ping', nonce))
+            sent_messages += 1
+            sent_bytes += len(message)
+        pump(max(0.0, min(0.05, schedule[0][0] - time.time())) if schedule else 0)
+
+    # Wait for the node to work through its backlog
+    deadline = time.time() + args.drain
+    while any(p.pings for p in peers) and time.time() < deadline:
+        pump(0.1)
+    elapsed = max(time.time() - start, 1e-9)
+    pending = sum(len(p.pings) for p in peers)
+    rss_end = get_rss_kib(args.pid) if args.pid else None
+
+    print('%d peers, %d messages sent (%d dropped), %.1f MB in %.2fs' %
+          (len(peers), sent_messages, dropped, sent_bytes / 1e6, elapsed))
+    print('%.1f messages/s, %.2f MB/s' % (sent_messages / elapsed, sent_bytes / 1e6 / elapsed))
+    if pending:
+        print('%d messages still unanswered after draining for %ds' % (pending, args.drain))
+    if rss_start is not None and rss_end is not None:
+        print('node RSS %.1f MB -> %.1f MB (%+.1f MB)' % (rss_start / 1024, rss_end / 1024, (rss_end - rss_start) / 1024))
+    print()
+    print('%12s %8s %10s %10s %10s' % ('command', 'count', 'p50 ms', 'p99 ms', 'max ms'))
+    for command in sorted(latencies):
+        values = latencies[command]
+        print('%12s %8d %10.2f %10.2f %10.2f' % (command, len(values), percentile(values, 0.5) * 1000,
+                                                percentile(values, 0.99) * 1000, max(values) * 1000))
+
+    for peer in peers:
+        peer.sock.close()
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--chain', choices=sorted(MAGIC), default='regtest')
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, help='P2P port of the node (default: the chain default)')
+    subparsers = parser.add_subparsers(dest='command')
+    subparsers.required = True
+
+    parser_record = subparsers.add_parser('record', help='capture the messages a node sends to a new peer')
+    parser_record.add_argument('--duration', type=float, default=300, help='seconds to record for')
+    parser_record.add_argument('--blocks', type=int, default=200, help='number of blocks to fetch from genesis')
+    parser_record.add_argument('capture', help='capture file to write')
+    parser_record.set_defaults(func=record)
+
+    parser_replay = subparsers.add_parser('replay', help='send a capture to a node from fake peers')
+    parser_replay.add_argument('--peers', type=int, default=8, help='number of peers replaying the capture')
+    parser_replay.add_argument('--speed', type=float, default=1.0, help='replay speed relative to the recording')
+    parser_replay.add_argument('--latency', type=float, default=0.0, help='added delay per message in ms')
+    parser_replay.add_argument('--jitter', type=float, default=0.0, help='random variation of the delay in ms')
+    parser_replay.add_argument('--loss', type=float, default=0.0, help='fraction of messages to drop')
+    parser_replay.add_argument('--seed', type=int, help='seed for delays and losses, for repeatable runs')
+    parser_replay.add_argument('--drain', type=int, default=60, help='seconds to wait for outstanding pongs')
+    parser_replay.add_argument('--pid', type=int, help='process id of the node, to report its memory growth')
+    parser_replay.add_argument('capture', help='capture file to replay')
+    parser_replay.set_defaults(func=replay)
+
+    args = parser.parse_args()
+    return args.func(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
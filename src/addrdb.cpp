@@ -9,6 +9,7 @@
 #include <chainparams.h>
 #include <clientversion.h>
 #include <hash.h>
+#include <protocol.h>
 #include <random.h>
 #include <streams.h>
 #include <tinyformat.h>
@@ -119,19 +120,213 @@ bool CBanDB::Read(banmap_t& banSet)
     return DeserializeFileDB(pathBanlist, banSet);
 }
 
+/**
+ * peers.dat layout:
+ * * header, ADDRDB_HEADER_SIZE bytes:
+ *   * network magic
+ *   * version byte (ADDRDB_VERSION; the stream format starts with 0 or 1 here)
+ *   * bucket key the entries are hashed with
+ *   * zero padding, then the first 4 bytes of the hash of everything before it
+ * * one ADDRDB_RECORD_SIZE byte record per slot:
+ *   * first 4 bytes of the hash of the rest of the record
+ *   * flags: ADDRDB_RECORD_NEW or ADDRDB_RECORD_TRIED, or 0 for a free slot
+ *   * the CAddrInfo
+ *   * number of new buckets the entry is in, followed by each bucket as uint16
+ *   * zero padding
+ *
+ * Records are overwritten in place, so a record torn by a crash only loses
+ * that entry: it fails its checksum and is skipped on load.
+ */
+static const unsigned char ADDRDB_VERSION = 2;
+static const size_t ADDRDB_HEADER_SIZE = 64;
+static const size_t ADDRDB_RECORD_SIZE = 96;
+static const uint8_t ADDRDB_RECORD_NEW = 1;
+static const uint8_t ADDRDB_RECORD_TRIED = 2;
+
+namespace {
+
+uint32_t GetRecordChecksum(const unsigned char* pbegin, const unsigned char* pend)
+{
+    uint256 hash = Hash(pbegin, pend);
+    uint32_t nChecksum;
+    memcpy(&nChecksum, hash.begin(), sizeof(nChecksum));
+    return nChecksum;
+}
+
+std::vector<unsigned char> MakeHeader(const uint256& nKey)
+{
+    std::vector<unsigned char> vchHeader(ADDRDB_HEADER_SIZE, 0);
+    memcpy(&vchHeader[0], Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE);
+    vchHeader[4] = ADDRDB_VERSION;
+    memcpy(&vchHeader[5], nKey.begin(), nKey.size());
+    uint32_t nChecksum = GetRecordChecksum(&vchHeader[0], &vchHeader[ADDRDB_HEADER_SIZE - 4]);
+    memcpy(&vchHeader[ADDRDB_HEADER_SIZE - 4], &nChecksum, sizeof(nChecksum));
+    return vchHeader;
+}
+
+void MakeRecord(const CAddrSlot& slot, std::vector<unsigned char>& vchRecord)
+{
+    vchRecord.assign(ADDRDB_RECORD_SIZE, 0);
+    if (!slot.fUsed)
+        return;
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << (slot.fInTried ? ADDRDB_RECORD_TRIED : ADDRDB_RECORD_NEW);
+    ss << slot.info;
+    ss << (uint8_t)slot.vNewBuckets.size();
+    for (int nBucket : slot.vNewBuckets)
+        ss << (uint16_t)nBucket;
+    assert(ss.size() + 4 <= ADDRDB_RECORD_SIZE);
+
+    memcpy(&vchRecord[4], ss.data(), ss.size());
+    uint32_t nChecksum = GetRecordChecksum(&vchRecord[4], &vchRecord[ADDRDB_RECORD_SIZE]);
+    memcpy(&vchRecord[0], &nChecksum, sizeof(nChecksum));
+}
+
+//! Parse a record into slot; returns false for a corrupt one
+bool ParseRecord(const std::vector<unsigned char>& vchRecord, CAddrSlot& slot)
+{
+    if (vchRecord[4] == 0)
+        return true;
+
+    uint32_t nChecksum;
+    memcpy(&nChecksum, &vchRecord[0], sizeof(nChecksum));
+    if (nChecksum != GetRecordChecksum(&vchRecord[4], &vchRecord[ADDRDB_RECORD_SIZE]))
+        return false;
+
+    try {
+        CDataStream ss((const char*)&vchRecord[4], (const char*)vchRecord.data() + vchRecord.size(), SER_DISK, CLIENT_VERSION);
+        uint8_t nFlags;
+        ss >> nFlags;
+        if (nFlags != ADDRDB_RECORD_NEW && nFlags != ADDRDB_RECORD_TRIED)
+            return false;
+        ss >> slot.info;
+        uint8_t nBuckets;
+        ss >> nBuckets;
+        for (int n = 0; n < nBuckets; n++) {
+            uint16_t nBucket;
+            ss >> nBucket;
+            slot.vNewBuckets.push_back(nBucket);
+        }
+        slot.fUsed = true;
+        slot.fInTried = nFlags == ADDRDB_RECORD_TRIED;
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+bool WriteRecords(FILE* file, const std::vector<CAddrSlot>& vSlots)
+{
+    std::vector<unsigned char> vchRecord;
+    for (const CAddrSlot& slot : vSlots) {
+        MakeRecord(slot, vchRecord);
+        if (fseek(file, ADDRDB_HEADER_SIZE + (long)slot.nSlot * ADDRDB_RECORD_SIZE, SEEK_SET) != 0 ||
+            fwrite(vchRecord.data(), 1, vchRecord.size(), file) != vchRecord.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
 CAddrDB::CAddrDB()
 {
     pathAddr = GetDataDir() / "peers.dat";
 }
 
-bool CAddrDB::Write(const CAddrMan& addr)
+bool CAddrDB::Write(CAddrMan& addr)
 {
-    return SerializeFileDB("peers", pathAddr, addr);
+    bool fFull = !fs::exists(pathAddr);
+    uint256 nKey;
+    std::vector<CAddrSlot> vSlots;
+    int nSlots = addr.GetSlots(fFull, nKey, vSlots);
+
+    if (fFull) {
+        // Write a fresh table next to the old file and move it into place.
+        unsigned short randv = 0;
+        GetRandBytes((unsigned char*)&randv, sizeof(randv));
+        fs::path pathTmp = GetDataDir() / strprintf("peers.%04x", randv);
+
+        FILE *file = fsbridge::fopen(pathTmp, "wb");
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull()) {
+            addr.InvalidateSlots();
+            return error("%s: Failed to open file %s", __func__, pathTmp.string());
+        }
+        std::vector<unsigned char> vchHeader = MakeHeader(nKey);
+        if (fwrite(vchHeader.data(), 1, vchHeader.size(), fileout.Get()) != vchHeader.size() ||
+            !WriteRecords(fileout.Get(), vSlots)) {
+            addr.InvalidateSlots();
+            return error("%s: Failed to write %s", __func__, pathTmp.string());
+        }
+        FileCommit(fileout.Get());
+        fileout.fclose();
+
+        if (!RenameOver(pathTmp, pathAddr)) {
+            addr.InvalidateSlots();
+            return error("%s: Rename-into-place failed", __func__);
+        }
+    } else if (!vSlots.empty()) {
+        FILE *file = fsbridge::fopen(pathAddr, "r+b");
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull() || !WriteRecords(fileout.Get(), vSlots)) {
+            addr.InvalidateSlots();
+            return error("%s: Failed to update %s", __func__, pathAddr.string());
+        }
+        FileCommit(fileout.Get());
+    }
+
+    LogPrint(BCLog::ADDRMAN, "Wrote %u of %d records to peers.dat%s\n", vSlots.size(), nSlots, fFull ? " (full rewrite)" : "");
+    return true;
 }
 
 bool CAddrDB::Read(CAddrMan& addr)
 {
-    return DeserializeFileDB(pathAddr, addr);
+    uint256 nKey;
+    std::vector<CAddrSlot> vSlots;
+    int nSlots = 0;
+    int nCorrupt = 0;
+    {
+        FILE *file = fsbridge::fopen(pathAddr, "rb");
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: Failed to open file %s", __func__, pathAddr.string());
+
+        std::vector<unsigned char> vchHeader(ADDRDB_HEADER_SIZE);
+        size_t nHeader = fread(vchHeader.data(), 1, vchHeader.size(), filein.Get());
+        if (nHeader < 5 || memcmp(&vchHeader[0], Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE))
+            return error("%s: Invalid network magic number", __func__);
+        if (vchHeader[4] != ADDRDB_VERSION) {
+            // Stream format of older versions.
+            filein.fclose();
+            return DeserializeFileDB(pathAddr, addr);
+        }
+        memcpy(nKey.begin(), &vchHeader[5], nKey.size());
+        if (nHeader != ADDRDB_HEADER_SIZE || vchHeader != MakeHeader(nKey))
+            return error("%s: Checksum mismatch, header corrupted", __func__);
+
+        std::vector<unsigned char> vchRecord(ADDRDB_RECORD_SIZE);
+        while (fread(vchRecord.data(), 1, vchRecord.size(), filein.Get()) == vchRecord.size()) {
+            CAddrSlot slot;
+            slot.nSlot = nSlots++;
+            if (!ParseRecord(vchRecord, slot)) {
+                // Hand it over as a free slot, so that it gets cleared.
+                nCorrupt++;
+                slot = CAddrSlot();
+                slot.nSlot = nSlots - 1;
+                vSlots.push_back(slot);
+            } else if (slot.fUsed) {
+                vSlots.push_back(slot);
+            }
+        }
+    }
+
+    if (nCorrupt)
+        LogPrintf("%s: skipped %d corrupt records in %s\n", __func__, nCorrupt, pathAddr.string());
+    addr.LoadSlots(nKey, vSlots, nSlots);
+    return true;
 }
 
 bool CAddrDB::Read(CAddrMan& addr, CDataStream& ssPeers)
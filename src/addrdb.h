@@ -76,14 +76,22 @@ public:
 
 typedef std::map<CSubNet, CBanEntry> banmap_t;
 
-/** Access to the (IP) address database (peers.dat) */
+/**
+ * Access to the (IP) address database (peers.dat)
+ *
+ * The file is a header followed by a table of fixed-size records, one per
+ * address manager entry, so that a flush only rewrites the records of the
+ * entries that changed since the previous one; see addrdb.cpp for the layout.
+ * Files in the older stream format are still read, and rewritten as a table
+ * by the next flush.
+ */
 class CAddrDB
 {
 private:
     fs::path pathAddr;
 public:
     CAddrDB();
-    bool Write(const CAddrMan& addr);
+    bool Write(CAddrMan& addr);
     bool Read(CAddrMan& addr);
     static bool Read(CAddrMan& addr, CDataStream& ssPeers);
 };
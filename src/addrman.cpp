@@ -9,6 +9,18 @@
 #include <serialize.h>
 #include <streams.h>
 
+#include <limits>
+
+SaltedNetAddrHasher::SaltedNetAddrHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+size_t SaltedNetAddrHasher::operator()(const CNetAddr& addr) const
+{
+    unsigned char vch[16];
+    for (int n = 0; n < 16; n++)
+        vch[n] = addr.GetByte(15 - n);
+    return CSipHasher(k0, k1).Write(vch, sizeof(vch)).Finalize();
+}
+
 int CAddrInfo::GetTriedBucket(const uint256& nKey) const
 {
     uint64_t hash1 = (CHashWriter(SER_GETHASH, 0) << nKey << GetKey()).GetHash().GetCheapHash();
@@ -67,12 +79,12 @@ double CAddrInfo::GetChance(int64_t nNow) const
 
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
+    auto it = mapAddr.find(addr);
     if (it == mapAddr.end())
         return nullptr;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
+    auto it2 = mapInfo.find((*it).second);
     if (it2 != mapInfo.end())
         return &(*it2).second;
     return nullptr;
@@ -85,11 +97,59 @@ CAddrInfo* CAddrMan::Create(const CAddress& addr, const CNetAddr& addrSource, in
     mapAddr[addr] = nId;
     mapInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
+    AssignSlot(mapInfo[nId], nId);
     if (pnId)
         *pnId = nId;
     return &mapInfo[nId];
 }
 
+void CAddrMan::AssignSlot(CAddrInfo& info, int nId)
+{
+    if (vSlotFree.empty()) {
+        info.nSlot = vSlotId.size();
+        vSlotId.push_back(nId);
+    } else {
+        info.nSlot = vSlotFree.back();
+        vSlotFree.pop_back();
+        vSlotId[info.nSlot] = nId;
+    }
+    setSlotDirty.insert(info.nSlot);
+}
+
+void CAddrMan::ReleaseSlot(CAddrInfo& info)
+{
+    if (info.nSlot < 0)
+        return;
+    vSlotId[info.nSlot] = -1;
+    vSlotFree.push_back(info.nSlot);
+    setSlotDirty.insert(info.nSlot);
+    info.nSlot = -1;
+}
+
+void CAddrMan::MarkDirty(const CAddrInfo& info)
+{
+    if (info.nSlot >= 0)
+        setSlotDirty.insert(info.nSlot);
+}
+
+void CAddrMan::GetNewPositions(const std::vector<CAddress>& vAddr, const CNetAddr& source, uint256& nKeyOut, std::vector<std::pair<int, int>>& vPos)
+{
+    {
+        LOCK(cs);
+        nKeyOut = nKey;
+    }
+    vPos.reserve(vAddr.size());
+    for (const CAddress& addr : vAddr) {
+        if (!addr.IsRoutable()) {
+            vPos.emplace_back(-1, -1);
+            continue;
+        }
+        CAddrInfo info(addr, source);
+        int nUBucket = info.GetNewBucket(nKeyOut, source);
+        vPos.emplace_back(nUBucket, info.GetBucketPosition(nKeyOut, true, nUBucket));
+    }
+}
+
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
 {
     if (nRndPos1 == nRndPos2)
@@ -119,6 +179,7 @@ void CAddrMan::Delete(int nId)
 
     SwapRandom(info.nRandomPos, vRandom.size() - 1);
     vRandom.pop_back();
+    ReleaseSlot(info);
     mapAddr.erase(info);
     mapInfo.erase(nId);
     nNew--;
@@ -135,6 +196,8 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
         vvNew[nUBucket][nUBucketPos] = -1;
         if (infoDelete.nRefCount == 0) {
             Delete(nIdDelete);
+        } else {
+            MarkDirty(infoDelete);
         }
     }
 }
@@ -179,12 +242,14 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
         infoOld.nRefCount = 1;
         vvNew[nUBucket][nUBucketPos] = nIdEvict;
         nNew++;
+        MarkDirty(infoOld);
     }
     assert(vvTried[nKBucket][nKBucketPos] == -1);
 
     vvTried[nKBucket][nKBucketPos] = nId;
     nTried++;
     info.fInTried = true;
+    MarkDirty(info);
 }
 
 void CAddrMan::Good_(const CService& addr, int64_t nTime)
@@ -209,6 +274,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     info.nLastSuccess = nTime;
     info.nLastTry = nTime;
     info.nAttempts = 0;
+    MarkDirty(info);
     // nTime is not updated here, to avoid leaking information about
     // currently-connected peers.
 
@@ -239,7 +305,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     MakeTried(info, nId);
 }
 
-bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimePenalty)
+bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimePenalty, const std::pair<int, int>* pPos)
 {
     if (!addr.IsRoutable())
         return false;
@@ -257,11 +323,16 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         // periodically update nTime
         bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < 24 * 60 * 60);
         int64_t nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
-        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty))
+        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty)) {
             pinfo->nTime = std::max((int64_t)0, addr.nTime - nTimePenalty);
+            MarkDirty(*pinfo);
+        }
 
         // add services
-        pinfo->nServices = ServiceFlags(pinfo->nServices | addr.nServices);
+        if ((pinfo->nServices | addr.nServices) != pinfo->nServices) {
+            pinfo->nServices = ServiceFlags(pinfo->nServices | addr.nServices);
+            MarkDirty(*pinfo);
+        }
 
         // do not update if no new information is present
         if (!addr.nTime || (pinfo->nTime && addr.nTime <= pinfo->nTime))
@@ -288,8 +359,16 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         fNew = true;
     }
 
-    int nUBucket = pinfo->GetNewBucket(nKey, source);
-    int nUBucketPos = pinfo->GetBucketPosition(nKey, true, nUBucket);
+    // The position hashed ahead of time is only valid for the same port, as
+    // an existing entry for this address may have been added with another one.
+    int nUBucket, nUBucketPos;
+    if (pPos && static_cast<const CService&>(*pinfo) == addr) {
+        nUBucket = pPos->first;
+        nUBucketPos = pPos->second;
+    } else {
+        nUBucket = pinfo->GetNewBucket(nKey, source);
+        nUBucketPos = pinfo->GetBucketPosition(nKey, true, nUBucket);
+    }
     if (vvNew[nUBucket][nUBucketPos] != nId) {
         bool fInsert = vvNew[nUBucket][nUBucketPos] == -1;
         if (!fInsert) {
@@ -303,6 +382,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
             ClearNew(nUBucket, nUBucketPos);
             pinfo->nRefCount++;
             vvNew[nUBucket][nUBucketPos] = nId;
+            MarkDirty(*pinfo);
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -331,6 +411,7 @@ void CAddrMan::Attempt_(const CService& addr, bool fCountFailure, int64_t nTime)
     if (fCountFailure && info.nLastCountAttempt < nLastGood) {
         info.nLastCountAttempt = nTime;
         info.nAttempts++;
+        MarkDirty(info);
     }
 }
 
@@ -496,8 +577,10 @@ void CAddrMan::Connected_(const CService& addr, int64_t nTime)
 
     // update info
     int64_t nUpdateInterval = 20 * 60;
-    if (nTime - info.nTime > nUpdateInterval)
+    if (nTime - info.nTime > nUpdateInterval) {
         info.nTime = nTime;
+        MarkDirty(info);
+    }
 }
 
 void CAddrMan::SetServices_(const CService& addr, ServiceFlags nServices)
@@ -516,6 +599,151 @@ void CAddrMan::SetServices_(const CService& addr, ServiceFlags nServices)
 
     // update info
     info.nServices = nServices;
+    MarkDirty(info);
+}
+
+int CAddrMan::GetSlots(bool& fFull, uint256& nKeyOut, std::vector<CAddrSlot>& vSlots)
+{
+    LOCK(cs);
+
+    fFull |= fSlotsRewrite;
+    nKeyOut = nKey;
+
+    if (fFull) {
+        vSlotId.clear();
+        vSlotFree.clear();
+        setSlotDirty.clear();
+        for (auto& entry : mapInfo) {
+            entry.second.nSlot = vSlotId.size();
+            vSlotId.push_back(entry.first);
+        }
+        fSlotsRewrite = false;
+    }
+
+    // Which new buckets each entry is in is only kept implicitly in vvNew.
+    std::unordered_map<int, std::vector<int>> mapBuckets;
+    if (!fFull) {
+        for (int nSlot : setSlotDirty) {
+            if (vSlotId[nSlot] != -1)
+                mapBuckets[vSlotId[nSlot]];
+        }
+    }
+    for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
+        for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
+            int nId = vvNew[bucket][i];
+            if (nId == -1)
+                continue;
+            if (fFull) {
+                mapBuckets[nId].push_back(bucket);
+            } else {
+                auto it = mapBuckets.find(nId);
+                if (it != mapBuckets.end())
+                    it->second.push_back(bucket);
+            }
+        }
+    }
+
+    auto addSlot = [&](int nSlot) {
+        CAddrSlot slot;
+        slot.nSlot = nSlot;
+        int nId = vSlotId[nSlot];
+        if (nId != -1) {
+            const CAddrInfo& info = mapInfo[nId];
+            slot.fUsed = true;
+            slot.fInTried = info.fInTried;
+            slot.info = info;
+            if (!info.fInTried)
+                slot.vNewBuckets = mapBuckets[nId];
+        }
+        vSlots.push_back(slot);
+    };
+    if (fFull) {
+        vSlots.reserve(vSlotId.size());
+        for (size_t nSlot = 0; nSlot < vSlotId.size(); nSlot++)
+            addSlot(nSlot);
+    } else {
+        vSlots.reserve(setSlotDirty.size());
+        for (int nSlot : setSlotDirty)
+            addSlot(nSlot);
+    }
+    setSlotDirty.clear();
+
+    return vSlotId.size();
+}
+
+void CAddrMan::LoadSlots(const uint256& nKeyIn, const std::vector<CAddrSlot>& vSlots, int nSlots)
+{
+    LOCK(cs);
+
+    Clear();
+    nKey = nKeyIn;
+    vSlotId.assign(nSlots, -1);
+
+    int nLost = 0;
+    int nLostUnk = 0;
+    for (const CAddrSlot& slot : vSlots) {
+        if (slot.nSlot < 0 || slot.nSlot >= nSlots)
+            continue;
+        if (!slot.fUsed || mapAddr.count(slot.info)) {
+            setSlotDirty.insert(slot.nSlot);
+            continue;
+        }
+        int nId = nIdCount;
+        if (slot.fInTried) {
+            int nKBucket = slot.info.GetTriedBucket(nKey);
+            int nKBucketPos = slot.info.GetBucketPosition(nKey, false, nKBucket);
+            if (vvTried[nKBucket][nKBucketPos] != -1) {
+                setSlotDirty.insert(slot.nSlot);
+                nLost++;
+                continue;
+            }
+            CAddrInfo& info = mapInfo[nId];
+            info = slot.info;
+            info.fInTried = true;
+            vvTried[nKBucket][nKBucketPos] = nId;
+            nTried++;
+        } else {
+            CAddrInfo& info = mapInfo[nId];
+            info = slot.info;
+            for (int bucket : slot.vNewBuckets) {
+                if (bucket < 0 || bucket >= ADDRMAN_NEW_BUCKET_COUNT || info.nRefCount >= ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
+                    continue;
+                int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
+                if (vvNew[bucket][nUBucketPos] == -1) {
+                    vvNew[bucket][nUBucketPos] = nId;
+                    info.nRefCount++;
+                }
+            }
+            if (info.nRefCount == 0) {
+                // Collided with another entry in every bucket it was in.
+                mapInfo.erase(nId);
+                setSlotDirty.insert(slot.nSlot);
+                nLostUnk++;
+                continue;
+            }
+            nNew++;
+        }
+        CAddrInfo& info = mapInfo[nId];
+        info.nRandomPos = vRandom.size();
+        info.nSlot = slot.nSlot;
+        vRandom.push_back(nId);
+        mapAddr[info] = nId;
+        vSlotId[slot.nSlot] = nId;
+        nIdCount++;
+    }
+
+    // Reuse the lowest free slots first.
+    for (int nSlot = nSlots - 1; nSlot >= 0; nSlot--) {
+        if (vSlotId[nSlot] == -1)
+            vSlotFree.push_back(nSlot);
+    }
+    fSlotsRewrite = false;
+
+    if (nLost + nLostUnk > 0) {
+        LogPrint(BCLog::ADDRMAN, "addrman lost %i new and %i tried addresses due to collisions\n", nLostUnk, nLost);
+    }
+
+    Check();
 }
 
 int CAddrMan::RandomInt(int nMax){
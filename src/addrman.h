@@ -16,6 +16,8 @@
 #include <map>
 #include <set>
 #include <stdint.h>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 /**
@@ -51,6 +53,9 @@ private:
     //! position in vRandom
     int nRandomPos;
 
+    //! record slot in peers.dat, -1 if not assigned yet (memory only)
+    int nSlot;
+
     friend class CAddrMan;
 
 public:
@@ -74,6 +79,7 @@ public:
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
+        nSlot = -1;
     }
 
     CAddrInfo(const CAddress &addrIn, const CNetAddr &addrSource) : CAddress(addrIn), source(addrSource)
@@ -109,10 +115,36 @@ public:
 
 };
 
+/** Salted hasher for the address index, so that peers cannot aim collisions at a single hash bucket */
+class SaltedNetAddrHasher
+{
+private:
+    const uint64_t k0, k1;
+
+public:
+    SaltedNetAddrHasher();
+
+    size_t operator()(const CNetAddr& addr) const;
+};
+
+/** One record slot of peers.dat, as handed between CAddrMan and CAddrDB */
+struct CAddrSlot
+{
+    int nSlot;
+    //! false for a free slot; the other fields are then unused
+    bool fUsed;
+    bool fInTried;
+    CAddrInfo info;
+    //! new buckets the entry is referenced from (empty for tried entries)
+    std::vector<int> vNewBuckets;
+
+    CAddrSlot() : nSlot(-1), fUsed(false), fInTried(false) {}
+};
+
 /** Stochastic address manager
  *
  * Design goals:
- *  * Keep the address tables in-memory, and asynchronously dump the entire table to peers.dat.
+ *  * Keep the address tables in-memory, and asynchronously write the entries that changed back to peers.dat.
  *  * Make sure no (localized) attacker can fill the entire table with his nodes/addresses.
  *
  * To that end:
@@ -133,6 +165,8 @@ public:
  *      be observable by adversaries.
  *    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
  *      consistency checks for the entire data structure.
+ *  * Bucket positions of gossiped addresses are hashed before taking the lock, and peers.dat is written from a
+ *    copy of the changed entries, so that address relay from many peers does not hold up Select().
  */
 
 //! total number of buckets for tried addresses
@@ -189,10 +223,10 @@ private:
     int nIdCount;
 
     //! table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    std::unordered_map<int, CAddrInfo> mapInfo;
 
     //! find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    std::unordered_map<CNetAddr, int, SaltedNetAddrHasher> mapAddr;
 
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -212,6 +246,18 @@ private:
     //! last time Good was called (memory only)
     int64_t nLastGood;
 
+    //! nId stored in each record slot of peers.dat, -1 for free slots
+    std::vector<int> vSlotId;
+
+    //! free slots, reused before peers.dat is grown
+    std::vector<int> vSlotFree;
+
+    //! slots changed since the last flush
+    std::set<int> setSlotDirty;
+
+    //! whether the next flush has to rewrite peers.dat in full (new key, or slots not assigned yet)
+    bool fSlotsRewrite;
+
 protected:
     //! secret key to randomize bucket select with
     uint256 nKey;
@@ -226,6 +272,18 @@ protected:
     //! nTime and nServices of the found node are updated, if necessary.
     CAddrInfo* Create(const CAddress &addr, const CNetAddr &addrSource, int *pnId = nullptr);
 
+    //! Give an entry a record slot in peers.dat.
+    void AssignSlot(CAddrInfo& info, int nId);
+
+    //! Free the record slot of an entry that is being deleted.
+    void ReleaseSlot(CAddrInfo& info);
+
+    //! Remember that an entry has to be written back to peers.dat.
+    void MarkDirty(const CAddrInfo& info);
+
+    //! Hash each address into the new bucket position it would get from source, without holding cs.
+    void GetNewPositions(const std::vector<CAddress>& vAddr, const CNetAddr& source, uint256& nKeyOut, std::vector<std::pair<int, int>>& vPos);
+
     //! Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
@@ -241,8 +299,8 @@ protected:
     //! Mark an entry "good", possibly moving it from "new" to "tried".
     void Good_(const CService &addr, int64_t nTime);
 
-    //! Add an entry to the "new" table.
-    bool Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimePenalty);
+    //! Add an entry to the "new" table, at pPos (bucket, position) if it was hashed ahead of time.
+    bool Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimePenalty, const std::pair<int, int>* pPos = nullptr);
 
     //! Mark an entry as attempted to connect.
     void Attempt_(const CService &addr, bool fCountFailure, int64_t nTime);
@@ -269,6 +327,9 @@ protected:
 
 public:
     /**
+     * Stream format, used by peers.dat before it became a table of fixed-size records
+     * (see CAddrDB); still read to import such a file.
+     *
      * serialized format:
      * * version byte (currently 1)
      * * 0x20 + nKey (serialized as if it were a vector, for backward compatibility)
@@ -437,9 +498,9 @@ public:
 
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); ) {
+        for (std::unordered_map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); ) {
             if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
+                std::unordered_map<int, CAddrInfo>::const_iterator itCopy = it++;
                 Delete(itCopy->first);
                 nLostUnk++;
             } else {
@@ -475,8 +536,31 @@ public:
         nLastGood = 1; //Initially at 1 so that "never" is strictly worse.
         mapInfo.clear();
         mapAddr.clear();
+        vSlotId.clear();
+        vSlotFree.clear();
+        setSlotDirty.clear();
+        fSlotsRewrite = true;
     }
 
+    /**
+     * Collect the peers.dat records to write and the bucket key they are hashed with.
+     * Returns every slot, renumbered densely, if fFull is set or the file has to be
+     * rewritten anyway (fFull is then set on return); otherwise only the slots that
+     * changed since the last call. Returns the total number of slots.
+     */
+    int GetSlots(bool& fFull, uint256& nKeyOut, std::vector<CAddrSlot>& vSlots);
+
+    //! Make the next GetSlots return every slot, after writing peers.dat failed.
+    void InvalidateSlots()
+    {
+        LOCK(cs);
+        fSlotsRewrite = true;
+    }
+
+    //! Replace the tables by the records of a peers.dat written with bucket key nKeyIn; free
+    //! slots among vSlots are records to clear, other slots missing from it are already free.
+    void LoadSlots(const uint256& nKeyIn, const std::vector<CAddrSlot>& vSlots, int nSlots);
+
     CAddrMan()
     {
         Clear();
@@ -524,11 +608,17 @@ public:
     //! Add multiple addresses.
     bool Add(const std::vector<CAddress> &vAddr, const CNetAddr& source, int64_t nTimePenalty = 0)
     {
+        uint256 nKeyHashed;
+        std::vector<std::pair<int, int>> vPos;
+        GetNewPositions(vAddr, source, nKeyHashed, vPos);
+
         LOCK(cs);
         int nAdd = 0;
         Check();
-        for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
-            nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
+        // The key only changes when the tables are cleared or reloaded; hash again under the lock then.
+        bool fHashed = nKeyHashed == nKey;
+        for (size_t i = 0; i < vAddr.size(); i++)
+            nAdd += Add_(vAddr[i], source, nTimePenalty, fHashed ? &vPos[i] : nullptr) ? 1 : 0;
         Check();
         if (nAdd) {
             LogPrint(BCLog::ADDRMAN, "Added %i addresses from %s: %i tried, %i new\n", nAdd, source.ToString(), nTried, nNew);
@@ -5,7 +5,10 @@
 
 #include "alert.h"
 
+#include "chainparams.h"
 #include "clientversion.h"
+#include "net_processing.h"
+#include "netmessagedispatcher.h"
 #include "netmessagemaker.h"
 #include "pubkey.h"
 #include "timedata.h"
@@ -245,3 +248,38 @@ bool CAlert::ProcessAlert(const CPubKey& alertKey)
     LogPrint(BCLog::ALERT, "accepted alert %d, AppliesToMe()=%d\n", nID, AppliesToMe());
     return true;
 }
+
+static bool ProcessAlertMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    if (!fAlerts)
+        return true;
+
+    CAlert alert;
+    vRecv >> alert;
+
+    uint256 alertHash = alert.GetHash();
+    if (pfrom->setKnown.count(alertHash) == 0) {
+        if (alert.ProcessAlert(chainparams.DevPubKey())) {
+            // Relay
+            pfrom->setKnown.insert(alertHash);
+            connman->ForEachNode([&alert](CNode* pnode) {
+                alert.RelayTo(pnode);
+            });
+        } else {
+            // Small DoS penalty so peers that send us lots of
+            // duplicate/expired/invalid-signature/whatever alerts
+            // eventually get banned.
+            // This isn't a Misbehaving(100) (immediate ban) because the
+            // peer might be an older or different implementation with
+            // a different signature key, etc.
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 10);
+        }
+    }
+    return true;
+}
+
+void RegisterAlertMessageHandlers(CNetMessageDispatcher& dispatcher)
+{
+    dispatcher.Register(NetMsgType::ALERT, ProcessAlertMessage);
+}
@@ -16,6 +16,7 @@
 #include <string>
 
 class CAlert;
+class CNetMessageDispatcher;
 class CNode;
 class uint256;
 
@@ -111,4 +112,7 @@ public:
     static CAlert getAlertByHash(const uint256& hash);
 };
 
+/** Register the handler for received alert messages */
+void RegisterAlertMessageHandlers(CNetMessageDispatcher& dispatcher);
+
 #endif // BITCOIN_ALERT_H
@@ -172,6 +172,8 @@ enum BlockStatus : uint32_t {
     BLOCK_FAILED_VALID = 32, //!< stage after last reached validness failed
     BLOCK_FAILED_CHILD = 64, //!< descends from failed block
     BLOCK_FAILED_MASK = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
+
+    BLOCK_HAVE_CHECKSUM = 128, //!< blk*.dat record is followed by a CRC32C of the block data
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -366,6 +368,8 @@ public:
         block.nNonce = nNonce;
         block.nFlags = nFlags;
         block.fFlags = true;
+        if (phashBlock)
+            block.SeedHash(*phashBlock);
         return block;
     }
 
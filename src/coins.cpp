@@ -31,11 +31,146 @@ size_t CCoinsViewBacked::EstimateSize() const { return base->EstimateSize(); }
 
 SaltedOutpointHasher::SaltedOutpointHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
+size_t CCoinsMap::FindSlot(const COutPoint& key, uint32_t nHash) const
+{
+    // Returns the slot holding key, or the slot an insertion of key should
+    // use: the first tombstone on its probe sequence, else the empty slot
+    // that ends it. The table is never full, so the probe terminates.
+    const size_t nMask = vSlots.size() - 1;
+    size_t nTombstone = vSlots.size();
+    for (size_t i = nHash & nMask;; i = (i + 1) & nMask) {
+        const Slot& slot = vSlots[i];
+        if (slot.nEntry == SLOT_EMPTY)
+            return nTombstone < vSlots.size() ? nTombstone : i;
+        if (slot.nEntry == SLOT_DELETED) {
+            if (nTombstone == vSlots.size())
+                nTombstone = i;
+        } else if (slot.nHash == nHash && Entry(slot.nEntry)->first == key) {
+            return i;
+        }
+    }
+}
+
+uint32_t CCoinsMap::AllocateEntry()
+{
+    if (!vFreeEntries.empty()) {
+        uint32_t n = vFreeEntries.back();
+        vFreeEntries.pop_back();
+        return n;
+    }
+    if (nEntriesUsed == vChunks.size() * CHUNK_ENTRIES)
+        vChunks.push_back(static_cast<value_type*>(::operator new(sizeof(value_type) * CHUNK_ENTRIES)));
+    return nEntriesUsed++;
+}
+
+void CCoinsMap::FreeEntry(uint32_t n)
+{
+    Entry(n)->~value_type();
+    vFreeEntries.push_back(n);
+}
+
+void CCoinsMap::Rehash(size_t nNewSlots)
+{
+    std::vector<Slot> vOld;
+    vOld.swap(vSlots);
+    vSlots.assign(nNewSlots, Slot{SLOT_EMPTY, 0});
+    const size_t nMask = nNewSlots - 1;
+    for (const Slot& slot : vOld) {
+        if (slot.nEntry >= SLOT_DELETED)
+            continue;
+        size_t i = slot.nHash & nMask;
+        while (vSlots[i].nEntry != SLOT_EMPTY)
+            i = (i + 1) & nMask;
+        vSlots[i] = slot;
+    }
+    nDeleted = 0;
+}
+
+CCoinsMap::iterator CCoinsMap::find(const COutPoint& key)
+{
+    if (nSize == 0)
+        return end();
+    size_t nSlot = FindSlot(key, (uint32_t)hasher(key));
+    return Occupied(nSlot) ? iterator(this, nSlot) : end();
+}
+
+CCoinsMap::const_iterator CCoinsMap::find(const COutPoint& key) const
+{
+    return const_cast<CCoinsMap*>(this)->find(key);
+}
+
+std::pair<CCoinsMap::iterator, bool> CCoinsMap::try_emplace(const COutPoint& key)
+{
+    return try_emplace(key, Coin());
+}
+
+std::pair<CCoinsMap::iterator, bool> CCoinsMap::try_emplace(const COutPoint& key, Coin&& coin)
+{
+    // Keep at most 3/4 of the slots in use (live entries plus tombstones);
+    // grow when live entries alone would pass half, else just sweep tombstones
+    if ((nSize + nDeleted + 1) * 4 > vSlots.size() * 3)
+        Rehash(std::max(MIN_SLOTS, (nSize + 1) * 2 > vSlots.size() ? vSlots.size() * 2 : vSlots.size()));
+
+    const uint32_t nHash = (uint32_t)hasher(key);
+    size_t nSlot = FindSlot(key, nHash);
+    if (Occupied(nSlot))
+        return std::make_pair(iterator(this, nSlot), false);
+
+    uint32_t n = AllocateEntry();
+    new (Entry(n)) value_type(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::move(coin)));
+    if (vSlots[nSlot].nEntry == SLOT_DELETED)
+        nDeleted--;
+    vSlots[nSlot] = Slot{n, nHash};
+    nSize++;
+    return std::make_pair(iterator(this, nSlot), true);
+}
+
+CCoinsMap::iterator CCoinsMap::erase(iterator it)
+{
+    FreeEntry(vSlots[it.nSlot].nEntry);
+    vSlots[it.nSlot].nEntry = SLOT_DELETED;
+    nSize--;
+    nDeleted++;
+    return iterator(this, NextOccupied(it.nSlot + 1));
+}
+
+void CCoinsMap::clear()
+{
+    for (const Slot& slot : vSlots) {
+        if (slot.nEntry < SLOT_DELETED)
+            Entry(slot.nEntry)->~value_type();
+    }
+    for (value_type* chunk : vChunks)
+        ::operator delete(chunk);
+    std::vector<Slot>().swap(vSlots);
+    std::vector<value_type*>().swap(vChunks);
+    std::vector<uint32_t>().swap(vFreeEntries);
+    nEntriesUsed = 0;
+    nSize = 0;
+    nDeleted = 0;
+}
+
+void CCoinsMap::swap(CCoinsMap& other)
+{
+    std::swap(hasher, other.hasher);
+    vSlots.swap(other.vSlots);
+    vChunks.swap(other.vChunks);
+    std::swap(nEntriesUsed, other.nEntriesUsed);
+    vFreeEntries.swap(other.vFreeEntries);
+    std::swap(nSize, other.nSize);
+    std::swap(nDeleted, other.nDeleted);
+}
+
+size_t CCoinsMap::DynamicMemoryUsage() const
+{
+    return memusage::MallocUsage(sizeof(value_type) * CHUNK_ENTRIES) * vChunks.size() + memusage::DynamicUsage(vChunks) + memusage::DynamicUsage(vSlots) + memusage::DynamicUsage(vFreeEntries);
+}
+
 CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0) {}
 
 size_t CCoinsViewCache::DynamicMemoryUsage() const
 {
-    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+    return cacheCoins.DynamicMemoryUsage() + cachedCoinsUsage;
 }
 
 CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint& outpoint) const
@@ -46,7 +181,7 @@ CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint& outpoint) const
     Coin tmp;
     if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
-    CCoinsMap::iterator ret = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::forward_as_tuple(std::move(tmp))).first;
+    CCoinsMap::iterator ret = cacheCoins.try_emplace(outpoint, std::move(tmp)).first;
     if (ret->second.coin.IsSpent()) {
         // The parent only has an empty entry for this outpoint; we can consider our
         // version as fresh.
@@ -72,7 +207,7 @@ void CCoinsViewCache::AddCoin(const COutPoint& outpoint, Coin&& coin, bool possi
     if (coin.out.scriptPubKey.IsUnspendable()) return;
     CCoinsMap::iterator it;
     bool inserted;
-    std::tie(it, inserted) = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::tuple<>());
+    std::tie(it, inserted) = cacheCoins.try_emplace(outpoint);
     bool fresh = false;
     if (!inserted) {
         cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
@@ -215,8 +350,11 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
 bool CCoinsViewCache::Flush()
 {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
-    cacheCoins.clear();
-    cachedCoinsUsage = 0;
+    // On failure whatever the base did not take over is still unwritten; keep it
+    if (fOk) {
+        cacheCoins.clear();
+        cachedCoinsUsage = 0;
+    }
     return fOk;
 }
 
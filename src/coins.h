@@ -18,6 +18,7 @@
 #include <assert.h>
 #include <stdint.h>
 
+#include <type_traits>
 #include <unordered_map>
 
 /**
@@ -116,7 +117,7 @@ class SaltedOutpointHasher
 {
 private:
     /** Salt */
-    const uint64_t k0, k1;
+    uint64_t k0, k1;
 
 public:
     SaltedOutpointHasher();
@@ -150,7 +151,141 @@ struct CCoinsCacheEntry {
     explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0) {}
 };
 
-typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
+/**
+ * Hash table behind the coins caches.
+ *
+ * Open addressing with linear probing over a flat array of slots, each holding
+ * the index of an entry and the low bits of its hash. The entries themselves
+ * live in a pool of fixed-size chunks and erased ones are recycled by index, so
+ * there is no allocation per coin, no per-entry next pointer, and a lookup
+ * mostly touches one cache line of the slot array.
+ *
+ * Entries are never moved once inserted: pointers and references to them stay
+ * valid until they are erased, as with std::unordered_map. Erasing leaves a
+ * tombstone until the next rehash, so erasing while iterating is fine (erase
+ * returns the next position); inserting while iterating is not.
+ */
+class CCoinsMap
+{
+public:
+    typedef COutPoint key_type;
+    typedef CCoinsCacheEntry mapped_type;
+    typedef std::pair<const COutPoint, CCoinsCacheEntry> value_type;
+
+private:
+    static const uint32_t SLOT_EMPTY = 0xffffffff;
+    static const uint32_t SLOT_DELETED = 0xfffffffe;
+    //! Entries per pool chunk; small enough not to matter for per-transaction caches
+    static const uint32_t CHUNK_ENTRIES = 64;
+    static const size_t MIN_SLOTS = 16;
+
+    struct Slot {
+        uint32_t nEntry;
+        uint32_t nHash;
+    };
+
+    SaltedOutpointHasher hasher;
+    std::vector<Slot> vSlots;
+    std::vector<value_type*> vChunks;
+    uint32_t nEntriesUsed;  //!< entries handed out from the chunks so far
+    std::vector<uint32_t> vFreeEntries;  //!< indexes of erased entries, ready for reuse
+    size_t nSize;
+    size_t nDeleted;
+
+    value_type* Entry(uint32_t n) const
+    {
+        return vChunks[n / CHUNK_ENTRIES] + n % CHUNK_ENTRIES;
+    }
+
+    bool Occupied(size_t nSlot) const
+    {
+        return vSlots[nSlot].nEntry < SLOT_DELETED;
+    }
+
+    size_t NextOccupied(size_t nSlot) const
+    {
+        while (nSlot < vSlots.size() && !Occupied(nSlot))
+            nSlot++;
+        return nSlot;
+    }
+
+    size_t FindSlot(const COutPoint& key, uint32_t nHash) const;
+    uint32_t AllocateEntry();
+    void FreeEntry(uint32_t n);
+    void Rehash(size_t nNewSlots);
+
+public:
+    template <typename V>
+    class iterator_base
+    {
+        friend class CCoinsMap;
+        template <typename W>
+        friend class iterator_base;
+
+        const CCoinsMap* pmap;
+        size_t nSlot;
+
+        iterator_base(const CCoinsMap* pmapIn, size_t nSlotIn) : pmap(pmapIn), nSlot(nSlotIn) {}
+
+    public:
+        iterator_base() : pmap(nullptr), nSlot(0) {}
+        template <typename W, typename = typename std::enable_if<std::is_convertible<W*, V*>::value>::type>
+        iterator_base(const iterator_base<W>& other) : pmap(other.pmap), nSlot(other.nSlot) {}
+
+        V& operator*() const { return *pmap->Entry(pmap->vSlots[nSlot].nEntry); }
+        V* operator->() const { return &**this; }
+
+        iterator_base& operator++()
+        {
+            nSlot = pmap->NextOccupied(nSlot + 1);
+            return *this;
+        }
+        iterator_base operator++(int)
+        {
+            iterator_base ret = *this;
+            ++*this;
+            return ret;
+        }
+
+        template <typename W>
+        bool operator==(const iterator_base<W>& other) const { return nSlot == other.nSlot; }
+        template <typename W>
+        bool operator!=(const iterator_base<W>& other) const { return nSlot != other.nSlot; }
+    };
+    typedef iterator_base<value_type> iterator;
+    typedef iterator_base<const value_type> const_iterator;
+
+    CCoinsMap() : nEntriesUsed(0), nSize(0), nDeleted(0) {}
+    ~CCoinsMap() { clear(); }
+
+    CCoinsMap(const CCoinsMap&) = delete;
+    CCoinsMap& operator=(const CCoinsMap&) = delete;
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator begin() { return iterator(this, NextOccupied(0)); }
+    iterator end() { return iterator(this, vSlots.size()); }
+    const_iterator begin() const { return const_iterator(this, NextOccupied(0)); }
+    const_iterator end() const { return const_iterator(this, vSlots.size()); }
+
+    iterator find(const COutPoint& key);
+    const_iterator find(const COutPoint& key) const;
+
+    /** Insert a default-constructed entry for key unless there already is one */
+    std::pair<iterator, bool> try_emplace(const COutPoint& key);
+    /** Insert an entry for key holding coin unless there already is one */
+    std::pair<iterator, bool> try_emplace(const COutPoint& key, Coin&& coin);
+    CCoinsCacheEntry& operator[](const COutPoint& key) { return try_emplace(key).first->second; }
+
+    /** Erase the entry at it, returning the position of the next one */
+    iterator erase(iterator it);
+    void clear();
+    /** Exchange contents with other in constant time */
+    void swap(CCoinsMap& other);
+
+    size_t DynamicMemoryUsage() const;
+};
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -5,11 +5,13 @@
 #include <galaxycash.h>
 
 #include <chainparams.h>
+#include <checkqueue.h>
 #include <hash.h>
 #include <memory>
 #include <pow.h>
 #include <uint256.h>
 #include <util.h>
+#include <validation.h>
 
 #include <stdint.h>
 
@@ -17,10 +19,236 @@
 CGalaxyCashStateRef g_galaxycash;
 
 
-CGalaxyCashDB::CGalaxyCashDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "galaxycash" / "database", nCacheSize, fMemory, fWipe)
+static const char DB_TOKEN = 't';
+static const char DB_TOKEN_SYMBOL = 's';
+static const char DB_TOKEN_NAME = 'n';
+static const char DB_TOKEN_OUTPOINT = 'o';
+
+// A quarter of -gchdbcache goes to LevelDB, the rest to the in-memory token index
+CGalaxyCashDB::CGalaxyCashDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "galaxycash" / "database", nCacheSize / 4, fMemory, fWipe),
+                                                                              nMaxCacheUsage(nCacheSize - nCacheSize / 4),
+                                                                              cachedTokensUsage(0)
+{
+}
+
+static size_t TokenUsage(const CGalaxyCashTokenRef& token)
+{
+    // The symbol and name are copied into the secondary maps
+    return memusage::DynamicUsage(token) + token->DynamicMemoryUsage() +
+           memusage::MallocUsage(token->symbol.capacity()) + memusage::MallocUsage(token->name.capacity());
+}
+
+size_t CGalaxyCashDB::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // lruTokens holds one list node per cached token
+    return memusage::DynamicUsage(mapTokens) + lruTokens.size() * memusage::MallocUsage(sizeof(uint256) + 2 * sizeof(void*)) +
+           memusage::DynamicUsage(mapTokenSymbols) + memusage::DynamicUsage(mapTokenNames) + memusage::DynamicUsage(mapTokenOutPoints) +
+           memusage::DynamicUsage(setDirtyTokens) + memusage::DynamicUsage(mapErasedTokens) + cachedTokensUsage;
+}
+
+CGalaxyCashTokenRef CGalaxyCashDB::CacheToken(const uint256& hash, const CGalaxyCashTokenRef& token, bool fDirty)
 {
+    AssertLockHeld(cs);
+    std::map<uint256, CTokenEntry>::iterator it = mapTokens.find(hash);
+    if (it != mapTokens.end()) {
+        lruTokens.splice(lruTokens.begin(), lruTokens, it->second.itUsed);
+    } else {
+        lruTokens.push_front(hash);
+        it = mapTokens.emplace(hash, CTokenEntry{token, lruTokens.begin()}).first;
+        cachedTokensUsage += TokenUsage(token);
+        mapTokenSymbols.emplace(token->symbol, hash);
+        mapTokenNames.emplace(token->name, hash);
+        if (!token->proof.IsNull())
+            mapTokenOutPoints.emplace(token->proof, hash);
+    }
+    if (fDirty)
+        setDirtyTokens.insert(hash);
+    return it->second.token;
 }
 
+void CGalaxyCashDB::UncacheToken(std::map<uint256, CTokenEntry>::iterator it)
+{
+    AssertLockHeld(cs);
+    const CGalaxyCashTokenRef& token = it->second.token;
+    std::map<std::string, uint256>::iterator itSymbol = mapTokenSymbols.find(token->symbol);
+    if (itSymbol != mapTokenSymbols.end() && itSymbol->second == it->first)
+        mapTokenSymbols.erase(itSymbol);
+    std::map<std::string, uint256>::iterator itName = mapTokenNames.find(token->name);
+    if (itName != mapTokenNames.end() && itName->second == it->first)
+        mapTokenNames.erase(itName);
+    std::map<COutPoint, uint256>::iterator itOutPoint = mapTokenOutPoints.find(token->proof);
+    if (itOutPoint != mapTokenOutPoints.end() && itOutPoint->second == it->first)
+        mapTokenOutPoints.erase(itOutPoint);
+    cachedTokensUsage -= TokenUsage(token);
+    lruTokens.erase(it->second.itUsed);
+    mapTokens.erase(it);
+}
+
+void CGalaxyCashDB::EvictTokens()
+{
+    AssertLockHeld(cs);
+    std::list<uint256>::iterator it = lruTokens.end();
+    while (DynamicMemoryUsage() > nMaxCacheUsage && it != lruTokens.begin()) {
+        // The most recently used entry stays, it is what the caller is looking at
+        if (--it == lruTokens.begin())
+            break;
+        // Added tokens stay until they are written
+        if (setDirtyTokens.count(*it))
+            continue;
+        UncacheToken(mapTokens.find(*it++));
+    }
+}
+
+CGalaxyCashTokenRef CGalaxyCashDB::FetchToken(const uint256& hash)
+{
+    AssertLockHeld(cs);
+    std::map<uint256, CTokenEntry>::iterator it = mapTokens.find(hash);
+    if (it != mapTokens.end()) {
+        lruTokens.splice(lruTokens.begin(), lruTokens, it->second.itUsed);
+        return it->second.token;
+    }
+    if (mapErasedTokens.count(hash))
+        return nullptr;
+
+    CGalaxyCashTokenRef token = MakeGalaxyCashTokenRef();
+    if (!Read(std::make_pair(DB_TOKEN, hash), *token))
+        return nullptr;
+    token = CacheToken(hash, token, false);
+    EvictTokens();
+    return token;
+}
+
+CGalaxyCashTokenRef CGalaxyCashDB::FetchToken(const std::map<std::string, uint256>& mapIndex, char key, const std::string& str)
+{
+    AssertLockHeld(cs);
+    uint256 hash;
+    std::map<std::string, uint256>::const_iterator it = mapIndex.find(str);
+    if (it != mapIndex.end())
+        hash = it->second;
+    else if (!Read(std::make_pair(key, str), hash))
+        return nullptr;
+    return FetchToken(hash);
+}
+
+bool CGalaxyCashDB::FlushTokens()
+{
+    AssertLockHeld(cs);
+    if (!setDirtyTokens.empty() || !mapErasedTokens.empty()) {
+        CDBBatch batch(*this);
+        for (const std::pair<uint256, CGalaxyCashTokenRef>& erased : mapErasedTokens) {
+            batch.Erase(std::make_pair(DB_TOKEN, erased.first));
+            batch.Erase(std::make_pair(DB_TOKEN_SYMBOL, erased.second->symbol));
+            batch.Erase(std::make_pair(DB_TOKEN_NAME, erased.second->name));
+            if (!erased.second->proof.IsNull())
+                batch.Erase(std::make_pair(DB_TOKEN_OUTPOINT, erased.second->proof));
+        }
+        // After the erases, so a token added again under an erased key keeps it
+        for (const uint256& hash : setDirtyTokens) {
+            const CGalaxyCashTokenRef& token = mapTokens.at(hash).token;
+            batch.Write(std::make_pair(DB_TOKEN, hash), *token);
+            batch.Write(std::make_pair(DB_TOKEN_SYMBOL, token->symbol), hash);
+            batch.Write(std::make_pair(DB_TOKEN_NAME, token->name), hash);
+            if (!token->proof.IsNull())
+                batch.Write(std::make_pair(DB_TOKEN_OUTPOINT, token->proof), hash);
+        }
+        LogPrint(BCLog::DB, "Writing %u tokens, erasing %u from galaxycash database (%.2f MiB)\n", setDirtyTokens.size(), mapErasedTokens.size(), batch.SizeEstimate() * (1.0 / 1048576.0));
+        if (!WriteBatch(batch))
+            return false;
+        setDirtyTokens.clear();
+        mapErasedTokens.clear();
+    }
+
+    EvictTokens();
+    return true;
+}
+
+bool CGalaxyCashDB::Flush()
+{
+    LOCK(cs);
+    return FlushTokens();
+}
+
+bool CGalaxyCashDB::AddToken(const CGalaxyCashTokenRef& token)
+{
+    if (!token || token->IsNull())
+        return false;
+
+    LOCK(cs);
+    const uint256 hash = token->GetHash();
+    if (FetchToken(hash))
+        return false;
+    // Every key of the index must stay unique, or a second add would silently
+    // repoint the symbol, name or outpoint at the new record
+    CGalaxyCashTokenRef existing;
+    if (!token->proof.IsNull() && GetTokenByOutPoint(token->proof, existing))
+        return false;
+    if (GetTokenBySymbol(token->symbol, existing) || GetTokenByName(token->name, existing))
+        return false;
+
+    mapErasedTokens.erase(hash);
+    CacheToken(hash, MakeGalaxyCashTokenRef(*token), true);
+    EvictTokens();
+    return true;
+}
+
+bool CGalaxyCashDB::EraseToken(const uint256& hash)
+{
+    LOCK(cs);
+    CGalaxyCashTokenRef token = FetchToken(hash);
+    if (!token)
+        return false;
+    setDirtyTokens.erase(hash);
+    mapErasedTokens.emplace(hash, token);
+    UncacheToken(mapTokens.find(hash));
+    return true;
+}
+
+bool CGalaxyCashDB::GetTokenByHash(const uint256& hash, CGalaxyCashTokenRef& token)
+{
+    LOCK(cs);
+    token = FetchToken(hash);
+    return token != nullptr;
+}
+
+bool CGalaxyCashDB::GetTokenBySymbol(const std::string& symbol, CGalaxyCashTokenRef& token)
+{
+    LOCK(cs);
+    token = FetchToken(mapTokenSymbols, DB_TOKEN_SYMBOL, symbol);
+    return token != nullptr;
+}
+
+bool CGalaxyCashDB::GetTokenByName(const std::string& name, CGalaxyCashTokenRef& token)
+{
+    LOCK(cs);
+    token = FetchToken(mapTokenNames, DB_TOKEN_NAME, name);
+    return token != nullptr;
+}
+
+bool CGalaxyCashDB::GetTokenByOutPoint(const COutPoint& tx, CGalaxyCashTokenRef& token)
+{
+    LOCK(cs);
+    uint256 hash;
+    std::map<COutPoint, uint256>::const_iterator it = mapTokenOutPoints.find(tx);
+    if (it != mapTokenOutPoints.end())
+        hash = it->second;
+    else if (!Read(std::make_pair(DB_TOKEN_OUTPOINT, tx), hash))
+        return false;
+    token = FetchToken(hash);
+    return token != nullptr;
+}
+
+bool CGalaxyCashDB::IsToken(const uint256& hash)
+{
+    LOCK(cs);
+    return FetchToken(hash) != nullptr;
+}
+
+bool CGalaxyCashDB::IsToken(const COutPoint& tx)
+{
+    CGalaxyCashTokenRef token;
+    return GetTokenByOutPoint(tx, token);
+}
 
 class CGalaxyCashVM
 {
@@ -38,6 +266,7 @@ CGalaxyCashState::CGalaxyCashState() : pdb(new CGalaxyCashDB((gArgs.GetArg("-gch
 }
 CGalaxyCashState::~CGalaxyCashState()
 {
+    pdb->Flush();
     delete pdb;
 }
 
@@ -48,4 +277,124 @@ void CGalaxyCashState::EvalScript()
 bool CGalaxyCashConsensus::CheckSignature() const
 {
     return true;
-}
\ No newline at end of file
+}
+bool CGalaxyCashTransaction::CheckTransaction() const
+{
+    if (version < MINIMAL_VERSION || script.empty())
+        return false;
+    for (const CGalaxyCashOpcode& op : script) {
+        if (op.type == CGalaxyCashOpcode::OPCODE_NULL || op.type > CGalaxyCashOpcode::OPCODE_LAST)
+            return false;
+    }
+    return true;
+}
+
+bool GalaxyCashCheckScript(CGalaxyCashStateRef& state, const CGalaxyCashOpcode* script, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (script[i].type == CGalaxyCashOpcode::OPCODE_NULL || script[i].type > CGalaxyCashOpcode::OPCODE_LAST)
+            return false;
+    }
+    return true;
+}
+
+static bool GetScriptTokens(const CGalaxyCashOpcode* script, uint32_t count, std::vector<CGalaxyCashTokenRef>& vTokens)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        for (const CGalaxyCashOperand& operand : script[i].operands) {
+            if (operand.type != CGalaxyCashOperand::OPERAND_TOKEN)
+                continue;
+            try {
+                vTokens.push_back(OperandAsToken(operand));
+            } catch (const std::exception&) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The only state transition evaluated so far is token issue: a script that
+// carries a token operand adds that token to the index, and undoing the
+// script erases it again. Either happens for all of the script's tokens or
+// for none.
+bool GalaxyCashRunScript(CGalaxyCashStateRef& state, const CGalaxyCashOpcode* script, uint32_t count)
+{
+    std::vector<CGalaxyCashTokenRef> vTokens;
+    if (!state || !GalaxyCashCheckScript(state, script, count) || !GetScriptTokens(script, count, vTokens))
+        return false;
+    for (size_t i = 0; i < vTokens.size(); i++) {
+        if (!state->pdb->AddToken(vTokens[i])) {
+            while (i-- > 0)
+                state->pdb->EraseToken(vTokens[i]->GetHash());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool GalaxyCashUndoScript(CGalaxyCashStateRef& state, const CGalaxyCashOpcode* script, uint32_t count)
+{
+    std::vector<CGalaxyCashTokenRef> vTokens;
+    if (!state || !GalaxyCashCheckScript(state, script, count) || !GetScriptTokens(script, count, vTokens))
+        return false;
+    bool fClean = true;
+    for (std::vector<CGalaxyCashTokenRef>::const_reverse_iterator it = vTokens.rbegin(); it != vTokens.rend(); ++it) {
+        if (!state->pdb->EraseToken((*it)->GetHash()))
+            fClean = false;
+    }
+    return fClean;
+}
+
+bool CGalaxyCashTxCheck::operator()()
+{
+    return tx && tx->CheckTransaction() && tx->CheckSignature();
+}
+
+bool GalaxyCashConnectTransactions(CGalaxyCashStateRef& state, const std::vector<CGalaxyCashTransactionRef>& vtx, CGalaxyCashUndo& undo, CCheckQueueControl<CBlockCheck>* pcontrol)
+{
+    undo.vtx.clear();
+    if (vtx.empty())
+        return true;
+
+    // Stateless phase
+    std::vector<CBlockCheck> vChecks;
+    vChecks.reserve(vtx.size());
+    for (const CGalaxyCashTransactionRef& tx : vtx) {
+        CGalaxyCashTxCheck check(tx);
+        if (!pcontrol) {
+            if (!check())
+                return error("%s: invalid galaxycash transaction %s", __func__, tx ? tx->GetHash().ToString() : "(null)");
+            continue;
+        }
+        vChecks.emplace_back(check);
+    }
+    if (pcontrol)
+        pcontrol->Add(vChecks);
+
+    // Sequential state application
+    undo.vtx.reserve(vtx.size());
+    for (const CGalaxyCashTransactionRef& tx : vtx) {
+        if (!GalaxyCashRunScript(state, tx->script.data(), tx->script.size())) {
+            CGalaxyCashUndo applied;
+            applied.vtx.swap(undo.vtx);
+            GalaxyCashDisconnectTransactions(state, applied);
+            return error("%s: failed to apply galaxycash transaction %s", __func__, tx->GetHash().ToString());
+        }
+        undo.vtx.push_back(tx);
+    }
+    return true;
+}
+
+bool GalaxyCashDisconnectTransactions(CGalaxyCashStateRef& state, const CGalaxyCashUndo& undo)
+{
+    bool fClean = true;
+    for (std::vector<CGalaxyCashTransactionRef>::const_reverse_iterator it = undo.vtx.rbegin(); it != undo.vtx.rend(); ++it) {
+        const CGalaxyCashTransactionRef& tx = *it;
+        if (!GalaxyCashUndoScript(state, tx->script.data(), tx->script.size())) {
+            LogPrintf("%s: failed to undo galaxycash transaction %s\n", __func__, tx->GetHash().ToString());
+            fClean = false;
+        }
+    }
+    return fClean;
+}
@@ -10,12 +10,16 @@
 #include <coins.h>
 #include <dbwrapper.h>
 #include <key.h>
+#include <memusage.h>
 #include <net.h>
 #include <pubkey.h>
+#include <sync.h>
 
 
+#include <list>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -31,6 +35,10 @@
 #include <uint256.h>
 #include <arith_uint256.h>
 
+class CBlockCheck;
+template <typename T>
+class CCheckQueueControl;
+
 struct CGalaxyCashOperand {
     uint8_t type;
     std::vector<unsigned char> vch;
@@ -533,7 +541,12 @@ struct CGalaxyCashToken {
         return name.empty() || symbol.empty() || owner == CPubKey() || signature.empty();
     }
 
-    uint256 GetHash() { return SerializeHash(*this); }
+    uint256 GetHash() const { return SerializeHash(*this); }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::MallocUsage(name.capacity()) + memusage::MallocUsage(symbol.capacity()) + memusage::DynamicUsage(signature);
+    }
 };
 
 typedef std::shared_ptr<CGalaxyCashToken> CGalaxyCashTokenRef;
@@ -588,7 +601,6 @@ public:
         READWRITE(version);
         READWRITE(token);
         READWRITE(address);
-        GetPubKey(address, pubKey);
         READWRITE(script);
         if (!(s.GetType() & SER_GETHASH)) READWRITE(signature);
     }
@@ -598,14 +610,9 @@ public:
         SetNull();
     }
 
-    CGalaxyCashTransaction(const CGalaxyCashTransaction& tx) : version(tx.version), token(tx.token), address(tx.address), pubKey(tx.pubKey)
+    CGalaxyCashTransaction(const CGalaxyCashTransaction& tx) : version(tx.version), token(tx.token), address(tx.address), pubKey(tx.pubKey),
+                                                               script(tx.script), signature(tx.signature)
     {
-        if (!tx.script.empty()) {
-            std::copy(tx.script.begin(), tx.script.end(), script.begin());
-        }
-        if (!tx.signature.empty()) {
-            std::copy(tx.signature.begin(), tx.signature.end(), signature.begin());
-        }
     }
 
     CGalaxyCashTransaction(const std::shared_ptr<CGalaxyCashTransaction>& tx)
@@ -615,17 +622,15 @@ public:
             token = tx->token;
             address = tx->address;
             pubKey = tx->pubKey;
-            if (!tx->script.empty()) {
-                std::copy(tx->script.begin(), tx->script.end(), script.begin());
-            }
-            if (!tx->signature.empty()) {
-                std::copy(tx->signature.begin(), tx->signature.end(), signature.begin());
-            }
+            script = tx->script;
+            signature = tx->signature;
         } else {
             SetNull();
         }
     }
 
+    CGalaxyCashTransaction& operator=(const CGalaxyCashTransaction& tx) = default;
+
     void SetNull()
     {
         version = CURRENT_VERSION;
@@ -635,18 +640,18 @@ public:
         signature.clear();
     }
 
-    void GetPubKey(const CKeyID& addr, CPubKey& pub);
-
     uint256 GetHash() const
     {
         return SerializeHash(*this);
     }
 
+    // The signature is compact, so the key behind address is recovered from it
     bool CheckSignature() const
     {
-        if (!pubKey.IsValid())
+        CPubKey pubkey;
+        if (!pubkey.RecoverCompact(GetHash(), signature))
             return false;
-        return pubKey.Verify(GetHash(), signature);
+        return pubkey.GetID() == address;
     }
 
     bool CheckTransaction() const;
@@ -1034,8 +1039,48 @@ public:
     }
 };
 
+/**
+ * Token database with an in-memory index in front of it. Every token is kept
+ * once in mapTokens (keyed by its hash); the symbol, name and outpoint maps
+ * only point at that canonical record. Lookups that miss go to LevelDB and
+ * cache what they find. Added and erased tokens stay in memory until Flush()
+ * writes them back in one CDBBatch, together with the chainstate; clean
+ * entries are evicted least recently used first once the index outgrows its
+ * share of -gchdbcache.
+ */
 class CGalaxyCashDB : public CDBWrapper
 {
+private:
+    mutable CCriticalSection cs;
+
+    struct CTokenEntry {
+        CGalaxyCashTokenRef token;
+        //! position in lruTokens
+        std::list<uint256>::iterator itUsed;
+    };
+
+    std::map<uint256, CTokenEntry> mapTokens;
+    //! cached token hashes, most recently used first
+    std::list<uint256> lruTokens;
+    std::map<std::string, uint256> mapTokenSymbols;
+    std::map<std::string, uint256> mapTokenNames;
+    std::map<COutPoint, uint256> mapTokenOutPoints;
+    //! added tokens not written yet
+    std::set<uint256> setDirtyTokens;
+    //! erased tokens not removed from disk yet, with the keys to remove
+    std::map<uint256, CGalaxyCashTokenRef> mapErasedTokens;
+
+    size_t nMaxCacheUsage;
+    size_t cachedTokensUsage;
+
+    CGalaxyCashTokenRef CacheToken(const uint256& hash, const CGalaxyCashTokenRef& token, bool fDirty);
+    void UncacheToken(std::map<uint256, CTokenEntry>::iterator it);
+    //! Evict clean entries, least recently used first, until the cache fits
+    void EvictTokens();
+    CGalaxyCashTokenRef FetchToken(const uint256& hash);
+    CGalaxyCashTokenRef FetchToken(const std::map<std::string, uint256>& mapIndex, char key, const std::string& str);
+    bool FlushTokens();
+
 public:
     CGalaxyCashDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -1043,12 +1088,18 @@ public:
     bool GetConsensus(CGalaxyCashConsensusRef& consensus);
 
     bool AddToken(const CGalaxyCashTokenRef& token);
+    bool EraseToken(const uint256& hash);
     bool GetTokenByHash(const uint256& hash, CGalaxyCashTokenRef& token);
     bool GetTokenBySymbol(const std::string& symbol, CGalaxyCashTokenRef& token);
     bool GetTokenByName(const std::string& name, CGalaxyCashTokenRef& token);
     bool GetTokenByOutPoint(const COutPoint& tx, CGalaxyCashTokenRef& token);
     bool IsToken(const uint256& hash);
     bool IsToken(const COutPoint& tx);
+
+    //! Write added and erased tokens to disk, then evict clean entries if the cache is over its limit
+    bool Flush();
+    //! Memory used by the in-memory token index
+    size_t DynamicMemoryUsage() const;
 };
 
 class CGalaxyCashState
@@ -1088,5 +1139,21 @@ bool GalaxyCashRunScript(CGalaxyCashStateRef& state, const CGalaxyCashOpcode* sc
 bool GalaxyCashUndoScript(CGalaxyCashStateRef& state, const CGalaxyCashOpcode* script, uint32_t count);
 bool GalaxyCashGetTransaction(const CGalaxyCashStateRef& state, const uint256& hash, CGalaxyCashTransactionRef& tx);
 
+/** Transactions applied to the GalaxyCash state by a block, in application order. */
+struct CGalaxyCashUndo {
+    std::vector<CGalaxyCashTransactionRef> vtx;
+};
+
+/**
+ * Apply a block's GalaxyCash transactions: their signature and format checks
+ * (CGalaxyCashTxCheck) are added to pcontrol, next to the block's script
+ * checks, then the scripts are applied to the state one by one. Without
+ * pcontrol the checks run inline. On failure nothing stays applied; on
+ * success undo receives what GalaxyCashDisconnectTransactions needs to roll
+ * the block back, which the caller also has to do if pcontrol->Wait() fails.
+ */
+bool GalaxyCashConnectTransactions(CGalaxyCashStateRef& state, const std::vector<CGalaxyCashTransactionRef>& vtx, CGalaxyCashUndo& undo, CCheckQueueControl<CBlockCheck>* pcontrol = nullptr);
+bool GalaxyCashDisconnectTransactions(CGalaxyCashStateRef& state, const CGalaxyCashUndo& undo);
+
 
 #endif
@@ -0,0 +1,91 @@
+// Copyright (c) 2017-2019 The GalaxyCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <invpayloadcache.h>
+
+#include <utiltime.h>
+
+CInvPayloadCache invPayloadCache;
+
+CInvPayloadCache::CInvPayloadCache(size_t nMaxSizeIn) : nSize(0), nMaxSize(nMaxSizeIn), nHits(0), nMisses(0)
+{
+}
+
+size_t CInvPayloadCache::GetEntrySize(const CSharedNetMsg& msg)
+{
+    return (msg.header ? msg.header->size() : 0) + (msg.payload ? msg.payload->size() : 0);
+}
+
+void CInvPayloadCache::EraseEntry(std::map<CInv, Entry>::iterator it)
+{
+    nSize -= GetEntrySize(it->second.msg);
+    listOrder.erase(it->second.itOrder);
+    mapEntries.erase(it);
+}
+
+void CInvPayloadCache::SetMaxSize(size_t nMaxSizeIn)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    nMaxSize = nMaxSizeIn;
+    while (nSize > nMaxSize && !listOrder.empty())
+        EraseEntry(mapEntries.find(listOrder.front()));
+}
+
+bool CInvPayloadCache::Get(const CInv& inv, CSharedNetMsg& msgRet)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    auto it = mapEntries.find(inv);
+    if (it == mapEntries.end()) {
+        nMisses++;
+        return false;
+    }
+    if (it->second.nTime + INV_PAYLOAD_CACHE_EXPIRY < GetTime()) {
+        EraseEntry(it);
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    msgRet = it->second.msg;
+    return true;
+}
+
+void CInvPayloadCache::Put(const CInv& inv, const CSharedNetMsg& msg)
+{
+    const size_t nEntrySize = GetEntrySize(msg);
+    std::lock_guard<std::mutex> lock(cs);
+    if (nEntrySize == 0 || nEntrySize > nMaxSize)
+        return;
+
+    auto it = mapEntries.find(inv);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+    while (nSize + nEntrySize > nMaxSize && !listOrder.empty())
+        EraseEntry(mapEntries.find(listOrder.front()));
+
+    listOrder.push_back(inv);
+    mapEntries.emplace(inv, Entry{msg, GetTime(), std::prev(listOrder.end())});
+    nSize += nEntrySize;
+}
+
+void CInvPayloadCache::Erase(const CInv& inv)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    auto it = mapEntries.find(inv);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+}
+
+void CInvPayloadCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(cs);
+    mapEntries.clear();
+    listOrder.clear();
+    nSize = 0;
+}
+
+InvPayloadCacheStats CInvPayloadCache::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    return InvPayloadCacheStats{mapEntries.size(), nSize, nHits, nMisses};
+}
@@ -0,0 +1,75 @@
+// Copyright (c) 2017-2019 The GalaxyCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef GALAXYCASH_INVPAYLOADCACHE_H
+#define GALAXYCASH_INVPAYLOADCACHE_H
+
+#include <net.h>
+#include <protocol.h>
+
+#include <list>
+#include <map>
+#include <mutex>
+
+/** Default for -invpayloadcache, in megabytes */
+static const unsigned int DEFAULT_INV_PAYLOAD_CACHE_SIZE = 8;
+/** Seconds a serialized response is served for before the object is serialized again */
+static const int64_t INV_PAYLOAD_CACHE_EXPIRY = 2 * 60;
+
+struct InvPayloadCacheStats {
+    size_t nEntries;
+    size_t nBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+};
+
+/**
+ * Serialized getdata responses for relayed transactions, masternode messages
+ * and sporks.
+ *
+ * Announcing an object makes every peer that lacks it ask for it at about the
+ * same time. The first request serializes the object and stores the finished
+ * message, header and checksum included; the others are answered with the
+ * same buffers. Entries are evicted oldest first once the cache is over its
+ * size limit, and expire after INV_PAYLOAD_CACHE_EXPIRY so that objects which
+ * change under the same hash are picked up again. Code that changes such an
+ * object in place should Erase() it as well.
+ */
+class CInvPayloadCache
+{
+public:
+    explicit CInvPayloadCache(size_t nMaxSizeIn = DEFAULT_INV_PAYLOAD_CACHE_SIZE * 1024 * 1024);
+
+    void SetMaxSize(size_t nMaxSizeIn);
+
+    /** Look up the response to inv; returns false if it is not cached or has expired */
+    bool Get(const CInv& inv, CSharedNetMsg& msgRet);
+    void Put(const CInv& inv, const CSharedNetMsg& msg);
+    void Erase(const CInv& inv);
+    void Clear();
+
+    InvPayloadCacheStats GetStats() const;
+
+private:
+    struct Entry {
+        CSharedNetMsg msg;
+        int64_t nTime;
+        std::list<CInv>::iterator itOrder;
+    };
+
+    static size_t GetEntrySize(const CSharedNetMsg& msg);
+    void EraseEntry(std::map<CInv, Entry>::iterator it);
+
+    mutable std::mutex cs;
+    std::map<CInv, Entry> mapEntries;
+    //! Keys of mapEntries, oldest first
+    std::list<CInv> listOrder;
+    size_t nSize;
+    size_t nMaxSize;
+    uint64_t nHits;
+    uint64_t nMisses;
+};
+
+extern CInvPayloadCache invPayloadCache;
+
+#endif // GALAXYCASH_INVPAYLOADCACHE_H
@@ -63,9 +63,14 @@ uint256 ComputeStakeModifier(const CBlockIndex* pindexPrev, const uint256& kerne
     return HashX12(ss.begin(), ss.end());
 }
 
-bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CBlockHeader& blockFrom, const CTransaction& tx, const CTransaction& txPrev, const COutPoint& prevout, uint256& hashProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CDiskStakeInput& stakeFrom, const CTransaction& tx, const COutPoint& prevout, uint256& hashProofOfStake, bool fPrintProofOfStake)
 {
-    if (tx.nTime < txPrev.nTime) // Transaction timestamp violation
+    return CheckStakeKernelHash(pindexPrev, nBits, stakeFrom, tx.nTime, prevout, hashProofOfStake);
+}
+
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CDiskStakeInput& stakeFrom, unsigned int nTimeTx, const COutPoint& prevout, uint256& hashProofOfStake)
+{
+    if (nTimeTx < stakeFrom.nTime) // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     // Base target
@@ -73,14 +78,14 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
     bnTarget.SetCompact(nBits);
 
     // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
+    int64_t nValueIn = stakeFrom.nValue;
     arith_uint256 bnWeight = arith_uint256(nValueIn);
     bnTarget *= bnWeight;
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
     ss << pindexPrev->bnStakeModifier;
-    ss << txPrev.nTime << prevout.hash << prevout.n << tx.nTime;
+    ss << stakeFrom.nTime << prevout.hash << prevout.n << nTimeTx;
     hashProofOfStake = HashX12(ss.begin(), ss.end());
 
     // Now check if proof-of-stake hash meets target protocol
@@ -91,7 +96,7 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
 }
 
 // Check kernel hash target and coinstake signature
-bool CheckProofOfStake(const CBlockIndex* pindexPrev, unsigned int nBits, const CTransaction& tx, uint256& hashProofOfStake)
+bool CheckProofOfStake(const CBlockIndex* pindexPrev, unsigned int nBits, const CTransaction& tx, uint256& hashProofOfStake, std::vector<CBlockCheck>* pvChecks)
 {
     if (!tx.IsCoinStake())
         return true;
@@ -99,51 +104,27 @@ bool CheckProofOfStake(const CBlockIndex* pindexPrev, unsigned int nBits, const
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // Transaction index is required to get to block header
-    if (!fTxIndex)
-        return error("CheckProofOfStake() : transaction index not available");
-
-    // Get transaction index for the previous transaction
-    CDiskTxPos postx;
-    if (!pblocktree->ReadTxIndex(txin.prevout.hash, postx))
-        return error("CheckProofOfStake() : tx index not found"); // tx index not found
-
-    // Read txPrev and header of its block
-    CBlockHeader header;
-    CTransactionRef txPrev;
-    {
-        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-        try {
-            file >> header;
-            fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-            file >> txPrev;
-        } catch (std::exception& e) {
-            return error("%s() : deserialize or I/O error in CheckProofOfStake()", __PRETTY_FUNCTION__);
-        }
-        if (txPrev->GetHash() != txin.prevout.hash)
-            return error("%s() : txid mismatch in CheckProofOfStake()", __PRETTY_FUNCTION__);
-    }
-
-
-    int nDepth = 0;
-    CBlockIndex* ptxPrevBlock = mapBlockIndex.find(header.GetHash()) != mapBlockIndex.end() ? mapBlockIndex[header.GetHash()] : NULL;
-    if (ptxPrevBlock && pindexPrev)
-        nDepth = (pindexPrev->nHeight + 1) - ptxPrevBlock->nHeight;
+    // Time, height, value and script of the output being staked
+    CDiskStakeInput stakeFrom;
+    CScript scriptPubKey;
+    if (!GetStakeInput(txin.prevout, stakeFrom, &scriptPubKey))
+        return error("CheckProofOfStake() : stake input %s not found", txin.prevout.ToString());
 
+    int nDepth = pindexPrev ? (pindexPrev->nHeight + 1) - stakeFrom.nHeight : 0;
     if (nDepth < Params().GetConsensus().nStakeMinConfirmations - 1)
         return error("CheckProofOfStake() : tried to stake at depth %d", nDepth + 1);
 
-    // Verify signature
-    {
-        int nIn = 0;
-        const CTxOut& prevOut = txPrev->vout[tx.vin[nIn].prevout.n];
-        TransactionSignatureChecker checker(&tx, nIn, prevOut.nValue, PrecomputedTransactionData(tx));
-
-        if (!VerifyScript(tx.vin[nIn].scriptSig, prevOut.scriptPubKey, SCRIPT_VERIFY_P2SH, checker, nullptr))
-            return error("%s: VerifyScript failed on coinstake %s", __func__, tx.GetHash().ToString());
-    }
-
-    if (!CheckStakeKernelHash(pindexPrev, nBits, header, tx, *txPrev, txin.prevout, hashProofOfStake, gArgs.GetBoolArg("-debug", false)))
+    // Verify signature against the staked output's script, taken from the
+    // UTXO set or, once the output is spent on our chain, the transaction index
+    if (scriptPubKey.empty())
+        return error("CheckProofOfStake() : no script for stake input %s", txin.prevout.ToString());
+    CStakeCheck check(CTxOut(stakeFrom.nValue, scriptPubKey), tx);
+    if (pvChecks)
+        pvChecks->emplace_back(check);
+    else if (!check())
+        return error("%s: VerifyScript failed on coinstake %s", __func__, tx.GetHash().ToString());
+
+    if (!CheckStakeKernelHash(pindexPrev, nBits, stakeFrom, tx, txin.prevout, hashProofOfStake, gArgs.GetBoolArg("-debug", false)))
         return error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s", tx.GetHash().ToString(), hashProofOfStake.ToString()); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -223,41 +204,16 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, const CTransaction
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // Transaction index is required to get to block header
-    if (!fTxIndex)
-        return error("CheckKernel() : transaction index not available");
-
-    // Get transaction index for the previous transaction
-    CDiskTxPos postx;
-    if (!pblocktree->ReadTxIndex(txin.prevout.hash, postx))
-        return error("CheckProofOfStake() : tx index not found"); // tx index not found
-
-    // Read txPrev and header of its block
-    CBlockHeader header;
-    CTransactionRef txPrev;
-    {
-        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-        try {
-            file >> header;
-            fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-            file >> txPrev;
-        } catch (std::exception& e) {
-            return error("%s() : deserialize or I/O error in CheckProofOfStake()", __PRETTY_FUNCTION__);
-        }
-        if (txPrev->GetHash() != txin.prevout.hash)
-            return error("%s() : txid mismatch in CheckProofOfStake()", __PRETTY_FUNCTION__);
-    }
-
-
-    int nDepth = 0;
-    CBlockIndex* ptxPrevBlock = mapBlockIndex.find(header.GetHash()) != mapBlockIndex.end() ? mapBlockIndex[header.GetHash()] : NULL;
-    if (ptxPrevBlock && pindexPrev)
-        nDepth = (pindexPrev->nHeight + 1) - ptxPrevBlock->nHeight;
+    // Time, height and value of the output being staked
+    CDiskStakeInput stakeFrom;
+    if (!GetStakeInput(txin.prevout, stakeFrom))
+        return error("CheckKernel() : stake input %s not found", txin.prevout.ToString());
 
+    int nDepth = pindexPrev ? (pindexPrev->nHeight + 1) - stakeFrom.nHeight : 0;
     if (nDepth < Params().GetConsensus().nStakeMinConfirmations - 1)
-        return error("CheckProofOfStake() : tried to stake at depth %d", nDepth + 1);
+        return error("CheckKernel() : tried to stake at depth %d", nDepth + 1);
 
-    bool fOk = CheckStakeKernelHash(pindexPrev, nBits, header, tx, *txPrev, txin.prevout, hashProofOfStake, gArgs.GetBoolArg("-debug", false));
+    bool fOk = CheckStakeKernelHash(pindexPrev, nBits, stakeFrom, tx, txin.prevout, hashProofOfStake, gArgs.GetBoolArg("-debug", false));
     if (hashProof)
         *hashProof = hashProofOfStake;
     return fOk;
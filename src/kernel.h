@@ -10,6 +10,8 @@ class CBlockIndex;
 class CValidationState;
 class CBlockHeader;
 class CBlock;
+class CBlockCheck;
+struct CDiskStakeInput;
 
 
 // To decrease granularity of timestamp
@@ -26,12 +28,15 @@ uint256 ComputeStakeModifier(const CBlockIndex* pindexPrev, const uint256& kerne
 
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
-bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CBlockHeader& blockFrom, const CTransaction& tx, const CTransaction& txPrev, const COutPoint& prevout, uint256& hashProofOfStake, bool fPrintProofOfStake = false);
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CDiskStakeInput& stakeFrom, const CTransaction& tx, const COutPoint& prevout, uint256& hashProofOfStake, bool fPrintProofOfStake = false);
+// Same, for a coinstake timestamp nTimeTx; only reads the stake modifier of pindexPrev, so needs no lock
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CDiskStakeInput& stakeFrom, unsigned int nTimeTx, const COutPoint& prevout, uint256& hashProofOfStake);
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, const CTransaction& tx, uint256* hashProof = nullptr);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
-bool CheckProofOfStake(const CBlockIndex* pindexPrev, unsigned int nBits, const CTransaction& tx, uint256& hashProofOfStake);
+// If pvChecks is not nullptr, the coinstake signature check is pushed onto it instead of being performed inline
+bool CheckProofOfStake(const CBlockIndex* pindexPrev, unsigned int nBits, const CTransaction& tx, uint256& hashProofOfStake, std::vector<CBlockCheck>* pvChecks = nullptr);
 
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
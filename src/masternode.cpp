@@ -13,10 +13,12 @@
 #include <consensus/validation.h>
 #include <hash.h>
 #include <init.h>
+#include <invpayloadcache.h>
 #include <merkleblock.h>
 #include <net_processing.h>
 #include <netaddress.h>
 #include <netbase.h>
+#include <netmessagedispatcher.h>
 #include <netmessagemaker.h>
 #include <policy/policy.h>
 #include <primitives/block.h>
@@ -1124,6 +1126,7 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled, bool fChec
             uint256 hash = mnb.GetHash();
             if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
                 mnodeman.mapSeenMasternodeBroadcast[hash].lastPing = *this;
+                invPayloadCache.Erase(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
             }
 
             pmn->Check(true);
@@ -1338,7 +1341,10 @@ bool CActiveMasternode::SendMasternodePing(std::string& errorMessage)
         //mnodeman.mapSeenMasternodeBroadcast.lastPing is probably outdated, so we'll update it
         CMasternodeBroadcast mnb(*pmn);
         uint256 hash = mnb.GetHash();
-        if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) mnodeman.mapSeenMasternodeBroadcast[hash].lastPing = mnp;
+        if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
+            mnodeman.mapSeenMasternodeBroadcast[hash].lastPing = mnp;
+            invPayloadCache.Erase(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
+        }
 
         mnp.Relay();
 
@@ -1367,8 +1373,8 @@ bool CActiveMasternode::SendMasternodePing(std::string& errorMessage)
 
         LogPrint(BCLog::MASTERNODE, "dseep - relaying from active mn, %s \n", vin.ToString().c_str());
         CTxIn vin2 = this->vin;
-        g_connman->ForEachNode([=, &vin2, &vchMasterNodeSignature, &masterNodeSignatureTime](CNode* pnode) {
-            g_connman->PushMessage(pnode, CNetMsgMaker(pnode->nVersion).Make("dseep", vin2, vchMasterNodeSignature, masterNodeSignatureTime, false));
+        g_connman->BroadcastMessage([&](int nVersion) {
+            return CNetMsgMaker(nVersion).Make("dseep", vin2, vchMasterNodeSignature, masterNodeSignatureTime, false);
         });
         /*
          * END OF "REMOVE"
@@ -1476,8 +1482,8 @@ bool CActiveMasternode::CreateBroadcast(CTxIn vin, CService service, CKey keyCol
         return false;
     }
 
-    g_connman->ForEachNode([=, &vin, &service, &vchMasterNodeSignature, &masterNodeSignatureTime, &pubKeyCollateralAddress, &pubKeyMasternode, &donationAddress, &donationPercantage](CNode* pnode) {
-        g_connman->PushMessage(pnode, CNetMsgMaker(pnode->nVersion).Make("dsee", vin, service, vchMasterNodeSignature, masterNodeSignatureTime, pubKeyCollateralAddress, pubKeyMasternode, -1, -1, masterNodeSignatureTime, PROTOCOL_VERSION, donationAddress, donationPercantage));
+    g_connman->BroadcastMessage([&](int nVersion) {
+        return CNetMsgMaker(nVersion).Make("dsee", vin, service, vchMasterNodeSignature, masterNodeSignatureTime, pubKeyCollateralAddress, pubKeyMasternode, -1, -1, masterNodeSignatureTime, PROTOCOL_VERSION, donationAddress, donationPercantage);
     });
     /*
      * END OF "REMOVE"
@@ -3357,10 +3363,9 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, const std::string& strCommand,
                     pmn->nLastDsee = sigTime;
                     pmn->Check();
                     if (pmn->IsEnabled()) {
-                        g_connman->ForEachNode([=, &vin, &addr, &vchSig, &sigTime, &pubkey, &pubkey2, &count, &current, &lastUpdated, &protocolVersion, &donationAddress, &donationPercentage](CNode* pnode) {
-                            if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto())
-                                g_connman->PushMessage(pnode, CNetMsgMaker(pnode->nVersion).Make("dsee", vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage));
-                        });
+                        g_connman->BroadcastMessage(
+                            [](CNode* pnode) { return pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto(); },
+                            [&](int nVersion) { return CNetMsgMaker(nVersion).Make("dsee", vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage); });
                     }
                 }
             }
@@ -3450,10 +3455,9 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, const std::string& strCommand,
                 Add(mn);
             }
             if (mn.IsEnabled()) {
-                g_connman->ForEachNode([=, &vin, &addr, &vchSig, &sigTime, &pubkey, &pubkey2, &count, &current, &lastUpdated, &protocolVersion, &donationAddress, &donationPercentage](CNode* pnode) {
-                    if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto())
-                        g_connman->PushMessage(pnode, CNetMsgMaker(pnode->nVersion).Make("dsee", vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage));
-                });
+                g_connman->BroadcastMessage(
+                    [](CNode* pnode) { return pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto(); },
+                    [&](int nVersion) { return CNetMsgMaker(nVersion).Make("dsee", vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage); });
             }
         } else {
             LogPrint(BCLog::MASTERNODE, "dsee - Rejected Masternode entry %s\n", vin.prevout.hash.ToString());
@@ -3515,10 +3519,9 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, const std::string& strCommand,
                 pmn->Check();
                 if (pmn->IsEnabled()) {
                     LogPrint(BCLog::MASTERNODE, "dseep - relaying %s \n", vin.prevout.hash.ToString());
-                    g_connman->ForEachNode([=, &vin, &vchSig, &sigTime, &stop](CNode* pnode) {
-                        if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto())
-                            g_connman->PushMessage(pnode, CNetMsgMaker(pnode->nVersion).Make("dseep", vin, vchSig, sigTime, stop));
-                    });
+                    g_connman->BroadcastMessage(
+                        [](CNode* pnode) { return pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto(); },
+                        [&](int nVersion) { return CNetMsgMaker(nVersion).Make("dseep", vin, vchSig, sigTime, stop); });
                 }
             }
             return;
@@ -3902,3 +3905,30 @@ void ThreadMasternode()
         }
     }
 }
+
+static bool ProcessMasternodeListMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
+    return true;
+}
+
+static bool ProcessMasternodePaymentsMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
+    return true;
+}
+
+static bool ProcessMasternodeSyncMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+    return true;
+}
+
+void RegisterMasternodeMessageHandlers(CNetMessageDispatcher& dispatcher)
+{
+    for (const char* pszCommand : {"mnb", "mnp", "dseg", "dsee", "dseep"})
+        dispatcher.Register(pszCommand, ProcessMasternodeListMessage, NETMSG_MASTERNODE);
+    for (const char* pszCommand : {"mnget", "mnw"})
+        dispatcher.Register(pszCommand, ProcessMasternodePaymentsMessage, NETMSG_MASTERNODE);
+    dispatcher.Register("ssc", ProcessMasternodeSyncMessage, NETMSG_MASTERNODE);
+}
@@ -34,6 +34,7 @@ extern std::string strMasterNodePrivKey;
 extern std::string strVoteMode;
 
 class CMasternodeConfig;
+class CNetMessageDispatcher;
 extern CMasternodeConfig masternodeConfig;
 
 class CMasternodeConfig
@@ -880,6 +881,8 @@ class CMasternodeMan;
 
 extern CMasternodeMan mnodeman;
 void DumpMasternodes();
+/** Register the handlers for the masternode list, payment and sync messages */
+void RegisterMasternodeMessageHandlers(CNetMessageDispatcher& dispatcher);
 
 /** Access to the MN database (mncache.dat)
  */
@@ -25,13 +25,19 @@
 #include <validation.h>
 #include <validationinterface.h>
 #include <kernel.h>
+#include <txdb.h>
 
 #include <wallet/wallet.h>
 #include <warnings.h>
 
 #include <algorithm>
+#include <functional>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <queue>
+#include <set>
+#include <unordered_map>
 #include <utility>
 
 #include <boost/thread.hpp>
@@ -94,12 +100,339 @@ void BlockAssembler::resetBlock()
     // These counters do not include coinbase tx
     nBlockTx = 0;
     nFees = 0;
+
+    vDeferred.clear();
+    vSkipped.clear();
+    fPackagesTruncated = false;
+}
+
+void BlockAssembler::clearTxs()
+{
+    pblock->vtx.resize(1);
+    pblocktemplate->vTxFees.resize(1);
+    pblocktemplate->vTxSigOpsCost.resize(1);
+    resetBlock();
+}
+
+void BlockAssembler::removeFromBlock(CTxMemPool::txiter iter)
+{
+    inBlock.erase(iter);
+    --nBlockTx;
+    nBlockSigOpsCost -= iter->GetSigOpCost();
+    nFees -= iter->GetFee();
+}
+
+// Limit the number of attempts to add transactions to the block when it is
+// close to full; this is just a simple heuristic to finish quickly if the
+// mempool has a lot of entries.
+static const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+
+/**
+ * The transactions of the last proof-of-work template, kept up to date from
+ * mempool notifications: entries leaving the mempool are dropped from the
+ * selection as they go, and arrivals are queued. The packages left out
+ * because the block was full are kept as candidates, best feerate first.
+ * The next template on the same tip or on a child of it then starts from
+ * the selection and only considers the queue and the candidates, instead
+ * of rerunning addPackageTxs over the whole mempool. Notifications arrive
+ * with mempool.cs held.
+ */
+class CTxSelectionCache
+{
+public:
+    //! Arrivals to queue before giving up and rebuilding the selection
+    static const size_t MAX_PENDING = 50000;
+    //! Candidates to keep; the worst ones beyond this are forgotten
+    static const size_t MAX_CANDIDATES = 50000;
+
+    std::mutex cs;
+    //! tip the selection was made on
+    uint256 hashPrevBlock;
+    //! selected transactions in block order; mapTx.end() for those removed since
+    std::vector<CTxMemPool::txiter> vSelected;
+    std::unordered_map<uint256, size_t, SaltedTxidHasher> mapSelected;
+    //! arrivals since the last template, and transactions not final yet
+    std::vector<uint256> vPending;
+    //! last transaction of packages that did not fit, by package feerate when they were left out
+    std::set<std::pair<CFeeRate, uint256>, std::greater<std::pair<CFeeRate, uint256>>> setCandidates;
+    //! packages were left out without becoming candidates; room freed once the candidates run out calls for a rebuild
+    bool fTruncated;
+    bool fRebuild;
+
+    void TrimCandidates()
+    {
+        while (setCandidates.size() > MAX_CANDIDATES) {
+            setCandidates.erase(std::prev(setCandidates.end()));
+            fTruncated = true;
+        }
+    }
+
+private:
+    boost::signals2::scoped_connection connAdded;
+    boost::signals2::scoped_connection connRemoved;
+
+    void EntryAdded(const CTransactionRef& ptx)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (fRebuild)
+            return;
+        if (vPending.size() >= MAX_PENDING) {
+            fRebuild = true;
+            vPending.clear();
+            return;
+        }
+        vPending.push_back(ptx->GetHash());
+    }
+
+    void EntryRemoved(const CTransactionRef& ptx)
+    {
+        // The descendants of a removed transaction go with it, unless it was
+        // confirmed, so the remaining selection stays in a valid order
+        std::lock_guard<std::mutex> lock(cs);
+        auto it = mapSelected.find(ptx->GetHash());
+        if (it == mapSelected.end())
+            return;
+        vSelected[it->second] = mempool.mapTx.end();
+        mapSelected.erase(it);
+    }
+
+public:
+    CTxSelectionCache() : fTruncated(false), fRebuild(true)
+    {
+        connAdded = mempool.NotifyEntryAdded.connect([this](CTransactionRef ptx) { EntryAdded(ptx); });
+        connRemoved = mempool.NotifyEntryRemoved.connect([this](CTransactionRef ptx, MemPoolRemovalReason) { EntryRemoved(ptx); });
+    }
+};
+
+static CTxSelectionCache& GetTxSelectionCache()
+{
+    // Constructed on first use, so only nodes serving templates track the mempool
+    static CTxSelectionCache cache;
+    return cache;
 }
 
+static std::mutex csBlockTemplateStats;
+static BlockTemplateStats blockTemplateStats;
+
+BlockTemplateStats GetBlockTemplateStats()
+{
+    std::lock_guard<std::mutex> lock(csBlockTemplateStats);
+    return blockTemplateStats;
+}
+
+bool BlockAssembler::displaceForPackage(const CTxMemPool::setEntries& ancestors, const CFeeRate& packageFeeRate, int64_t packageSigOpsCost,
+    std::multimap<CFeeRate, CTxMemPool::txiter>& mapLeaves, CTxSelectionCache& cache)
+{
+    // Sigop cost the block has to give up for TestPackage to pass
+    int64_t nExcess = nBlockSigOpsCost + packageSigOpsCost - MAX_BLOCK_SIGOPS_COST + 1;
+    std::vector<std::multimap<CFeeRate, CTxMemPool::txiter>::iterator> vEvict;
+    CTxMemPool::setEntries setEvict;
+    for (auto lit = mapLeaves.begin(); lit != mapLeaves.end() && nExcess > 0 && lit->first < packageFeeRate;) {
+        CTxMemPool::txiter it = lit->second;
+        bool fLeaf = inBlock.count(it);
+        for (CTxMemPool::txiter child : mempool.GetMemPoolChildren(it)) {
+            if (fLeaf && inBlock.count(child)) {
+                fLeaf = false;
+                break;
+            }
+        }
+        if (!fLeaf) {
+            lit = mapLeaves.erase(lit);
+            continue;
+        }
+        // The package's own ancestors have to stay
+        if (!ancestors.count(it) && setEvict.insert(it).second) {
+            nExcess -= it->GetSigOpCost();
+            vEvict.push_back(lit);
+        }
+        ++lit;
+    }
+    if (nExcess > 0)
+        return false;
 
+    for (auto lit : vEvict) {
+        CTxMemPool::txiter it = lit->second;
+        cache.setCandidates.emplace(lit->first, it->GetTx().GetHash());
+        mapLeaves.erase(lit);
+        removeFromBlock(it);
+        for (CTxMemPool::txiter parent : mempool.GetMemPoolParents(it)) {
+            if (inBlock.count(parent))
+                mapLeaves.emplace(CFeeRate(parent->GetModifiedFee(), parent->GetTxSize()), parent);
+        }
+    }
+    return true;
+}
 
-// galaxycash: if pwallet != NULL it will attempt to create coinstake
-std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool* pfPoSCancel)
+bool BlockAssembler::addCachedTxs(CTxSelectionCache& cache, const CBlockIndex* pindexPrev, int& nPackagesSelected)
+{
+    // On a child of its tip the confirmed entries of the selection are gone,
+    // and conflicts went with their descendants; anything else needs a rebuild
+    if (cache.fRebuild || cache.hashPrevBlock.IsNull())
+        return false;
+    if (cache.hashPrevBlock != pindexPrev->GetBlockHash() &&
+        (!pindexPrev->pprev || cache.hashPrevBlock != pindexPrev->pprev->GetBlockHash()))
+        return false;
+
+    std::vector<CTxMemPool::txiter> vSelected;
+    vSelected.reserve(cache.mapSelected.size() + cache.vPending.size());
+    for (CTxMemPool::txiter it : cache.vSelected) {
+        if (it == mempool.mapTx.end())
+            continue;
+        AddToBlock(it);
+        vSelected.push_back(it);
+    }
+    const size_t nCached = vSelected.size();
+
+    // Arrivals join the candidates, scored by their ancestor feerate like in addPackageTxs
+    for (const uint256& hash : cache.vPending) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end() || inBlock.count(it))
+            continue;
+
+        // A reorg puts transactions back into the mempool that selected ones spend
+        for (CTxMemPool::txiter child : mempool.GetMemPoolChildren(it)) {
+            if (inBlock.count(child))
+                return false;
+        }
+        cache.setCandidates.emplace(CFeeRate(it->GetModFeesWithAncestors(), it->GetSizeWithAncestors()), hash);
+    }
+
+    // Fill the block from the candidates, best first. A package that does not
+    // fit takes the place of selected transactions with a lower feerate.
+    std::vector<uint256> vPending;
+    std::multimap<CFeeRate, CTxMemPool::txiter> mapLeaves;
+    bool fLeaves = false;
+    bool fDisplaced = false;
+    int64_t nConsecutiveFailed = 0;
+    auto cit = cache.setCandidates.begin();
+    while (cit != cache.setCandidates.end() && nConsecutiveFailed <= MAX_CONSECUTIVE_FAILURES) {
+        CTxMemPool::txiter iter = mempool.mapTx.find(cit->second);
+        if (iter == mempool.mapTx.end() || inBlock.count(iter)) {
+            cit = cache.setCandidates.erase(cit);
+            continue;
+        }
+
+        CTxMemPool::setEntries ancestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        CTxMemPool::setEntries package(ancestors);
+        onlyUnconfirmed(package);
+        package.insert(iter);
+
+        std::vector<CTxMemPool::txiter> sortedEntries;
+        SortForBlock(package, iter, sortedEntries);
+        if (!TestPackageTransactions(package)) {
+            // Retry on later templates, once final
+            for (CTxMemPool::txiter it : sortedEntries)
+                vPending.push_back(it->GetTx().GetHash());
+            cit = cache.setCandidates.erase(cit);
+            continue;
+        }
+
+        uint64_t packageSize = 0;
+        CAmount packageFees = 0;
+        int64_t packageSigOpsCost = 0;
+        for (CTxMemPool::txiter it : package) {
+            packageSize += it->GetTxSize();
+            packageFees += it->GetModifiedFee();
+            packageSigOpsCost += it->GetSigOpCost();
+        }
+        CFeeRate packageFeeRate(packageFees, packageSize);
+
+        if (!TestPackage(packageSize, packageSigOpsCost)) {
+            if (!fLeaves) {
+                for (CTxMemPool::txiter it : vSelected) {
+                    bool fLeaf = true;
+                    for (CTxMemPool::txiter child : mempool.GetMemPoolChildren(it)) {
+                        if (inBlock.count(child)) {
+                            fLeaf = false;
+                            break;
+                        }
+                    }
+                    if (fLeaf)
+                        mapLeaves.emplace(CFeeRate(it->GetModifiedFee(), it->GetTxSize()), it);
+                }
+                fLeaves = true;
+            }
+            if (!displaceForPackage(ancestors, packageFeeRate, packageSigOpsCost, mapLeaves, cache)) {
+                ++nConsecutiveFailed;
+                ++cit;
+                continue;
+            }
+            fDisplaced = true;
+        }
+        nConsecutiveFailed = 0;
+
+        for (CTxMemPool::txiter it : sortedEntries) {
+            AddToBlock(it);
+            vSelected.push_back(it);
+        }
+        if (fLeaves)
+            mapLeaves.emplace(CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()), iter);
+        ++nPackagesSelected;
+        cit = cache.setCandidates.erase(cit);
+    }
+
+    // Packages addPackageTxs never looked at are not candidates, so only a
+    // rebuild can fill the room left once the candidates have run out
+    if (cache.fTruncated && cache.setCandidates.empty() && nCached != cache.vSelected.size())
+        return false;
+
+    if (fDisplaced) {
+        // Put the block together again without the displaced transactions;
+        // one that came back is kept at its first place, after its parents
+        std::vector<CTxMemPool::txiter> vKept;
+        CTxMemPool::setEntries setKept;
+        for (CTxMemPool::txiter it : vSelected) {
+            if (inBlock.count(it) && setKept.insert(it).second)
+                vKept.push_back(it);
+        }
+        clearTxs();
+        for (CTxMemPool::txiter it : vKept)
+            AddToBlock(it);
+        vSelected.swap(vKept);
+    }
+
+    if (fDisplaced || nCached != cache.mapSelected.size() || vSelected.size() != cache.vSelected.size()) {
+        // Drop the removed entries and index the new ones
+        size_t nIndexed = nCached;
+        if (fDisplaced || nCached != cache.vSelected.size()) {
+            cache.mapSelected.clear();
+            nIndexed = 0;
+        }
+        for (size_t i = nIndexed; i < vSelected.size(); i++)
+            cache.mapSelected.emplace(vSelected[i]->GetTx().GetHash(), i);
+        cache.vSelected.swap(vSelected);
+    }
+    cache.vPending.swap(vPending);
+    cache.TrimCandidates();
+    cache.hashPrevBlock = pindexPrev->GetBlockHash();
+    return true;
+}
+
+void BlockAssembler::storeCachedTxs(CTxSelectionCache& cache, const CBlockIndex* pindexPrev)
+{
+    cache.vSelected.clear();
+    cache.mapSelected.clear();
+    for (size_t i = 1; i < pblock->vtx.size(); i++) {
+        const uint256& hash = pblock->vtx[i]->GetHash();
+        cache.mapSelected.emplace(hash, cache.vSelected.size());
+        cache.vSelected.push_back(mempool.mapTx.find(hash));
+    }
+    cache.vPending.swap(vDeferred);
+    cache.setCandidates.clear();
+    cache.setCandidates.insert(vSkipped.begin(), vSkipped.end());
+    cache.fTruncated = fPackagesTruncated;
+    cache.TrimCandidates();
+    cache.hashPrevBlock = pindexPrev->GetBlockHash();
+    cache.fRebuild = false;
+}
+
+
+
+// galaxycash: if pkernel != NULL the block is built around a coinstake spending it
+std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, const CStakeKernel* pkernel)
 {
     int64_t nTimeStart = GetTimeMicros();
 
@@ -134,30 +467,19 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     pblocktemplate->vTxFees.push_back(-1);       // updated at end
     pblocktemplate->vTxSigOpsCost.push_back(-1); // updated at end
 
-    // galaxycash: if coinstake available add coinstake tx
-    static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // only initialized at startup
-    CKey keyCoinStake;
-    if (pwallet) // attemp to find a coinstake
-    {
-        *pfPoSCancel = true;
-        pblock->nBits = GetNextTargetRequired(pindexPrev, CBlockHeader::ALGO_X12, true, chainparams.GetConsensus());
+    // galaxycash: add the coinstake of the kernel found by the stake minter
+    if (pkernel) {
+        assert(pwallet);
+        if (pkernel->pindexPrev != pindexPrev)
+            return nullptr; // the tip moved on while the kernel was searched for
+        pblock->nBits = pkernel->nBits;
         CMutableTransaction txCoinStake;
-        txCoinStake.nTime &= ~STAKE_TIMESTAMP_MASK;
-        int64_t nSearchTime = txCoinStake.nTime; // search to current time
-        if (nSearchTime > nLastCoinStakeSearchTime) {
-            int64_t nSearchInterval = 1;
-            if (pwallet->CreateCoinStake(*pwallet, nFees, nHeight, pblock->nBits, nSearchInterval, txCoinStake, pblocktemplate->key)) {
-                coinbaseTx.vout[0].SetEmpty();
-                coinbaseTx.nTime = txCoinStake.nTime;
-                pblock->vtx.push_back(MakeTransactionRef(CTransaction(txCoinStake)));
-                pblock->nTime = txCoinStake.nTime;
-                *pfPoSCancel = false;
-            }
-            nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
-            nLastCoinStakeSearchTime = nSearchTime;
-        }
-        if (*pfPoSCancel)
-            return nullptr; // galaxycash: there is no point to continue if we failed to create coinstake
+        if (!pwallet->CreateCoinStake(*pwallet, pkernel->prevout, pkernel->nTime, nFees, nHeight, txCoinStake, pblocktemplate->key))
+            return nullptr;
+        coinbaseTx.vout[0].SetEmpty();
+        coinbaseTx.nTime = txCoinStake.nTime;
+        pblock->vtx.push_back(MakeTransactionRef(CTransaction(txCoinStake)));
+        pblock->nTime = txCoinStake.nTime;
     }
 
     LOCK(mempool.cs);
@@ -170,7 +492,21 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     int nPackagesSelected = 0;
     int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    bool fRebuilt = true;
+    if (pkernel) {
+        // The coinstake timestamp limits the transactions of a proof-of-stake block
+        addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    } else {
+        CTxSelectionCache& cache = GetTxSelectionCache();
+        std::lock_guard<std::mutex> lock(cache.cs);
+        if (addCachedTxs(cache, pindexPrev, nPackagesSelected)) {
+            fRebuilt = false;
+        } else {
+            clearTxs();
+            addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+            storeCachedTxs(cache, pindexPrev);
+        }
+    }
 
     int64_t nTime1 = GetTimeMicros();
 
@@ -182,7 +518,7 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     // Fill in header
     pblock->hashPrevBlock = pindexPrev->GetBlockHash();
-    if ((*pfPoSCancel)) {
+    if (!pkernel) {
         pblock->nTime          = std::max(pindexPrev->GetBlockTime()+1, pblock->GetMaxTransactionTime());
         UpdateTime(&pblocktemplate->block);
     }
@@ -192,7 +528,19 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     int64_t nTime2 = GetTimeMicros();
 
-    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d %s packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, fRebuilt ? "selected" : "added", nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+
+    {
+        std::lock_guard<std::mutex> lock(csBlockTemplateStats);
+        blockTemplateStats.nTemplates++;
+        blockTemplateStats.nBuildMicros += nTime2 - nTimeStart;
+        if (fRebuilt) {
+            blockTemplateStats.nRebuilds++;
+            blockTemplateStats.nRebuildMicros += nTime2 - nTimeStart;
+        }
+        blockTemplateStats.nLastBuildMicros = nTime2 - nTimeStart;
+        blockTemplateStats.nMaxBuildMicros = std::max(blockTemplateStats.nMaxBuildMicros, nTime2 - nTimeStart);
+    }
 
     return std::move(pblocktemplate);
 }
@@ -328,10 +676,6 @@ void BlockAssembler::addPackageTxs(int& nPackagesSelected, int& nDescendantsUpda
     CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
     CTxMemPool::txiter iter;
 
-    // Limit the number of attempts to add transactions to the block when it is
-    // close to full; this is just a simple heuristic to finish quickly if the
-    // mempool has a lot of entries.
-    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
     int64_t nConsecutiveFailed = 0;
 
     while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
@@ -373,9 +717,11 @@ void BlockAssembler::addPackageTxs(int& nPackagesSelected, int& nDescendantsUpda
         assert(!inBlock.count(iter));
 
         uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
         int64_t packageSigOpsCost = iter->GetSigOpCostWithAncestors();
         if (fUsingModified) {
             packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
             packageSigOpsCost = modit->nSigOpCostWithAncestors;
         }
 
@@ -388,10 +734,12 @@ void BlockAssembler::addPackageTxs(int& nPackagesSelected, int& nDescendantsUpda
                 failedTx.insert(iter);
             }
 
+            vSkipped.emplace_back(CFeeRate(packageFees, packageSize), iter->GetTx().GetHash());
             ++nConsecutiveFailed;
 
             if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES) {
                 // Give up if we're close to full and haven't succeeded in a while
+                fPackagesTruncated = true;
                 break;
             }
             continue;
@@ -411,6 +759,11 @@ void BlockAssembler::addPackageTxs(int& nPackagesSelected, int& nDescendantsUpda
                 mapModifiedTx.get<ancestor_score>().erase(modit);
                 failedTx.insert(iter);
             }
+            // Retry on later templates, once final
+            std::vector<CTxMemPool::txiter> sortedEntries;
+            SortForBlock(ancestors, iter, sortedEntries);
+            for (CTxMemPool::txiter it : sortedEntries)
+                vDeferred.push_back(it->GetTx().GetHash());
             continue;
         }
 
@@ -473,12 +826,72 @@ static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainpar
     return true;
 }
 
+static std::mutex csStakeMinterStats;
+static StakeMinterStats stakeMinterStats;
+
+StakeMinterStats GetStakeMinterStats()
+{
+    std::lock_guard<std::mutex> lock(csStakeMinterStats);
+    return stakeMinterStats;
+}
+
+/**
+ * Search the candidate coins for a kernel meeting the target of the tip
+ * snapshot in kernel, for coinstake timestamps nSearchTime back to
+ * nSearchTime - nSearchInterval + 1. Runs without holding any lock: block
+ * indexes are never freed and the stake modifier of a connected block does
+ * not change, and the stake inputs come from the block tree database, cached
+ * in mapStakeInputs across searches.
+ */
+static bool SearchStakeKernel(const std::vector<CInputCoin>& vCandidates, int64_t nSearchTime, int64_t nSearchInterval, std::map<COutPoint, CDiskStakeInput>& mapStakeInputs, CStakeKernel& kernel)
+{
+    static const int64_t nMaxStakeSearchInterval = 60;
+
+    // Forget the inputs of coins that are no longer candidates
+    std::set<COutPoint> setCandidates;
+    for (const CInputCoin& coin : vCandidates)
+        setCandidates.insert(coin.outpoint);
+    for (auto it = mapStakeInputs.begin(); it != mapStakeInputs.end();) {
+        if (setCandidates.count(it->first))
+            ++it;
+        else
+            it = mapStakeInputs.erase(it);
+    }
+
+    for (const CInputCoin& coin : vCandidates) {
+        auto it = mapStakeInputs.find(coin.outpoint);
+        if (it == mapStakeInputs.end()) {
+            CDiskStakeInput stakeFrom;
+            if (!GetStakeInput(coin.outpoint, stakeFrom))
+                continue;
+            it = mapStakeInputs.emplace(coin.outpoint, stakeFrom).first;
+        }
+
+        // Search backward in time from nSearchTime
+        for (int64_t n = 0; n < std::min(nSearchInterval, nMaxStakeSearchInterval); n++) {
+            unsigned int nTime = nSearchTime - n;
+            if (nTime < it->second.nTime)
+                break;
+            uint256 hashProofOfStake;
+            if (CheckStakeKernelHash(kernel.pindexPrev, kernel.nBits, it->second, nTime, coin.outpoint, hashProofOfStake)) {
+                LogPrint(BCLog::STAKE, "%s: kernel found %s\n", __func__, coin.outpoint.ToString());
+                kernel.prevout = coin.outpoint;
+                kernel.nTime = nTime;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 void PoSMiner(CWallet* pwallet)
 {
     LogPrintf("CPUMiner started for proof-of-stake\n");
     RenameThread("galaxycash-stakethread-minter");
 
     unsigned int nExtraNonce = 0;
+    int64_t nLastCoinStakeSearchTime = GetAdjustedTime();
+    std::map<COutPoint, CDiskStakeInput> mapStakeInputs;
 
     std::shared_ptr<CReserveScript> coinbaseScript;
     pwallet->GetScriptForMining(coinbaseScript);
@@ -496,7 +909,6 @@ void PoSMiner(CWallet* pwallet)
     std::string strMintMessage = _("Info: Staking suspended due to locked wallet.");
     std::string strMintSyncMessage = _("Info: Staking suspended while synchronizing wallet.");
     std::string strMintDisabledMessage = _("Info: Staking disabled by 'staking' option.");
-    std::string strMintBlockMessage = _("Info: Staking suspended due to block creation failure.");
     std::string strMintEmpty = _("");
     if (!gArgs.GetBoolArg("-staking", true)) {
         strMintWarning = strMintDisabledMessage;
@@ -533,41 +945,81 @@ void PoSMiner(CWallet* pwallet)
 
             strMintWarning = strMintEmpty;
 
+            // Search to the current time, once per masked timestamp
+            int64_t nSearchTime = GetAdjustedTime() & ~STAKE_TIMESTAMP_MASK;
+            if (nSearchTime <= nLastCoinStakeSearchTime) {
+                MilliSleep(pos_timio);
+                continue;
+            }
+            nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
+            nLastCoinStakeSearchTime = nSearchTime;
+
             //
-            // Create new block
+            // Search for a kernel against a snapshot of the tip and candidate coins
             //
-            CBlockIndex* pindexPrev = chainActive.Tip();
-            bool fPoSCancel = false;
-            std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(coinbaseScript->reserveScript, pwallet, &fPoSCancel));
-            if (!pblocktemplate.get()) {
-                if (fPoSCancel == true)
-                {
-                    MilliSleep(pos_timio);
-                    continue;
-                }
-                strMintWarning = strMintBlockMessage;
-                LogPrintf("Error in GalaxyCashMiner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
-                return;
+            int64_t nTimeStart = GetTimeMicros();
+            CStakeKernel kernel;
+            std::vector<CInputCoin> vCandidates;
+            {
+                LOCK(cs_main);
+                kernel.pindexPrev = chainActive.Tip();
+                kernel.nBits = GetNextTargetRequired(kernel.pindexPrev, CBlockHeader::ALGO_X12, true, Params().GetConsensus());
+            }
+            pwallet->GetStakeCandidates(vCandidates);
+            int64_t nTimeSnapshot = GetTimeMicros();
+            bool fKernelFound = !vCandidates.empty() && SearchStakeKernel(vCandidates, nSearchTime, 1, mapStakeInputs, kernel);
+            int64_t nTimeSearch = GetTimeMicros();
+            {
+                std::lock_guard<std::mutex> lock(csStakeMinterStats);
+                stakeMinterStats.nSearches++;
+                stakeMinterStats.nKernels += fKernelFound;
+                stakeMinterStats.nSnapshotMicros += nTimeSnapshot - nTimeStart;
+                stakeMinterStats.nSearchMicros += nTimeSearch - nTimeSnapshot;
+            }
+            if (!fKernelFound) {
+                MilliSleep(pos_timio);
+                continue;
             }
-            CBlock* pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-            // galaxycash: if proof-of-stake block found then process block
-            if (pblock->IsProofOfStake()) {
-                pblock->nFlags = CBlockIndex::BLOCK_PROOF_OF_STAKE;
-                
-                if (!pblocktemplate->key.Sign(pblock->GetHash(), pblock->vchBlockSig))
-                    throw std::runtime_error(strprintf("%s: Block sign failed", __func__));
-
-                CValidationState state;
-                if (!TestBlockValidity(state, Params(), *pblock, pindexPrev, false, false)) {
-                    throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
-                }
 
-                LogPrintf("CPUMiner : proof-of-stake block found %s\n", pblock->GetHash().ToString());
-                ProcessBlockFound(pblock, Params());
-                MilliSleep(60 * 1000 + GetRand(4 * 60 * 1000));
+            //
+            // Only a found kernel takes cs_main, to build, check and sign the block
+            //
+            std::unique_ptr<CBlockTemplate> pblocktemplate;
+            CBlock* pblock = nullptr;
+            {
+                LOCK(cs_main);
+                int64_t nTimeLock = GetTimeMicros();
+                pblocktemplate = BlockAssembler(Params()).CreateNewBlock(coinbaseScript->reserveScript, pwallet, &kernel);
+                if (pblocktemplate) {
+                    pblock = &pblocktemplate->block;
+                    IncrementExtraNonce(pblock, kernel.pindexPrev, nExtraNonce);
+                    pblock->nFlags = CBlockIndex::BLOCK_PROOF_OF_STAKE;
+
+                    if (!pblocktemplate->key.Sign(pblock->GetHash(), pblock->vchBlockSig))
+                        throw std::runtime_error(strprintf("%s: Block sign failed", __func__));
+
+                    CValidationState state;
+                    if (!TestBlockValidity(state, Params(), *pblock, kernel.pindexPrev, false, false)) {
+                        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+                    }
+                }
+                int64_t nLockMicros = GetTimeMicros() - nTimeLock;
+                std::lock_guard<std::mutex> lock(csStakeMinterStats);
+                stakeMinterStats.nAssembleMicros += nLockMicros;
+                stakeMinterStats.nMaxAssembleMicros = std::max(stakeMinterStats.nMaxAssembleMicros, nLockMicros);
+                LogPrint(BCLog::BENCH, "%s: snapshot %.2fms, kernel search %.2fms, cs_main held %.2fms to build the block\n", __func__,
+                    0.001 * (nTimeSnapshot - nTimeStart), 0.001 * (nTimeSearch - nTimeSnapshot), 0.001 * nLockMicros);
+            }
+            if (!pblock) {
+                // The tip moved on or the kernel got spent while searching
+                LogPrint(BCLog::STAKE, "%s: kernel %s went stale\n", __func__, kernel.prevout.ToString());
+                MilliSleep(pos_timio);
+                continue;
             }
+
+            LogPrintf("CPUMiner : proof-of-stake block found %s\n", pblock->GetHash().ToString());
+            ProcessBlockFound(pblock, Params());
+            MilliSleep(60 * 1000 + GetRand(4 * 60 * 1000));
             MilliSleep(pos_timio);
             continue;
         }
@@ -12,6 +12,7 @@
 
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index_container.hpp>
+#include <map>
 #include <memory>
 #include <stdint.h>
 
@@ -21,6 +22,7 @@ extern int64_t nLastCoinStakeSearchInterval;
 class CBlockIndex;
 class CChainParams;
 class CScript;
+class CTxSelectionCache;
 class CWallet;
 
 namespace Consensus
@@ -28,6 +30,16 @@ namespace Consensus
 struct Params;
 };
 
+/** A proof-of-stake kernel found by the stake minter, to build a block around */
+struct CStakeKernel {
+    //! tip the kernel was searched against; it is only valid on top of it
+    CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    COutPoint prevout;
+    //! coinstake timestamp that meets the target
+    unsigned int nTime;
+};
+
 static const bool DEFAULT_PRINTPRIORITY = false;
 
 struct CBlockTemplate {
@@ -140,6 +152,12 @@ private:
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
     CTxMemPool::setEntries inBlock;
+    //! transactions of packages that were not final yet, to retry on later templates
+    std::vector<uint256> vDeferred;
+    //! feerate and last transaction of the packages left out because the block was full
+    std::vector<std::pair<CFeeRate, uint256>> vSkipped;
+    //! whether addPackageTxs gave up before it had looked at every package
+    bool fPackagesTruncated;
 
     // Chain context for the block
     int nHeight;
@@ -155,8 +173,9 @@ public:
     explicit BlockAssembler(const CChainParams& params);
     BlockAssembler(const CChainParams& params, const Options& options);
 
-    /** Construct a new block template with coinbase to scriptPubKeyIn */
-    std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet = nullptr, bool* pfPoSCancel = nullptr);
+    /** Construct a new block template with coinbase to scriptPubKeyIn, or a proof-of-stake
+     *  block around the coinstake for pkernel; returns nullptr if the kernel went stale */
+    std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet = nullptr, const CStakeKernel* pkernel = nullptr);
 
 private:
     // utility functions
@@ -170,6 +189,22 @@ private:
       * Increments nPackagesSelected / nDescendantsUpdated with corresponding
       * statistics from the package selection (for logging statistics). */
     void addPackageTxs(int& nPackagesSelected, int& nDescendantsUpdated);
+    /** Add the transactions cached from the last template and the ones that
+      * arrived in the mempool since. Returns false if the selection has to be
+      * rebuilt with addPackageTxs instead; the block then needs clearTxs(). */
+    bool addCachedTxs(CTxSelectionCache& cache, const CBlockIndex* pindexPrev, int& nPackagesSelected);
+    /** Store the transactions of the block in the cache, for the next template */
+    void storeCachedTxs(CTxSelectionCache& cache, const CBlockIndex* pindexPrev);
+    /** Remove all transactions but the coinbase from the block */
+    void clearTxs();
+    /** Take a tx out of the block's totals; the block itself is rebuilt with clearTxs() afterwards */
+    void removeFromBlock(CTxMemPool::txiter iter);
+    /** Make room for a package by taking out selected transactions that have no selected
+      * children and a lower feerate, lowest first. mapLeaves holds those transactions
+      * (entries that stopped being leaves are dropped on the way); the ones taken out
+      * become candidates again. Returns false, changing nothing, if they don't free enough. */
+    bool displaceForPackage(const CTxMemPool::setEntries& ancestors, const CFeeRate& packageFeeRate, int64_t packageSigOpsCost,
+        std::multimap<CFeeRate, CTxMemPool::txiter>& mapLeaves, CTxSelectionCache& cache);
 
     // helper functions for addPackageTxs()
     /** Remove confirmed (inBlock) entries from given set */
@@ -202,4 +237,30 @@ class thread_group;
 } // namespace boost
 void MintStake(boost::thread_group& threadGroup);
 
+/** Time the stake minter spent searching for kernels and holding cs_main, in microseconds */
+struct StakeMinterStats {
+    uint64_t nSearches;
+    uint64_t nKernels;
+    //! spent in kernel searches, without holding cs_main
+    int64_t nSearchMicros;
+    //! cs_main held to snapshot the tip and the candidate coins for a search
+    int64_t nSnapshotMicros;
+    //! cs_main held to assemble, check and sign the blocks of found kernels
+    int64_t nAssembleMicros;
+    int64_t nMaxAssembleMicros;
+};
+StakeMinterStats GetStakeMinterStats();
+
+/** Time spent assembling block templates, in microseconds */
+struct BlockTemplateStats {
+    uint64_t nTemplates;
+    //! templates that ran the package selection over the whole mempool
+    uint64_t nRebuilds;
+    int64_t nBuildMicros;
+    int64_t nRebuildMicros;
+    int64_t nLastBuildMicros;
+    int64_t nMaxBuildMicros;
+};
+BlockTemplateStats GetBlockTemplateStats();
+
 #endif // BITCOIN_MINER_H
@@ -17,6 +17,7 @@
 #include <netbase.h>
 #include <primitives/transaction.h>
 #include <scheduler.h>
+#include <socketevents.h>
 #include <ui_interface.h>
 #include <utilstrencodings.h>
 
@@ -26,6 +27,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -37,6 +39,7 @@
 
 
 #include <math.h>
+#include <unordered_map>
 
 // Dump addresses to peers.dat and banlist.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
@@ -74,6 +77,93 @@ enum BindFlags {
 
 const static std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
 
+/** Message handler scheduling state of a peer, see CNode::nMsgProcState */
+enum MsgProcState {
+    MSGPROC_IDLE,          //! neither queued nor being handled
+    MSGPROC_QUEUED,        //! waiting in CConnman::vMsgProcQueue
+    MSGPROC_RUNNING,       //! being handled by a message handler thread
+    MSGPROC_RUNNING_WOKEN, //! being handled, and to be queued again afterwards
+};
+
+/** How often every peer is queued for the message handlers, in milliseconds */
+static const int64_t MSGPROC_SWEEP_INTERVAL = 100;
+
+#ifndef WIN32
+/** Send buffers handed to a single sendmsg(); well below IOV_MAX everywhere */
+static const int SEND_IOV_MAX = 64;
+#endif
+
+/** Milliseconds between sweeps of every peer for inactivity */
+static const int64_t INACTIVITY_CHECK_INTERVAL = 1000;
+
+/** How far ahead of the data received a message buffer grows */
+static const unsigned int RECV_BUFFER_GROWTH = 256 * 1024;
+
+/**
+ * Recycles the buffers message payloads are received into, so that receiving
+ * a message rarely has to allocate a buffer, or to cleanse and free one once it
+ * has been processed. Buffers are kept by size class, and a bounded number of
+ * free buffers is kept per class.
+ */
+class CRecvBufferPool
+{
+private:
+    struct SizeClass {
+        size_t nSize;
+        size_t nMaxFree;
+        std::vector<CSerializeData> vFree;
+    };
+
+    std::mutex cs;
+    SizeClass vClasses[4] = {
+        {4 * 1024, 64, {}},
+        {64 * 1024, 16, {}},
+        {1024 * 1024, 4, {}},
+        {MAX_PROTOCOL_MESSAGE_LENGTH, 2, {}},
+    };
+
+public:
+    /**
+     * Hand out a free buffer with room for nSize bytes. If there is none, vch
+     * gets the capacity of the size class, so that Put can recycle it later;
+     * but only for classes within RECV_BUFFER_GROWTH, so a miss never commits
+     * more memory than the data received would.
+     */
+    void Get(size_t nSize, CSerializeData& vch)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        for (SizeClass& sizeClass : vClasses) {
+            if (nSize > sizeClass.nSize)
+                continue;
+            if (!sizeClass.vFree.empty()) {
+                vch.swap(sizeClass.vFree.back());
+                sizeClass.vFree.pop_back();
+            } else if (sizeClass.nSize <= RECV_BUFFER_GROWTH) {
+                vch.reserve(sizeClass.nSize);
+            }
+            return;
+        }
+    }
+
+    /** Take back vch, keeping it for reuse if its class has room */
+    void Put(CSerializeData& vch)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        for (int i = sizeof(vClasses) / sizeof(vClasses[0]) - 1; i >= 0; i--) {
+            SizeClass& sizeClass = vClasses[i];
+            if (vch.capacity() < sizeClass.nSize)
+                continue;
+            if (sizeClass.vFree.size() < sizeClass.nMaxFree) {
+                vch.clear();
+                sizeClass.vFree.push_back(std::move(vch));
+            }
+            return;
+        }
+    }
+};
+
+static CRecvBufferPool recvBufferPool;
+
 static const uint64_t RANDOMIZER_ID_NETGROUP = 0x6c0edd8036ef4036ULL;       // SHA256("netgroup")[0:8]
 static const uint64_t RANDOMIZER_ID_LOCALHOSTNONCE = 0xd93e69e2bbfa5735ULL; // SHA256("localhostnonce")[0:8]
 //
@@ -480,6 +570,10 @@ void CNode::CloseSocketDisconnect()
     LOCK(cs_hSocket);
     if (hSocket != INVALID_SOCKET) {
         LogPrint(BCLog::NET, "disconnecting peer=%d\n", id);
+        if (pSocketEvents) {
+            pSocketEvents->Remove(hSocket);
+            pSocketEvents = nullptr;
+        }
         CloseSocket(hSocket);
     }
 }
@@ -705,6 +799,7 @@ void CNode::copyStats(CNodeStats& stats)
     {
         LOCK(cs_vRecv);
         X(mapRecvBytesPerMsgCmd);
+        X(mapRecvLatencyPerMsgCmd);
         X(nRecvBytes);
     }
     X(fWhitelisted);
@@ -742,7 +837,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& complete
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION));
+            vRecvMsg.emplace_back(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -781,6 +876,40 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& complete
     return true;
 }
 
+bool CNode::GetRecvBuffer(char*& pch, unsigned int& nSize)
+{
+    LOCK(cs_vRecv);
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return false;
+    CNetMessage& msg = vRecvMsg.back();
+    msg.ReserveData(msg.nDataPos + 1);
+    pch = &msg.vRecv[msg.nDataPos];
+    nSize = msg.vRecv.size() - msg.nDataPos;
+    return true;
+}
+
+void CMessageLatency::Record(int64_t nMicros)
+{
+    size_t nBucket = 0;
+    while (nBucket < MESSAGE_LATENCY_BUCKET_COUNT - 1 && nMicros >= MESSAGE_LATENCY_BUCKETS[nBucket] * 1000)
+        nBucket++;
+    vHistogram[nBucket]++;
+    nCount++;
+    nTotal += nMicros;
+    nMax = std::max(nMax, nMicros);
+}
+
+void CNode::RecordMessageLatency(const std::string& strCommand, int64_t nMicros)
+{
+    LOCK(cs_vRecv);
+    // only commands known in advance are tracked, see ReceiveMsgBytes
+    mapMsgCmdLatency::iterator i = mapRecvLatencyPerMsgCmd.find(strCommand);
+    if (i == mapRecvLatencyPerMsgCmd.end())
+        i = mapRecvLatencyPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapRecvLatencyPerMsgCmd.end());
+    i->second.Record(nMicros);
+}
+
 void CNode::SetSendVersion(int nVersionIn)
 {
     // Send version may only be changed in the version message, and
@@ -808,22 +937,29 @@ int CNode::GetSendVersion() const
 }
 
 
+CNetMessage::~CNetMessage()
+{
+    CSerializeData vch;
+    vRecv.SwapBuffer(vch);
+    recvBufferPool.Put(vch);
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = sizeof(hdrbuf) - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&hdrbuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < sizeof(hdrbuf))
         return nCopy;
 
     // deserialize to CMessageHeader
     try {
-        hdrbuf >> hdr;
+        CVectorReader(vRecv.GetType(), vRecv.GetVersion(), (const unsigned char*)hdrbuf, sizeof(hdrbuf)) >> hdr;
     } catch (const std::exception&) {
         return -1;
     }
@@ -838,18 +974,31 @@ int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
     return nCopy;
 }
 
+void CNetMessage::ReserveData(unsigned int nSize)
+{
+    if (vRecv.size() >= nSize)
+        return;
+    if (vRecv.empty()) {
+        CSerializeData vch;
+        recvBufferPool.Get(hdr.nMessageSize, vch);
+        vRecv.SwapBuffer(vch);
+    }
+    // Grow ahead of the data received, so that a peer announcing a large
+    // message cannot make us allocate much more than it actually sends
+    vRecv.resize(std::min(hdr.nMessageSize, nSize + RECV_BUFFER_GROWTH));
+}
+
 int CNetMessage::readData(const char* pch, unsigned int nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
+    ReserveData(nDataPos + nCopy);
 
     hasher.Write((const unsigned char*)pch, nCopy);
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // Data received directly into the payload (see CNode::GetRecvBuffer) is already in place
+    if (pch != &vRecv[nDataPos])
+        memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -867,31 +1016,59 @@ const uint256& CNetMessage::GetMessageHash() const
 // requires LOCK(cs_vSend)
 size_t CConnman::SocketSendData(CNode* pnode) const
 {
-    auto it = pnode->vSendMsg.begin();
     size_t nSentSize = 0;
 
-    while (it != pnode->vSendMsg.end()) {
-        const auto& data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = 0;
+    while (!pnode->vSendMsg.empty()) {
+        // Hand as much of the queue to the kernel as one call takes, so that a
+        // header and its payload, or a burst of small messages, cost one syscall
+        size_t nBatchSize = 0;
+        ssize_t nBytes = 0;
         {
             LOCK(pnode->cs_hSocket);
             if (pnode->hSocket == INVALID_SOCKET)
                 break;
-            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef WIN32
+            const auto& data = *pnode->vSendMsg.front();
+            nBatchSize = data.size() - pnode->nSendOffset;
+            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, nBatchSize, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+            struct iovec vIov[SEND_IOV_MAX];
+            int nIov = 0;
+            size_t nOffset = pnode->nSendOffset;
+            for (auto it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < SEND_IOV_MAX; ++it, ++nIov) {
+                const auto& data = **it;
+                assert(data.size() > nOffset);
+                vIov[nIov].iov_base = const_cast<unsigned char*>(data.data()) + nOffset;
+                vIov[nIov].iov_len = data.size() - nOffset;
+                nBatchSize += vIov[nIov].iov_len;
+                nOffset = 0;
+            }
+            struct msghdr msg = {};
+            msg.msg_iov = vIov;
+            msg.msg_iovlen = nIov;
+            nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         }
         if (nBytes > 0) {
             pnode->nLastSend = GetSystemTimeInSeconds();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            size_t nRemaining = nBytes;
+            while (nRemaining > 0) {
+                const size_t nSize = pnode->vSendMsg.front()->size();
+                const size_t nLeft = nSize - pnode->nSendOffset;
+                if (nRemaining < nLeft) {
+                    pnode->nSendOffset += nRemaining;
+                    break;
+                }
+                nRemaining -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
-                it++;
-            } else {
-                // could not send full message; stop sending more
+                pnode->nSendSize -= nSize;
+                pnode->vSendMsg.pop_front();
+            }
+            pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+            if ((size_t)nBytes < nBatchSize) {
+                // could not send the whole batch; the socket buffer is full
                 break;
             }
         } else {
@@ -908,14 +1085,68 @@ size_t CConnman::SocketSendData(CNode* pnode) const
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    UpdateSocketEvents(pnode);
     return nSentSize;
 }
 
+/** The events to wait for on pnode's socket. cs_vSend must be held. */
+static int GetSocketInterest(const CNode* pnode)
+{
+    // Implement the following logic:
+    // * If there is data to send, wait for sending data. As this only
+    //   happens when optimistic write failed, we choose to first drain the
+    //   write buffer in this case before receiving more. This avoids
+    //   needlessly queueing received data, if the remote peer is not themselves
+    //   receiving data. This means properly utilizing TCP flow control signalling.
+    // * Otherwise, if there is space left in the receive buffer, wait for
+    //   receiving data.
+    // * Hand off all complete messages to the processor, to be handled without
+    //   blocking here.
+    if (!pnode->vSendMsg.empty())
+        return SOCKET_EVENT_SEND;
+    if (!pnode->fPauseRecv)
+        return SOCKET_EVENT_RECV;
+    return 0;
+}
+
+void CConnman::UpdateSocketEvents(CNode* pnode) const
+{
+    LOCK(pnode->cs_vSend);
+    int nInterest = GetSocketInterest(pnode);
+
+    LOCK(pnode->cs_hSocket);
+    if (pnode->hSocket == INVALID_SOCKET || !pnode->pSocketEvents || pnode->nSocketEvents == nInterest)
+        return;
+    if (!pnode->pSocketEvents->Modify(pnode->hSocket, nInterest)) {
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+    pnode->nSocketEvents = nInterest;
+}
+
+/** Start watching the socket of a node that has just been added to vNodes */
+static void WatchSocket(CSocketEvents* events, CNode* pnode)
+{
+    if (!events)
+        return;
+    LOCK(pnode->cs_vSend);
+    LOCK(pnode->cs_hSocket);
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    int nInterest = GetSocketInterest(pnode);
+    if (!events->Add(pnode->hSocket, nInterest)) {
+        LogPrintf("cannot watch socket of peer=%d with %s\n", pnode->GetId(), events->GetName());
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+    pnode->pSocketEvents = events;
+    pnode->nSocketEvents = nInterest;
+}
+
 struct NodeEvictionCandidate {
     NodeId id;
     int64_t nTimeConnected;
@@ -1089,7 +1320,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket)
         return;
     }
 
-    if (!IsSelectableSocket(hSocket)) {
+    if (!socketEvents->IsSelectable(hSocket)) {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
         return;
@@ -1125,15 +1356,32 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket)
 
     LogPrint(BCLog::NET, "connection from %s accepted\n", addr.ToString());
 
+    InsertNode(pnode);
+}
+
+void CConnman::InsertNode(CNode* pnode)
+{
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+        LOCK(pnode->cs_hSocket);
+        pnode->hSocketWatched = pnode->hSocket;
+        if (pnode->hSocket != INVALID_SOCKET)
+            mapSocketNodes[pnode->hSocket] = pnode;
     }
+    WatchSocket(socketEvents.get(), pnode);
 }
 
 void CConnman::ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nNextInactivityCheck = 0;
+
+    for (const ListenSocket& hListenSocket : vhListenSocket) {
+        if (!socketEvents->Add(hListenSocket.socket, SOCKET_EVENT_RECV, true))
+            LogPrintf("cannot watch listening socket with %s\n", socketEvents->GetName());
+    }
+
     while (!interruptNet) {
         //
         // Disconnect nodes
@@ -1146,6 +1394,10 @@ void CConnman::ThreadSocketHandler()
                 if (pnode->fDisconnect) {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    // its socket may already have been reused by a newer node
+                    auto itSocket = mapSocketNodes.find(pnode->hSocketWatched);
+                    if (itSocket != mapSocketNodes.end() && itSocket->second == pnode)
+                        mapSocketNodes.erase(itSocket);
 
                     // release outbound grant (if any)
                     pnode->grantOutbound.Release();
@@ -1196,217 +1448,232 @@ void CConnman::ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+        // Wait at most 50ms so that disconnected nodes are cleaned up promptly.
+        std::vector<SocketEvent> vEvents;
+        bool fWaitOk = socketEvents->Wait(50, vEvents);
+        if (interruptNet)
+            return;
 
-        for (const ListenSocket& hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+        if (!fWaitOk) {
+            if (!interruptNet.sleep_for(std::chrono::milliseconds(50)))
+                return;
         }
 
-        {
+        //
+        // Find the nodes of the ready sockets
+        //
+        std::vector<std::pair<CNode*, int>> vReady;
+        std::vector<SOCKET> vOtherSockets;
+        if (!vEvents.empty()) {
             LOCK(cs_vNodes);
-            for (CNode* pnode : vNodes) {
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is space left in the receive buffer, select() for
-                //   receiving data.
-                // * Hand off all complete messages to the processor, to be handled without
-                //   blocking here.
-
-                bool select_recv = !pnode->fPauseRecv;
-                bool select_send;
-                {
-                    LOCK(pnode->cs_vSend);
-                    select_send = !pnode->vSendMsg.empty();
-                }
-
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                if (select_send) {
-                    FD_SET(pnode->hSocket, &fdsetSend);
-                    continue;
-                }
-                if (select_recv) {
-                    FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        if (interruptNet)
-            return;
-
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+            vReady.reserve(vEvents.size());
+            for (const SocketEvent& event : vEvents) {
+                auto it = mapSocketNodes.find(event.hSocket);
+                if (it != mapSocketNodes.end())
+                    vReady.emplace_back(it->second->AddRef(), event.nEvents);
+                else
+                    vOtherSockets.push_back(event.hSocket);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec / 1000)))
-                return;
         }
 
         //
         // Accept new connections
         //
         for (const ListenSocket& hListenSocket : vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
+            if (hListenSocket.socket != INVALID_SOCKET && std::count(vOtherSockets.begin(), vOtherSockets.end(), hListenSocket.socket)) {
                 AcceptConnection(hListenSocket);
             }
         }
 
         //
-        // Service each socket
+        // Service each ready socket
         //
-        std::vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy)
-                pnode->AddRef();
-        }
-        for (CNode* pnode : vNodesCopy) {
+        for (const std::pair<CNode*, int>& ready : vReady) {
             if (interruptNet)
-                return;
+                break;
+            CNode* pnode = ready.first;
+            const int nEvents = ready.second;
 
             //
             // Receive
             //
-            bool recvSet = false;
-            bool sendSet = false;
-            bool errorSet = false;
-            {
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-                sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-                errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
-            }
-            if (recvSet || errorSet) {
+            if (nEvents & (SOCKET_EVENT_RECV | SOCKET_EVENT_ERR)) {
                 // typical socket buffer is 8K-64K
                 char pchBuf[0x10000];
-                int nBytes = 0;
-                {
-                    LOCK(pnode->cs_hSocket);
-                    if (pnode->hSocket == INVALID_SOCKET)
-                        continue;
-                    nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                }
-                if (nBytes > 0) {
-                    bool notify = false;
-                    if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                        pnode->CloseSocketDisconnect();
-                    RecordBytesRecv(nBytes);
-                    if (notify) {
-                        size_t nSizeAdded = 0;
-                        auto it(pnode->vRecvMsg.begin());
-                        for (; it != pnode->vRecvMsg.end(); ++it) {
-                            if (!it->complete())
-                                break;
-                            nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
-                        }
-                        {
-                            LOCK(pnode->cs_vProcessMsg);
-                            pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
-                            pnode->nProcessQueueSize += nSizeAdded;
-                            pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
-                        }
-                        WakeMessageHandler();
+                char* pchRecv;
+                unsigned int nRecvSize;
+                // Edge-triggered backends only report the socket again once it has
+                // been drained, so keep reading until a short read or until the
+                // receive queue is full.
+                bool fDrained = false;
+                while (!fDrained) {
+                    // The rest of a large payload is received straight into its
+                    // buffer; small messages go through pchBuf, several per recv
+                    if (!pnode->GetRecvBuffer(pchRecv, nRecvSize) || nRecvSize < sizeof(pchBuf)) {
+                        pchRecv = pchBuf;
+                        nRecvSize = sizeof(pchBuf);
                     }
-                } else if (nBytes == 0) {
-                    // socket closed gracefully
-                    if (!pnode->fDisconnect) {
-                        LogPrint(BCLog::NET, "socket closed\n");
+                    int nBytes = 0;
+                    {
+                        LOCK(pnode->cs_hSocket);
+                        if (pnode->hSocket == INVALID_SOCKET)
+                            break;
+                        nBytes = recv(pnode->hSocket, pchRecv, nRecvSize, MSG_DONTWAIT);
                     }
-                    pnode->CloseSocketDisconnect();
-                } else if (nBytes < 0) {
-                    // error
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                    fDrained = nBytes < (int)nRecvSize;
+                    if (nBytes > 0) {
+                        bool notify = false;
+                        if (!pnode->ReceiveMsgBytes(pchRecv, nBytes, notify))
+                            pnode->CloseSocketDisconnect();
+                        RecordBytesRecv(nBytes);
+                        if (notify) {
+                            size_t nSizeAdded = 0;
+                            auto it(pnode->vRecvMsg.begin());
+                            for (; it != pnode->vRecvMsg.end(); ++it) {
+                                if (!it->complete())
+                                    break;
+                                nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
+                            }
+                            bool fPaused = false;
+                            {
+                                LOCK(pnode->cs_vProcessMsg);
+                                pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
+                                pnode->nProcessQueueSize += nSizeAdded;
+                                fPaused = !pnode->fPauseRecv && pnode->nProcessQueueSize > nReceiveFloodSize;
+                                pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
+                            }
+                            if (fPaused)
+                                UpdateSocketEvents(pnode);
+                            WakeMessageHandler(pnode);
+                        }
+                    } else if (nBytes == 0) {
+                        // socket closed gracefully
+                        if (!pnode->fDisconnect) {
+                            LogPrint(BCLog::NET, "socket closed\n");
+                        }
                         pnode->CloseSocketDisconnect();
+                    } else if (nBytes < 0) {
+                        // error
+                        int nErr = WSAGetLastError();
+                        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+                            if (!pnode->fDisconnect)
+                                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                            pnode->CloseSocketDisconnect();
+                        }
                     }
+                    if (pnode->fPauseRecv)
+                        break;
                 }
             }
 
             //
             // Send
             //
-            if (sendSet) {
+            if (nEvents & SOCKET_EVENT_SEND) {
                 LOCK(pnode->cs_vSend);
                 size_t nBytes = SocketSendData(pnode);
                 if (nBytes) {
                     RecordBytesSent(nBytes);
                 }
             }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetSystemTimeInSeconds();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint(BCLog::NET, "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->GetId());
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60)) {
-                    LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                } else if (!pnode->fSuccessfullyConnected) {
-                    LogPrintf("version handshake timeout from %d\n", pnode->GetId());
-                    pnode->fDisconnect = true;
-                }
-            }
         }
-        {
+        if (!vReady.empty()) {
             LOCK(cs_vNodes);
+            for (const std::pair<CNode*, int>& ready : vReady)
+                ready.first->Release();
+        }
+        if (interruptNet)
+            return;
+
+        //
+        // Inactivity is only judged in whole seconds; sweep every peer on a
+        // timer of its own rather than on each wakeup
+        //
+        int64_t nNowMillis = GetTimeMillis();
+        if (nNowMillis >= nNextInactivityCheck) {
+            nNextInactivityCheck = nNowMillis + INACTIVITY_CHECK_INTERVAL;
+            std::vector<CNode*> vNodesCopy;
+            {
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
+                for (CNode* pnode : vNodesCopy)
+                    pnode->AddRef();
+            }
             for (CNode* pnode : vNodesCopy)
-                pnode->Release();
+                InactivityCheck(pnode);
+            {
+                LOCK(cs_vNodes);
+                for (CNode* pnode : vNodesCopy)
+                    pnode->Release();
+            }
         }
     }
 }
 
+void CConnman::InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetSystemTimeInSeconds();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint(BCLog::NET, "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->GetId());
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > TIMEOUT_INTERVAL) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60)) {
+            LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        } else if (!pnode->fSuccessfullyConnected) {
+            LogPrintf("version handshake timeout from %d\n", pnode->GetId());
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+/** Queue pnode for a message handler thread, or have it queued again once the
+ *  thread handling it is done. mutexMsgProc must be held. */
+static void ScheduleNode(std::deque<CNode*>& vQueue, CNode* pnode)
+{
+    if (pnode->nMsgProcState == MSGPROC_IDLE) {
+        pnode->nMsgProcState = MSGPROC_QUEUED;
+        vQueue.push_back(pnode->AddRef());
+    } else if (pnode->nMsgProcState == MSGPROC_RUNNING) {
+        pnode->nMsgProcState = MSGPROC_RUNNING_WOKEN;
+    }
+}
+
 void CConnman::WakeMessageHandler()
+{
+    std::vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        for (CNode* pnode : vNodesCopy)
+            pnode->AddRef();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutexMsgProc);
+        for (CNode* pnode : vNodesCopy) {
+            if (!pnode->fDisconnect)
+                ScheduleNode(vMsgProcQueue, pnode);
+        }
+    }
+    condMsgProc.notify_all();
+    for (CNode* pnode : vNodesCopy)
+        pnode->Release();
+}
+
+void CConnman::WakeMessageHandler(CNode* pnode)
 {
     {
         std::lock_guard<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = true;
+        ScheduleNode(vMsgProcQueue, pnode);
     }
     condMsgProc.notify_one();
 }
@@ -1914,56 +2181,58 @@ void CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
         pnode->m_manual_connection = true;
 
     m_msgproc->InitializeNode(pnode);
-    {
-        LOCK(cs_vNodes);
-        vNodes.push_back(pnode);
-    }
+    InsertNode(pnode);
 }
 
 void CConnman::ThreadMessageHandler()
 {
     while (!flagInterruptMsgProc) {
-        std::vector<CNode*> vNodesCopy;
+        // Make sure SendMessages also runs regularly for peers that sent nothing
+        bool fSweep = false;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
-                pnode->AddRef();
+            std::lock_guard<std::mutex> lock(mutexMsgProc);
+            int64_t nNow = GetTimeMillis();
+            if (nNow >= nNextMsgProcSweep) {
+                nNextMsgProcSweep = nNow + MSGPROC_SWEEP_INTERVAL;
+                fSweep = true;
             }
         }
+        if (fSweep)
+            WakeMessageHandler();
 
-        bool fMoreWork = false;
-
-        for (CNode* pnode : vNodesCopy) {
-            if (pnode->fDisconnect)
+        CNode* pnode;
+        {
+            std::unique_lock<std::mutex> lock(mutexMsgProc);
+            condMsgProc.wait_for(lock, std::chrono::milliseconds(MSGPROC_SWEEP_INTERVAL), [this] { return !vMsgProcQueue.empty() || flagInterruptMsgProc; });
+            if (vMsgProcQueue.empty() || flagInterruptMsgProc)
                 continue;
+            pnode = vMsgProcQueue.front();
+            vMsgProcQueue.pop_front();
+            pnode->nMsgProcState = MSGPROC_RUNNING;
+        }
 
+        bool fMoreWork = false;
+        if (!pnode->fDisconnect) {
             // Receive messages
             bool fMoreNodeWork = m_msgproc->ProcessMessages(pnode, flagInterruptMsgProc);
-            fMoreWork |= (fMoreNodeWork && !pnode->fPauseSend);
-            if (flagInterruptMsgProc)
-                return;
+            fMoreWork = fMoreNodeWork && !pnode->fPauseSend;
             // Send messages
-            {
+            if (!flagInterruptMsgProc) {
                 LOCK(pnode->cs_sendProcessing);
                 m_msgproc->SendMessages(pnode, flagInterruptMsgProc);
             }
-
-            if (flagInterruptMsgProc)
-                return;
         }
 
         {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodesCopy)
-                pnode->Release();
-        }
-
-        std::unique_lock<std::mutex> lock(mutexMsgProc);
-        if (!fMoreWork) {
-            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this] { return fMsgProcWake; });
+            std::lock_guard<std::mutex> lock(mutexMsgProc);
+            bool fRequeue = fMoreWork || pnode->nMsgProcState == MSGPROC_RUNNING_WOKEN;
+            pnode->nMsgProcState = MSGPROC_IDLE;
+            if (fRequeue && !pnode->fDisconnect && !flagInterruptMsgProc)
+                ScheduleNode(vMsgProcQueue, pnode);
         }
-        fMsgProcWake = false;
+        if (fMoreWork)
+            condMsgProc.notify_one();
+        pnode->Release();
     }
 }
 
@@ -2161,6 +2430,13 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
 {
     Init(connOptions);
 
+    socketEvents = MakeSocketEvents(connOptions.strSocketEvents.empty() ? GetSocketEventsBackends().front() : connOptions.strSocketEvents);
+    if (!socketEvents) {
+        LogPrintf("Cannot use %s for socket events, falling back to select\n", connOptions.strSocketEvents);
+        socketEvents = MakeSocketEvents("select");
+    }
+    LogPrintf("Using %s for socket events\n", socketEvents->GetName());
+
     {
         LOCK(cs_totalBytesRecv);
         nTotalBytesRecv = 0;
@@ -2242,7 +2518,8 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
 
     {
         std::unique_lock<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = false;
+        vMsgProcQueue.clear();
+        nNextMsgProcSweep = 0;
     }
 
     // Send and receive from sockets, accept connections
@@ -2268,7 +2545,9 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         threadOpenConnections = std::thread(&TraceThread<std::function<void()>>, "opencon", std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this, connOptions.m_specified_outgoing)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()>>, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    LogPrintf("Using %d message handler threads\n", nMsgHandlerThreads);
+    for (int i = 0; i < nMsgHandlerThreads; i++)
+        threadMessageHandlers.emplace_back(&TraceThread<std::function<void()>>, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
 
     // Dump network addresses
     scheduler.scheduleEvery(std::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL * 1000);
@@ -2316,8 +2595,11 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    for (std::thread& thread : threadMessageHandlers) {
+        if (thread.joinable())
+            thread.join();
+    }
+    threadMessageHandlers.clear();
     if (threadOpenConnections.joinable())
         threadOpenConnections.join();
     if (threadOpenAddedConnections.joinable())
@@ -2327,6 +2609,16 @@ void CConnman::Stop()
     if (threadSocketHandler.joinable())
         threadSocketHandler.join();
 
+    // Drop the references held by peers still queued for the message handlers
+    {
+        std::unique_lock<std::mutex> lock(mutexMsgProc);
+        for (CNode* pnode : vMsgProcQueue) {
+            pnode->nMsgProcState = MSGPROC_IDLE;
+            pnode->Release();
+        }
+        vMsgProcQueue.clear();
+    }
+
     if (fAddressesInitialized) {
         DumpData();
         fAddressesInitialized = false;
@@ -2348,10 +2640,12 @@ void CConnman::Stop()
         DeleteNode(pnode);
     }
     vNodes.clear();
+    mapSocketNodes.clear();
     vNodesDisconnected.clear();
     vhListenSocket.clear();
     semOutbound.reset();
     semAddnode.reset();
+    socketEvents.reset();
 }
 
 void CConnman::DeleteNode(CNode* pnode)
@@ -2622,6 +2916,9 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     fVerack = false;
     fDisconnect = false;
     nRefCount = 0;
+    pSocketEvents = nullptr;
+    nSocketEvents = 0;
+    hSocketWatched = INVALID_SOCKET;
     nSendSize = 0;
     nSendOffset = 0;
     hashContinue = uint256();
@@ -2632,6 +2929,8 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nNextLocalAddrSend = 0;
     nNextAddrSend = 0;
     nNextInvSend = 0;
+    nTxAnnounceCursor = 0;
+    nLastTxTrickle = 0;
     fRelayTxes = false;
     fSentAddr = false;
     pfilter = MakeUnique<CBloomFilter>();
@@ -2651,9 +2950,14 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nProcessQueueSize = 0;
     lastAcceptedHeader = uint256();
 
-    for (const std::string& msg : getAllNetMessageTypes())
+    nMsgProcState = MSGPROC_IDLE;
+
+    for (const std::string& msg : getAllNetMessageTypes()) {
         mapRecvBytesPerMsgCmd[msg] = 0;
+        mapRecvLatencyPerMsgCmd[msg];
+    }
     mapRecvBytesPerMsgCmd[NET_MESSAGE_COMMAND_OTHER] = 0;
+    mapRecvLatencyPerMsgCmd[NET_MESSAGE_COMMAND_OTHER];
 
     if (fLogIPs) {
         LogPrint(BCLog::NET, "Added connection to %s peer=%d\n", addrName, id);
@@ -2664,6 +2968,8 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
 
 CNode::~CNode()
 {
+    if (pSocketEvents && hSocket != INVALID_SOCKET)
+        pSocketEvents->Remove(hSocket);
     CloseSocket(hSocket);
 }
 
@@ -2706,22 +3012,39 @@ bool CConnman::NodeFullyConnected(const CNode* pnode)
     return pnode && pnode->fSuccessfullyConnected && !pnode->fDisconnect;
 }
 
-void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+CSharedNetMsg CConnman::ShareMessage(CSerializedNetMsg&& msg)
 {
-    size_t nMessageSize = msg.data.size();
-    if (nMessageSize == 0)
-        return;
-    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
-    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n", SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
+    CSharedNetMsg shared;
+    shared.command = std::move(msg.command);
+    if (msg.data.empty())
+        return shared;
 
     std::vector<unsigned char> serializedHeader;
     serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
-    uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
-    CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
+    uint256 hash = Hash(msg.data.data(), msg.data.data() + msg.data.size());
+    CMessageHeader hdr(Params().MessageStart(), shared.command.c_str(), msg.data.size());
     memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 
     CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
 
+    shared.header = std::make_shared<const std::vector<unsigned char>>(std::move(serializedHeader));
+    shared.payload = std::make_shared<const std::vector<unsigned char>>(std::move(msg.data));
+    return shared;
+}
+
+void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+{
+    PushMessage(pnode, ShareMessage(std::move(msg)));
+}
+
+void CConnman::PushMessage(CNode* pnode, const CSharedNetMsg& msg)
+{
+    if (!msg.payload)
+        return;
+    size_t nMessageSize = msg.payload->size();
+    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
+    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n", SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
+
     size_t nBytesSent = 0;
     {
         LOCK(pnode->cs_vSend);
@@ -2733,9 +3056,8 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
-        if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+        pnode->vSendMsg.push_back(msg.header);
+        pnode->vSendMsg.push_back(msg.payload);
 
         // If write queue empty, attempt "optimistic write"
         if (optimisticSend == true)
@@ -25,9 +25,11 @@
 #include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <map>
 #include <memory>
 #include <stdint.h>
 #include <thread>
+#include <unordered_map>
 
 
 #ifndef WIN32
@@ -37,6 +39,7 @@
 
 class CScheduler;
 class CNode;
+class CSocketEvents;
 
 namespace boost
 {
@@ -77,6 +80,10 @@ static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 /** The default for -maxuploadtarget. 0 = Unlimited */
 static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The default number of threads processing peer messages (-msghandlers) */
+static const int DEFAULT_MSGHANDLER_THREADS = 4;
+/** The maximum number of threads processing peer messages */
+static const int MAX_MSGHANDLER_THREADS = 16;
 /** The default timeframe for -maxuploadtarget. 1 day. */
 static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
 /** Default for blocks only*/
@@ -118,6 +125,19 @@ struct CSerializedNetMsg {
     std::string command;
 };
 
+/** An immutable send buffer; the same buffer can be queued to any number of nodes */
+typedef std::shared_ptr<const std::vector<unsigned char>> CSendBufferRef;
+
+/**
+ * A message whose header and payload have been serialized and checksummed
+ * once, ready to be queued to many nodes without copying.
+ */
+struct CSharedNetMsg {
+    CSendBufferRef header;
+    CSendBufferRef payload;
+    std::string command;
+};
+
 class NetEventsInterface;
 class CConnman
 {
@@ -148,6 +168,9 @@ public:
         bool m_use_addrman_outgoing = true;
         std::vector<std::string> m_specified_outgoing;
         std::vector<std::string> m_added_nodes;
+        //! Socket readiness backend, see GetSocketEventsBackends(); empty for the preferred one
+        std::string strSocketEvents;
+        int nMsgHandlerThreads = DEFAULT_MSGHANDLER_THREADS;
     };
 
     void Init(const Options& connOptions)
@@ -162,6 +185,7 @@ public:
         m_msgproc = connOptions.m_msgproc;
         nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
         nReceiveFloodSize = connOptions.nReceiveFloodSize;
+        nMsgHandlerThreads = std::max(1, std::min(connOptions.nMsgHandlerThreads, MAX_MSGHANDLER_THREADS));
         {
             LOCK(cs_totalBytesSent);
             nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
@@ -187,6 +211,23 @@ public:
     bool ForNode(NodeId id, std::function<bool(CNode* pnode)> func);
 
     void PushMessage(CNode* pnode, CSerializedNetMsg&& msg);
+    void PushMessage(CNode* pnode, const CSharedNetMsg& msg);
+    //! Build the header of msg and take its payload, so it can be pushed to several nodes
+    static CSharedNetMsg ShareMessage(CSerializedNetMsg&& msg);
+
+    /**
+     * Push the message returned by make(nVersion) to every fully connected
+     * node that passes pred, serializing it once per protocol version in use
+     * rather than once per node.
+     */
+    template <typename Predicate, typename Maker>
+    void BroadcastMessage(Predicate&& pred, Maker&& make);
+
+    template <typename Maker>
+    void BroadcastMessage(Maker&& make)
+    {
+        BroadcastMessage([](CNode*) { return true; }, std::forward<Maker>(make));
+    }
 
     template <typename Callable>
     void ForEachNode(Callable&& func)
@@ -317,7 +358,13 @@ public:
 
     unsigned int GetReceiveFloodSize() const;
 
+    /** Queue every peer for the message handlers, e.g. so that a new tip is announced promptly */
     void WakeMessageHandler();
+    /** Queue pnode for the message handlers, once it has messages to process */
+    void WakeMessageHandler(CNode* pnode);
+    /** Bring the events the socket handler waits for on pnode's socket in line
+     *  with its send queue and fPauseRecv. Called whenever either of them changes. */
+    void UpdateSocketEvents(CNode* pnode) const;
 
 private:
     struct ListenSocket {
@@ -336,6 +383,9 @@ private:
     void ThreadOpenConnections(std::vector<std::string> connect);
     void ThreadMessageHandler();
     void AcceptConnection(const ListenSocket& hListenSocket);
+    /** Add a new node to vNodes and start watching its socket */
+    void InsertNode(CNode* pnode);
+    void InactivityCheck(CNode* pnode);
     void ThreadSocketHandler();
     void ThreadDNSAddressSeed();
 
@@ -404,6 +454,8 @@ private:
     CCriticalSection cs_vAddedNodes;
     std::vector<CNode*> vNodes;
     std::list<CNode*> vNodesDisconnected;
+    //! Nodes of vNodes by socket, so that a ready socket leads straight to its node; guarded by cs_vNodes
+    std::unordered_map<SOCKET, CNode*> mapSocketNodes;
     mutable CCriticalSection cs_vNodes;
     std::atomic<NodeId> nLastNodeId;
 
@@ -423,8 +475,15 @@ private:
     /** SipHasher seeds for deterministic randomness */
     const uint64_t nSeed0, nSeed1;
 
-    /** flag for waking the message processor. */
-    bool fMsgProcWake;
+    /**
+     * Peers waiting for a message handler thread. A peer is queued at most
+     * once and handled by one thread at a time, so its messages are processed
+     * in order; see CNode::nMsgProcState. Queued peers hold a reference.
+     */
+    std::deque<CNode*> vMsgProcQueue;
+    //! GetTimeMillis() at which every peer is next queued, so SendMessages runs for idle peers too
+    int64_t nNextMsgProcSweep;
+    int nMsgHandlerThreads;
 
     std::condition_variable condMsgProc;
     std::mutex mutexMsgProc;
@@ -432,11 +491,14 @@ private:
 
     CThreadInterrupt interruptNet;
 
+    /** Readiness notification for the listening and peer sockets */
+    std::unique_ptr<CSocketEvents> socketEvents;
+
     std::thread threadDNSAddressSeed;
     std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
-    std::thread threadMessageHandler;
+    std::vector<std::thread> threadMessageHandlers;
 
     /** flag for deciding to connect to an extra outbound peer,
      *  in excess of nMaxOutbound
@@ -523,6 +585,23 @@ extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 typedef std::map<std::string, uint64_t> mapMsgCmdSize; //command, total bytes
 
+/** Upper bounds in milliseconds of the message latency histogram buckets; a last, unbounded bucket follows */
+static const int64_t MESSAGE_LATENCY_BUCKETS[] = {1, 10, 100, 1000, 10000};
+static const size_t MESSAGE_LATENCY_BUCKET_COUNT = sizeof(MESSAGE_LATENCY_BUCKETS) / sizeof(MESSAGE_LATENCY_BUCKETS[0]) + 1;
+
+/** Time from the receipt of messages of one command until they were processed */
+struct CMessageLatency
+{
+    uint64_t nCount;
+    int64_t nTotal; //! microseconds
+    int64_t nMax;   //! microseconds
+    uint64_t vHistogram[MESSAGE_LATENCY_BUCKET_COUNT];
+
+    CMessageLatency() : nCount(0), nTotal(0), nMax(0), vHistogram() {}
+    void Record(int64_t nMicros);
+};
+typedef std::map<std::string, CMessageLatency> mapMsgCmdLatency;
+
 class CNodeStats
 {
 public:
@@ -543,6 +622,7 @@ public:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    mapMsgCmdLatency mapRecvLatencyPerMsgCmd;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -565,23 +645,23 @@ private:
 public:
     bool in_data; // parsing header (false) or data (true)
 
-    CDataStream hdrbuf; // partially received header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr; // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv; // received message data
+    CDataStream vRecv; // received message data, in a buffer from the receive buffer pool
     unsigned int nDataPos;
 
     int64_t nTime; // time (in microseconds) of message receipt.
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn)
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn)
     {
-        hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
+    ~CNetMessage();
 
     bool complete() const
     {
@@ -594,10 +674,12 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
+    /** Make room in vRecv for the payload up to nSize bytes */
+    void ReserveData(unsigned int nSize);
+
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
 };
@@ -615,7 +697,7 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<std::vector<unsigned char>> vSendMsg;
+    std::deque<CSendBufferRef> vSendMsg;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
@@ -668,16 +750,27 @@ public:
     std::atomic_bool fPauseRecv;
     std::atomic_bool fPauseSend;
 
+    // socket readiness registration, protected by cs_hSocket
+    CSocketEvents* pSocketEvents; // set once hSocket is watched
+    int nSocketEvents;            // SocketEventFlags currently waited for
+    SOCKET hSocketWatched;        // hSocket as added to vNodes, its key in CConnman::mapSocketNodes
+
+    // message handler scheduling, protected by CConnman::mutexMsgProc
+    int nMsgProcState;
+
 protected:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    mapMsgCmdLatency mapRecvLatencyPerMsgCmd;
 
 public:
     uint256 hashContinue;
     std::atomic<int> nStartingHeight;
     bool fMasternode;
 
-    // flood relay
+    // flood relay; vAddrToSend and addrKnown are protected by cs_addrToSend,
+    // as other peers' message handlers relay addresses to this one
+    CCriticalSection cs_addrToSend;
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
     bool fGetAddr;
@@ -689,9 +782,12 @@ public:
     // inventory based relay
     CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
-    // Set of transaction ids we still have to announce.
-    // They are sorted by the mempool before relay, so the order is not important.
-    std::set<uint256> setInventoryTxToSend;
+    // Position in txAnnounceQueue: every transaction queued before it has
+    // been announced to this peer or passed over.
+    uint64_t nTxAnnounceCursor;
+    // When transactions were last announced, in microseconds; the size of
+    // the next batch depends on the time since.
+    int64_t nLastTxTrickle;
     // List of block ids we still have announce.
     // There is no final sorting before sending, as they are always sent immediately
     // and in the order requested.
@@ -780,6 +876,14 @@ public:
     }
 
     bool ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& complete);
+    /**
+     * Room left in the payload of the message being received, so that it can be
+     * received into directly and ReceiveMsgBytes has nothing to copy. Returns
+     * false while no payload is being received.
+     */
+    bool GetRecvBuffer(char*& pch, unsigned int& nSize);
+    /** Account the time from receipt of a message of strCommand until it was processed */
+    void RecordMessageLatency(const std::string& strCommand, int64_t nMicros);
 
     void SetRecvVersion(int nVersionIn)
     {
@@ -815,6 +919,7 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrToSend);
         addrKnown.insert(_addr.GetKey());
     }
 
@@ -823,6 +928,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrToSend);
         if (_addr.IsValid() && !addrKnown.contains(_addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand.randrange(vAddrToSend.size())] = _addr;
@@ -845,11 +951,8 @@ public:
     void PushInventory(const CInv& inv)
     {
         LOCK(cs_inventory);
-        if (inv.type == MSG_TX) {
-            if (!filterInventoryKnown.contains(inv.hash)) {
-                setInventoryTxToSend.insert(inv.hash);
-            }
-        } else if (inv.type == MSG_BLOCK) {
+        // Transactions are announced from txAnnounceQueue
+        if (inv.type == MSG_BLOCK) {
             vInventoryBlockToSend.push_back(inv.hash);
         }
     }
@@ -902,6 +1005,21 @@ public:
     void MaybeSetAddrName(const std::string& addrNameIn);
 };
 
+template <typename Predicate, typename Maker>
+void CConnman::BroadcastMessage(Predicate&& pred, Maker&& make)
+{
+    std::map<int, CSharedNetMsg> mapShared;
+    ForEachNode([&](CNode* pnode) {
+        if (!pred(pnode))
+            return;
+        const int nVersion = pnode->nVersion;
+        auto it = mapShared.find(nVersion);
+        if (it == mapShared.end())
+            it = mapShared.emplace(nVersion, ShareMessage(make(nVersion))).first;
+        PushMessage(pnode, it->second);
+    });
+}
+
 
 /** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
 int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
@@ -12,11 +12,14 @@
 #include <chainparams.h>
 #include <checkpoints.h>
 #include <consensus/validation.h>
+#include <core_memusage.h>
 #include <hash.h>
 #include <init.h>
+#include <invpayloadcache.h>
 #include <masternode.h>
 #include <merkleblock.h>
 #include <netbase.h>
+#include <netmessagedispatcher.h>
 #include <netmessagemaker.h>
 #include <policy/policy.h>
 #include <primitives/block.h>
@@ -25,6 +28,7 @@
 #include <reverse_iterator.h>
 #include <scheduler.h>
 #include <tinyformat.h>
+#include <txannounce.h>
 #include <txmempool.h>
 #include <ui_interface.h>
 #include <util.h>
@@ -116,6 +120,7 @@ namespace {
         uint256 hash;
         const CBlockIndex* pindex;                               //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
+        std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
     };
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -123,6 +128,8 @@ namespace {
     struct WaitElement {
         std::shared_ptr<CBlock> pblock;
             int64_t time;
+        bool fCompact; //!< Reconstructed from a cmpctblock
+        bool fForce;   //!< Process even if it is not a candidate for a new tip
     };
     std::map<CBlockIndex*, WaitElement> mapBlocksWait;
 
@@ -200,6 +207,14 @@ struct CNodeState {
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
     bool fPreferHeaders;
+    //! Whether this peer wants invs or cmpctblocks (when possible) for block announcements.
+    bool fPreferHeaderAndIDs;
+    /**
+      * Whether this peer will send us cmpctblocks if we request them.
+      * This is not used to gate request logic, as we really only care about fSupportsDesiredCmpctVersion,
+      * but is used as a flag to "lock in" the version of compact blocks we send.
+      */
+    bool fProvidesHeaderAndIDs;
 
     /** State used to enforce CHAIN_SYNC_TIMEOUT
       * Only in effect for outbound, non-manual connections, with
@@ -248,6 +263,8 @@ struct CNodeState {
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
         m_chain_sync = { 0, nullptr, false, false };
         m_last_block_announcement = 0;
     }
@@ -344,7 +361,8 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlockIndex*
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), {hash, pindex, pindex != nullptr});
+    std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
+            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr)});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -393,6 +411,41 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+/** Whether we asked nodeid to announce new blocks with cmpctblock (BIP 152 high-bandwidth mode) */
+bool IsPeerAnnouncingHeaderAndIDs(NodeId nodeid) {
+    AssertLockHeld(cs_main);
+    return std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), nodeid) != lNodesAnnouncingHeaderAndIDs.end();
+}
+
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(NodeId nodeid, CConnman* connman) {
+    AssertLockHeld(cs_main);
+    CNodeState* nodestate = State(nodeid);
+    if (!nodestate || !nodestate->fProvidesHeaderAndIDs) {
+        // Never ask from peers who can't provide compact blocks.
+        return;
+    }
+    if (IsPeerAnnouncingHeaderAndIDs(nodeid)) {
+        // Already one of the high-bandwidth peers; move it to the back of the list.
+        lNodesAnnouncingHeaderAndIDs.remove(nodeid);
+        lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+        return;
+    }
+    connman->ForNode(nodeid, [connman](CNode* pfrom) {
+        uint64_t nCMPCTBLOCKVersion = 1;
+        if (lNodesAnnouncingHeaderAndIDs.size() >= 3) {
+            // As per BIP152, we only get 3 of our peers to announce
+            // blocks using compact encodings.
+            connman->ForNode(lNodesAnnouncingHeaderAndIDs.front(), [connman, nCMPCTBLOCKVersion](CNode* pnodeStop) {
+                connman->PushMessage(pnodeStop, CNetMsgMaker(pnodeStop->GetSendVersion()).Make(NetMsgType::SENDCMPCT, /*fAnnounceUsingCMPCTBLOCK=*/false, nCMPCTBLOCKVersion));
+                return true;
+            });
+            lNodesAnnouncingHeaderAndIDs.pop_front();
+        }
+        connman->PushMessage(pfrom, CNetMsgMaker(pfrom->GetSendVersion()).Make(NetMsgType::SENDCMPCT, /*fAnnounceUsingCMPCTBLOCK=*/true, nCMPCTBLOCKVersion));
+        lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+        return true;
+    });
+}
 
 bool TipMayBeStale(const Consensus::Params &consensusParams)
 {
@@ -529,6 +582,11 @@ void PeerLogicValidation::InitializeNode(CNode *pnode) {
         LOCK(cs_main);
         mapNodeState.emplace_hint(mapNodeState.end(), std::piecewise_construct, std::forward_as_tuple(nodeid), std::forward_as_tuple(addr, std::move(addrName)));
     }
+    {
+        // Only transactions relayed from now on are announced to a new peer
+        LOCK(pnode->cs_inventory);
+        pnode->nTxAnnounceCursor = txAnnounceQueue.GetEndSequence();
+    }
     if(!pnode->fInbound)
         PushNodeVersion(pnode, connman, GetTime());
 }
@@ -590,6 +648,17 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
 //
 #include <serialize.h>
 
+void AddToCompactExtraTransactions(const CTransactionRef& tx) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
+{
+    size_t max_extra_txn = gArgs.GetArg("-blockreconstructionextratxn", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN);
+    if (max_extra_txn <= 0)
+        return;
+    if (!vExtraTxnForCompact.size())
+        vExtraTxnForCompact.resize(max_extra_txn);
+    vExtraTxnForCompact[vExtraTxnForCompactIt] = std::make_pair(tx->GetHash(), tx);
+    vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % max_extra_txn;
+}
+
 bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
 {
     const uint256& hash = tx->GetHash();
@@ -616,6 +685,8 @@ bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRE
     }
 
 
+    AddToCompactExtraTransactions(tx);
+
     LogPrint(BCLog::MEMPOOL, "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
         mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
     return true;
@@ -743,6 +814,11 @@ PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler& schedu
 
 void PeerLogicValidation::BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex* pindex, const std::vector<CTransactionRef>& vtxConflicted)
 {
+    for (const CTransactionRef& ptx : pblock->vtx)
+        txAnnounceQueue.Remove(ptx->GetHash());
+    for (const CTransactionRef& ptx : vtxConflicted)
+        txAnnounceQueue.Remove(ptx->GetHash());
+
     LOCK(g_cs_orphans);
 
     std::vector<uint256> vOrphanErase;
@@ -777,6 +853,7 @@ void PeerLogicValidation::BlockConnected(const std::shared_ptr<const CBlock>& pb
 // All of the following cache a recent block, and are protected by cs_most_recent_block
 static CCriticalSection cs_most_recent_block;
 static std::shared_ptr<const CBlock> most_recent_block;
+static std::shared_ptr<const CBlockHeaderAndShortTxIDs> most_recent_compact_block;
 static uint256 most_recent_block_hash;
 
 void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex* pindex, const std::shared_ptr<const CBlock>& pblock)
@@ -791,13 +868,38 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex* pindex, const std:
 
     nHighestFastAnnounce = pindex->nHeight;
 
+    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = std::make_shared<const CBlockHeaderAndShortTxIDs>(*pblock);
+    // The cmpctblock is the same for every peer past OLD_VERSION, so serialize it once
+    const CSharedNetMsg msg = CConnman::ShareMessage(msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
+
     uint256 hashBlock(pblock->GetHash());
 
     {
         LOCK(cs_most_recent_block);
         most_recent_block_hash = hashBlock;
         most_recent_block = pblock;
+        most_recent_compact_block = pcmpctblock;
     }
+
+    connman->ForEachNode([this, &msg, pindex, &hashBlock](CNode* pnode) {
+        if (pnode->nVersion <= OLD_VERSION || pnode->fDisconnect)
+            return;
+        ProcessBlockAvailability(pnode->GetId());
+        CNodeState& state = *State(pnode->GetId());
+        // If the peer has, or we announced to them the previous block already,
+        // but we don't think they have this one, go ahead and announce it
+        if (state.fPreferHeaderAndIDs && !PeerHasHeader(&state, pindex) && PeerHasHeader(&state, pindex->pprev)) {
+            LogPrint(BCLog::NET, "%s sending header-and-ids %s to peer=%d\n", "PeerLogicValidation::NewPoWValidBlock",
+                    hashBlock.ToString(), pnode->GetId());
+            connman->PushMessage(pnode, msg);
+            state.pindexBestHeaderSent = pindex;
+        }
+    });
+}
+
+void PeerLogicValidation::TransactionRemovedFromMempool(const CTransactionRef& ptx)
+{
+    txAnnounceQueue.Remove(ptx->GetHash());
 }
 
 void PeerLogicValidation::UpdatedBlockTip(const CBlockIndex* pindexNew, const CBlockIndex* pindexFork, bool fInitialDownload)
@@ -857,6 +959,13 @@ void PeerLogicValidation::BlockChecked(const CBlock& block, const CValidationSta
     // 3. This is currently the best block we're aware of. We haven't updated
     //    the tip yet so we have no way to check this directly here. Instead we
     //    just check that there are currently no other blocks in flight.
+    else if (state.IsValid() &&
+             !IsInitialBlockDownload() &&
+             mapBlocksInFlight.count(hash) == mapBlocksInFlight.size()) {
+        if (it != mapBlockSource.end()) {
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(it->second.first, connman);
+        }
+    }
     if (it != mapBlockSource.end())
         mapBlockSource.erase(it);
 }
@@ -915,10 +1024,7 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
 static void RelayTransaction(const CTransaction& tx, CConnman* connman)
 {
-    CInv inv(MSG_TX, tx.GetHash());
-    connman->ForEachNode([&inv](CNode* pnode) {
-        pnode->PushInventory(inv);
-    });
+    txAnnounceQueue.Push(mempool, tx.GetHash());
 }
 
 static void RelayAddress(const CAddress& addr, bool fReachable, CConnman* connman)
@@ -958,13 +1064,29 @@ static void RelayAddress(const CAddress& addr, bool fReachable, CConnman* connma
 }
 
 
+/**
+ * Peers newer than OLD_VERSION expect the header flags (SER_GALAXYCASH) right
+ * after the 80 header bytes. Disk records don't carry them, so splice them in
+ * from the block index, which FixIndex keeps in sync with the block.
+ */
+static void InsertBlockFlags(std::vector<unsigned char>& data, const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    const int32_t nFlags = pindex->nFlags & (CBlockIndex::BLOCK_PROOF_OF_STAKE | CBlockIndex::BLOCK_STAKE_ENTROPY | CBlockIndex::BLOCK_SUBSIDY);
+    std::vector<unsigned char> vchFlags;
+    CVectorWriter(SER_NETWORK | SER_GALAXYCASH, PROTOCOL_VERSION, vchFlags, 0, nFlags, true);
+    data.insert(data.begin() + CBlockHeader::NORMAL_SERIALIZE_SIZE, vchFlags.begin(), vchFlags.end());
+}
+
 void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensusParams, const CInv& inv, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
 {
     bool send = false;
     std::shared_ptr<const CBlock> a_recent_block;
+    std::shared_ptr<const CBlockHeaderAndShortTxIDs> a_recent_compact_block;
     {
         LOCK(cs_most_recent_block);
         a_recent_block = most_recent_block;
+        a_recent_compact_block = most_recent_compact_block;
     }
 
     bool need_activate_chain = false;
@@ -1025,6 +1147,15 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
         std::shared_ptr<const CBlock> pblock;
         if (a_recent_block && a_recent_block->GetHash() == (*mi).second->GetBlockHash()) {
             pblock = a_recent_block;
+        } else if (inv.type == MSG_BLOCK) {
+            // Send block from disk as stored, without deserializing and reserializing it
+            CSerializedNetMsg msg;
+            msg.command = NetMsgType::BLOCK;
+            if (!ReadRawBlockFromDisk(msg.data, (*mi).second, consensusParams))
+                assert(!"cannot load block from disk");
+            if (pfrom->GetSendVersion() > OLD_VERSION)
+                InsertBlockFlags(msg.data, (*mi).second);
+            connman->PushMessage(pfrom, std::move(msg));
         } else {
             // Send block from disk
             std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
@@ -1032,8 +1163,9 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
                 assert(!"cannot load block from disk");
             pblock = pblockRead;
         }
-        pblock->MakeFlags();
-        if (inv.type == MSG_BLOCK)
+        if (pblock)
+            pblock->MakeFlags();
+        if (inv.type == MSG_BLOCK && pblock)
             connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
         else if (inv.type == MSG_FILTERED_BLOCK)
         {
@@ -1061,6 +1193,23 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
             // else
                 // no response
         }
+        else if (inv.type == MSG_CMPCT_BLOCK)
+        {
+            // If a peer is asking for old blocks, we're almost guaranteed
+            // they won't have a useful mempool to match against a compact block,
+            // and we don't feel like constructing the object for them, so
+            // instead we respond with the full, non-compact block.
+            if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                if (a_recent_compact_block && a_recent_compact_block->header.GetHash() == mi->second->GetBlockHash()) {
+                    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
+                } else {
+                    CBlockHeaderAndShortTxIDs cmpctblock(*pblock);
+                    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::CMPCTBLOCK, cmpctblock));
+                }
+            } else {
+                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
+            }
+        }
 
         // Trigger the peer node to send a getblocks request for the next batch of inventory
         if (inv.hash == pfrom->hashContinue)
@@ -1079,6 +1228,38 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
     }
 }
 
+/** Inventory types answered from memory by ProcessGetData, as opposed to blocks read from disk */
+static bool IsRelayedInvType(int type)
+{
+    return type == MSG_TX || type == MSG_SPORK || type == MSG_MASTERNODE_WINNER ||
+           type == MSG_MASTERNODE_ANNOUNCE || type == MSG_MASTERNODE_PING;
+}
+
+/**
+ * Push the response to inv from invPayloadCache, serializing it with make()
+ * and caching it first if this is the first request since it was relayed.
+ */
+template <typename Maker>
+static void PushInvPayload(CNode* pfrom, CConnman* connman, const CInv& inv, Maker&& make)
+{
+    CSharedNetMsg msg;
+    if (!invPayloadCache.Get(inv, msg)) {
+        msg = CConnman::ShareMessage(make());
+        invPayloadCache.Put(inv, msg);
+    }
+    connman->PushMessage(pfrom, msg);
+}
+
+/** Serialize a masternode or spork object as a raw stream, as its message handlers expect */
+template <typename T>
+static CSerializedNetMsg MakeRawPayloadMessage(const CNetMsgMaker& msgMaker, const std::string& strCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(1000);
+    ss << obj;
+    return msgMaker.Make(strCommand, ss);
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
 {
     AssertLockNotHeld(cs_main);
@@ -1089,7 +1270,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     {
         LOCK(cs_main);
 
-        while (it != pfrom->vRecvGetData.end() && (it->type == MSG_TX)) {
+        while (it != pfrom->vRecvGetData.end() && IsRelayedInvType(it->type)) {
             if (interruptMsgProc)
                 return;
             // Don't bother if send buffer is too full to respond anyway
@@ -1103,7 +1284,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             bool push = false;
             auto mi = mapRelay.find(inv.hash);
             if (mi != mapRelay.end()) {
-                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::TX, *mi->second));
+                PushInvPayload(pfrom, connman, CInv(MSG_TX, inv.hash), [&] { return msgMaker.Make(NetMsgType::TX, *mi->second); });
                 push = true;
             } else if (pfrom->timeLastMempoolReq) {
                 auto txinfo = mempool.info(inv.hash);
@@ -1113,44 +1294,36 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                     connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::TX, *txinfo.tx));
                     push = true;
                 }
-            } 
-            
+            }
+
             if (!push && inv.type == MSG_SPORK) {
-                if (mapSporks.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapSporks[inv.hash];
-                        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::SPORK, ss));
-                        push = true;
+                auto mi = mapSporks.find(inv.hash);
+                if (mi != mapSporks.end()) {
+                    PushInvPayload(pfrom, connman, inv, [&] { return MakeRawPayloadMessage(msgMaker, NetMsgType::SPORK, mi->second); });
+                    push = true;
                 }
             }
-            
+
             if (!push && inv.type == MSG_MASTERNODE_WINNER) {
-                    if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << masternodePayments.mapMasternodePayeeVotes[inv.hash];
-                        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::MASTERNODE_WINNER, ss));
-                        push = true;
-                    }
+                auto mi = masternodePayments.mapMasternodePayeeVotes.find(inv.hash);
+                if (mi != masternodePayments.mapMasternodePayeeVotes.end()) {
+                    PushInvPayload(pfrom, connman, inv, [&] { return MakeRawPayloadMessage(msgMaker, NetMsgType::MASTERNODE_WINNER, mi->second); });
+                    push = true;
+                }
             }
-            
+
             if (!push && inv.type == MSG_MASTERNODE_ANNOUNCE) {
-                if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
-                    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                    ss.reserve(1000);
-                    ss << mnodeman.mapSeenMasternodeBroadcast[inv.hash];
-                    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::MASTERNODE_ANNOUNCE, ss));
+                auto mi = mnodeman.mapSeenMasternodeBroadcast.find(inv.hash);
+                if (mi != mnodeman.mapSeenMasternodeBroadcast.end()) {
+                    PushInvPayload(pfrom, connman, inv, [&] { return MakeRawPayloadMessage(msgMaker, NetMsgType::MASTERNODE_ANNOUNCE, mi->second); });
                     push = true;
                 }
-             }
-             
-             if (!push && inv.type == MSG_MASTERNODE_PING) {
-                if (mnodeman.mapSeenMasternodePing.count(inv.hash)) {
-                    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                    ss.reserve(1000);
-                    ss << mnodeman.mapSeenMasternodePing[inv.hash];
-                    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::MASTERNODE_PING, ss));
+            }
+
+            if (!push && inv.type == MSG_MASTERNODE_PING) {
+                auto mi = mnodeman.mapSeenMasternodePing.find(inv.hash);
+                if (mi != mnodeman.mapSeenMasternodePing.end()) {
+                    PushInvPayload(pfrom, connman, inv, [&] { return MakeRawPayloadMessage(msgMaker, NetMsgType::MASTERNODE_PING, mi->second); });
                     push = true;
                 }
             }
@@ -1163,7 +1336,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
     if (it != pfrom->vRecvGetData.end() && !pfrom->fPauseSend) {
         const CInv &inv = *it;
-        if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+        if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
             it++;
             ProcessGetBlockData(pfrom, consensusParams, inv, connman, interruptMsgProc);
         }
@@ -1211,6 +1384,11 @@ bool static ProcessHeadersMessage(CNode* pfrom, CConnman* connman, const std::ve
         return true;
     }
 
+    // Hash the whole batch up front, outside cs_main and across the header
+    // hashing threads; everything below works from these hashes.
+    std::vector<uint256> vHashes;
+    HashBlockHeaders(headers, vHashes);
+
     bool received_new_header = false;
     const CBlockIndex* pindexLast = nullptr;
     {
@@ -1229,14 +1407,14 @@ bool static ProcessHeadersMessage(CNode* pfrom, CConnman* connman, const std::ve
             nodestate->nUnconnectingHeaders++;
             connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256()));
             LogPrint(BCLog::NET, "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
-                headers[0].GetHash().ToString(),
+                vHashes[0].ToString(),
                 headers[0].hashPrevBlock.ToString(),
                 pindexBestHeader->nHeight,
                 pfrom->GetId(), nodestate->nUnconnectingHeaders);
             // Set hashLastUnknownBlock for this peer, so that if we
             // eventually get the headers - even from a different peer -
             // we can use this peer to download.
-            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+            UpdateBlockAvailability(pfrom->GetId(), vHashes.back());
 
             if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0) {
                 Misbehaving(pfrom->GetId(), 20);
@@ -1244,14 +1422,13 @@ bool static ProcessHeadersMessage(CNode* pfrom, CConnman* connman, const std::ve
             return true;
         }
 
-        uint256 hashLastBlock;
-        for (const CBlockHeader& header : headers) {
-            if (!hashLastBlock.IsNull() && header.hashPrevBlock != hashLastBlock) {
+        for (size_t i = 1; i < nCount; i++) {
+            if (headers[i].hashPrevBlock != vHashes[i - 1]) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            hashLastBlock = header.GetHash();
         }
+        const uint256& hashLastBlock = vHashes.back();
 
         // If we don't have the last header, then they'll have given us
         // something new (if these headers are valid).
@@ -1262,7 +1439,7 @@ bool static ProcessHeadersMessage(CNode* pfrom, CConnman* connman, const std::ve
 
     CValidationState state;
     CBlockHeader first_invalid_header;
-    if (!ProcessNewBlockHeaders(pfrom->lastAcceptedHeader, headers, pfrom->nVersion <= OLD_VERSION, state, chainparams, &pindexLast, &first_invalid_header)) {
+    if (!ProcessNewBlockHeaders(pfrom->lastAcceptedHeader, headers, pfrom->nVersion <= OLD_VERSION, state, chainparams, &pindexLast, &first_invalid_header, &vHashes)) {
         int nDoS;
         if (state.IsInvalid(nDoS)) {
             LOCK(cs_main);
@@ -1303,7 +1480,7 @@ bool static ProcessHeadersMessage(CNode* pfrom, CConnman* connman, const std::ve
             return error("invalid header received");
         }
     }
-    pfrom->lastAcceptedHeader = headers.back().GetHash();
+    pfrom->lastAcceptedHeader = vHashes.back();
 
     {
         LOCK(cs_main);
@@ -1372,6 +1549,10 @@ bool static ProcessHeadersMessage(CNode* pfrom, CConnman* connman, const std::ve
                         pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
                 }
                 if (vGetData.size() > 0) {
+                    if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1 && mapBlocksInFlight.size() == 1 && pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN)) {
+                        // In any case, we want to download using a compact block, not a regular one
+                        vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                    }
                     connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETDATA, vGetData));
                 }
             }
@@ -1412,1172 +1593,1513 @@ bool static ProcessHeadersMessage(CNode* pfrom, CConnman* connman, const std::ve
 }
 
 
-bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+static bool ProcessRejectMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
 {
-    LogPrint(BCLog::NET, "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->GetId());
-    if (gArgs.IsArgSet("-dropmessagestest") && GetRand(gArgs.GetArg("-dropmessagestest", 0)) == 0)
-    {
-        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
-        return true;
-    }
+    if (LogAcceptCategory(BCLog::NET)) {
+        try {
+            std::string strMsg; unsigned char ccode; std::string strReason;
+            vRecv >> LIMITED_STRING(strMsg, CMessageHeader::COMMAND_SIZE) >> ccode >> LIMITED_STRING(strReason, MAX_REJECT_MESSAGE_LENGTH);
 
-    if (!(pfrom->GetLocalServices() & NODE_BLOOM) &&
-              (strCommand == NetMsgType::FILTERLOAD ||
-               strCommand == NetMsgType::FILTERADD))
-    {
-        if (pfrom->nVersion >= NO_BLOOM_VERSION) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 100);
-            return false;
-        } else {
-            pfrom->fDisconnect = true;
-            return false;
+            std::ostringstream ss;
+            ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
+
+            if (strMsg == NetMsgType::BLOCK || strMsg == NetMsgType::TX)
+            {
+                uint256 hash;
+                vRecv >> hash;
+                ss << ": hash " << hash.ToString();
+            }
+            LogPrint(BCLog::NET, "Reject %s\n", SanitizeString(ss.str()));
+        } catch (const std::ios_base::failure&) {
+            // Avoid feedback loops by preventing reject messages from triggering a new reject message.
+            LogPrint(BCLog::NET, "Unparseable reject message received\n");
         }
     }
 
+    return true;
+}
 
-
-    if (strCommand == NetMsgType::REJECT)
+static bool ProcessVersionMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    // Each connection can only send one version message
+    if (pfrom->nVersion != 0)
     {
-        if (LogAcceptCategory(BCLog::NET)) {
-            try {
-                std::string strMsg; unsigned char ccode; std::string strReason;
-                vRecv >> LIMITED_STRING(strMsg, CMessageHeader::COMMAND_SIZE) >> ccode >> LIMITED_STRING(strReason, MAX_REJECT_MESSAGE_LENGTH);
-
-                std::ostringstream ss;
-                ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
-
-                if (strMsg == NetMsgType::BLOCK || strMsg == NetMsgType::TX)
-                {
-                    uint256 hash;
-                    vRecv >> hash;
-                    ss << ": hash " << hash.ToString();
-                }
-                LogPrint(BCLog::NET, "Reject %s\n", SanitizeString(ss.str()));
-            } catch (const std::ios_base::failure&) {
-                // Avoid feedback loops by preventing reject messages from triggering a new reject message.
-                LogPrint(BCLog::NET, "Unparseable reject message received\n");
-            }
-        }
+        connman->PushMessage(pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::REJECT, strCommand, REJECT_DUPLICATE, std::string("Duplicate version message")));
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 1);
+        return false;
     }
 
-
-    else if (strCommand == NetMsgType::VERSION)
+    int64_t nTime;
+    CAddress addrMe;
+    CAddress addrFrom;
+    uint64_t nNonce = 1;
+    uint64_t nServiceInt;
+    ServiceFlags nServices;
+    int nVersion;
+    int nSendVersion;
+    std::string strSubVer;
+    std::string cleanSubVer;
+    int nStartingHeight = -1;
+    bool fRelay = true;
+
+    vRecv >> nVersion >> nServiceInt >> nTime >> addrMe;
+    nSendVersion = std::min(nVersion, PROTOCOL_VERSION);
+    nServices = ServiceFlags(nServiceInt);
+    if (!pfrom->fInbound)
     {
-        // Each connection can only send one version message
-        if (pfrom->nVersion != 0)
-        {
-            connman->PushMessage(pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::REJECT, strCommand, REJECT_DUPLICATE, std::string("Duplicate version message")));
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 1);
-            return false;
-        }
+        connman->SetServices(pfrom->addr, nServices);
+    }
+    if (!pfrom->fInbound && !pfrom->fFeeler && !pfrom->m_manual_connection && !HasAllDesirableServiceFlags(nServices))
+    {
+        LogPrint(BCLog::NET, "peer=%d does not offer the expected services (%08x offered, %08x expected); disconnecting\n", pfrom->GetId(), nServices, GetDesirableServiceFlags(nServices));
+        connman->PushMessage(pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::REJECT, strCommand, REJECT_NONSTANDARD,
+                           strprintf("Expected to offer services %08x", GetDesirableServiceFlags(nServices))));
+        pfrom->fDisconnect = true;
+        return false;
+    }
 
-        int64_t nTime;
-        CAddress addrMe;
-        CAddress addrFrom;
-        uint64_t nNonce = 1;
-        uint64_t nServiceInt;
-        ServiceFlags nServices;
-        int nVersion;
-        int nSendVersion;
-        std::string strSubVer;
-        std::string cleanSubVer;
-        int nStartingHeight = -1;
-        bool fRelay = true;
-
-        vRecv >> nVersion >> nServiceInt >> nTime >> addrMe;
-        nSendVersion = std::min(nVersion, PROTOCOL_VERSION);
-        nServices = ServiceFlags(nServiceInt);
-        if (!pfrom->fInbound)
-        {
-            connman->SetServices(pfrom->addr, nServices);
-        }
-        if (!pfrom->fInbound && !pfrom->fFeeler && !pfrom->m_manual_connection && !HasAllDesirableServiceFlags(nServices))
-        {
-            LogPrint(BCLog::NET, "peer=%d does not offer the expected services (%08x offered, %08x expected); disconnecting\n", pfrom->GetId(), nServices, GetDesirableServiceFlags(nServices));
-            connman->PushMessage(pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::REJECT, strCommand, REJECT_NONSTANDARD,
-                               strprintf("Expected to offer services %08x", GetDesirableServiceFlags(nServices))));
+    if (nServices & ((1 << 7) | (1 << 5))) {
+        if (GetTime() < 1533096000) {
+            // Immediately disconnect peers that use service bits 6 or 8 until August 1st, 2018
+            // These bits have been used as a flag to indicate that a node is running incompatible
+            // consensus rules instead of changing the network magic, so we're stuck disconnecting
+            // based on these service bits, at least for a while.
             pfrom->fDisconnect = true;
             return false;
         }
+    }
 
-        if (nServices & ((1 << 7) | (1 << 5))) {
-            if (GetTime() < 1533096000) {
-                // Immediately disconnect peers that use service bits 6 or 8 until August 1st, 2018
-                // These bits have been used as a flag to indicate that a node is running incompatible
-                // consensus rules instead of changing the network magic, so we're stuck disconnecting
-                // based on these service bits, at least for a while.
-                pfrom->fDisconnect = true;
-                return false;
-            }
-        }
-
-        if (nVersion < MIN_PEER_PROTO_VERSION)
-        {
-            // disconnect from peers older than this proto version
-            LogPrint(BCLog::NET, "peer=%d using obsolete version %i; disconnecting\n", pfrom->GetId(), nVersion);
-            connman->PushMessage(pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::REJECT, strCommand, REJECT_OBSOLETE,
-                               strprintf("Version must be %d or greater", MIN_PEER_PROTO_VERSION)));
-            pfrom->fDisconnect = true;
-            return false;
-        }
+    if (nVersion < MIN_PEER_PROTO_VERSION)
+    {
+        // disconnect from peers older than this proto version
+        LogPrint(BCLog::NET, "peer=%d using obsolete version %i; disconnecting\n", pfrom->GetId(), nVersion);
+        connman->PushMessage(pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::REJECT, strCommand, REJECT_OBSOLETE,
+                           strprintf("Version must be %d or greater", MIN_PEER_PROTO_VERSION)));
+        pfrom->fDisconnect = true;
+        return false;
+    }
 
-        if (nVersion == 10300)
-            nVersion = 300;
-        if (!vRecv.empty())
-            vRecv >> addrFrom >> nNonce;
-        if (!vRecv.empty()) {
-            vRecv >> LIMITED_STRING(strSubVer, MAX_SUBVERSION_LENGTH);
-            cleanSubVer = SanitizeString(strSubVer);
-        }
-        if (!vRecv.empty()) {
-            vRecv >> nStartingHeight;
-        }
-        if (!vRecv.empty())
-            vRecv >> fRelay;
-        // Disconnect if we connected to ourself
-        if (pfrom->fInbound && !connman->CheckIncomingNonce(nNonce))
-        {
-            LogPrintf("connected to self at %s, disconnecting\n", pfrom->addr.ToString());
-            pfrom->fDisconnect = true;
-            return true;
-        }
+    if (nVersion == 10300)
+        nVersion = 300;
+    if (!vRecv.empty())
+        vRecv >> addrFrom >> nNonce;
+    if (!vRecv.empty()) {
+        vRecv >> LIMITED_STRING(strSubVer, MAX_SUBVERSION_LENGTH);
+        cleanSubVer = SanitizeString(strSubVer);
+    }
+    if (!vRecv.empty()) {
+        vRecv >> nStartingHeight;
+    }
+    if (!vRecv.empty())
+        vRecv >> fRelay;
+    // Disconnect if we connected to ourself
+    if (pfrom->fInbound && !connman->CheckIncomingNonce(nNonce))
+    {
+        LogPrintf("connected to self at %s, disconnecting\n", pfrom->addr.ToString());
+        pfrom->fDisconnect = true;
+        return true;
+    }
 
-        if (pfrom->fInbound && addrMe.IsRoutable())
-        {
-            SeenLocal(addrMe);
-        }
+    if (pfrom->fInbound && addrMe.IsRoutable())
+    {
+        SeenLocal(addrMe);
+    }
 
-        // Change version
-        pfrom->SetSendVersion(nSendVersion);
-        pfrom->nVersion = nVersion;
+    // Change version
+    pfrom->SetSendVersion(nSendVersion);
+    pfrom->nVersion = nVersion;
 
-        // Be shy and don't send version until we hear
-        if (pfrom->fInbound)
-            PushNodeVersion(pfrom, connman, GetAdjustedTime());
+    // Be shy and don't send version until we hear
+    if (pfrom->fInbound)
+        PushNodeVersion(pfrom, connman, GetAdjustedTime());
 
-        connman->PushMessage(pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::VERACK));
+    connman->PushMessage(pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::VERACK));
 
-        pfrom->nServices = nServices;
-        pfrom->SetAddrLocal(addrMe);
-        {
-            LOCK(pfrom->cs_SubVer);
-            pfrom->strSubVer = strSubVer;
-            pfrom->cleanSubVer = cleanSubVer;
-        }
-        pfrom->nStartingHeight = nStartingHeight;
-        pfrom->fClient = !(nServices & NODE_NETWORK);
-        {
-            LOCK(pfrom->cs_filter);
-            pfrom->fRelayTxes = fRelay; // set to true after we get the first filter* message
-        }
+    pfrom->nServices = nServices;
+    pfrom->SetAddrLocal(addrMe);
+    {
+        LOCK(pfrom->cs_SubVer);
+        pfrom->strSubVer = strSubVer;
+        pfrom->cleanSubVer = cleanSubVer;
+    }
+    pfrom->nStartingHeight = nStartingHeight;
+    pfrom->fClient = !(nServices & NODE_NETWORK);
+    {
+        LOCK(pfrom->cs_filter);
+        pfrom->fRelayTxes = fRelay; // set to true after we get the first filter* message
+    }
 
-        // Potentially mark this peer as a preferred download peer.
-        {
-        LOCK(cs_main);
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
-        }
+    // Potentially mark this peer as a preferred download peer.
+    {
+    LOCK(cs_main);
+    UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+    }
 
-        if (!pfrom->fInbound)
+    if (!pfrom->fInbound)
+    {
+        // Advertise our address
+        if (fListen && !IsInitialBlockDownload())
         {
-            // Advertise our address
-            if (fListen && !IsInitialBlockDownload())
-            {
-                CAddress addr = GetLocalAddress(&pfrom->addr, pfrom->GetLocalServices());
-                FastRandomContext insecure_rand;
-                if (addr.IsRoutable())
-                {
-                    LogPrint(BCLog::NET, "ProcessMessages: advertising address %s\n", addr.ToString());
-                    pfrom->PushAddress(addr, insecure_rand);
-                } else if (IsPeerAddrLocalGood(pfrom)) {
-                    addr.SetIP(addrMe);
-                    LogPrint(BCLog::NET, "ProcessMessages: advertising address %s\n", addr.ToString());
-                    pfrom->PushAddress(addr, insecure_rand);
-                }
-            }
-
-            // Get recent addresses
-            if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || connman->GetAddressCount() < 1000)
+            CAddress addr = GetLocalAddress(&pfrom->addr, pfrom->GetLocalServices());
+            FastRandomContext insecure_rand;
+            if (addr.IsRoutable())
             {
-                connman->PushMessage(pfrom, CNetMsgMaker(nSendVersion).Make(NetMsgType::GETADDR));
-                pfrom->fGetAddr = true;
+                LogPrint(BCLog::NET, "ProcessMessages: advertising address %s\n", addr.ToString());
+                pfrom->PushAddress(addr, insecure_rand);
+            } else if (IsPeerAddrLocalGood(pfrom)) {
+                addr.SetIP(addrMe);
+                LogPrint(BCLog::NET, "ProcessMessages: advertising address %s\n", addr.ToString());
+                pfrom->PushAddress(addr, insecure_rand);
             }
-            connman->MarkAddressGood(pfrom->addr);
         }
 
-        // peercoin: relay alerts
+        // Get recent addresses
+        if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || connman->GetAddressCount() < 1000)
         {
-            LOCK(cs_mapAlerts);
-            for (auto& item : mapAlerts)
-                item.second.RelayTo(pfrom);
+            connman->PushMessage(pfrom, CNetMsgMaker(nSendVersion).Make(NetMsgType::GETADDR));
+            pfrom->fGetAddr = true;
         }
+        connman->MarkAddressGood(pfrom->addr);
+    }
 
-        std::string remoteAddr;
-        if (fLogIPs)
-            remoteAddr = ", peeraddr=" + pfrom->addr.ToString();
-
-        LogPrint(BCLog::NET, "receive version message: %s: version %d, blocks=%d, us=%s, peer=%d%s\n",
-                  cleanSubVer, pfrom->nVersion,
-                  pfrom->nStartingHeight, addrMe.ToString(), pfrom->GetId(),
-                  remoteAddr);
-
+    // peercoin: relay alerts
+    {
+        LOCK(cs_mapAlerts);
+        for (auto& item : mapAlerts)
+            item.second.RelayTo(pfrom);
+    }
 
-        int64_t nTimeOffset = nTime - GetTime();
-        pfrom->nTimeOffset = nTimeOffset;
-        AddTimeData(pfrom->addr, nTimeOffset);
+    std::string remoteAddr;
+    if (fLogIPs)
+        remoteAddr = ", peeraddr=" + pfrom->addr.ToString();
 
-        // Feeler connections exist only to verify if address is online.
-        if (pfrom->fFeeler) {
-            assert(pfrom->fInbound == false);
-            pfrom->fDisconnect = true;
-        }
+    LogPrint(BCLog::NET, "receive version message: %s: version %d, blocks=%d, us=%s, peer=%d%s\n",
+              cleanSubVer, pfrom->nVersion,
+              pfrom->nStartingHeight, addrMe.ToString(), pfrom->GetId(),
+              remoteAddr);
 
 
-        pfrom->fVerack = false;
-        pfrom->fSuccessfullyConnected = true;
+    int64_t nTimeOffset = nTime - GetTime();
+    pfrom->nTimeOffset = nTimeOffset;
+    AddTimeData(pfrom->addr, nTimeOffset);
 
-        return true;
+    // Feeler connections exist only to verify if address is online.
+    if (pfrom->fFeeler) {
+        assert(pfrom->fInbound == false);
+        pfrom->fDisconnect = true;
     }
 
 
-    else if (pfrom->nVersion == 0)
-    {
-        // Must have a version message before anything else
-        LOCK(cs_main);
-        Misbehaving(pfrom->GetId(), 1);
-        return false;
-    }
+    pfrom->fVerack = false;
+    pfrom->fSuccessfullyConnected = true;
 
+    return true;
+}
 
-        
-    // peercoin: set/unset network serialization mode for new clients
-    if (pfrom->nVersion != 0) {
-        if (pfrom->nVersion <= OLD_VERSION)
-            vRecv.SetType(vRecv.GetType() & ~SER_GALAXYCASH);
-        else
-            vRecv.SetType(vRecv.GetType() | SER_GALAXYCASH);
-    }
-    // At this point, the outgoing message serialization version can't change.
+static bool ProcessVerackMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
     const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
 
-    if (strCommand == NetMsgType::VERACK)
-    {
-        LOCK(cs_main);
-        pfrom->SetRecvVersion(std::min(pfrom->nVersion.load(), PROTOCOL_VERSION));
-        pfrom->fVerack = true;
+    LOCK(cs_main);
+    pfrom->SetRecvVersion(std::min(pfrom->nVersion.load(), PROTOCOL_VERSION));
+    pfrom->fVerack = true;
+
+    if (!pfrom->fInbound) {
+        // Mark this node as currently connected, so we update its timestamp later.
+        State(pfrom->GetId())->fCurrentlyConnected = true;
+        LogPrintf("New outbound peer connected: version: %d, blocks=%d, peer=%d%s\n",
+                  pfrom->nVersion.load(), pfrom->nStartingHeight, pfrom->GetId(),
+                  (fLogIPs ? strprintf(", peeraddr=%s", pfrom->addr.ToString()) : ""));
+    }
+
+    if (pfrom->nVersion >= SENDHEADERS_VERSION) {
+        // Tell our peer we prefer to receive headers rather than inv's
+        // We send this to non-NODE NETWORK peers as well, because even
+        // non-NODE NETWORK peers can announce blocks (such as pruning
+        // nodes)
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::SENDHEADERS));
+    }
+    if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+        // Tell our peer we are willing to provide version 1 cmpctblocks
+        // However, we do not request new block announcements using
+        // cmpctblock messages.
+        // We send this to non-NODE NETWORK peers as well, because
+        // they may wish to request compact blocks from us
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 1;
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion));
+    }
 
-        if (!pfrom->fInbound) {
-            // Mark this node as currently connected, so we update its timestamp later.
-            State(pfrom->GetId())->fCurrentlyConnected = true;
-            LogPrintf("New outbound peer connected: version: %d, blocks=%d, peer=%d%s\n",
-                      pfrom->nVersion.load(), pfrom->nStartingHeight, pfrom->GetId(),
-                      (fLogIPs ? strprintf(", peeraddr=%s", pfrom->addr.ToString()) : ""));
-        }
+    return true;
+}
 
-        if (pfrom->nVersion >= SENDHEADERS_VERSION) {
-            // Tell our peer we prefer to receive headers rather than inv's
-            // We send this to non-NODE NETWORK peers as well, because even
-            // non-NODE NETWORK peers can announce blocks (such as pruning
-            // nodes)
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::SENDHEADERS));
-        }
+static bool ProcessAddrMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    std::vector<CAddress> vAddr;
+    vRecv >> vAddr;
 
+    // Don't want addr from older versions unless seeding
+    if (pfrom->nVersion < CADDR_TIME_VERSION && connman->GetAddressCount() > 1000)
         return true;
+    if (vAddr.size() > 1000)
+    {
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message addr size() = %u", vAddr.size());
     }
 
-    else if (strCommand == NetMsgType::ADDR)
+    // Store the new addresses
+    std::vector<CAddress> vAddrOk;
+    int64_t nNow = GetAdjustedTime();
+    int64_t nSince = nNow - 10 * 60;
+    for (CAddress& addr : vAddr)
     {
-        std::vector<CAddress> vAddr;
-        vRecv >> vAddr;
-
-        // Don't want addr from older versions unless seeding
-        if (pfrom->nVersion < CADDR_TIME_VERSION && connman->GetAddressCount() > 1000)
+        if (interruptMsgProc)
             return true;
-        if (vAddr.size() > 1000)
-        {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message addr size() = %u", vAddr.size());
-        }
-
-        // Store the new addresses
-        std::vector<CAddress> vAddrOk;
-        int64_t nNow = GetAdjustedTime();
-        int64_t nSince = nNow - 10 * 60;
-        for (CAddress& addr : vAddr)
-        {
-            if (interruptMsgProc)
-                return true;
 
-            // We only bother storing full nodes, though this may include
-            // things which we would not make an outbound connection to, in
-            // part because we may make feeler connections to them.
-            if (!MayHaveUsefulAddressDB(addr.nServices))
-                continue;
+        // We only bother storing full nodes, though this may include
+        // things which we would not make an outbound connection to, in
+        // part because we may make feeler connections to them.
+        if (!MayHaveUsefulAddressDB(addr.nServices))
+            continue;
 
-            if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
-                addr.nTime = nNow - 5 * 24 * 60 * 60;
-            pfrom->AddAddressKnown(addr);
-            bool fReachable = IsReachable(addr);
-            if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
-            {
-                // Relay to a limited number of other nodes
-                RelayAddress(addr, fReachable, connman);
-            }
-            // Do not store addresses outside our network
-            if (fReachable)
-                vAddrOk.push_back(addr);
+        if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
+            addr.nTime = nNow - 5 * 24 * 60 * 60;
+        pfrom->AddAddressKnown(addr);
+        bool fReachable = IsReachable(addr);
+        if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
+        {
+            // Relay to a limited number of other nodes
+            RelayAddress(addr, fReachable, connman);
         }
-        connman->AddNewAddresses(vAddrOk, pfrom->addr, 2 * 60 * 60);
-        if (vAddr.size() < 1000)
-            pfrom->fGetAddr = false;
-        if (pfrom->fOneShot)
-            pfrom->fDisconnect = true;
+        // Do not store addresses outside our network
+        if (fReachable)
+            vAddrOk.push_back(addr);
     }
+    connman->AddNewAddresses(vAddrOk, pfrom->addr, 2 * 60 * 60);
+    if (vAddr.size() < 1000)
+        pfrom->fGetAddr = false;
+    if (pfrom->fOneShot)
+        pfrom->fDisconnect = true;
+
+    return true;
+}
 
-    else if (strCommand == NetMsgType::SENDHEADERS) {
+static bool ProcessSendCmpctMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 0;
+    vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+    // galaxycash: there is no witness, so version 1 is the only one we speak
+    if (nCMPCTBLOCKVersion == 1) {
         LOCK(cs_main);
-        State(pfrom->GetId())->fPreferHeaders = true;
+        CNodeState* nodestate = State(pfrom->GetId());
+        nodestate->fProvidesHeaderAndIDs = true;
+        nodestate->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
     }
 
+    return true;
+}
 
-    else if (strCommand == NetMsgType::INV) {
-        std::vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message inv size() = %u", vInv.size());
-        }
+static bool ProcessSendHeadersMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    LOCK(cs_main);
+    State(pfrom->GetId())->fPreferHeaders = true;
 
-        bool fBlocksOnly = !fRelayTxes;
+    return true;
+}
 
-        // Allow whitelisted peers to send data other than blocks in blocks only mode if whitelistrelay is true
-        if (pfrom->fWhitelisted && gArgs.GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY))
-            fBlocksOnly = false;
+static bool ProcessInvMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
 
+    std::vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ) {
         LOCK(cs_main);
-
-        for (CInv& inv : vInv) {
-            if (interruptMsgProc)
-                return true;
-
-            bool fAlreadyHave = AlreadyHave(inv);
-            LogPrint(BCLog::NET, "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->GetId());
-
-            if (inv.type == MSG_BLOCK) {
-                UpdateBlockAvailability(pfrom->GetId(), inv.hash);
-                if (!fAlreadyHave && !mapBlocksInFlight.count(inv.hash)) {
-                    // We used to request the full block here, but since headers-announcements are now the
-                    // primary method of announcement on the network, and since, in the case that a node
-                    // fell back to inv we probably have a reorg which we should get the headers for first,
-                    // we now only provide a getheaders response here. When we receive the headers, we will
-                    // then ask for the blocks we need.
-                    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), inv.hash));
-                    LogPrint(BCLog::NET, "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->GetId());
-                }
-            } else {
-                pfrom->AddInventoryKnown(inv);
-                if (fBlocksOnly) {
-                    LogPrint(BCLog::NET, "transaction (%s) inv sent in violation of protocol peer=%d\n", inv.hash.ToString(), pfrom->GetId());
-                } else if (!fAlreadyHave) {
-                    pfrom->AskFor(inv);
-                }
-            }
-        }
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message inv size() = %u", vInv.size());
     }
 
-    else if (strCommand == NetMsgType::GETDATA) {
-        std::vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message getdata size() = %u", vInv.size());
-        }
-
-        LogPrint(BCLog::NET, "received getdata (%u invsz) peer=%d\n", vInv.size(), pfrom->GetId());
+    bool fBlocksOnly = !fRelayTxes;
 
-        if (vInv.size() > 0) {
-            LogPrint(BCLog::NET, "received getdata for: %s peer=%d\n", vInv[0].ToString(), pfrom->GetId());
-        }
+    // Allow whitelisted peers to send data other than blocks in blocks only mode if whitelistrelay is true
+    if (pfrom->fWhitelisted && gArgs.GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY))
+        fBlocksOnly = false;
 
-        pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
-        ProcessGetData(pfrom, chainparams.GetConsensus(), connman, interruptMsgProc);
-    }
+    LOCK(cs_main);
 
+    for (CInv& inv : vInv) {
+        if (interruptMsgProc)
+            return true;
 
-    else if (strCommand == NetMsgType::GETBLOCKTXN) {
-        BlockTransactionsRequest req;
-        vRecv >> req;
+        bool fAlreadyHave = AlreadyHave(inv);
+        LogPrint(BCLog::NET, "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->GetId());
 
-        std::shared_ptr<const CBlock> recent_block;
-        {
-            LOCK(cs_most_recent_block);
-            if (most_recent_block_hash == req.blockhash)
-                recent_block = most_recent_block;
-            // Unlock cs_most_recent_block to avoid cs_main lock inversion
-        }
-        if (recent_block) {
-            SendBlockTransactions(*recent_block, req, pfrom, connman);
-            return true;
+        if (inv.type == MSG_BLOCK) {
+            UpdateBlockAvailability(pfrom->GetId(), inv.hash);
+            if (!fAlreadyHave && !mapBlocksInFlight.count(inv.hash)) {
+                // We used to request the full block here, but since headers-announcements are now the
+                // primary method of announcement on the network, and since, in the case that a node
+                // fell back to inv we probably have a reorg which we should get the headers for first,
+                // we now only provide a getheaders response here. When we receive the headers, we will
+                // then ask for the blocks we need.
+                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), inv.hash));
+                LogPrint(BCLog::NET, "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->GetId());
+            }
+        } else {
+            pfrom->AddInventoryKnown(inv);
+            if (fBlocksOnly) {
+                LogPrint(BCLog::NET, "transaction (%s) inv sent in violation of protocol peer=%d\n", inv.hash.ToString(), pfrom->GetId());
+            } else if (!fAlreadyHave) {
+                pfrom->AskFor(inv);
+            }
         }
+    }
 
+    return true;
+}
+
+static bool ProcessGetDataMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    std::vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ) {
         LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message getdata size() = %u", vInv.size());
+    }
 
-        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
-        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
-            LogPrint(BCLog::NET, "Peer %d sent us a getblocktxn for a block we don't have", pfrom->GetId());
-            return true;
-        }
+    LogPrint(BCLog::NET, "received getdata (%u invsz) peer=%d\n", vInv.size(), pfrom->GetId());
 
-        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
-            // If an older block is requested (should never happen in practice,
-            // but can happen in tests) send a block response instead of a
-            // blocktxn response. Sending a full block response instead of a
-            // small blocktxn response is preferable in the case where a peer
-            // might maliciously send lots of getblocktxn requests to trigger
-            // expensive disk reads, because it will require the peer to
-            // actually receive all the data read from disk over the network.
-            LogPrint(BCLog::NET, "Peer %d sent us a getblocktxn for a block > %i deep", pfrom->GetId(), MAX_BLOCKTXN_DEPTH);
-            CInv inv;
-            inv.type = MSG_BLOCK;
-            inv.hash = req.blockhash;
-            pfrom->vRecvGetData.push_back(inv);
-            // The message processing loop will go around again (without pausing) and we'll respond then (without cs_main)
-            return true;
-        }
+    if (vInv.size() > 0) {
+        LogPrint(BCLog::NET, "received getdata for: %s peer=%d\n", vInv[0].ToString(), pfrom->GetId());
+    }
+
+    pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
+    ProcessGetData(pfrom, chainparams.GetConsensus(), connman, interruptMsgProc);
 
-        CBlock block;
-        bool ret = ReadBlockFromDisk(block, it->second, chainparams.GetConsensus());
-        assert(ret);
+    return true;
+}
+
+static bool ProcessGetBlockTxnMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    BlockTransactionsRequest req;
+    vRecv >> req;
 
-        SendBlockTransactions(block, req, pfrom, connman);
+    std::shared_ptr<const CBlock> recent_block;
+    {
+        LOCK(cs_most_recent_block);
+        if (most_recent_block_hash == req.blockhash)
+            recent_block = most_recent_block;
+        // Unlock cs_most_recent_block to avoid cs_main lock inversion
+    }
+    if (recent_block) {
+        SendBlockTransactions(*recent_block, req, pfrom, connman);
+        return true;
     }
 
+    LOCK(cs_main);
 
-    else if (strCommand == NetMsgType::GETBLOCKS) {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
+    BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+    if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+        LogPrint(BCLog::NET, "Peer %d sent us a getblocktxn for a block we don't have", pfrom->GetId());
+        return true;
+    }
 
-        // We might have announced the currently-being-connected tip using a
-        // compact block, which resulted in the peer sending a getblocks
-        // request, which we would otherwise respond to without the new block.
-        // To avoid this situation we simply verify that we are on our best
-        // known chain now. This is super overkill, but we handle it better
-        // for getheaders requests, and there are no known nodes which support
-        // compact blocks but still use getblocks to request blocks.
+    if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+        // If an older block is requested (should never happen in practice,
+        // but can happen in tests) send a block response instead of a
+        // blocktxn response. Sending a full block response instead of a
+        // small blocktxn response is preferable in the case where a peer
+        // might maliciously send lots of getblocktxn requests to trigger
+        // expensive disk reads, because it will require the peer to
+        // actually receive all the data read from disk over the network.
+        LogPrint(BCLog::NET, "Peer %d sent us a getblocktxn for a block > %i deep", pfrom->GetId(), MAX_BLOCKTXN_DEPTH);
+        CInv inv;
+        inv.type = MSG_BLOCK;
+        inv.hash = req.blockhash;
+        pfrom->vRecvGetData.push_back(inv);
+        // The message processing loop will go around again (without pausing) and we'll respond then (without cs_main)
+        return true;
+    }
+
+    CBlock block;
+    bool ret = ReadBlockFromDisk(block, it->second, chainparams.GetConsensus());
+    assert(ret);
+
+    SendBlockTransactions(block, req, pfrom, connman);
+
+    return true;
+}
+
+static bool ProcessGetBlocksMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
+
+    // We might have announced the currently-being-connected tip using a
+    // compact block, which resulted in the peer sending a getblocks
+    // request, which we would otherwise respond to without the new block.
+    // To avoid this situation we simply verify that we are on our best
+    // known chain now. This is super overkill, but we handle it better
+    // for getheaders requests, and there are no known nodes which support
+    // compact blocks but still use getblocks to request blocks.
+    {
+        std::shared_ptr<const CBlock> a_recent_block;
         {
-            std::shared_ptr<const CBlock> a_recent_block;
-            {
-                LOCK(cs_most_recent_block);
-                a_recent_block = most_recent_block;
-            }
-            CValidationState dummy;
-            ActivateBestChain(dummy, Params(), a_recent_block);
+            LOCK(cs_most_recent_block);
+            a_recent_block = most_recent_block;
         }
+        CValidationState dummy;
+        ActivateBestChain(dummy, Params(), a_recent_block);
+    }
 
 
-        LOCK(cs_main);
-        CNodeState* nodestate = State(pfrom->GetId());
+    LOCK(cs_main);
+    CNodeState* nodestate = State(pfrom->GetId());
+
+    // Find the last block the caller has in the main chain
+    const CBlockIndex* pindex = FindForkInGlobalIndex(chainActive, locator);
+
+    // Send the rest of the chain
+    if (pindex)
+        pindex = chainActive.Next(pindex);
+    int nLimit = 500;
+    LogPrint(BCLog::NET, "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.IsNull() ? "end" : hashStop.ToString(), nLimit, pfrom->GetId());
+    
+    std::vector<CInv> vHashes;
+    for (; pindex; pindex = chainActive.Next(pindex)) {
+        if (pindex->GetBlockHash() == hashStop) {
+            LogPrint(BCLog::NET, "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            // peercoin: tell downloading node about the latest block if it's
+            // without risk being rejected due to stake connection check
+            if (hashStop != chainActive.Tip()->GetBlockHash() && pindex->GetBlockTime() + Params().GetConsensus().nStakeMinAge > chainActive.Tip()->GetBlockTime())
+                vHashes.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+            break;
+        }
+        vHashes.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+        if (--nLimit <= 0) {
+            // When this block is requested, we'll send an inv that'll
+            // trigger the peer to getblocks the next batch of inventory.
+            LogPrint(BCLog::NET, "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            pfrom->hashContinue = pindex->GetBlockHash();
+            break;
+        }
+    }
+
+    nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
+    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vHashes));
 
-        // Find the last block the caller has in the main chain
-        const CBlockIndex* pindex = FindForkInGlobalIndex(chainActive, locator);
+    return true;
+}
 
-        // Send the rest of the chain
-        if (pindex)
-            pindex = chainActive.Next(pindex);
-        int nLimit = 500;
-        LogPrint(BCLog::NET, "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.IsNull() ? "end" : hashStop.ToString(), nLimit, pfrom->GetId());
-        
-        std::vector<CInv> vHashes;
-        for (; pindex; pindex = chainActive.Next(pindex)) {
-            if (pindex->GetBlockHash() == hashStop) {
-                LogPrint(BCLog::NET, "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                // peercoin: tell downloading node about the latest block if it's
-                // without risk being rejected due to stake connection check
-                if (hashStop != chainActive.Tip()->GetBlockHash() && pindex->GetBlockTime() + Params().GetConsensus().nStakeMinAge > chainActive.Tip()->GetBlockTime())
-                    vHashes.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                break;
-            }
-            vHashes.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
-            if (--nLimit <= 0) {
-                // When this block is requested, we'll send an inv that'll
-                // trigger the peer to getblocks the next batch of inventory.
-                LogPrint(BCLog::NET, "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                pfrom->hashContinue = pindex->GetBlockHash();
-                break;
-            }
-        }
+static bool ProcessTxMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
 
-        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
-        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vHashes));
+    // Stop processing the transaction early if
+    // We are in blocks only mode and peer is either not whitelisted or whitelistrelay is off
+    if (!fRelayTxes && (!pfrom->fWhitelisted || !gArgs.GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY))) {
+        LogPrint(BCLog::NET, "transaction sent in violation of protocol peer=%d\n", pfrom->GetId());
+        return true;
     }
 
-    else if (strCommand == NetMsgType::TX) {
-        // Stop processing the transaction early if
-        // We are in blocks only mode and peer is either not whitelisted or whitelistrelay is off
-        if (!fRelayTxes && (!pfrom->fWhitelisted || !gArgs.GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY))) {
-            LogPrint(BCLog::NET, "transaction sent in violation of protocol peer=%d\n", pfrom->GetId());
-            return true;
-        }
+    std::deque<COutPoint> vWorkQueue;
+    std::vector<uint256> vEraseQueue;
+    CTransactionRef ptx;
+    vRecv >> ptx;
+    const CTransaction& tx = *ptx;
 
-        std::deque<COutPoint> vWorkQueue;
-        std::vector<uint256> vEraseQueue;
-        CTransactionRef ptx;
-        vRecv >> ptx;
-        const CTransaction& tx = *ptx;
+    CInv inv(MSG_TX, tx.GetHash());
+    pfrom->AddInventoryKnown(inv);
 
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
+    LOCK2(cs_main, g_cs_orphans);
 
-        LOCK2(cs_main, g_cs_orphans);
+    bool fMissingInputs = false;
+    CValidationState state;
 
-        bool fMissingInputs = false;
-        CValidationState state;
+    pfrom->setAskFor.erase(inv.hash);
+    mapAlreadyAskedFor.erase(inv.hash);
 
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv.hash);
+    std::list<CTransactionRef> lRemovedTxn;
 
-        std::list<CTransactionRef> lRemovedTxn;
+    if (!AlreadyHave(inv) &&
+        AcceptToMemoryPool(mempool, state, ptx, &fMissingInputs, false /* bypass_limits */)) {
+        mempool.check(pcoinsTip.get());
+        RelayTransaction(tx, connman);
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            vWorkQueue.emplace_back(inv.hash, i);
+        }
 
-        if (!AlreadyHave(inv) &&
-            AcceptToMemoryPool(mempool, state, ptx, &fMissingInputs, false /* bypass_limits */)) {
-            mempool.check(pcoinsTip.get());
-            RelayTransaction(tx, connman);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                vWorkQueue.emplace_back(inv.hash, i);
-            }
+        pfrom->nLastTXTime = GetTime();
 
-            pfrom->nLastTXTime = GetTime();
+        LogPrint(BCLog::MEMPOOL, "AcceptToMemoryPool: peer=%d: accepted %s (poolsz %u txn, %u kB)\n",
+            pfrom->GetId(),
+            tx.GetHash().ToString(),
+            mempool.size(), mempool.DynamicMemoryUsage() / 1000);
+
+        // Recursively process any orphan transactions that depended on this one
+        std::set<NodeId> setMisbehaving;
+        while (!vWorkQueue.empty()) {
+            auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
+            vWorkQueue.pop_front();
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (auto mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi) {
+                const CTransactionRef& porphanTx = (*mi)->second.tx;
+                const CTransaction& orphanTx = *porphanTx;
+                const uint256& orphanHash = orphanTx.GetHash();
+                NodeId fromPeer = (*mi)->second.fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
 
-            LogPrint(BCLog::MEMPOOL, "AcceptToMemoryPool: peer=%d: accepted %s (poolsz %u txn, %u kB)\n",
-                pfrom->GetId(),
-                tx.GetHash().ToString(),
-                mempool.size(), mempool.DynamicMemoryUsage() / 1000);
 
-            // Recursively process any orphan transactions that depended on this one
-            std::set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
+                if (setMisbehaving.count(fromPeer))
                     continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi) {
-                    const CTransactionRef& porphanTx = (*mi)->second.tx;
-                    const CTransaction& orphanTx = *porphanTx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, &fMissingInputs2, false /* bypass_limits */)) {
-                        LogPrint(BCLog::MEMPOOL, "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx, connman);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
-                        }
-                        vEraseQueue.push_back(orphanHash);
-                    } else if (!fMissingInputs2) {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint(BCLog::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee
-                        LogPrint(BCLog::MEMPOOL, "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        if (!stateDummy.CorruptionPossible()) {
-                            assert(recentRejects);
-                            recentRejects->insert(orphanHash);
-                        }
+                if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, &fMissingInputs2, false /* bypass_limits */)) {
+                    LogPrint(BCLog::MEMPOOL, "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx, connman);
+                    for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
+                        vWorkQueue.emplace_back(orphanHash, i);
+                    }
+                    vEraseQueue.push_back(orphanHash);
+                } else if (!fMissingInputs2) {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0) {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint(BCLog::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee
+                    LogPrint(BCLog::MEMPOOL, "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
+                    if (!stateDummy.CorruptionPossible()) {
+                        assert(recentRejects);
+                        recentRejects->insert(orphanHash);
                     }
-                    mempool.check(pcoinsTip.get());
                 }
+                mempool.check(pcoinsTip.get());
             }
+        }
 
-            for (uint256 hash : vEraseQueue)
-                EraseOrphanTx(hash);
-        } else if (fMissingInputs) {
-            bool fRejectedParents = false; // It may be the case that the orphans parents have all been rejected
+        for (uint256 hash : vEraseQueue)
+            EraseOrphanTx(hash);
+    } else if (fMissingInputs) {
+        bool fRejectedParents = false; // It may be the case that the orphans parents have all been rejected
+        for (const CTxIn& txin : tx.vin) {
+            if (recentRejects->contains(txin.prevout.hash)) {
+                fRejectedParents = true;
+                break;
+            }
+        }
+        if (!fRejectedParents) {
             for (const CTxIn& txin : tx.vin) {
-                if (recentRejects->contains(txin.prevout.hash)) {
-                    fRejectedParents = true;
-                    break;
-                }
+                CInv _inv(MSG_TX, txin.prevout.hash);
+                pfrom->AddInventoryKnown(_inv);
+                if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
             }
-            if (!fRejectedParents) {
-                for (const CTxIn& txin : tx.vin) {
-                    CInv _inv(MSG_TX, txin.prevout.hash);
-                    pfrom->AddInventoryKnown(_inv);
-                    if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
-                }
-                AddOrphanTx(ptx, pfrom->GetId());
+            AddOrphanTx(ptx, pfrom->GetId());
 
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-                unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, gArgs.GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-                if (nEvicted > 0) {
-                    LogPrint(BCLog::MEMPOOL, "mapOrphan overflow, removed %u tx\n", nEvicted);
-                }
-            } else {
-                LogPrint(BCLog::MEMPOOL, "not keeping orphan with rejected parents %s\n", tx.GetHash().ToString());
-                // We will continue to reject this tx since it has rejected
-                // parents so avoid re-requesting it from other peers.
-                recentRejects->insert(tx.GetHash());
+            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, gArgs.GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            if (nEvicted > 0) {
+                LogPrint(BCLog::MEMPOOL, "mapOrphan overflow, removed %u tx\n", nEvicted);
             }
         } else {
-            if (!state.CorruptionPossible()) {
-                assert(recentRejects);
-                recentRejects->insert(tx.GetHash());
+            LogPrint(BCLog::MEMPOOL, "not keeping orphan with rejected parents %s\n", tx.GetHash().ToString());
+            // We will continue to reject this tx since it has rejected
+            // parents so avoid re-requesting it from other peers.
+            recentRejects->insert(tx.GetHash());
+        }
+    } else {
+        if (!state.CorruptionPossible()) {
+            assert(recentRejects);
+            recentRejects->insert(tx.GetHash());
+            if (RecursiveDynamicUsage(*ptx) < 100000) {
+                AddToCompactExtraTransactions(ptx);
             }
+        }
 
-            if (pfrom->fWhitelisted && gArgs.GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->GetId());
-                    RelayTransaction(tx, connman);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->GetId(), FormatStateMessage(state));
-                }
+        if (pfrom->fWhitelisted && gArgs.GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->GetId());
+                RelayTransaction(tx, connman);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->GetId(), FormatStateMessage(state));
             }
         }
+    }
 
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS)) {
-            LogPrint(BCLog::MEMPOOLREJ, "%s from peer=%d was not accepted: %s\n", tx.GetHash().ToString(),
-                pfrom->GetId(),
-                FormatStateMessage(state));
-            if (state.GetRejectCode() > 0 && state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
-                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
-                                                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash));
-            if (nDoS > 0) {
-                Misbehaving(pfrom->GetId(), nDoS);
-            }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS)) {
+        LogPrint(BCLog::MEMPOOLREJ, "%s from peer=%d was not accepted: %s\n", tx.GetHash().ToString(),
+            pfrom->GetId(),
+            FormatStateMessage(state));
+        if (state.GetRejectCode() > 0 && state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
+            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
+                                            state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash));
+        if (nDoS > 0) {
+            Misbehaving(pfrom->GetId(), nDoS);
         }
     }
 
-    else if (strCommand == NetMsgType::BLOCKTXN && !fImporting && !fReindex) // Ignore blocks received while importing
+    return true;
+}
+
+/**
+ * Hand a block received from pfrom to validation. Blocks wait in mapBlocksWait
+ * until their previous block has been accepted, so that proof-of-stake blocks
+ * are checked against the chain they build on. fCompact marks a block
+ * reconstructed from a cmpctblock. It is only processed as requested if we
+ * picked pfrom as a high-bandwidth peer, or if fRequested says we asked pfrom
+ * for it; callers that already cleared the in-flight state must pass that
+ * explicitly, as mapBlocksInFlight no longer knows. BIP 152 lets peers relay those before
+ * full validation, so the sender of an invalid one is not punished; but only
+ * for proof-of-work blocks, whose header already cost its work. A
+ * proof-of-stake header is free to make, so it is punished as usual.
+ */
+static bool ProcessReceivedBlock(CNode* pfrom, const std::shared_ptr<CBlock>& pblock2, const CChainParams& chainparams, bool fCompact, bool fRequested)
+{
+    int64_t nTimeNow = GetSystemTimeInSeconds();
+
     {
-        BlockTransactions resp;
-        vRecv >> resp;
+        const uint256 hash2(pblock2->GetHash());
+        LOCK(cs_main);
+        const bool fForce = fRequested || (fCompact && IsPeerAnnouncingHeaderAndIDs(pfrom->GetId()));
+        const bool fExpected = fForce || mapBlocksInFlight.count(hash2);
+
+        BlockMap::iterator miPrev = mapBlockIndex.find(pblock2->hashPrevBlock);
+        if (miPrev == mapBlockIndex.end()) {
+            return error("previous header not found");
+        }
+
+        if (!fExpected) {
+            if (!miPrev->second->IsValid(BLOCK_VALID_TRANSACTIONS)) {
+                MarkBlockAsReceived(hash2);
+                return error("this block does not connect to any valid known blocks");
+            }
+        }
+        // peercoin: store in memory until we can connect it to some chain
+        WaitElement we;
+        we.pblock = pblock2;
+        we.time = nTimeNow;
+        we.fCompact = fCompact;
+        we.fForce = fForce;
+        mapBlocksWait[miPrev->second] = we;
+    }
+
+    static CBlockIndex* pindexLastAccepted = nullptr;
+    if (pindexLastAccepted == nullptr)
+        pindexLastAccepted = chainActive.Tip();
+    bool fContinue = true;
+
+    // peercoin: accept as many blocks as we possibly can from mapBlocksWait
+    while (fContinue) {
+        fContinue = false;
+        bool fSelected = false;
+        bool forceProcessing = false;
+        bool fBlockCompact = false;
+        bool fBlockForce = false;
+        CBlockIndex* pindexPrev;
+        std::shared_ptr<CBlock> pblock;
 
-        std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-        bool fBlockRead = false;
         {
             LOCK(cs_main);
+            // peercoin: try to select next block in a constant time
+            std::map<CBlockIndex*, WaitElement>::iterator it = mapBlocksWait.find(pindexLastAccepted);
+            if (it != mapBlocksWait.end() && pindexLastAccepted != nullptr) {
+                pindexPrev = it->first;
+                pblock = it->second.pblock;
+                fBlockCompact = it->second.fCompact;
+                fBlockForce = it->second.fForce;
+                mapBlocksWait.erase(pindexPrev);
+                fContinue = true;
+                fSelected = true;
+            } else
+                // otherwise: try to scan for it
+                for (auto& pair : mapBlocksWait) {
+                    pindexPrev = pair.first;
+                    pblock = pair.second.pblock;
+                    const uint256 hash(pblock->GetHash());
+                    // remove blocks that were not connected in 60 seconds
+                    if (nTimeNow > pair.second.time + 60) {
+                        mapBlocksWait.erase(pindexPrev);
+                        fContinue = true;
+                        MarkBlockAsReceived(hash);
+                        break;
+                    }
+                    if (!pindexPrev->IsValid(BLOCK_VALID_TRANSACTIONS)) {
+                        if (pindexPrev->nStatus & BLOCK_FAILED_MASK) {
+                            mapBlocksWait.erase(pindexPrev); // prev block was rejected
+                            fContinue = true;
+                            MarkBlockAsReceived(hash);
+                            break;
+                        }
+                        continue; // prev block was not (yet) accepted on disk, skip to next one
+                    }
 
-            std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator>>::iterator it = mapBlocksInFlight.find(resp.blockhash);
-            if (it == mapBlocksInFlight.end() ||
-                it->second.first != pfrom->GetId()) {
-                LogPrint(BCLog::NET, "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->GetId());
-                return true;
-            }
-            *pblock = CBlock((*it->second.second).pindex->GetBlockHeader());
+                    fBlockCompact = pair.second.fCompact;
+                    fBlockForce = pair.second.fForce;
+                    mapBlocksWait.erase(pindexPrev);
+                    fContinue = true;
+                    fSelected = true;
+                    break;
+                }
+            if (!fSelected)
+                continue;
 
-            ReadStatus status = FillBlock(*pblock, resp.txn);
-            if (status == READ_STATUS_INVALID) {
-                MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
-                Misbehaving(pfrom->GetId(), 100);
-                LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->GetId());
-                return true;
-            } else if (status == READ_STATUS_FAILED) {
-                // Might have collided, fall back to getdata now :(
-                std::vector<CInv> invs;
-                invs.push_back(CInv(MSG_BLOCK, resp.blockhash));
-                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETDATA, invs));
-            } else {
-                // Block is either okay, or possibly we received
-                // READ_STATUS_CHECKBLOCK_FAILED.
-                // Note that CheckBlock can only fail for one of a few reasons:
-                // 1. bad-proof-of-work (impossible here, because we've already
-                //    accepted the header)
-                // 2. merkleroot doesn't match the transactions given (already
-                //    caught in FillBlock with READ_STATUS_FAILED, so
-                //    impossible here)
-                // 3. the block is otherwise invalid (eg invalid coinbase,
-                //    block is too big, too many legacy sigops, etc).
-                // So if CheckBlock failed, #3 is the only possibility.
-                // Under BIP 152, we don't DoS-ban unless proof of work is
-                // invalid (we don't require all the stateless checks to have
-                // been run).  This is handled below, so just treat this as
-                // though the block was successfully read, and rely on the
-                // handling in ProcessNewBlock to ensure the block index is
-                // updated, reject messages go out, etc.
-                MarkBlockAsReceived(resp.blockhash); // it is now an empty pointer
-                fBlockRead = true;
-                // mapBlockSource is only used for sending reject messages and DoS scores,
-                // so the race between here and cs_main in ProcessNewBlock is fine.
-                // BIP 152 permits peers to relay compact blocks after validating
-                // the header only; we should not punish peers if the block turns
-                // out to be invalid.
-                mapBlockSource.emplace(resp.blockhash, std::make_pair(pfrom->GetId(), false));
-            }
-        } // Don't hold cs_main when we call into ProcessNewBlock
-        if (fBlockRead) {
-            bool fNewBlock = false;
-            // Since we requested this block (it was in mapBlocksInFlight), force it to be processed,
-            // even if it would not be a candidate for new tip (missing previous block, chain not long enough, etc)
-            // This bypasses some anti-DoS logic in AcceptBlock (eg to prevent
-            // disk-space attacks), but this should be safe due to the
-            // protections in the compact block handler -- see related comment
-            // in compact block optimistic reconstruction handling.
-            //ProcessNewBlock(chainparams, pblock, pfrom->GetRecvVersion() <= OLD_VERSION, /*fForceProcessing=*/true, &fNewBlock);
-            pblock->MakeFlags();
-            ProcessNewBlock(chainparams, pblock, pfrom->nVersion <= OLD_VERSION, /*fForceProcessing=*/true, &fNewBlock);
-            if (fNewBlock) {
-                pfrom->nLastBlockTime = GetTime();
-            } else {
-                LOCK(cs_main);
-                mapBlockSource.erase(pblock->GetHash());
-            }
+            const uint256 hash(pblock->GetHash());
+
+            // Also always process if we requested the block explicitly, as we may
+            // need it even though it is not a candidate for a new best tip.
+            // The in-flight state of reconstructed blocks is cleared by the
+            // compact block handlers.
+            if (fBlockCompact)
+                forceProcessing = fBlockForce;
+            else
+                forceProcessing |= MarkBlockAsReceived(hash);
+            // mapBlockSource is only used for sending reject messages and DoS scores,
+            // so the race between here and cs_main in ProcessNewBlock is fine.
+            mapBlockSource.emplace(hash, std::make_pair(pfrom->GetId(), !fBlockCompact || pblock->IsProofOfStake()));
+        } // LOCK(cs_main);
+
+        bool fNewBlock = false;
+        bool fOldClient = pfrom->nVersion.load() <= OLD_VERSION;
+        bool fPoSDuplicate = false;
+
+        pblock->MakeFlags();
+        ProcessNewBlock(chainparams, pblock, fOldClient, forceProcessing, &fNewBlock, &pindexLastAccepted, &fPoSDuplicate);
+
+        if (fNewBlock) {
+            pfrom->nLastBlockTime = GetTime();
+        } else {
+            LOCK(cs_main);
+            mapBlockSource.erase(pblock->GetHash());
         }
     }
 
+    return true;
+}
 
-    else if (strCommand == NetMsgType::GETHEADERS) {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
+/**
+ * Complete a compact block download with the transactions the peer sent in
+ * resp, which is empty if everything was found in our mempool.
+ */
+static bool ProcessBlockTransactions(CNode* pfrom, const BlockTransactions& resp, const CChainParams& chainparams, CConnman* connman)
+{
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
 
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    bool fBlockRead = false;
+    bool fRequested = false;
+    {
         LOCK(cs_main);
-        if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
-            LogPrint(BCLog::NET, "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->GetId());
+
+        std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator>>::iterator it = mapBlocksInFlight.find(resp.blockhash);
+        if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+            it->second.first != pfrom->GetId()) {
+            LogPrint(BCLog::NET, "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->GetId());
             return true;
         }
 
-        CNodeState* nodestate = State(pfrom->GetId());
-        const CBlockIndex* pindex = nullptr;
-        if (locator.IsNull()) {
-            // If locator is null, return the hashStop block
-            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
-                return true;
-            pindex = (*mi).second;
-
-            if (!BlockRequestAllowed(pindex, chainparams.GetConsensus())) {
-                LogPrint(BCLog::NET, "%s: ignoring request from peer=%i for old block header that isn't in the main chain\n", __func__, pfrom->GetId());
-                return true;
-            }
+        PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
+        ReadStatus status = partialBlock.FillBlock(*pblock, resp.txn);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->GetId());
+            return true;
+        } else if (status == READ_STATUS_FAILED) {
+            // Might have collided, fall back to getdata now :(
+            std::vector<CInv> invs;
+            invs.push_back(CInv(MSG_BLOCK, resp.blockhash));
+            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETDATA, invs));
         } else {
-            // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
-            if (pindex)
-                pindex = chainActive.Next(pindex);
-        }
-
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        std::vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
-        LogPrint(BCLog::NET, "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.IsNull() ? "end" : hashStop.ToString(), pfrom->GetId());
-        for (; pindex; pindex = chainActive.Next(pindex)) {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
-        }
-        // pindex can be nullptr either if we sent chainActive.Tip() OR
-        // if our peer has chainActive.Tip() (and thus we are sending an empty
-        // headers message). In both cases it's safe to update
-        // pindexBestHeaderSent to be our tip.
-        //
-        // It is important that we simply reset the BestHeaderSent value here,
-        // and not max(BestHeaderSent, newHeaderSent). We might have announced
-        // the currently-being-connected tip using a compact block, which
-        // resulted in the peer sending a headers request, which we respond to
-        // without the new block. By resetting the BestHeaderSent, we ensure we
-        // will re-announce the new block via headers (or compact blocks again)
-        // in the SendMessages logic.
-        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
-        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::HEADERS, vHeaders));
-    }
-
-    else if (strCommand == NetMsgType::HEADERS && !fImporting && !fReindex) // Ignore headers received while importing
-    {
-        std::vector<CBlockHeader> headers;
+            // Block is either okay, or possibly we received
+            // READ_STATUS_CHECKBLOCK_FAILED.
+            // Note that CheckBlock can only fail for one of a few reasons:
+            // 1. bad-proof-of-work (impossible here, because we've already
+            //    accepted the header)
+            // 2. merkleroot doesn't match the transactions given (already
+            //    caught in FillBlock with READ_STATUS_FAILED, so
+            //    impossible here)
+            // 3. the block is otherwise invalid (eg invalid coinbase,
+            //    block is too big, too many legacy sigops, bad block
+            //    signature, etc).
+            // So if CheckBlock failed, #3 is the only possibility.
+            // Under BIP 152, we don't DoS-ban unless proof of work is
+            // invalid (we don't require all the stateless checks to have
+            // been run); proof-of-stake blocks are punished regardless, see
+            // ProcessReceivedBlock. So just treat this as though the block
+            // was successfully read, and rely on the handling in
+            // ProcessNewBlock to ensure the block index is updated, reject
+            // messages go out, etc.
+            // We asked pfrom for this block (checked above); remember that
+            // before the in-flight entry goes away.
+            fRequested = it->second.first == pfrom->GetId();
+            MarkBlockAsReceived(resp.blockhash); // it is now an empty pointer
+            fBlockRead = true;
+        }
+    } // Don't hold cs_main when we call into ProcessNewBlock
+    if (fBlockRead) {
+        // Blocks we requested from pfrom, and blocks from our high-bandwidth
+        // peers, are forced to be processed, even if they would not be a
+        // candidate for new tip (missing previous block, chain not long
+        // enough, etc). This bypasses some anti-DoS logic in AcceptBlock (eg
+        // to prevent disk-space attacks), which is why it is limited to
+        // blocks we asked for and peers we picked.
+        return ProcessReceivedBlock(pfrom, pblock, chainparams, /*fCompact=*/true, fRequested);
+    }
 
-        // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
-        unsigned int nCount = ReadCompactSize(vRecv);
-        if (nCount > MAX_HEADERS_RESULTS) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("headers message size = %u", nCount);
-        }
-        headers.resize(nCount);
-        {
-            LOCK(cs_main);
-            for (unsigned int n = 0; n < nCount; n++) {
-                vRecv >> headers[n];
-                ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
-                ReadCompactSize(vRecv); // needed for vchBlockSig.}
-            }
-        }
+    return true;
+}
+
+static bool ProcessBlockTxnMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
+
+    BlockTransactions resp;
+    vRecv >> resp;
+
+    return ProcessBlockTransactions(pfrom, resp, chainparams, connman);
+}
 
-        // Headers received via a HEADERS message should be valid, and reflect
-        // the chain the peer is on. If we receive a known-invalid header,
-        // disconnect the peer if it is using one of our outbound connection
-        // slots.
-        bool should_punish = !pfrom->fInbound && !pfrom->m_manual_connection;
-        return ProcessHeadersMessage(pfrom, connman, headers, chainparams, should_punish);
+static bool ProcessCmpctBlockMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    // Ignore cmpctblock received while importing
+    if (fImporting || fReindex) {
+        LogPrint(BCLog::NET, "Unexpected cmpctblock message received from peer %d\n", pfrom->GetId());
+        return true;
     }
 
-    else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
-    {
-        std::shared_ptr<CBlock> pblock2 = std::make_shared<CBlock>();
-        vRecv >> *pblock2; pblock2->MakeFlags();
-        int64_t nTimeNow = GetSystemTimeInSeconds();
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
 
-        LogPrint(BCLog::NET, "received block %s peer=%d\n", pblock2->GetHash().ToString(), pfrom->GetId());
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    vRecv >> cmpctblock;
 
-        {
-            const uint256 hash2(pblock2->GetHash());
-            LOCK(cs_main);
-            bool fRequested = mapBlocksInFlight.count(hash2);
+    const uint256 hashBlock(cmpctblock.header.GetHash());
+    bool received_new_header = false;
 
-            BlockMap::iterator miPrev = mapBlockIndex.find(pblock2->hashPrevBlock);
-            if (miPrev == mapBlockIndex.end()) {
-                return error("previous header not found");
-            }
+    {
+        LOCK(cs_main);
 
-            if (!fRequested) {
-                if (!miPrev->second->IsValid(BLOCK_VALID_TRANSACTIONS)) {
-                    MarkBlockAsReceived(hash2);
-                    return error("this block does not connect to any valid known blocks");
-                }
-            }
-            // peercoin: store in memory until we can connect it to some chain
-            WaitElement we;
-            we.pblock = pblock2;
-            we.time = nTimeNow;
-            mapBlocksWait[miPrev->second] = we;
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+            if (!IsInitialBlockDownload())
+                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256()));
+            return true;
         }
 
-        static CBlockIndex* pindexLastAccepted = nullptr;
-        if (pindexLastAccepted == nullptr)
-            pindexLastAccepted = chainActive.Tip();
-        bool fContinue = true;
-
-        // peercoin: accept as many blocks as we possibly can from mapBlocksWait
-        while (fContinue) {
-            fContinue = false;
-            bool fSelected = false;
-            bool forceProcessing = false;
-            CBlockIndex* pindexPrev;
-            std::shared_ptr<CBlock> pblock;
+        if (mapBlockIndex.find(hashBlock) == mapBlockIndex.end()) {
+            received_new_header = true;
+        }
+    }
 
-            {
+    const CBlockIndex* pindex = nullptr;
+    CValidationState state;
+    const std::vector<uint256> vHashes{hashBlock};
+    if (!ProcessNewBlockHeaders(pfrom->lastAcceptedHeader, {cmpctblock.header}, pfrom->nVersion <= OLD_VERSION, state, chainparams, &pindex, nullptr, &vHashes)) {
+        int nDoS;
+        if (state.IsInvalid(nDoS)) {
+            if (nDoS > 0) {
                 LOCK(cs_main);
-                // peercoin: try to select next block in a constant time
-                std::map<CBlockIndex*, WaitElement>::iterator it = mapBlocksWait.find(pindexLastAccepted);
-                if (it != mapBlocksWait.end() && pindexLastAccepted != nullptr) {
-                    pindexPrev = it->first;
-                    pblock = it->second.pblock;
-                    mapBlocksWait.erase(pindexPrev);
-                    fContinue = true;
-                    fSelected = true;
-                } else
-                    // otherwise: try to scan for it
-                    for (auto& pair : mapBlocksWait) {
-                        pindexPrev = pair.first;
-                        pblock = pair.second.pblock;
-                        const uint256 hash(pblock->GetHash());
-                        // remove blocks that were not connected in 60 seconds
-                        if (nTimeNow > pair.second.time + 60) {
-                            mapBlocksWait.erase(pindexPrev);
-                            fContinue = true;
-                            MarkBlockAsReceived(hash);
-                            break;
-                        }
-                        if (!pindexPrev->IsValid(BLOCK_VALID_TRANSACTIONS)) {
-                            if (pindexPrev->nStatus & BLOCK_FAILED_MASK) {
-                                mapBlocksWait.erase(pindexPrev); // prev block was rejected
-                                fContinue = true;
-                                MarkBlockAsReceived(hash);
-                                break;
-                            }
-                            continue; // prev block was not (yet) accepted on disk, skip to next one
-                        }
+                Misbehaving(pfrom->GetId(), nDoS);
+            }
+            LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->GetId());
+            return true;
+        }
+    }
 
-                        mapBlocksWait.erase(pindexPrev);
-                        fContinue = true;
-                        fSelected = true;
-                        break;
-                    }
-                if (!fSelected)
-                    continue;
+    // When everything was found in our mempool, the block is completed the
+    // same way as after a blocktxn, with an empty set of transactions.
+    bool fProcessBLOCKTXN = false;
+    BlockTransactions blockTxn;
 
-                const uint256 hash(pblock->GetHash());
+    // If we end up treating this as a plain headers message, call that as well
+    // without cs_main.
+    bool fRevertToHeaderProcessing = false;
 
-                // Also always process if we requested the block explicitly, as we may
-                // need it even though it is not a candidate for a new best tip.
-                forceProcessing |= MarkBlockAsReceived(hash);
-                // mapBlockSource is only used for sending reject messages and DoS scores,
-                // so the race between here and cs_main in ProcessNewBlock is fine.
-                mapBlockSource.emplace(hash, std::make_pair(pfrom->GetId(), true));
-            } // LOCK(cs_main);
+    // Keep a CBlock for "optimistic" compactblock reconstructions (see
+    // below)
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    bool fBlockReconstructed = false;
 
-            bool fNewBlock = false;
-            bool fOldClient = pfrom->nVersion.load() <= OLD_VERSION;
-            bool fPoSDuplicate = false;
+    {
+        LOCK2(cs_main, g_cs_orphans);
+        // If AcceptBlockHeader returned true, it set pindex
+        assert(pindex);
+        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
 
-            pblock->MakeFlags();
-            ProcessNewBlock(chainparams, pblock, fOldClient, forceProcessing, &fNewBlock, &pindexLastAccepted, &fPoSDuplicate);
+        CNodeState* nodestate = State(pfrom->GetId());
 
-            if (fNewBlock) {
-                pfrom->nLastBlockTime = GetTime();
-            } else {
-                LOCK(cs_main);
-                mapBlockSource.erase(pblock->GetHash());
-            }
+        // If this was a new header with more work than our tip, update the
+        // peer's last block announcement time
+        if (received_new_header && pindex->nChainTrust > chainActive.Tip()->nChainTrust) {
+            nodestate->m_last_block_announcement = GetTime();
         }
-    }
 
-    else if (strCommand == NetMsgType::GETADDR) {
-        // This asymmetric behavior for inbound and outbound connections was introduced
-        // to prevent a fingerprinting attack: an attacker can send specific fake addresses
-        // to users' AddrMan and later request them by sending getaddr messages.
-        // Making nodes which are behind NAT and can only make outgoing connections ignore
-        // the getaddr message mitigates the attack.
-        if (!pfrom->fInbound) {
-            LogPrint(BCLog::NET, "Ignoring \"getaddr\" from outbound connection. peer=%d\n", pfrom->GetId());
+        std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator>>::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+        bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
             return true;
-        }
 
-        // Only send one GetAddr response per connection to reduce resource waste
-        //  and discourage addr stamping of INV announcements.
-        if (pfrom->fSentAddr) {
-            LogPrint(BCLog::NET, "Ignoring repeated \"getaddr\". peer=%d\n", pfrom->GetId());
+        if (pindex->nChainTrust <= chainActive.Tip()->nChainTrust || // We know something better
+            pindex->nTx != 0) {                                      // We had this block at some point, but pruned it
+            if (fAlreadyInFlight) {
+                // We requested this block for some reason, but our mempool will probably be useless
+                // so we just grab the block via normal getdata
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(MSG_BLOCK, hashBlock);
+                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETDATA, vInv));
+            }
             return true;
         }
-        pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
-        std::vector<CAddress> vAddr = connman->GetAddresses();
-        FastRandomContext insecure_rand;
-        for (const CAddress& addr : vAddr)
-            pfrom->PushAddress(addr, insecure_rand);
+        // If we're not close to tip yet, give up and let parallel block fetch work its magic
+        if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+            return true;
+
+        // We want to be a bit conservative just to be extra careful about DoS
+        // possibilities in compact block processing...
+        if (pindex->nHeight <= chainActive.Height() + 2) {
+            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+                (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
+                std::list<QueuedBlock>::iterator* queuedBlockIt = nullptr;
+                if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), pindex, &queuedBlockIt)) {
+                    if (!(*queuedBlockIt)->partialBlock)
+                        (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                    else {
+                        // The block was already in flight using compact blocks from the same peer
+                        LogPrint(BCLog::NET, "Peer sent us compact block we were already syncing!\n");
+                        return true;
+                    }
+                }
+
+                PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+                ReadStatus status = partialBlock.InitData(cmpctblock, vExtraTxnForCompact);
+                if (status == READ_STATUS_INVALID) {
+                    MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+                    Misbehaving(pfrom->GetId(), 100);
+                    LogPrintf("Peer %d sent us invalid compact block\n", pfrom->GetId());
+                    return true;
+                } else if (status == READ_STATUS_FAILED) {
+                    // Duplicate txindexes, the block is now in-flight, so just request it
+                    std::vector<CInv> vInv(1);
+                    vInv[0] = CInv(MSG_BLOCK, hashBlock);
+                    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETDATA, vInv));
+                    return true;
+                }
+
+                BlockTransactionsRequest req;
+                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                    if (!partialBlock.IsTxAvailable(i))
+                        req.indexes.push_back(i);
+                }
+                if (req.indexes.empty()) {
+                    blockTxn.blockhash = hashBlock;
+                    fProcessBLOCKTXN = true;
+                } else {
+                    req.blockhash = pindex->GetBlockHash();
+                    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETBLOCKTXN, req));
+                }
+            } else {
+                // This block is either already in flight from a different
+                // peer, or this peer has too many blocks outstanding to
+                // download from.
+                // Optimistically try to reconstruct anyway since we might be
+                // able to without any round trips.
+                PartiallyDownloadedBlock tempBlock(&mempool);
+                ReadStatus status = tempBlock.InitData(cmpctblock, vExtraTxnForCompact);
+                if (status == READ_STATUS_INVALID) {
+                    Misbehaving(pfrom->GetId(), 100);
+                    LogPrintf("Peer %d sent us invalid compact block\n", pfrom->GetId());
+                    return true;
+                } else if (status != READ_STATUS_OK) {
+                    // The block is on its way from elsewhere anyway
+                    return true;
+                }
+                std::vector<CTransactionRef> dummy;
+                status = tempBlock.FillBlock(*pblock, dummy);
+                if (status == READ_STATUS_OK) {
+                    fBlockReconstructed = true;
+                }
+            }
+        } else {
+            if (fAlreadyInFlight) {
+                // We requested this block, but its far into the future, so our
+                // mempool will probably be useless - request the block normally
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(MSG_BLOCK, hashBlock);
+                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETDATA, vInv));
+                return true;
+            } else {
+                // If this was an announce-cmpctblock, we want the same treatment as a header message
+                fRevertToHeaderProcessing = true;
+            }
+        }
+    } // cs_main
+
+    if (fProcessBLOCKTXN)
+        return ProcessBlockTransactions(pfrom, blockTxn, chainparams, connman);
+
+    if (fRevertToHeaderProcessing) {
+        // Headers received from HB compact block peers are permitted to be
+        // relayed before full validation (see BIP 152), so we don't want to disconnect
+        // the peer if a proof-of-work header turns out to be for an invalid block.
+        // Proof-of-stake headers cost nothing to make and get no such leniency.
+        // Note that if a peer tries to build on an invalid chain, that
+        // will be detected and the peer will be banned.
+        const bool fPoS = cmpctblock.header.nFlags & CBlockIndex::BLOCK_PROOF_OF_STAKE;
+        return ProcessHeadersMessage(pfrom, connman, {cmpctblock.header}, chainparams, /*punish_duplicate_invalid=*/fPoS);
+    }
+
+    if (fBlockReconstructed) {
+        // If we got here, we were able to optimistically reconstruct a
+        // block that is in flight from some other peer.
+        // If we picked this peer as a high-bandwidth one, it is treated as
+        // requested, which bypasses some of our anti-DoS protections in
+        // AcceptBlock that filter unrequested blocks that might be trying to
+        // waste our resources (eg disk space). Because we only try to
+        // reconstruct blocks when we're close to caught up (via the
+        // CanDirectFetch() requirement above, combined with the behavior of
+        // not requesting blocks until we have a chain with at least
+        // nMinimumChainWork), and we ignore compact blocks with less work
+        // than our tip, that is safe for peers we chose ourselves.
+        ProcessReceivedBlock(pfrom, pblock, chainparams, /*fCompact=*/true, /*fRequested=*/false);
+
+        LOCK(cs_main); // hold cs_main for CBlockIndex::IsValid()
+        if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS)) {
+            // Clear download state for this block, which is in
+            // process from some other peer.  We do this after calling
+            // ProcessNewBlock so that a malleated cmpctblock announcement
+            // can't be used to interfere with block relay.
+            MarkBlockAsReceived(pblock->GetHash());
+        }
     }
 
+    return true;
+}
+static bool ProcessGetHeadersMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
 
-    else if (strCommand == NetMsgType::MEMPOOL) {
-        if (!(pfrom->GetLocalServices() & NODE_BLOOM) && !pfrom->fWhitelisted) {
-            LogPrint(BCLog::NET, "mempool request with bloom filters disabled, disconnect peer=%d\n", pfrom->GetId());
-            pfrom->fDisconnect = true;
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
+
+    LOCK(cs_main);
+    if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
+        LogPrint(BCLog::NET, "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->GetId());
+        return true;
+    }
+
+    CNodeState* nodestate = State(pfrom->GetId());
+    const CBlockIndex* pindex = nullptr;
+    if (locator.IsNull()) {
+        // If locator is null, return the hashStop block
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+        if (mi == mapBlockIndex.end())
             return true;
-        }
+        pindex = (*mi).second;
 
-        if (connman->OutboundTargetReached(false) && !pfrom->fWhitelisted) {
-            LogPrint(BCLog::NET, "mempool request with bandwidth limit reached, disconnect peer=%d\n", pfrom->GetId());
-            pfrom->fDisconnect = true;
+        if (!BlockRequestAllowed(pindex, chainparams.GetConsensus())) {
+            LogPrint(BCLog::NET, "%s: ignoring request from peer=%i for old block header that isn't in the main chain\n", __func__, pfrom->GetId());
             return true;
         }
+    } else {
+        // Find the last block the caller has in the main chain
+        pindex = FindForkInGlobalIndex(chainActive, locator);
+        if (pindex)
+            pindex = chainActive.Next(pindex);
+    }
 
-        LOCK(pfrom->cs_inventory);
-        pfrom->fSendMempool = true;
+    // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
+    std::vector<CBlock> vHeaders;
+    int nLimit = MAX_HEADERS_RESULTS;
+    LogPrint(BCLog::NET, "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.IsNull() ? "end" : hashStop.ToString(), pfrom->GetId());
+    for (; pindex; pindex = chainActive.Next(pindex)) {
+        vHeaders.push_back(pindex->GetBlockHeader());
+        if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+            break;
     }
+    // pindex can be nullptr either if we sent chainActive.Tip() OR
+    // if our peer has chainActive.Tip() (and thus we are sending an empty
+    // headers message). In both cases it's safe to update
+    // pindexBestHeaderSent to be our tip.
+    //
+    // It is important that we simply reset the BestHeaderSent value here,
+    // and not max(BestHeaderSent, newHeaderSent). We might have announced
+    // the currently-being-connected tip using a compact block, which
+    // resulted in the peer sending a headers request, which we respond to
+    // without the new block. By resetting the BestHeaderSent, we ensure we
+    // will re-announce the new block via headers (or compact blocks again)
+    // in the SendMessages logic.
+    nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
+    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::HEADERS, vHeaders));
 
+    return true;
+}
 
+static bool ProcessHeadersMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    // Ignore headers received while importing
+    if (fImporting || fReindex)
+        return true;
 
-    else if (strCommand == NetMsgType::PING)
+    std::vector<CBlockHeader> headers;
+
+    // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
+    unsigned int nCount = ReadCompactSize(vRecv);
+    if (nCount > MAX_HEADERS_RESULTS) {
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("headers message size = %u", nCount);
+    }
+    headers.resize(nCount);
     {
-        if (pfrom->nVersion > BIP0031_VERSION)
-        {
-            uint64_t nonce = 0;
-            vRecv >> nonce;
-            // Echo the message back with the nonce. This allows for two useful features:
-            //
-            // 1) A remote node can quickly check if the connection is operational
-            // 2) Remote nodes can measure the latency of the network thread. If this node
-            //    is overloaded it won't respond to pings quickly and the remote node can
-            //    avoid sending us more work, like chain download requests.
-            //
-            // The nonce stops the remote getting confused between different pings: without
-            // it, if the remote node sends a ping once per second and this node takes 5
-            // seconds to respond to each, the 5th ping the remote sends would appear to
-            // return very quickly.
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::PONG, nonce));
+        LOCK(cs_main);
+        for (unsigned int n = 0; n < nCount; n++) {
+            vRecv >> headers[n];
+            ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
+            ReadCompactSize(vRecv); // needed for vchBlockSig.}
         }
     }
 
+    // Headers received via a HEADERS message should be valid, and reflect
+    // the chain the peer is on. If we receive a known-invalid header,
+    // disconnect the peer if it is using one of our outbound connection
+    // slots.
+    bool should_punish = !pfrom->fInbound && !pfrom->m_manual_connection;
+    return ProcessHeadersMessage(pfrom, connman, headers, chainparams, should_punish);
+}
+
+static bool ProcessBlockMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
 
-    else if (strCommand == NetMsgType::PONG)
+    std::shared_ptr<CBlock> pblock2 = std::make_shared<CBlock>();
+    vRecv >> *pblock2; pblock2->MakeFlags();
+
+    LogPrint(BCLog::NET, "received block %s peer=%d\n", pblock2->GetHash().ToString(), pfrom->GetId());
+
+    return ProcessReceivedBlock(pfrom, pblock2, chainparams, /*fCompact=*/false, /*fRequested=*/false);
+}
+
+static bool ProcessGetAddrMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    // This asymmetric behavior for inbound and outbound connections was introduced
+    // to prevent a fingerprinting attack: an attacker can send specific fake addresses
+    // to users' AddrMan and later request them by sending getaddr messages.
+    // Making nodes which are behind NAT and can only make outgoing connections ignore
+    // the getaddr message mitigates the attack.
+    if (!pfrom->fInbound) {
+        LogPrint(BCLog::NET, "Ignoring \"getaddr\" from outbound connection. peer=%d\n", pfrom->GetId());
+        return true;
+    }
+
+    // Only send one GetAddr response per connection to reduce resource waste
+    //  and discourage addr stamping of INV announcements.
+    if (pfrom->fSentAddr) {
+        LogPrint(BCLog::NET, "Ignoring repeated \"getaddr\". peer=%d\n", pfrom->GetId());
+        return true;
+    }
+    pfrom->fSentAddr = true;
+
+    {
+        LOCK(pfrom->cs_addrToSend);
+        pfrom->vAddrToSend.clear();
+    }
+    std::vector<CAddress> vAddr = connman->GetAddresses();
+    FastRandomContext insecure_rand;
+    for (const CAddress& addr : vAddr)
+        pfrom->PushAddress(addr, insecure_rand);
+
+    return true;
+}
+
+static bool ProcessMempoolMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    if (!(pfrom->GetLocalServices() & NODE_BLOOM) && !pfrom->fWhitelisted) {
+        LogPrint(BCLog::NET, "mempool request with bloom filters disabled, disconnect peer=%d\n", pfrom->GetId());
+        pfrom->fDisconnect = true;
+        return true;
+    }
+
+    if (connman->OutboundTargetReached(false) && !pfrom->fWhitelisted) {
+        LogPrint(BCLog::NET, "mempool request with bandwidth limit reached, disconnect peer=%d\n", pfrom->GetId());
+        pfrom->fDisconnect = true;
+        return true;
+    }
+
+    LOCK(pfrom->cs_inventory);
+    pfrom->fSendMempool = true;
+
+    return true;
+}
+
+static bool ProcessPingMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+
+    if (pfrom->nVersion > BIP0031_VERSION)
     {
-        int64_t pingUsecEnd = nTimeReceived;
         uint64_t nonce = 0;
-        size_t nAvail = vRecv.in_avail();
-        bool bPingFinished = false;
-        std::string sProblem;
+        vRecv >> nonce;
+        // Echo the message back with the nonce. This allows for two useful features:
+        //
+        // 1) A remote node can quickly check if the connection is operational
+        // 2) Remote nodes can measure the latency of the network thread. If this node
+        //    is overloaded it won't respond to pings quickly and the remote node can
+        //    avoid sending us more work, like chain download requests.
+        //
+        // The nonce stops the remote getting confused between different pings: without
+        // it, if the remote node sends a ping once per second and this node takes 5
+        // seconds to respond to each, the 5th ping the remote sends would appear to
+        // return very quickly.
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::PONG, nonce));
+    }
 
-        if (nAvail >= sizeof(nonce)) {
-            vRecv >> nonce;
+    return true;
+}
 
-            // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
-            if (pfrom->nPingNonceSent != 0) {
-                if (nonce == pfrom->nPingNonceSent) {
-                    // Matching pong received, this ping is no longer outstanding
-                    bPingFinished = true;
-                    int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
-                    if (pingUsecTime > 0) {
-                        // Successful ping time measurement, replace previous
-                        pfrom->nPingUsecTime = pingUsecTime;
-                        pfrom->nMinPingUsecTime = std::min(pfrom->nMinPingUsecTime.load(), pingUsecTime);
-                    } else {
-                        // This should never happen
-                        sProblem = "Timing mishap";
-                    }
+static bool ProcessPongMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    int64_t pingUsecEnd = nTimeReceived;
+    uint64_t nonce = 0;
+    size_t nAvail = vRecv.in_avail();
+    bool bPingFinished = false;
+    std::string sProblem;
+
+    if (nAvail >= sizeof(nonce)) {
+        vRecv >> nonce;
+
+        // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
+        if (pfrom->nPingNonceSent != 0) {
+            if (nonce == pfrom->nPingNonceSent) {
+                // Matching pong received, this ping is no longer outstanding
+                bPingFinished = true;
+                int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
+                if (pingUsecTime > 0) {
+                    // Successful ping time measurement, replace previous
+                    pfrom->nPingUsecTime = pingUsecTime;
+                    pfrom->nMinPingUsecTime = std::min(pfrom->nMinPingUsecTime.load(), pingUsecTime);
                 } else {
-                    // Nonce mismatches are normal when pings are overlapping
-                    sProblem = "Nonce mismatch";
-                    if (nonce == 0) {
-                        // This is most likely a bug in another implementation somewhere; cancel this ping
-                        bPingFinished = true;
-                        sProblem = "Nonce zero";
-                    }
+                    // This should never happen
+                    sProblem = "Timing mishap";
                 }
             } else {
-                sProblem = "Unsolicited pong without ping";
+                // Nonce mismatches are normal when pings are overlapping
+                sProblem = "Nonce mismatch";
+                if (nonce == 0) {
+                    // This is most likely a bug in another implementation somewhere; cancel this ping
+                    bPingFinished = true;
+                    sProblem = "Nonce zero";
+                }
             }
         } else {
-            // This is most likely a bug in another implementation somewhere; cancel this ping
-            bPingFinished = true;
-            sProblem = "Short payload";
+            sProblem = "Unsolicited pong without ping";
         }
+    } else {
+        // This is most likely a bug in another implementation somewhere; cancel this ping
+        bPingFinished = true;
+        sProblem = "Short payload";
+    }
 
-        if (!(sProblem.empty())) {
-            LogPrint(BCLog::NET, "pong peer=%d: %s, %x expected, %x received, %u bytes\n",
-                pfrom->GetId(),
-                sProblem,
-                pfrom->nPingNonceSent,
-                nonce,
-                nAvail);
-        }
-        if (bPingFinished) {
-            pfrom->nPingNonceSent = 0;
-        }
+    if (!(sProblem.empty())) {
+        LogPrint(BCLog::NET, "pong peer=%d: %s, %x expected, %x received, %u bytes\n",
+            pfrom->GetId(),
+            sProblem,
+            pfrom->nPingNonceSent,
+            nonce,
+            nAvail);
+    }
+    if (bPingFinished) {
+        pfrom->nPingNonceSent = 0;
     }
 
+    return true;
+}
 
+static bool ProcessFilterLoadMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    CBloomFilter filter;
+    vRecv >> filter;
 
-    else if (strCommand == NetMsgType::FILTERLOAD) {
-        CBloomFilter filter;
-        vRecv >> filter;
+    if (!filter.IsWithinSizeConstraints()) {
+        // There is no excuse for sending a too-large filter
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 100);
+    } else {
+        LOCK(pfrom->cs_filter);
+        pfrom->pfilter.reset(new CBloomFilter(filter));
+        pfrom->pfilter->UpdateEmptyFull();
+        pfrom->fRelayTxes = true;
+    }
 
-        if (!filter.IsWithinSizeConstraints()) {
-            // There is no excuse for sending a too-large filter
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 100);
+    return true;
+}
+
+static bool ProcessFilterAddMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    std::vector<unsigned char> vData;
+    vRecv >> vData;
+
+    // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
+    // and thus, the maximum size any matched object can have) in a filteradd message
+    bool bad = false;
+    if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE) {
+        bad = true;
+    } else {
+        LOCK(pfrom->cs_filter);
+        if (pfrom->pfilter) {
+            pfrom->pfilter->insert(vData);
         } else {
-            LOCK(pfrom->cs_filter);
-            pfrom->pfilter.reset(new CBloomFilter(filter));
-            pfrom->pfilter->UpdateEmptyFull();
-            pfrom->fRelayTxes = true;
+            bad = true;
         }
     }
+    if (bad) {
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 100);
+    }
 
+    return true;
+}
 
-    else if (strCommand == NetMsgType::FILTERADD) {
-        std::vector<unsigned char> vData;
-        vRecv >> vData;
+static bool ProcessFilterClearMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    LOCK(pfrom->cs_filter);
+    if (pfrom->GetLocalServices() & NODE_BLOOM) {
+        pfrom->pfilter.reset(new CBloomFilter());
+    }
+    pfrom->fRelayTxes = true;
 
-        // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
-        // and thus, the maximum size any matched object can have) in a filteradd message
-        bool bad = false;
-        if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE) {
-            bad = true;
-        } else {
-            LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter) {
-                pfrom->pfilter->insert(vData);
-            } else {
-                bad = true;
-            }
-        }
-        if (bad) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 100);
+    return true;
+}
+
+static bool ProcessFeeFilterMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    CAmount newFeeFilter = 0;
+    vRecv >> newFeeFilter;
+    if (MoneyRange(newFeeFilter)) {
+        {
+            LOCK(pfrom->cs_feeFilter);
+            pfrom->minFeeFilter = newFeeFilter;
         }
+        LogPrint(BCLog::NET, "received: feefilter of %d satoshi from peer=%d\n", newFeeFilter, pfrom->GetId());
     }
 
+    return true;
+}
 
-    else if (strCommand == NetMsgType::FILTERCLEAR) {
-        LOCK(pfrom->cs_filter);
-        if (pfrom->GetLocalServices() & NODE_BLOOM) {
-            pfrom->pfilter.reset(new CBloomFilter());
-        }
-        pfrom->fRelayTxes = true;
+static bool ProcessNotFoundMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    // We do not care about the NOTFOUND message, but logging an Unknown Command
+    // message would be undesirable as we transmit it ourselves.
+    return true;
+}
+
+/** Process one message; handler is the dispatcher entry for strCommand, or nullptr if it is unknown */
+bool static ProcessMessage(CNode* pfrom, CNetMessageDispatcher::Entry* handler, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    LogPrint(BCLog::NET, "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->GetId());
+    if (gArgs.IsArgSet("-dropmessagestest") && GetRand(gArgs.GetArg("-dropmessagestest", 0)) == 0)
+    {
+        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
+        return true;
     }
 
-    else if (strCommand == NetMsgType::FEEFILTER) {
-        CAmount newFeeFilter = 0;
-        vRecv >> newFeeFilter;
-        if (MoneyRange(newFeeFilter)) {
-            {
-                LOCK(pfrom->cs_feeFilter);
-                pfrom->minFeeFilter = newFeeFilter;
-            }
-            LogPrint(BCLog::NET, "received: feefilter of %d satoshi from peer=%d\n", newFeeFilter, pfrom->GetId());
+    if (handler != nullptr && (handler->nFlags & NETMSG_BLOOM) && !(pfrom->GetLocalServices() & NODE_BLOOM))
+    {
+        if (pfrom->nVersion >= NO_BLOOM_VERSION) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 100);
+            return false;
+        } else {
+            pfrom->fDisconnect = true;
+            return false;
         }
     }
 
-    else if (fAlerts && strCommand == NetMsgType::ALERT) {
-        CAlert alert;
-        vRecv >> alert;
-
-        uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0) {
-            if (alert.ProcessAlert(chainparams.DevPubKey())) {
-                // Relay
-                pfrom->setKnown.insert(alertHash);
-                if (g_connman)
-                    g_connman->ForEachNode([&alert](CNode* pnode) {
-                        alert.RelayTo(pnode);
-                    });
-            } else {
-                // Small DoS penalty so peers that send us lots of
-                // duplicate/expired/invalid-signature/whatever alerts
-                // eventually get banned.
-                // This isn't a Misbehaving(100) (immediate ban) because the
-                // peer might be an older or different implementation with
-                // a different signature key, etc.
-                Misbehaving(pfrom->GetId(), 10);
-            }
-        }
+    if (pfrom->nVersion == 0 && (handler == nullptr || !(handler->nFlags & NETMSG_BEFORE_VERSION)))
+    {
+        // Must have a version message before anything else
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 1);
+        return false;
     }
 
-    else if (strCommand == NetMsgType::NOTFOUND) {
-        // We do not care about the NOTFOUND message, but logging an Unknown Command
-        // message would be undesirable as we transmit it ourselves.
+    // peercoin: set/unset network serialization mode for new clients
+    if (pfrom->nVersion != 0) {
+        if (pfrom->nVersion <= OLD_VERSION)
+            vRecv.SetType(vRecv.GetType() & ~SER_GALAXYCASH);
+        else
+            vRecv.SetType(vRecv.GetType() | SER_GALAXYCASH);
     }
 
-    else {
-        //probably one the extensions
-        mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
-        masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
-        masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+    if (handler == nullptr) {
+        // Ignore unknown commands for extensibility
+        LogPrint(BCLog::NET, "Unknown command \"%s\" from peer=%d\n", SanitizeString(strCommand), pfrom->GetId());
+        return true;
     }
 
+    return netMessageDispatcher.Dispatch(*handler, pfrom, strCommand, vRecv, nTimeReceived, chainparams, connman, interruptMsgProc);
+}
 
-    return true;
+void RegisterNodeMessageHandlers(CNetMessageDispatcher& dispatcher)
+{
+    dispatcher.Register(NetMsgType::REJECT, ProcessRejectMessage, NETMSG_SERIAL | NETMSG_BEFORE_VERSION);
+    dispatcher.Register(NetMsgType::VERSION, ProcessVersionMessage, NETMSG_SERIAL | NETMSG_BEFORE_VERSION);
+    dispatcher.Register(NetMsgType::VERACK, ProcessVerackMessage);
+    dispatcher.Register(NetMsgType::ADDR, ProcessAddrMessage, 0);
+    dispatcher.Register(NetMsgType::SENDHEADERS, ProcessSendHeadersMessage);
+    dispatcher.Register(NetMsgType::SENDCMPCT, ProcessSendCmpctMessage);
+    // Inventory looks into the masternode maps as well
+    dispatcher.Register(NetMsgType::INV, ProcessInvMessage, NETMSG_SERIAL | NETMSG_MASTERNODE);
+    dispatcher.Register(NetMsgType::GETDATA, ProcessGetDataMessage, NETMSG_SERIAL | NETMSG_MASTERNODE);
+    dispatcher.Register(NetMsgType::GETBLOCKTXN, ProcessGetBlockTxnMessage);
+    dispatcher.Register(NetMsgType::GETBLOCKS, ProcessGetBlocksMessage);
+    dispatcher.Register(NetMsgType::TX, ProcessTxMessage);
+    dispatcher.Register(NetMsgType::CMPCTBLOCK, ProcessCmpctBlockMessage);
+    dispatcher.Register(NetMsgType::BLOCKTXN, ProcessBlockTxnMessage);
+    dispatcher.Register(NetMsgType::GETHEADERS, ProcessGetHeadersMessage);
+    dispatcher.Register(NetMsgType::HEADERS, ProcessHeadersMessage);
+    dispatcher.Register(NetMsgType::BLOCK, ProcessBlockMessage);
+    dispatcher.Register(NetMsgType::GETADDR, ProcessGetAddrMessage, 0);
+    dispatcher.Register(NetMsgType::MEMPOOL, ProcessMempoolMessage);
+    dispatcher.Register(NetMsgType::PING, ProcessPingMessage, 0);
+    dispatcher.Register(NetMsgType::PONG, ProcessPongMessage, 0);
+    dispatcher.Register(NetMsgType::FILTERLOAD, ProcessFilterLoadMessage, NETMSG_SERIAL | NETMSG_BLOOM);
+    dispatcher.Register(NetMsgType::FILTERADD, ProcessFilterAddMessage, NETMSG_SERIAL | NETMSG_BLOOM);
+    dispatcher.Register(NetMsgType::FILTERCLEAR, ProcessFilterClearMessage);
+    dispatcher.Register(NetMsgType::FEEFILTER, ProcessFeeFilterMessage);
+    dispatcher.Register(NetMsgType::NOTFOUND, ProcessNotFoundMessage);
 }
 
 static bool SendRejectsAndCheckIfBanned(CNode* pnode, CConnman* connman)
@@ -2610,7 +3132,26 @@ static bool SendRejectsAndCheckIfBanned(CNode* pnode, CConnman* connman)
     return false;
 }
 
-static CNode *psyncnode = nullptr;
+static std::atomic<CNode*> psyncnode{nullptr};
+
+static void ResetSyncNode(CNode* pnode)
+{
+    psyncnode.compare_exchange_strong(pnode, nullptr);
+}
+
+/**
+ * Messages of one peer are processed in order, but the message handler threads
+ * process different peers in parallel. Across peers, commands that touch chain
+ * or mempool state run one at a time under cs_msgProcSerial, which is taken
+ * before cs_main, so they do not pile up on cs_main while workers are left for
+ * the rest. Masternode and spork gossip is serialized among itself under
+ * cs_msgProcMasternode, which inventory requests also take as they look into
+ * the masternode maps. Everything else (ping, pong, addr, getaddr) only touches
+ * the peer itself or internally locked state, and runs fully in parallel. Each
+ * command's lane is given by the NetMessageFlags it was registered with.
+ */
+static CCriticalSection cs_msgProcSerial;
+static CCriticalSection cs_msgProcMasternode;
 
 bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& interruptMsgProc)
 {
@@ -2625,11 +3166,13 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     //
     bool fMoreWork = false;
 
-    if (!pfrom->vRecvGetData.empty())
+    if (!pfrom->vRecvGetData.empty()) {
+        LOCK2(cs_msgProcSerial, cs_msgProcMasternode);
         ProcessGetData(pfrom, chainparams.GetConsensus(), connman, interruptMsgProc);
+    }
 
     if (pfrom->fDisconnect) {
-        if (psyncnode == pfrom) psyncnode = nullptr;
+        ResetSyncNode(pfrom);
         return false;
     }
 
@@ -2641,6 +3184,7 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
         return false;
 
     std::list<CNetMessage> msgs;
+    bool fResumeRecv = false;
     {
         LOCK(pfrom->cs_vProcessMsg);
         if (pfrom->vProcessMsg.empty())
@@ -2648,9 +3192,12 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
         // Just take one message
         msgs.splice(msgs.begin(), pfrom->vProcessMsg, pfrom->vProcessMsg.begin());
         pfrom->nProcessQueueSize -= msgs.front().vRecv.size() + CMessageHeader::HEADER_SIZE;
+        fResumeRecv = pfrom->fPauseRecv && pfrom->nProcessQueueSize <= connman->GetReceiveFloodSize();
         pfrom->fPauseRecv = pfrom->nProcessQueueSize > connman->GetReceiveFloodSize();
         fMoreWork = !pfrom->vProcessMsg.empty();
     }
+    if (fResumeRecv)
+        connman->UpdateSocketEvents(pfrom);
     CNetMessage& msg(msgs.front());
 
     msg.SetVersion(pfrom->GetRecvVersion());
@@ -2658,7 +3205,7 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     if (memcmp(msg.hdr.pchMessageStart, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE) != 0) {
         LogPrint(BCLog::NET, "PROCESSMESSAGE: INVALID MESSAGESTART %s peer=%d\n", SanitizeString(msg.hdr.GetCommand()), pfrom->GetId());
         pfrom->fDisconnect = true;
-        if (psyncnode == pfrom) psyncnode = nullptr;
+        ResetSyncNode(pfrom);
         return false;
     }
 
@@ -2687,7 +3234,16 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     // Process message
     bool fRet = false;
     try {
-        fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman, interruptMsgProc);
+        // The lane is part of the registration; unknown commands only get logged
+        CNetMessageDispatcher::Entry* handler = netMessageDispatcher.Find(strCommand);
+        const unsigned int nFlags = handler ? handler->nFlags : 0;
+        std::unique_lock<CCriticalSection> lockSerial(cs_msgProcSerial, std::defer_lock);
+        std::unique_lock<CCriticalSection> lockMasternode(cs_msgProcMasternode, std::defer_lock);
+        if (nFlags & NETMSG_SERIAL)
+            lockSerial.lock();
+        if (nFlags & NETMSG_MASTERNODE)
+            lockMasternode.lock();
+        fRet = ProcessMessage(pfrom, handler, strCommand, vRecv, msg.nTime, chainparams, connman, interruptMsgProc);
         if (interruptMsgProc)
             return false;
         if (!pfrom->vRecvGetData.empty())
@@ -2715,9 +3271,15 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     if (!fRet) {
         LogPrint(BCLog::NET, "%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->GetId());
     }
+    pfrom->RecordMessageLatency(strCommand, GetTimeMicros() - msg.nTime);
 
-    LOCK(cs_main);
-    SendRejectsAndCheckIfBanned(pfrom, connman);
+    {
+        // Don't hold up this worker behind block validation; if cs_main is
+        // busy, the next SendMessages for this peer sends the rejects instead
+        TRY_LOCK(cs_main, lockMain);
+        if (lockMain)
+            SendRejectsAndCheckIfBanned(pfrom, connman);
+    }
 
     return fMoreWork;
 }
@@ -2758,7 +3320,7 @@ void PeerLogicValidation::ConsiderEviction(CNode* pto, int64_t time_in_seconds)
                 // They've run out of time to catch up!
                 LogPrintf("Disconnecting outbound peer %d for old chain, best known block = %s\n", pto->GetId(), state.pindexBestKnownBlock != nullptr ? state.pindexBestKnownBlock->GetBlockHash().ToString() : "<none>");
                 pto->fDisconnect = true;
-                if (psyncnode == pto) psyncnode = nullptr;
+                ResetSyncNode(pto);
             } else {
                 assert(state.m_chain_sync.m_work_header);
                 LogPrint(BCLog::NET, "sending getheaders to outbound peer=%d to verify chain work (current best known block:%s, benchmark blockhash: %s)\n", pto->GetId(), state.pindexBestKnownBlock != nullptr ? state.pindexBestKnownBlock->GetBlockHash().ToString() : "<none>", state.m_chain_sync.m_work_header->GetBlockHash().ToString());
@@ -2813,7 +3375,7 @@ void PeerLogicValidation::EvictExtraOutboundPeers(int64_t time_in_seconds)
                 if (time_in_seconds - pnode->nTimeConnected > MINIMUM_CONNECT_TIME && state.nBlocksInFlight == 0) {
                     LogPrint(BCLog::NET, "disconnecting extra outbound peer=%d (last block announcement received at time %d)\n", pnode->GetId(), oldest_block_announcement);
                     pnode->fDisconnect = true;
-                    if (psyncnode == pnode) psyncnode = nullptr;
+                    ResetSyncNode(pnode);
                     return true;
                 } else {
                     LogPrint(BCLog::NET, "keeping outbound peer=%d chosen for eviction (connect time: %d, blocks_in_flight: %d)\n", pnode->GetId(), pnode->nTimeConnected, state.nBlocksInFlight);
@@ -2854,24 +3416,6 @@ void PeerLogicValidation::CheckForStaleTipAndEvictPeers(const Consensus::Params&
     }
 }
 
-class CompareInvMempoolOrder
-{
-    CTxMemPool* mp;
-
-public:
-    explicit CompareInvMempoolOrder(CTxMemPool* _mempool)
-    {
-        mp = _mempool;
-    }
-
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
-    {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
-    }
-};
-
 bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptMsgProc)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -2914,8 +3458,12 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
             }
         }
 
-        LOCK(cs_main);
+        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
+        if (!lockMain)
+            return true;
 
+        if (SendRejectsAndCheckIfBanned(pto, connman))
+            return true;
         CNodeState &state = *State(pto->GetId());
 
         // Address refresh broadcast
@@ -2929,6 +3477,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
         // Message: addr
         //
         if (pto->nNextAddrSend < nNow) {
+            LOCK(pto->cs_addrToSend);
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             std::vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
@@ -3001,7 +3550,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
             LOCK(pto->cs_inventory);
             std::vector<CBlock> vHeaders;
             bool fRevertToInv = ((!state.fPreferHeaders &&
-                                 (pto->vBlockHashesToAnnounce.size() > 1)) ||
+                                 (!state.fPreferHeaderAndIDs || pto->vBlockHashesToAnnounce.size() > 1)) ||
                                 pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
             const CBlockIndex *pBestIndex = nullptr; // last header queued for delivery
             ProcessBlockAvailability(pto->GetId()); // ensure pindexBestKnownBlock is up-to-date
@@ -3055,7 +3604,29 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                 }
             }
             if (!fRevertToInv && !vHeaders.empty()) {
-                if (state.fPreferHeaders) {
+                if (vHeaders.size() == 1 && state.fPreferHeaderAndIDs) {
+                    // We only send up to 1 block as header-and-ids, as otherwise
+                    // probably means we're doing an initial-ish-sync or they're slow
+                    LogPrint(BCLog::NET, "%s sending header-and-ids %s to peer=%d\n", __func__,
+                            vHeaders.front().GetHash().ToString(), pto->GetId());
+
+                    bool fGotBlockFromCache = false;
+                    {
+                        LOCK(cs_most_recent_block);
+                        if (most_recent_block_hash == pBestIndex->GetBlockHash()) {
+                            connman->PushMessage(pto, msgMaker.Make(NetMsgType::CMPCTBLOCK, *most_recent_compact_block));
+                            fGotBlockFromCache = true;
+                        }
+                    }
+                    if (!fGotBlockFromCache) {
+                        CBlock block;
+                        bool ret = ReadBlockFromDisk(block, pBestIndex, consensusParams);
+                        assert(ret);
+                        CBlockHeaderAndShortTxIDs cmpctblock(block);
+                        connman->PushMessage(pto, msgMaker.Make(NetMsgType::CMPCTBLOCK, cmpctblock));
+                    }
+                    state.pindexBestHeaderSent = pBestIndex;
+                } else if (state.fPreferHeaders) {
                     if (vHeaders.size() > 1) {
                         LogPrint(BCLog::NET, "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
                                 vHeaders.size(),
@@ -3128,7 +3699,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
             // Time to send but the peer has requested we not relay transactions.
             if (fSendTrickle) {
                 LOCK(pto->cs_filter);
-                if (!pto->fRelayTxes) pto->setInventoryTxToSend.clear();
+                if (!pto->fRelayTxes) pto->nTxAnnounceCursor = txAnnounceQueue.GetEndSequence();
             }
 
             // Respond to BIP35 mempool requests
@@ -3146,7 +3717,6 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                 for (const auto& txinfo : vtxinfo) {
                     const uint256& hash = txinfo.tx->GetHash();
                     CInv inv(MSG_TX, hash);
-                    pto->setInventoryTxToSend.erase(hash);
                     if (filterrate) {
                         if (txinfo.fee < filterrate)
                             continue;
@@ -3164,51 +3734,52 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                 pto->timeLastMempoolReq = GetTime();
             }
 
-            // Determine transactions to relay
-            if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                std::vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
-                }
+            // Determine transactions to relay. Hold them back while the
+            // peer's send buffer is full; the batch grows with the wait.
+            if (fSendTrickle && !pto->fPauseSend) {
+                const int64_t nTickStart = GetTimeMicros();
+                // INVENTORY_BROADCAST_MAX per average trickle interval since the
+                // last batch, so that long Poisson delays don't cut into the
+                // peer's share, but no more than a few intervals' worth at once.
+                // No reason to drain out at many times the network's capacity,
+                // especially since we have many peers and some will draw much shorter delays.
+                const int64_t nInterval = (int64_t)(INVENTORY_BROADCAST_INTERVAL >> !pto->fInbound) * 1000000;
+                const int64_t nBudget = std::max<int64_t>(INVENTORY_BROADCAST_MAX,
+                    std::min<int64_t>(INVENTORY_BROADCAST_MAX * INVENTORY_BROADCAST_BURST, INVENTORY_BROADCAST_MAX * ((nNow - pto->nLastTxTrickle) / nInterval)));
+                pto->nLastTxTrickle = nNow;
+
+                std::vector<TxAnnounceEntryRef> vInvTx;
+                const uint64_t nEnd = txAnnounceQueue.GetSince(pto->nTxAnnounceCursor, vInvTx);
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
+                LOCK(pto->cs_filter);
+                // Pass over what the peer already has, what is no longer in
+                // the mempool and what it doesn't want; the rest are candidates.
+                vInvTx.erase(std::remove_if(vInvTx.begin(), vInvTx.end(), [&](const TxAnnounceEntryRef& entry) {
+                    return entry->fRemoved || pto->filterInventoryKnown.contains(entry->tx->GetHash()) ||
+                           (filterrate && entry->nFee < filterrate);
+                }), vInvTx.end());
                 // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
                 // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                // No reason to drain out at many times the network's capacity,
-                // especially since we have many peers and some will draw much shorter delays.
-                unsigned int nRelayedTransactions = 0;
-                LOCK(pto->cs_filter);
-                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
+                CompareTxAnnounceOrder compareTxAnnounceOrder;
+                std::make_heap(vInvTx.begin(), vInvTx.end(), compareTxAnnounceOrder);
+                int64_t nRelayedTransactions = 0;
+                int64_t nLatency = 0;
+                while (!vInvTx.empty() && nRelayedTransactions < nBudget) {
                     // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
+                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareTxAnnounceOrder);
+                    TxAnnounceEntryRef entry = std::move(vInvTx.back());
                     vInvTx.pop_back();
-                    uint256 hash = *it;
-                    // Remove it from the to-be-sent set
-                    pto->setInventoryTxToSend.erase(it);
-                    // Check if not in the filter already
-                    if (pto->filterInventoryKnown.contains(hash)) {
-                        continue;
-                    }
-                    // Not in the mempool anymore? don't bother sending it.
-                    auto txinfo = mempool.info(hash);
-                    if (!txinfo.tx) {
-                        continue;
-                    }
-                    if (filterrate && txinfo.fee < filterrate) {
-                        continue;
-                    }
-                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
+                    const uint256& hash = entry->tx->GetHash();
+                    pto->filterInventoryKnown.insert(hash);
+                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*entry->tx)) continue;
                     // Send
                     vInv.push_back(CInv(MSG_TX, hash));
                     nRelayedTransactions++;
+                    nLatency += nNow - entry->nTimeQueued;
                     {
                         // Expire old relay messages
                         while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
@@ -3217,7 +3788,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                             vRelayExpiration.pop_front();
                         }
 
-                        auto ret = mapRelay.insert(std::make_pair(hash, std::move(txinfo.tx)));
+                        auto ret = mapRelay.insert(std::make_pair(hash, entry->tx));
                         if (ret.second) {
                             vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
                         }
@@ -3226,8 +3797,14 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                         connman->PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv));
                         vInv.clear();
                     }
-                    pto->filterInventoryKnown.insert(hash);
                 }
+                // Whatever is left waits for the next batch; the cursor stays
+                // at the first of them, everything before it is done.
+                uint64_t nCursor = nEnd;
+                for (const TxAnnounceEntryRef& entry : vInvTx)
+                    nCursor = std::min(nCursor, entry->nSequence);
+                pto->nTxAnnounceCursor = nCursor;
+                txAnnounceQueue.RecordTick(nRelayedTransactions, nLatency, GetTimeMicros() - nTickStart);
             }
         }
         if (!vInv.empty())
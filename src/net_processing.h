@@ -10,6 +10,8 @@
 #include <net.h>
 #include <validationinterface.h>
 
+class CNetMessageDispatcher;
+
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
 /** Expiration time for orphan transactions in seconds */
@@ -53,6 +55,7 @@ public:
     void UpdatedBlockTip(const CBlockIndex* pindexNew, const CBlockIndex* pindexFork, bool fInitialDownload) override;
     void BlockChecked(const CBlock& block, const CValidationState& state) override;
     void NewPoWValidBlock(const CBlockIndex* pindex, const std::shared_ptr<const CBlock>& pblock) override;
+    void TransactionRemovedFromMempool(const CTransactionRef& ptx) override;
 
 
     void InitializeNode(CNode* pnode) override;
@@ -87,6 +90,8 @@ struct CNodeStateStats {
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
+/** Register the handlers for the core protocol messages */
+void RegisterNodeMessageHandlers(CNetMessageDispatcher& dispatcher);
 
 
 #endif // BITCOIN_NET_PROCESSING_H
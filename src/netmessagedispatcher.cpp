@@ -0,0 +1,78 @@
+// Copyright (c) 2017-2019 The GalaxyCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <netmessagedispatcher.h>
+
+#include <crypto/common.h>
+#include <utiltime.h>
+
+#include <assert.h>
+#include <string.h>
+
+CNetMessageDispatcher netMessageDispatcher;
+
+CNetMessageDispatcher::Entry::Entry(NetMessageHandler handlerIn, unsigned int nFlagsIn) :
+    handler(handlerIn), nFlags(nFlagsIn), nCalls(0), nBytes(0), nCPUTime(0), nMaxCPUTime(0)
+{
+}
+
+size_t CNetMessageDispatcher::CommandKeyHasher::operator()(const CommandKey& key) const
+{
+    static_assert(CMessageHeader::COMMAND_SIZE == 12, "command key is hashed as 8 + 4 bytes");
+    uint64_t nHash = ReadLE64((const unsigned char*)key.data()) * 0x9e3779b97f4a7c15ULL;
+    nHash ^= ReadLE32((const unsigned char*)key.data() + 8) + (nHash >> 29);
+    return nHash * 0xbf58476d1ce4e5b9ULL;
+}
+
+CNetMessageDispatcher::CommandKey CNetMessageDispatcher::MakeKey(const std::string& strCommand)
+{
+    CommandKey key;
+    key.fill(0);
+    memcpy(key.data(), strCommand.data(), std::min(strCommand.size(), key.size()));
+    return key;
+}
+
+void CNetMessageDispatcher::Register(const std::string& strCommand, NetMessageHandler handler, unsigned int nFlags)
+{
+    assert(!strCommand.empty() && strCommand.size() <= CMessageHeader::COMMAND_SIZE);
+    bool fInserted = mapHandlers.emplace(MakeKey(strCommand), std::unique_ptr<Entry>(new Entry(handler, nFlags))).second;
+    assert(fInserted);
+}
+
+CNetMessageDispatcher::Entry* CNetMessageDispatcher::Find(const std::string& strCommand) const
+{
+    // Commands from a message header are never longer than the key
+    if (strCommand.size() > CMessageHeader::COMMAND_SIZE)
+        return nullptr;
+    auto it = mapHandlers.find(MakeKey(strCommand));
+    return it == mapHandlers.end() ? nullptr : it->second.get();
+}
+
+bool CNetMessageDispatcher::Dispatch(Entry& entry, CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+{
+    entry.nCalls++;
+    entry.nBytes += vRecv.size();
+    int64_t nCPUStart = GetThreadCPUTimeMicros();
+    // A handler that throws is accounted as a call, but not for its CPU time
+    bool fRet = entry.handler(pfrom, strCommand, vRecv, nTimeReceived, chainparams, connman, interruptMsgProc);
+    int64_t nCPUTime = GetThreadCPUTimeMicros() - nCPUStart;
+    entry.nCPUTime += nCPUTime;
+    int64_t nMax = entry.nMaxCPUTime;
+    while (nCPUTime > nMax && !entry.nMaxCPUTime.compare_exchange_weak(nMax, nCPUTime)) {}
+    return fRet;
+}
+
+std::map<std::string, NetMessageStats> CNetMessageDispatcher::GetStats() const
+{
+    std::map<std::string, NetMessageStats> mapStats;
+    for (const auto& handler : mapHandlers) {
+        const Entry& entry = *handler.second;
+        NetMessageStats& stats = mapStats[std::string(handler.first.data(), strnlen(handler.first.data(), handler.first.size()))];
+        stats.nCalls = entry.nCalls;
+        stats.nBytes = entry.nBytes;
+        stats.nCPUTime = entry.nCPUTime;
+        stats.nMaxCPUTime = entry.nMaxCPUTime;
+    }
+    return mapStats;
+}
@@ -0,0 +1,95 @@
+// Copyright (c) 2017-2019 The GalaxyCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef GALAXYCASH_NETMESSAGEDISPATCHER_H
+#define GALAXYCASH_NETMESSAGEDISPATCHER_H
+
+#include <protocol.h>
+#include <streams.h>
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+class CChainParams;
+class CConnman;
+class CNode;
+
+/** Handles one received message; returning false logs the message as failed */
+typedef bool (*NetMessageHandler)(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc);
+
+/**
+ * Properties of a registered command. The message handler threads use the
+ * lane flags to decide which locks a command runs under, see ProcessMessages.
+ */
+enum NetMessageFlags : unsigned int {
+    //! Runs one at a time across peers, under cs_msgProcSerial
+    NETMSG_SERIAL = (1U << 0),
+    //! Runs one at a time with masternode gossip, under cs_msgProcMasternode
+    NETMSG_MASTERNODE = (1U << 1),
+    //! May be received before the version message
+    NETMSG_BEFORE_VERSION = (1U << 2),
+    //! Only allowed if we offer NODE_BLOOM
+    NETMSG_BLOOM = (1U << 3),
+};
+
+/** Counters kept for every registered command */
+struct NetMessageStats {
+    uint64_t nCalls;
+    uint64_t nBytes;      //! payload bytes handled
+    int64_t nCPUTime;     //! microseconds of thread CPU time, summed over all calls
+    int64_t nMaxCPUTime;  //! microseconds of thread CPU time, for the costliest call
+};
+
+/**
+ * Routes received messages to the handler registered for their command.
+ *
+ * Commands are interned into a fixed-size key, the 12 byte command field of
+ * the message header, so that dispatch is a single hash lookup. Core
+ * messages, masternodes and alerts register their own commands at startup;
+ * handlers must all be registered before the message handler threads start,
+ * after which lookups need no lock.
+ */
+class CNetMessageDispatcher
+{
+public:
+    typedef std::array<char, CMessageHeader::COMMAND_SIZE> CommandKey;
+
+    struct Entry {
+        NetMessageHandler handler;
+        //! NetMessageFlags given at registration
+        const unsigned int nFlags;
+        std::atomic<uint64_t> nCalls;
+        std::atomic<uint64_t> nBytes;
+        std::atomic<int64_t> nCPUTime;
+        std::atomic<int64_t> nMaxCPUTime;
+
+        Entry(NetMessageHandler handlerIn, unsigned int nFlagsIn);
+    };
+
+    void Register(const std::string& strCommand, NetMessageHandler handler, unsigned int nFlags = NETMSG_SERIAL);
+
+    /** The entry registered for strCommand, or nullptr if the command is unknown */
+    Entry* Find(const std::string& strCommand) const;
+
+    /** Run the handler of entry and account for it */
+    bool Dispatch(Entry& entry, CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc);
+
+    std::map<std::string, NetMessageStats> GetStats() const;
+
+private:
+    struct CommandKeyHasher {
+        size_t operator()(const CommandKey& key) const;
+    };
+
+    static CommandKey MakeKey(const std::string& strCommand);
+
+    std::unordered_map<CommandKey, std::unique_ptr<Entry>, CommandKeyHasher> mapHandlers;
+};
+
+extern CNetMessageDispatcher netMessageDispatcher;
+
+#endif // GALAXYCASH_NETMESSAGEDISPATCHER_H
@@ -12,22 +12,104 @@
 #include <serialize.h>
 #include <streams.h>
 
-uint256 CBlockHeader::GetHash() const
+#include <string.h>
+
+static std::atomic<uint64_t> nBlockHashesComputed{0};
+static std::atomic<uint64_t> nBlockHashesAvoided{0};
+
+uint64_t GetBlockHashesComputed()
+{
+    return nBlockHashesComputed.load(std::memory_order_relaxed);
+}
+
+uint64_t GetBlockHashesAvoided()
+{
+    return nBlockHashesAvoided.load(std::memory_order_relaxed);
+}
+
+CBlockHeaderHashMemo& CBlockHeaderHashMemo::operator=(const CBlockHeaderHashMemo& other)
+{
+    if (this == &other)
+        return *this;
+    CBlockHeaderHashMemo& src = const_cast<CBlockHeaderHashMemo&>(other);
+    // The memo is only a shortcut; if either side is busy, leave it behind
+    if (!TryLock())
+        return *this;
+    fValid = false;
+    if (src.TryLock()) {
+        if (src.fValid) {
+            memcpy(vchHashed, src.vchHashed, sizeof(vchHashed));
+            hash = src.hash;
+            fValid = true;
+        }
+        src.Unlock();
+    }
+    Unlock();
+    return *this;
+}
+
+bool CBlockHeaderHashMemo::Get(const unsigned char* pch, uint256& hashOut)
+{
+    if (!TryLock())
+        return false;
+    bool fFound = fValid && memcmp(vchHashed, pch, sizeof(vchHashed)) == 0;
+    if (fFound)
+        hashOut = hash;
+    Unlock();
+    return fFound;
+}
+
+void CBlockHeaderHashMemo::Set(const unsigned char* pch, const uint256& hashIn)
+{
+    if (!TryLock())
+        return;
+    memcpy(vchHashed, pch, sizeof(vchHashed));
+    hash = hashIn;
+    fValid = true;
+    Unlock();
+}
+
+void CBlockHeaderHashMemo::Clear()
+{
+    if (!TryLock())
+        return;
+    fValid = false;
+    Unlock();
+}
+
+static uint256 ComputeBlockHeaderHash(int32_t nVersion, const char* pbegin, const char* pend)
 {
     switch (nVersion) {
-    case X11_VERSION:
-        return HashX11(BEGIN(nVersion), END(nNonce));
-    case X13_VERSION:
-        return HashX13(BEGIN(nVersion), END(nNonce));
-    case SHA256D_VERSION:
-        return Hash(BEGIN(nVersion), END(nNonce));
-    case BLAKE2S_VERSION:
-        return HashBlake2s(BEGIN(nVersion), END(nNonce));
+    case CBlockHeader::X11_VERSION:
+        return HashX11(pbegin, pend);
+    case CBlockHeader::X13_VERSION:
+        return HashX13(pbegin, pend);
+    case CBlockHeader::SHA256D_VERSION:
+        return Hash(pbegin, pend);
+    case CBlockHeader::BLAKE2S_VERSION:
+        return HashBlake2s(pbegin, pend);
     default:
-        return HashX12(BEGIN(nVersion), END(nNonce));
+        return HashX12(pbegin, pend);
     }
 }
 
+uint256 CBlockHeader::GetHash() const
+{
+    // nVersion through nNonce are laid out back to back, the same bytes the hash is taken over
+    static_assert(sizeof(nVersion) + sizeof(hashPrevBlock) + sizeof(hashMerkleRoot) + sizeof(nTime) + sizeof(nBits) + sizeof(nNonce) == NORMAL_SERIALIZE_SIZE,
+        "header hash memo must cover the serialized header");
+    uint256 hash;
+    if (hashMemo.Get((const unsigned char*)&nVersion, hash)) {
+        nBlockHashesAvoided.fetch_add(1, std::memory_order_relaxed);
+        return hash;
+    }
+
+    hash = ComputeBlockHeaderHash(nVersion, BEGIN(nVersion), END(nNonce));
+    nBlockHashesComputed.fetch_add(1, std::memory_order_relaxed);
+    hashMemo.Set((const unsigned char*)&nVersion, hash);
+    return hash;
+}
+
 unsigned int CBlockHeader::GetStakeEntropyBit() const
 {
     // Take last bit of block hash as entropy bit
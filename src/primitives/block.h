@@ -12,6 +12,39 @@
 #include <tinyformat.h>
 #include <utilstrencodings.h>
 
+#include <atomic>
+
+/**
+ * Memory-only memo of a header's proof-of-work hash, kept with a copy of the
+ * 80 header bytes it was computed from. Any change to a hashed field (nNonce,
+ * nTime, ...) makes those bytes differ, so a stale memo is never returned.
+ * A try-lock guards it: a thread that finds it taken, because another thread
+ * is hashing the same header, hashes without the memo, so a header shared
+ * between threads is never written concurrently.
+ */
+class CBlockHeaderHashMemo
+{
+private:
+    std::atomic<bool> fBusy{false};
+    unsigned char vchHashed[80];
+    uint256 hash;
+    bool fValid;
+
+    bool TryLock() { return !fBusy.exchange(true, std::memory_order_acquire); }
+    void Unlock() { fBusy.store(false, std::memory_order_release); }
+
+public:
+    CBlockHeaderHashMemo() : fValid(false) {}
+    CBlockHeaderHashMemo(const CBlockHeaderHashMemo& other) : fValid(false) { *this = other; }
+    CBlockHeaderHashMemo& operator=(const CBlockHeaderHashMemo& other);
+
+    //! The remembered hash, if it was computed from the header bytes at pch
+    bool Get(const unsigned char* pch, uint256& hashOut);
+    //! Remember hashIn as the hash of the header bytes at pch
+    void Set(const unsigned char* pch, const uint256& hashIn);
+    void Clear();
+};
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -21,6 +54,10 @@
  */
 class CBlockHeader
 {
+private:
+    // memory only
+    mutable CBlockHeaderHashMemo hashMemo;
+
 public:
     // header
     int32_t nVersion;
@@ -86,6 +123,7 @@ public:
         nNonce = 0;
         nFlags = 0;
         fFlags = false;
+        hashMemo.Clear();
     }
 
     bool IsNull() const
@@ -132,12 +170,17 @@ public:
 
     unsigned int GetStakeEntropyBit() const; // galaxycash: entropy bit for stake modifier if chosen by modifier
 
+    //! Computed once and remembered until one of the hashed fields changes
     uint256 GetHash() const;
     uint256 GetPoWHash() const
     {
         return GetHash();
     }
 
+    //! Record hash as the hash of the current fields, for callers that already
+    //! know it (block index, verified disk reads)
+    void SeedHash(const uint256& hash) { hashMemo.Set((const unsigned char*)&nVersion, hash); }
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -220,16 +263,8 @@ public:
 
     CBlockHeader GetBlockHeader() const
     {
-        CBlockHeader block;
-        block.nVersion = nVersion;
-        block.hashPrevBlock = hashPrevBlock;
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.nTime = nTime;
-        block.nBits = nBits;
-        block.nNonce = nNonce;
-        block.nFlags = nFlags;
-        block.fFlags = fFlags;
-        return block;
+        // Copies the remembered hash along with the fields
+        return *this;
     }
 
     void SetAlgorithm(const int32_t algo)
@@ -331,4 +366,8 @@ struct CBlockLocator {
     }
 };
 
+/** Block header hashes computed so far, and those served from a header's remembered hash instead */
+uint64_t GetBlockHashesComputed();
+uint64_t GetBlockHashesAvoided();
+
 #endif // BITCOIN_PRIMITIVES_BLOCK_H
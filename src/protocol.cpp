@@ -53,6 +53,8 @@ const char* CHECKPOINT = "checkpoint";
 const char* DSEE = "dsee";
 const char* MNWINNER = "mnw";
 const char* FILTEREDBLOCK = MERKLEBLOCK;
+const char* SENDCMPCT = "sendcmpct";
+const char* CMPCTBLOCK = "cmpctblock";
 const char* GETBLOCKTXN = "getblocktxn";
 const char* BLOCKTXN = "blocktxn";
 } // namespace NetMsgType
@@ -95,6 +97,8 @@ const static std::string allNetMessageTypes[] = {
     NetMsgType::FEEFILTER,
     NetMsgType::CHECKPOINT,
     NetMsgType::FILTEREDBLOCK,
+    NetMsgType::SENDCMPCT,
+    NetMsgType::CMPCTBLOCK,
     NetMsgType::BLOCKTXN,
     NetMsgType::GETBLOCKTXN};
 
@@ -112,6 +116,7 @@ static const char* GetDataMsgName[] =
     NetMsgType::MASTERNODE_QUORUM,
     NetMsgType::MASTERNODE_ANNOUNCE,
     NetMsgType::MASTERNODE_PING,
+    NetMsgType::CMPCTBLOCK,
 };
 
 const static std::vector<std::string> allNetMessageTypesVec(allNetMessageTypes, allNetMessageTypes + ARRAYLEN(allNetMessageTypes));
@@ -231,6 +236,9 @@ std::string CInv::GetCommand() const
     case MSG_MASTERNODE_PING:
         return NetMsgType::MASTERNODE_PING;
         break;
+    case MSG_CMPCT_BLOCK:
+        return NetMsgType::CMPCTBLOCK;
+        break;
     }
 }
 
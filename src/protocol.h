@@ -254,6 +254,20 @@ extern const char* FEEFILTER;
 
 extern const char* CHECKPOINT;
 
+/**
+ * Contains a 1-byte bool and 8-byte LE version number.
+ * Indicates that a node is willing to provide blocks via "cmpctblock" messages.
+ * May indicate that a node prefers to receive new block announcements via a
+ * "cmpctblock" message rather than an "inv", depending on message contents.
+ * @since protocol version 70014 as described by BIP 152
+ */
+extern const char* SENDCMPCT;
+/**
+ * Contains a CBlockHeaderAndShortTxIDs object - providing a header and
+ * list of "short txids".
+ * @since protocol version 70014 as described by BIP 152
+ */
+extern const char* CMPCTBLOCK;
 /**
  * Contains a BlockTransactionsRequest
  * Peer should respond with "blocktxn" message.
@@ -406,7 +420,8 @@ enum GetDataMsg {
     MSG_MASTERNODE_SCANNING_ERROR,
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
-    MSG_MASTERNODE_PING
+    MSG_MASTERNODE_PING,
+    MSG_CMPCT_BLOCK, //!< Defined in BIP152
 };
 
 
@@ -9,6 +9,7 @@
 #include <consensus/validation.h>
 #include <net.h>
 #include <policy/policy.h>
+#include <txannounce.h>
 #include <txmempool.h>
 #include <validation.h>
 #include <wallet/wallet.h>
@@ -503,10 +504,7 @@ void MultisigDialog::on_sendTransactionButton_clicked()
     if (!AcceptToMemoryPool(mempool, state, tx, &fMissingInputs, false /* bypass_limits */))
         return;
 
-    CInv inv(MSG_TX, tx->GetHash());
-    g_connman->ForEachNode([&inv](CNode* pnode) {
-        pnode->PushInventory(inv);
-    });
+    txAnnounceQueue.Push(mempool, tx->GetHash());
 
     ui->statusLabel->setText(tr("The transaction is sent to galaxycash network."));
 }
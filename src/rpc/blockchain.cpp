@@ -134,7 +134,7 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
 
     result.push_back(Pair("flags", strprintf("%s", blockindex->IsProofOfStake() ? "proof-of-stake" : "proof-of-work")));
-    result.push_back(Pair("proofhash", blockindex->IsProofOfStake() ? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHeader().GetPoWHash().GetHex()));
+    result.push_back(Pair("proofhash", blockindex->IsProofOfStake() ? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex()));
     result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
     result.push_back(Pair("modifier", blockindex->bnStakeModifier.GetHex()));
     result.push_back(Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum)));
@@ -1120,6 +1120,28 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
             "        },\n"
             "     }, ...\n"
             "  ],\n"
+            "  \"headerpipeline\": {          (object) header verification pipeline throughput\n"
+            "     \"batches\": xxxxxx,         (numeric) headers batches hashed\n"
+            "     \"headers\": xxxxxx,         (numeric) headers hashed\n"
+            "     \"hashtime\": xxxxxx,        (numeric) seconds spent hashing headers on the worker pool\n"
+            "     \"accepttime\": xxxxxx,      (numeric) seconds spent on the sequential linkage and contextual checks\n"
+            "     \"headerspersec\": xxxxxx,   (numeric) headers verified per second over both stages\n"
+            "  },\n"
+            "  \"powhashes\": {               (object) block header proof-of-work hashing\n"
+            "     \"computed\": xxxxxx,        (numeric) header hashes computed\n"
+            "     \"avoided\": xxxxxx,         (numeric) header hashes served from a header's remembered hash instead\n"
+            "  },\n"
+            "  \"flushstalls\": {             (object) time cs_main was held to flush the chainstate\n"
+            "     \"flushes\": xxxxxx,         (numeric) chainstate flushes\n"
+            "     \"totaltime\": xxxxxx,       (numeric) seconds cs_main was held, over all flushes\n"
+            "     \"maxtime\": xxxxxx,         (numeric) seconds cs_main was held by the longest flush\n"
+            "     \"pending\": true|false,     (boolean) whether a flush is being written to disk in the background\n"
+            "     \"histogram\": {            (object) flushes by stall time, keyed by upper bound in milliseconds\n"
+            "        \"1\": xxxxxx,\n"
+            "        ...\n"
+            "        \"inf\": xxxxxx\n"
+            "     }\n"
+            "  },\n"
             "  \"warnings\" : \"...\",           (string) any network and blockchain warnings.\n"
             "}\n"
             "\nExamples:\n" +
@@ -1146,6 +1168,33 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
     softforks.push_back(SoftForkDesc("bip34", 2, tip, consensusParams));
     obj.push_back(Pair("softforks", softforks));
 
+    HeaderPipelineStats pipeline = GetHeaderPipelineStats();
+    int64_t nPipelineTime = pipeline.nHashTime + pipeline.nAcceptTime;
+    UniValue headerpipeline(UniValue::VOBJ);
+    headerpipeline.push_back(Pair("batches", pipeline.nBatches));
+    headerpipeline.push_back(Pair("headers", pipeline.nHeaders));
+    headerpipeline.push_back(Pair("hashtime", pipeline.nHashTime * 0.000001));
+    headerpipeline.push_back(Pair("accepttime", pipeline.nAcceptTime * 0.000001));
+    headerpipeline.push_back(Pair("headerspersec", nPipelineTime > 0 ? pipeline.nHeaders * 1000000.0 / nPipelineTime : 0.0));
+    obj.push_back(Pair("headerpipeline", headerpipeline));
+
+    UniValue powhashes(UniValue::VOBJ);
+    powhashes.push_back(Pair("computed", GetBlockHashesComputed()));
+    powhashes.push_back(Pair("avoided", GetBlockHashesAvoided()));
+    obj.push_back(Pair("powhashes", powhashes));
+
+    FlushStallStats flush = GetFlushStallStats();
+    UniValue flushstalls(UniValue::VOBJ);
+    flushstalls.push_back(Pair("flushes", flush.nFlushes));
+    flushstalls.push_back(Pair("totaltime", flush.nStallTime * 0.000001));
+    flushstalls.push_back(Pair("maxtime", flush.nMaxStall * 0.000001));
+    flushstalls.push_back(Pair("pending", pcoinsflush->IsPending()));
+    UniValue histogram(UniValue::VOBJ);
+    for (const auto& bucket : flush.vHistogram)
+        histogram.push_back(Pair(bucket.first >= 0 ? std::to_string(bucket.first) : "inf", bucket.second));
+    flushstalls.push_back(Pair("histogram", histogram));
+    obj.push_back(Pair("flushstalls", flushstalls));
+
     obj.push_back(Pair("warnings", GetWarnings("statusbar")));
     return obj;
 }
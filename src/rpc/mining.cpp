@@ -233,6 +233,22 @@ UniValue getmininginfo(const JSONRPCRequest& request)
             "  \"networkhashps\": nnn,      (numeric) The network hashes per second\n"
             "  \"pooledtx\": n              (numeric) The size of the mempool\n"
             "  \"chain\": \"xxxx\",           (string) current network name as defined in BIP70 (main, test, regtest)\n"
+            "  \"staking\": {               (json object) proof-of-stake minter timings\n"
+            "    \"searches\": n,           (numeric) kernel searches run\n"
+            "    \"kernels\": n,            (numeric) kernels found\n"
+            "    \"searchtime\": n,         (numeric) average time of a search, in microseconds, without holding cs_main\n"
+            "    \"snapshotlock\": n,       (numeric) average time cs_main is held to snapshot the tip and coins for a search, in microseconds\n"
+            "    \"assemblelock\": n,       (numeric) average time cs_main is held to build, check and sign the block of a kernel, in microseconds\n"
+            "    \"maxassemblelock\": n     (numeric) longest such hold, in microseconds\n"
+            "  },\n"
+            "  \"blocktemplate\": {         (json object) block template assembly timings\n"
+            "    \"templates\": n,          (numeric) templates built\n"
+            "    \"rebuilds\": n,           (numeric) templates that selected transactions from the whole mempool rather than updating the last selection\n"
+            "    \"buildtime\": n,          (numeric) average time to build a template, in microseconds\n"
+            "    \"rebuildtime\": n,        (numeric) average time to build a template with a full selection, in microseconds\n"
+            "    \"lastbuildtime\": n,      (numeric) time to build the last template, in microseconds\n"
+            "    \"maxbuildtime\": n        (numeric) longest time to build a template, in microseconds\n"
+            "  },\n"
             "  \"warnings\": \"...\"          (string) any network and blockchain warnings\n"
             "  \"errors\": \"...\"            (string) DEPRECATED. Same as warnings. Only shown when galaxycashd is started with -deprecatedrpc=getmininginfo\n"
             "}\n"
@@ -251,6 +267,24 @@ UniValue getmininginfo(const JSONRPCRequest& request)
     obj.push_back(Pair("networkghps", getnetworkghps(request)));
     obj.push_back(Pair("pooledtx", (uint64_t)mempool.size()));
     obj.push_back(Pair("chain", Params().NetworkIDString()));
+    StakeMinterStats stakeStats = GetStakeMinterStats();
+    UniValue staking(UniValue::VOBJ);
+    staking.push_back(Pair("searches", stakeStats.nSearches));
+    staking.push_back(Pair("kernels", stakeStats.nKernels));
+    staking.push_back(Pair("searchtime", stakeStats.nSearches ? (double)stakeStats.nSearchMicros / stakeStats.nSearches : 0.0));
+    staking.push_back(Pair("snapshotlock", stakeStats.nSearches ? (double)stakeStats.nSnapshotMicros / stakeStats.nSearches : 0.0));
+    staking.push_back(Pair("assemblelock", stakeStats.nKernels ? (double)stakeStats.nAssembleMicros / stakeStats.nKernels : 0.0));
+    staking.push_back(Pair("maxassemblelock", stakeStats.nMaxAssembleMicros));
+    obj.push_back(Pair("staking", staking));
+    BlockTemplateStats templateStats = GetBlockTemplateStats();
+    UniValue blocktemplate(UniValue::VOBJ);
+    blocktemplate.push_back(Pair("templates", templateStats.nTemplates));
+    blocktemplate.push_back(Pair("rebuilds", templateStats.nRebuilds));
+    blocktemplate.push_back(Pair("buildtime", templateStats.nTemplates ? (double)templateStats.nBuildMicros / templateStats.nTemplates : 0.0));
+    blocktemplate.push_back(Pair("rebuildtime", templateStats.nRebuilds ? (double)templateStats.nRebuildMicros / templateStats.nRebuilds : 0.0));
+    blocktemplate.push_back(Pair("lastbuildtime", templateStats.nLastBuildMicros));
+    blocktemplate.push_back(Pair("maxbuildtime", templateStats.nMaxBuildMicros));
+    obj.push_back(Pair("blocktemplate", blocktemplate));
     if (IsDeprecatedRPCEnabled("getmininginfo")) {
         obj.push_back(Pair("errors", GetWarnings("statusbar")));
     } else {
@@ -9,11 +9,14 @@
 #include <core_io.h>
 #include <net.h>
 #include <net_processing.h>
+#include <invpayloadcache.h>
 #include <netbase.h>
+#include <netmessagedispatcher.h>
 #include <policy/policy.h>
 #include <rpc/protocol.h>
 #include <sync.h>
 #include <timedata.h>
+#include <txannounce.h>
 #include <ui_interface.h>
 #include <util.h>
 #include <utilstrencodings.h>
@@ -109,6 +112,19 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
             "    \"bytesrecv_per_msg\": {\n"
             "       \"addr\": n,              (numeric) The total bytes received aggregated by message type\n"
             "       ...\n"
+            "    },\n"
+            "    \"latency_per_msg\": {      (json object) time from receipt until processed, by message type\n"
+            "       \"addr\": {\n"
+            "          \"count\": n,          (numeric) messages processed\n"
+            "          \"totaltime\": n,      (numeric) seconds, over all messages\n"
+            "          \"maxtime\": n,        (numeric) seconds, for the slowest message\n"
+            "          \"histogram\": {       (json object) messages by latency, keyed by upper bound in milliseconds\n"
+            "             \"1\": n,\n"
+            "             ...\n"
+            "             \"inf\": n\n"
+            "          }\n"
+            "       },\n"
+            "       ...\n"
             "    }\n"
             "  }\n"
             "  ,...\n"
@@ -182,6 +198,24 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
         }
         obj.push_back(Pair("bytesrecv_per_msg", recvPerMsgCmd));
 
+        UniValue latencyPerMsgCmd(UniValue::VOBJ);
+        for (const mapMsgCmdLatency::value_type& i : stats.mapRecvLatencyPerMsgCmd) {
+            if (i.second.nCount == 0)
+                continue;
+            UniValue latency(UniValue::VOBJ);
+            latency.push_back(Pair("count", i.second.nCount));
+            latency.push_back(Pair("totaltime", i.second.nTotal * 0.000001));
+            latency.push_back(Pair("maxtime", i.second.nMax * 0.000001));
+            UniValue histogram(UniValue::VOBJ);
+            for (size_t nBucket = 0; nBucket < MESSAGE_LATENCY_BUCKET_COUNT; nBucket++) {
+                std::string strBound = nBucket < MESSAGE_LATENCY_BUCKET_COUNT - 1 ? std::to_string(MESSAGE_LATENCY_BUCKETS[nBucket]) : "inf";
+                histogram.push_back(Pair(strBound, i.second.vHistogram[nBucket]));
+            }
+            latency.push_back(Pair("histogram", histogram));
+            latencyPerMsgCmd.push_back(Pair(i.first, latency));
+        }
+        obj.push_back(Pair("latency_per_msg", latencyPerMsgCmd));
+
         ret.push_back(obj);
     }
 
@@ -376,6 +410,39 @@ UniValue getnettotals(const JSONRPCRequest& request)
     return obj;
 }
 
+UniValue getmessagestats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 0)
+        throw std::runtime_error(
+            "getmessagestats\n"
+            "\nReturns how often each received message type was handled, and the CPU time its handler took.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {           (json object) message type, for each registered type received at least once\n"
+            "    \"calls\": n,           (numeric) messages handled\n"
+            "    \"bytes\": n,           (numeric) payload bytes handled\n"
+            "    \"cputime\": n,         (numeric) seconds of CPU time, over all messages\n"
+            "    \"maxcputime\": n       (numeric) seconds of CPU time, for the costliest message\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getmessagestats", "") + HelpExampleRpc("getmessagestats", ""));
+
+    UniValue obj(UniValue::VOBJ);
+    for (const auto& entry : netMessageDispatcher.GetStats()) {
+        if (entry.second.nCalls == 0)
+            continue;
+        UniValue stats(UniValue::VOBJ);
+        stats.push_back(Pair("calls", entry.second.nCalls));
+        stats.push_back(Pair("bytes", entry.second.nBytes));
+        stats.push_back(Pair("cputime", entry.second.nCPUTime * 0.000001));
+        stats.push_back(Pair("maxcputime", entry.second.nMaxCPUTime * 0.000001));
+        obj.push_back(Pair(entry.first, stats));
+    }
+    return obj;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -422,6 +489,19 @@ UniValue getnetworkinfo(const JSONRPCRequest& request)
             "  }\n"
             "  ,...\n"
             "  ],\n"
+            "  \"invpayloadcache\": {                 (json object) serialized responses kept for getdata requests\n"
+            "    \"entries\": xxxxx,                   (numeric) number of cached objects\n"
+            "    \"bytes\": xxxxx,                     (numeric) total size of the cached messages\n"
+            "    \"hits\": xxxxx,                      (numeric) requests answered from the cache\n"
+            "    \"misses\": xxxxx                     (numeric) requests that serialized the object\n"
+            "  },\n"
+            "  \"txannounce\": {                      (json object) transaction announcements to peers\n"
+            "    \"queued\": xxxxx,                    (numeric) transactions in the announcement queue\n"
+            "    \"announced\": xxxxx,                 (numeric) announcements sent to peers\n"
+            "    \"latency\": xxxxx,                   (numeric) average time from relay to announcement, in milliseconds\n"
+            "    \"ticks\": xxxxx,                     (numeric) batches of announcements prepared\n"
+            "    \"ticktime\": xxxxx                   (numeric) average time spent preparing a batch, in microseconds\n"
+            "  },\n"
             "  \"relayfee\": x.xxxxxxxx,                (numeric) minimum relay fee for transactions in " +
             CURRENCY_UNIT + "/kB\n"
                             "  \"incrementalfee\": x.xxxxxxxx,          (numeric) minimum fee increment for mempool limiting " +
@@ -453,6 +533,21 @@ UniValue getnetworkinfo(const JSONRPCRequest& request)
         obj.push_back(Pair("connections", (int)g_connman->GetNodeCount(CConnman::CONNECTIONS_ALL)));
     }
     obj.push_back(Pair("networks", GetNetworksInfo()));
+    InvPayloadCacheStats cacheStats = invPayloadCache.GetStats();
+    UniValue invCache(UniValue::VOBJ);
+    invCache.push_back(Pair("entries", (uint64_t)cacheStats.nEntries));
+    invCache.push_back(Pair("bytes", (uint64_t)cacheStats.nBytes));
+    invCache.push_back(Pair("hits", cacheStats.nHits));
+    invCache.push_back(Pair("misses", cacheStats.nMisses));
+    obj.push_back(Pair("invpayloadcache", invCache));
+    TxAnnounceStats announceStats = txAnnounceQueue.GetStats();
+    UniValue txAnnounce(UniValue::VOBJ);
+    txAnnounce.push_back(Pair("queued", (uint64_t)announceStats.nQueued));
+    txAnnounce.push_back(Pair("announced", announceStats.nAnnounced));
+    txAnnounce.push_back(Pair("latency", announceStats.nAnnounced ? announceStats.nLatencyMicros / 1000.0 / announceStats.nAnnounced : 0.0));
+    txAnnounce.push_back(Pair("ticks", announceStats.nTicks));
+    txAnnounce.push_back(Pair("ticktime", announceStats.nTicks ? (double)announceStats.nTickMicros / announceStats.nTicks : 0.0));
+    obj.push_back(Pair("txannounce", txAnnounce));
     UniValue localAddresses(UniValue::VARR);
     {
         LOCK(cs_mapLocalHost);
@@ -664,6 +759,7 @@ static const CRPCCommand commands[] =
         {"network", "disconnectnode", &disconnectnode, {"address", "nodeid"}},
         {"network", "getaddednodeinfo", &getaddednodeinfo, {"node"}},
         {"network", "getnettotals", &getnettotals, {}},
+        {"network", "getmessagestats", &getmessagestats, {}},
         {"network", "getnetworkinfo", &getnetworkinfo, {}},
         {"network", "setban", &setban, {"subnet", "command", "bantime", "absolute"}},
         {"network", "listbanned", &listbanned, {}},
@@ -20,6 +20,7 @@
 #include <script/script_error.h>
 #include <script/sign.h>
 #include <script/standard.h>
+#include <txannounce.h>
 #include <txmempool.h>
 #include <uint256.h>
 #include <utilstrencodings.h>
@@ -969,10 +970,7 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
     if (!g_connman)
         throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
 
-    CInv inv(MSG_TX, hashTx);
-    g_connman->ForEachNode([&inv](CNode* pnode) {
-        pnode->PushInventory(inv);
-    });
+    txAnnounceQueue.Push(mempool, hashTx);
 
     return hashTx.GetHex();
 }
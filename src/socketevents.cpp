@@ -0,0 +1,248 @@
+// Copyright (c) 2017-2019 The GalaxyCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <socketevents.h>
+
+#include <netbase.h>
+#include <util.h>
+
+#include <map>
+#include <mutex>
+#include <set>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+namespace {
+
+/** select() over every watched socket; available everywhere, limited to FD_SETSIZE */
+class CSocketEventsSelect final : public CSocketEvents
+{
+private:
+    std::mutex cs;
+    std::map<SOCKET, int> mapInterest;
+
+public:
+    const char* GetName() const override { return "select"; }
+
+    bool IsSelectable(SOCKET hSocket) const override
+    {
+        return IsSelectableSocket(hSocket);
+    }
+
+    bool Add(SOCKET hSocket, int nInterest, bool fLevel) override
+    {
+        if (!IsSelectable(hSocket))
+            return false;
+        std::lock_guard<std::mutex> lock(cs);
+        mapInterest[hSocket] = nInterest;
+        return true;
+    }
+
+    bool Modify(SOCKET hSocket, int nInterest) override
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        auto it = mapInterest.find(hSocket);
+        if (it == mapInterest.end())
+            return false;
+        it->second = nInterest;
+        return true;
+    }
+
+    void Remove(SOCKET hSocket) override
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        mapInterest.erase(hSocket);
+    }
+
+    bool Wait(int64_t nTimeoutMs, std::vector<SocketEvent>& vEvents) override
+    {
+        vEvents.clear();
+
+        struct timeval timeout;
+        timeout.tv_sec = nTimeoutMs / 1000;
+        timeout.tv_usec = (nTimeoutMs % 1000) * 1000;
+
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        fd_set fdsetError;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        SOCKET hSocketMax = 0;
+        std::vector<SOCKET> vSockets;
+        {
+            std::lock_guard<std::mutex> lock(cs);
+            vSockets.reserve(mapInterest.size());
+            for (const auto& entry : mapInterest) {
+                if (entry.second & SOCKET_EVENT_RECV)
+                    FD_SET(entry.first, &fdsetRecv);
+                if (entry.second & SOCKET_EVENT_SEND)
+                    FD_SET(entry.first, &fdsetSend);
+                FD_SET(entry.first, &fdsetError);
+                hSocketMax = std::max(hSocketMax, entry.first);
+                vSockets.push_back(entry.first);
+            }
+        }
+
+        int nSelect = select(vSockets.empty() ? 0 : hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        if (nSelect == SOCKET_ERROR) {
+            if (!vSockets.empty())
+                LogPrintf("socket select error %s\n", NetworkErrorString(WSAGetLastError()));
+            for (SOCKET hSocket : vSockets)
+                vEvents.push_back(SocketEvent{hSocket, SOCKET_EVENT_RECV});
+            return false;
+        }
+        if (nSelect == 0)
+            return true;
+
+        for (SOCKET hSocket : vSockets) {
+            int nEvents = 0;
+            if (FD_ISSET(hSocket, &fdsetRecv))
+                nEvents |= SOCKET_EVENT_RECV;
+            if (FD_ISSET(hSocket, &fdsetSend))
+                nEvents |= SOCKET_EVENT_SEND;
+            if (FD_ISSET(hSocket, &fdsetError))
+                nEvents |= SOCKET_EVENT_ERR;
+            if (nEvents)
+                vEvents.push_back(SocketEvent{hSocket, nEvents});
+        }
+        return true;
+    }
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+/** Linux epoll; the cost of a wakeup depends on the ready sockets only */
+class CSocketEventsEpoll final : public CSocketEvents
+{
+private:
+    //! Events returned by a single epoll_wait; any further ones stay queued for the next call
+    static const int MAX_EVENTS = 1024;
+
+    int fdEpoll;
+    std::vector<struct epoll_event> vReady;
+
+    std::mutex cs;
+    //! Registered sockets, only needed to report them all if epoll_wait fails
+    std::set<SOCKET> setSockets;
+
+    static uint32_t GetEpollFlags(int nInterest, bool fLevel)
+    {
+        uint32_t nFlags = fLevel ? 0 : EPOLLET;
+        if (nInterest & SOCKET_EVENT_RECV)
+            nFlags |= EPOLLIN;
+        if (nInterest & SOCKET_EVENT_SEND)
+            nFlags |= EPOLLOUT;
+        return nFlags;
+    }
+
+    bool Control(int nOp, SOCKET hSocket, int nInterest, bool fLevel)
+    {
+        struct epoll_event event;
+        event.events = GetEpollFlags(nInterest, fLevel);
+        event.data.fd = hSocket;
+        if (epoll_ctl(fdEpoll, nOp, hSocket, &event) != 0) {
+            LogPrintf("epoll_ctl error %s\n", NetworkErrorString(errno));
+            return false;
+        }
+        return true;
+    }
+
+public:
+    CSocketEventsEpoll() : fdEpoll(epoll_create1(EPOLL_CLOEXEC)), vReady(MAX_EVENTS) {}
+    ~CSocketEventsEpoll()
+    {
+        if (fdEpoll >= 0)
+            close(fdEpoll);
+    }
+
+    bool IsValid() const { return fdEpoll >= 0; }
+
+    const char* GetName() const override { return "epoll"; }
+
+    bool IsSelectable(SOCKET hSocket) const override
+    {
+        return hSocket != INVALID_SOCKET;
+    }
+
+    bool Add(SOCKET hSocket, int nInterest, bool fLevel) override
+    {
+        if (!Control(EPOLL_CTL_ADD, hSocket, nInterest, fLevel))
+            return false;
+        std::lock_guard<std::mutex> lock(cs);
+        setSockets.insert(hSocket);
+        return true;
+    }
+
+    bool Modify(SOCKET hSocket, int nInterest) override
+    {
+        return Control(EPOLL_CTL_MOD, hSocket, nInterest, false);
+    }
+
+    void Remove(SOCKET hSocket) override
+    {
+        struct epoll_event event = {};
+        epoll_ctl(fdEpoll, EPOLL_CTL_DEL, hSocket, &event);
+        std::lock_guard<std::mutex> lock(cs);
+        setSockets.erase(hSocket);
+    }
+
+    bool Wait(int64_t nTimeoutMs, std::vector<SocketEvent>& vEvents) override
+    {
+        vEvents.clear();
+        int nReady = epoll_wait(fdEpoll, vReady.data(), vReady.size(), nTimeoutMs);
+        if (nReady < 0) {
+            if (errno == EINTR)
+                return true;
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+            std::lock_guard<std::mutex> lock(cs);
+            for (SOCKET hSocket : setSockets)
+                vEvents.push_back(SocketEvent{hSocket, SOCKET_EVENT_RECV});
+            return false;
+        }
+        vEvents.reserve(nReady);
+        for (int i = 0; i < nReady; i++) {
+            int nEvents = 0;
+            if (vReady[i].events & EPOLLIN)
+                nEvents |= SOCKET_EVENT_RECV;
+            if (vReady[i].events & EPOLLOUT)
+                nEvents |= SOCKET_EVENT_SEND;
+            if (vReady[i].events & (EPOLLERR | EPOLLHUP))
+                nEvents |= SOCKET_EVENT_ERR;
+            vEvents.push_back(SocketEvent{(SOCKET)vReady[i].data.fd, nEvents});
+        }
+        return true;
+    }
+};
+#endif
+
+} // namespace
+
+std::vector<std::string> GetSocketEventsBackends()
+{
+    std::vector<std::string> vBackends;
+#ifdef HAVE_SYS_EPOLL_H
+    vBackends.push_back("epoll");
+#endif
+    vBackends.push_back("select");
+    return vBackends;
+}
+
+std::unique_ptr<CSocketEvents> MakeSocketEvents(const std::string& strBackend)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (strBackend == "epoll") {
+        std::unique_ptr<CSocketEventsEpoll> events(new CSocketEventsEpoll());
+        if (!events->IsValid()) {
+            LogPrintf("epoll_create1 error %s\n", NetworkErrorString(errno));
+            return nullptr;
+        }
+        return std::move(events);
+    }
+#endif
+    if (strBackend == "select")
+        return std::unique_ptr<CSocketEvents>(new CSocketEventsSelect());
+    return nullptr;
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2017-2019 The GalaxyCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef GALAXYCASH_SOCKETEVENTS_H
+#define GALAXYCASH_SOCKETEVENTS_H
+
+#include <compat.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+enum SocketEventFlags {
+    SOCKET_EVENT_RECV = (1 << 0),
+    SOCKET_EVENT_SEND = (1 << 1),
+    //! Error or hangup; always reported, never needs to be requested
+    SOCKET_EVENT_ERR = (1 << 2),
+};
+
+/** Readiness of one socket, as reported by CSocketEvents::Wait */
+struct SocketEvent {
+    SOCKET hSocket;
+    int nEvents;
+};
+
+/**
+ * Readiness notification for the sockets serviced by CConnman::ThreadSocketHandler.
+ *
+ * Sockets are registered once, and their interest is changed when it changes
+ * instead of being rebuilt on every wakeup. Peer sockets are edge-triggered on
+ * backends that support it: readiness is only reported again once the socket
+ * has been drained (recv or send returned less than asked, or would block),
+ * or when its interest is modified while it is ready. Sockets added with
+ * fLevel set, such as listening sockets, are reported for as long as they are
+ * ready.
+ */
+class CSocketEvents
+{
+public:
+    virtual ~CSocketEvents() {}
+
+    virtual const char* GetName() const = 0;
+    //! Whether hSocket can be watched at all; select() cannot go past FD_SETSIZE
+    virtual bool IsSelectable(SOCKET hSocket) const = 0;
+
+    virtual bool Add(SOCKET hSocket, int nInterest, bool fLevel = false) = 0;
+    virtual bool Modify(SOCKET hSocket, int nInterest) = 0;
+    //! Stop watching hSocket; must be called before the socket is closed
+    virtual void Remove(SOCKET hSocket) = 0;
+
+    /**
+     * Wait up to nTimeoutMs for sockets to become ready and return them in vEvents.
+     * Returns false if waiting failed; every watched socket is then reported as
+     * readable, so that reading from them finds the ones in error.
+     */
+    virtual bool Wait(int64_t nTimeoutMs, std::vector<SocketEvent>& vEvents) = 0;
+};
+
+/** Names of the backends available on this platform, preferred one first */
+std::vector<std::string> GetSocketEventsBackends();
+/** Create the named backend, or return nullptr if it is unknown or cannot be set up */
+std::unique_ptr<CSocketEvents> MakeSocketEvents(const std::string& strBackend);
+
+#endif // GALAXYCASH_SOCKETEVENTS_H
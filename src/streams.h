@@ -138,6 +138,64 @@ private:
     size_t nPos;
 };
 
+/** Minimal stream for reading from an existing byte buffer by reference
+ *
+ * The referenced buffer must outlive the reader; nothing is copied.
+ */
+class CVectorReader
+{
+public:
+    /**
+     * @param[in]  nTypeIn     Serialization Type
+     * @param[in]  nVersionIn  Serialization Version (including any flags)
+     * @param[in]  pchDataIn   Start of the referenced bytes
+     * @param[in]  nSizeIn     Number of referenced bytes
+     */
+    CVectorReader(int nTypeIn, int nVersionIn, const unsigned char* pchDataIn, size_t nSizeIn) : nType(nTypeIn), nVersion(nVersionIn), pchData(pchDataIn), nSize(nSizeIn), nPos(0) {}
+
+    CVectorReader(int nTypeIn, int nVersionIn, const std::vector<unsigned char>& vchDataIn) : CVectorReader(nTypeIn, nVersionIn, vchDataIn.data(), vchDataIn.size()) {}
+
+    void read(char* pch, size_t nRead)
+    {
+        if (nRead > nSize - nPos) {
+            throw std::ios_base::failure("CVectorReader::read(): end of data");
+        }
+        memcpy(pch, pchData + nPos, nRead);
+        nPos += nRead;
+    }
+    void ignore(size_t nSkip)
+    {
+        if (nSkip > nSize - nPos) {
+            throw std::ios_base::failure("CVectorReader::ignore(): end of data");
+        }
+        nPos += nSkip;
+    }
+    template <typename T>
+    CVectorReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+    int GetVersion() const
+    {
+        return nVersion;
+    }
+    int GetType() const
+    {
+        return nType;
+    }
+    size_t size() const { return nSize - nPos; }
+    bool empty() const { return nPos == nSize; }
+
+private:
+    const int nType;
+    const int nVersion;
+    const unsigned char* pchData;
+    const size_t nSize;
+    size_t nPos;
+};
+
 /** Double ended buffer combining vector and stream-like interfaces.
  *
  * >> and << read and write unformatted data using the above serialization templates.
@@ -406,6 +464,13 @@ public:
         clear();
     }
 
+    //! Exchange the underlying buffer, e.g. with a recycled one, and start reading it from the beginning
+    void SwapBuffer(CSerializeData& d)
+    {
+        vch.swap(d);
+        nReadPos = 0;
+    }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
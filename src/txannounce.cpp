@@ -0,0 +1,124 @@
+// Copyright (c) 2017-2019 The GalaxyCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <txannounce.h>
+
+#include <txmempool.h>
+#include <utiltime.h>
+
+CTxAnnounceQueue txAnnounceQueue;
+
+bool CompareTxAnnounceOrder::operator()(const TxAnnounceEntryRef& a, const TxAnnounceEntryRef& b) const
+{
+    // std::make_heap produces a max-heap, so return whether a should be announced after b
+    if (a->nCountWithAncestors != b->nCountWithAncestors)
+        return a->nCountWithAncestors > b->nCountWithAncestors;
+    double f1 = (double)a->nModifiedFee * b->nTxSize;
+    double f2 = (double)b->nModifiedFee * a->nTxSize;
+    if (f1 == f2)
+        return a->tx->GetHash() < b->tx->GetHash();
+    return f1 < f2;
+}
+
+void CTxAnnounceQueue::Push(CTxMemPool& pool, const uint256& txid)
+{
+    std::shared_ptr<TxAnnounceEntry> entry = std::make_shared<TxAnnounceEntry>();
+    {
+        LOCK(pool.cs);
+        CTxMemPool::indexed_transaction_set::const_iterator it = pool.mapTx.find(txid);
+        if (it == pool.mapTx.end())
+            return;
+        entry->tx = it->GetSharedTx();
+        entry->nFee = it->GetFee();
+        entry->nModifiedFee = it->GetModifiedFee();
+        entry->nTxSize = it->GetTxSize();
+        entry->nCountWithAncestors = it->GetCountWithAncestors();
+    }
+    entry->nTimeQueued = GetTimeMicros();
+    entry->fRemoved = false;
+
+    std::lock_guard<std::mutex> lock(cs);
+    Expire(entry->nTimeQueued);
+    auto itQueued = mapQueued.find(txid);
+    if (itQueued != mapQueued.end())
+        Drop(itQueued->second);
+    entry->nSequence = nNextSequence++;
+    queue.push_back(entry);
+    mapQueued[txid] = entry;
+}
+
+void CTxAnnounceQueue::Remove(const uint256& txid)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    auto it = mapQueued.find(txid);
+    if (it != mapQueued.end()) {
+        Drop(it->second);
+        mapQueued.erase(it);
+    }
+}
+
+void CTxAnnounceQueue::Drop(const TxAnnounceEntryRef& entry)
+{
+    entry->fRemoved = true;
+    if (queue.empty() || entry->nSequence < queue.front()->nSequence)
+        return;
+    const uint64_t nPos = entry->nSequence - queue.front()->nSequence;
+    if (nPos >= queue.size() || queue[nPos] != entry)
+        return;
+    // Keeps the sequence numbers consecutive, without holding on to the transaction
+    std::shared_ptr<TxAnnounceEntry> placeholder = std::make_shared<TxAnnounceEntry>();
+    placeholder->nSequence = entry->nSequence;
+    placeholder->nFee = 0;
+    placeholder->nModifiedFee = 0;
+    placeholder->nTxSize = 0;
+    placeholder->nCountWithAncestors = 0;
+    placeholder->nTimeQueued = entry->nTimeQueued;
+    placeholder->fRemoved = true;
+    queue[nPos] = std::move(placeholder);
+}
+
+void CTxAnnounceQueue::Expire(int64_t nNow)
+{
+    while (!queue.empty() && (queue.size() > MAX_TX_ANNOUNCE_QUEUE || queue.front()->nTimeQueued + TX_ANNOUNCE_EXPIRY * 1000000 < nNow)) {
+        if (queue.front()->tx) {
+            auto it = mapQueued.find(queue.front()->tx->GetHash());
+            if (it != mapQueued.end() && it->second == queue.front())
+                mapQueued.erase(it);
+        }
+        queue.pop_front();
+    }
+}
+
+uint64_t CTxAnnounceQueue::GetEndSequence() const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    return nNextSequence;
+}
+
+uint64_t CTxAnnounceQueue::GetSince(uint64_t nSequence, std::vector<TxAnnounceEntryRef>& vEntries) const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    if (!queue.empty()) {
+        // Sequence numbers are consecutive, so the cursor maps straight to a position
+        const uint64_t nFront = queue.front()->nSequence;
+        size_t nStart = nSequence > nFront ? std::min<uint64_t>(nSequence - nFront, queue.size()) : 0;
+        vEntries.insert(vEntries.end(), queue.begin() + nStart, queue.end());
+    }
+    return nNextSequence;
+}
+
+void CTxAnnounceQueue::RecordTick(size_t nAnnouncedIn, int64_t nLatencyMicrosIn, int64_t nTickMicrosIn)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    nAnnounced += nAnnouncedIn;
+    nLatencyMicros += nLatencyMicrosIn;
+    nTicks++;
+    nTickMicros += nTickMicrosIn;
+}
+
+TxAnnounceStats CTxAnnounceQueue::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    return TxAnnounceStats{queue.size(), nAnnounced, nLatencyMicros, nTicks, nTickMicros};
+}
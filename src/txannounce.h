@@ -0,0 +1,114 @@
+// Copyright (c) 2017-2019 The GalaxyCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef GALAXYCASH_TXANNOUNCE_H
+#define GALAXYCASH_TXANNOUNCE_H
+
+#include <amount.h>
+#include <primitives/transaction.h>
+#include <uint256.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class CTxMemPool;
+
+/** Seconds a transaction is offered to peers for before it is dropped from the queue */
+static const int64_t TX_ANNOUNCE_EXPIRY = 15 * 60;
+/** Maximum number of transactions waiting in the announcement queue */
+static const size_t MAX_TX_ANNOUNCE_QUEUE = 100000;
+
+/** A transaction to announce, with the mempool data needed to filter and order it */
+struct TxAnnounceEntry {
+    uint64_t nSequence;
+    CTransactionRef tx;
+    //! Fee, as compared against the peer's feefilter
+    CAmount nFee;
+    //! Fee including prioritisation, which decides the order of announcements
+    CAmount nModifiedFee;
+    size_t nTxSize;
+    uint64_t nCountWithAncestors;
+    //! When it was queued, in microseconds
+    int64_t nTimeQueued;
+    //! Set once it has left the mempool or has been queued again; it is no longer worth announcing
+    mutable std::atomic<bool> fRemoved;
+};
+
+typedef std::shared_ptr<const TxAnnounceEntry> TxAnnounceEntryRef;
+
+/**
+ * Max-heap order of announcements: parents before children, then by fee rate,
+ * the same order CTxMemPool::CompareDepthAndScore gives without the mempool lock.
+ */
+struct CompareTxAnnounceOrder {
+    bool operator()(const TxAnnounceEntryRef& a, const TxAnnounceEntryRef& b) const;
+};
+
+struct TxAnnounceStats {
+    size_t nQueued;
+    uint64_t nAnnounced;
+    //! Sum of the time between queueing and announcing, over all announcements
+    int64_t nLatencyMicros;
+    //! Number of trickles, and the time spent selecting what to announce in them
+    uint64_t nTicks;
+    int64_t nTickMicros;
+};
+
+/**
+ * Transactions waiting to be announced to peers.
+ *
+ * Every relayed transaction is appended with a sequence number, instead
+ * of being inserted into a set on every peer. Each peer keeps a cursor into the
+ * queue (CNode::nTxAnnounceCursor): all entries before it have been announced
+ * to it or passed over, and the entries from it on are the candidates for its
+ * next trickle. Fee and ancestor count are recorded when the transaction is
+ * queued, and entries are flagged when they leave the mempool, so selecting
+ * a trickle doesn't need the mempool lock. (It still runs in SendMessages,
+ * under cs_main.) A removed entry is replaced in the queue by a placeholder
+ * without the transaction, which frees the transaction once no trickle is
+ * using the entry anymore.
+ */
+class CTxAnnounceQueue
+{
+public:
+    /**
+     * Queue txid for announcement, if it is in pool. A transaction that is
+     * already queued is moved to the end, so that it is offered again to the
+     * peers that passed over it (wallet rebroadcasts).
+     */
+    void Push(CTxMemPool& pool, const uint256& txid);
+    /** Stop announcing txid; it has left the mempool */
+    void Remove(const uint256& txid);
+
+    /** Sequence number of the next transaction to be queued; new peers start here */
+    uint64_t GetEndSequence() const;
+    /** Append the entries from nSequence on to vEntries, and return GetEndSequence() */
+    uint64_t GetSince(uint64_t nSequence, std::vector<TxAnnounceEntryRef>& vEntries) const;
+
+    void RecordTick(size_t nAnnounced, int64_t nLatencyMicros, int64_t nTickMicros);
+    TxAnnounceStats GetStats() const;
+
+private:
+    void Expire(int64_t nNow);
+    //! Flag entry and put a placeholder without the transaction in its place
+    void Drop(const TxAnnounceEntryRef& entry);
+
+    mutable std::mutex cs;
+    std::deque<TxAnnounceEntryRef> queue;
+    //! Queued entries by txid, to flag them on removal
+    std::map<uint256, TxAnnounceEntryRef> mapQueued;
+    uint64_t nNextSequence = 0;
+
+    uint64_t nAnnounced = 0;
+    int64_t nLatencyMicros = 0;
+    uint64_t nTicks = 0;
+    int64_t nTickMicros = 0;
+};
+
+extern CTxAnnounceQueue txAnnounceQueue;
+
+#endif // GALAXYCASH_TXANNOUNCE_H
@@ -24,6 +24,7 @@ static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
+static const char DB_STAKEINPUT = 'k';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
@@ -90,6 +91,13 @@ std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    bool ret = WriteCoins(mapCoins, hashBlock);
+    mapCoins.clear();
+    return ret;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap& mapCoins, const uint256& hashBlock)
 {
     CDBBatch batch(db);
     size_t count = 0;
@@ -115,7 +123,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     batch.Erase(DB_BEST_BLOCK);
     batch.Write(DB_HEAD_BLOCKS, std::vector<uint256>{hashBlock, old_tip});
 
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
             CoinEntry entry(&it->first);
             if (it->second.coin.IsSpent())
@@ -125,8 +133,6 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
         if (batch.SizeEstimate() > batch_size) {
             LogPrint(BCLog::COINDB, "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
             db.WriteBatch(batch);
@@ -156,6 +162,131 @@ size_t CCoinsViewDB::EstimateSize() const
     return db.EstimateSize(DB_COIN, (char)(DB_COIN + 1));
 }
 
+CCoinsViewBackgroundFlush::CCoinsViewBackgroundFlush(CCoinsViewDB* dbIn) : CCoinsViewBacked(dbIn), db(dbIn), fPending(false), fFailed(false), fShutdown(false)
+{
+    threadFlush = std::thread(&TraceThread<std::function<void()>>, "coinsflush", std::function<void()>(std::bind(&CCoinsViewBackgroundFlush::ThreadFlush, this)));
+}
+
+CCoinsViewBackgroundFlush::~CCoinsViewBackgroundFlush()
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        fShutdown = true;
+    }
+    cond.notify_all();
+    threadFlush.join();
+}
+
+void CCoinsViewBackgroundFlush::ThreadFlush()
+{
+    std::unique_lock<std::mutex> lock(cs);
+    while (true) {
+        cond.wait(lock, [this] { return fPending || fShutdown; });
+        // A pending snapshot is always committed before shutting down.
+        if (!fPending)
+            return;
+
+        // mapPending is not modified while fPending is set, so it can be read
+        // here without the lock, concurrently with lookups.
+        lock.unlock();
+        int64_t nStart = GetTimeMicros();
+        bool fOk = false;
+        try {
+            fOk = db->WriteCoins(mapPending, hashPending);
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        LogPrint(BCLog::COINDB, "Background flush of %u coins for %s took %.2fms\n", (unsigned int)mapPending.size(), hashPending.ToString(), (GetTimeMicros() - nStart) * 0.001);
+        if (!fOk) {
+            // Keep the snapshot: lookups still need the coins it holds, and
+            // the database keeps its DB_HEAD_BLOCKS marker, so the blocks are
+            // replayed on the next start. Writers are refused from now on.
+            AbortNode("Failed to write to coin database");
+            lock.lock();
+            fFailed = true;
+            cond.notify_all();
+            cond.wait(lock, [this] { return fShutdown; });
+            return;
+        }
+        lock.lock();
+
+        mapPending.clear();
+        fPending = false;
+        cond.notify_all();
+    }
+}
+
+bool CCoinsViewBackgroundFlush::GetCoin(const COutPoint& outpoint, Coin& coin) const
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(outpoint);
+            if (it != mapPending.end()) {
+                coin = it->second.coin;
+                return !coin.IsSpent();
+            }
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewBackgroundFlush::HaveCoin(const COutPoint& outpoint) const
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(outpoint);
+            if (it != mapPending.end())
+                return !it->second.coin.IsSpent();
+        }
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewBackgroundFlush::GetBestBlock() const
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (fPending)
+            return hashPending;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewBackgroundFlush::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    std::unique_lock<std::mutex> lock(cs);
+    cond.wait(lock, [this] { return !fPending || fFailed; });
+    if (fFailed)
+        return false;
+    mapPending.swap(mapCoins);
+    mapCoins.clear();
+    hashPending = hashBlock;
+    fPending = true;
+    cond.notify_all();
+    return true;
+}
+
+CCoinsViewCursor* CCoinsViewBackgroundFlush::Cursor() const
+{
+    Wait();
+    return base->Cursor();
+}
+
+bool CCoinsViewBackgroundFlush::Wait() const
+{
+    std::unique_lock<std::mutex> lock(cs);
+    cond.wait(lock, [this] { return !fPending || fFailed; });
+    return !fFailed;
+}
+
+bool CCoinsViewBackgroundFlush::IsPending() const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    return fPending;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false)
 {
 }
@@ -264,6 +395,46 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadStakeInput(const COutPoint& outpoint, CDiskStakeInput& input)
+{
+    return Read(std::make_pair(DB_STAKEINPUT, outpoint), input);
+}
+
+bool CBlockTreeDB::WriteStakeInputs(const std::vector<std::pair<COutPoint, CDiskStakeInput>>& vect)
+{
+    CDBBatch batch(*this);
+    for (const auto& entry : vect) {
+        if (entry.second.IsNull())
+            batch.Erase(std::make_pair(DB_STAKEINPUT, entry.first));
+        else
+            batch.Write(std::make_pair(DB_STAKEINPUT, entry.first), entry.second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::EraseAllStakeInputs()
+{
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(DB_STAKEINPUT);
+
+    size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    CDBBatch batch(*this);
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, COutPoint> key;
+        if (!pcursor->GetKey(key) || key.first != DB_STAKEINPUT)
+            break;
+        batch.Erase(key);
+        if (batch.SizeEstimate() > batch_size) {
+            if (!WriteBatch(batch))
+                return false;
+            batch.Clear();
+        }
+        pcursor->Next();
+    }
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string& name, bool fValue)
 {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
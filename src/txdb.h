@@ -12,7 +12,10 @@
 
 #include <map>
 #include <memory>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -68,6 +71,51 @@ struct CDiskTxPos : public CDiskBlockPos {
     }
 };
 
+/** What the kernel and coin age checks need to know about an unspent
+ *  transaction output, kept in the block tree DB so that they do not have to
+ *  read the creating transaction back from the block files. Entries are erased
+ *  when the output is spent; the script stays in the UTXO set. */
+struct CDiskStakeInput {
+    uint32_t nTime;      //! time of the transaction that created the output
+    uint32_t nBlockTime; //! time of the block that contains that transaction
+    int nHeight;         //! height of that block
+    CAmount nValue;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        READWRITE(VARINT(nTime));
+        READWRITE(VARINT(nBlockTime));
+        READWRITE(VARINT(nHeight));
+        READWRITE(VARINT(nValue));
+    }
+
+    CDiskStakeInput(uint32_t nTimeIn, uint32_t nBlockTimeIn, int nHeightIn, CAmount nValueIn) : nTime(nTimeIn), nBlockTime(nBlockTimeIn), nHeight(nHeightIn), nValue(nValueIn)
+    {
+    }
+
+    CDiskStakeInput()
+    {
+        SetNull();
+    }
+
+    //! A null entry stands for an erased one in a pending write
+    void SetNull()
+    {
+        nTime = 0;
+        nBlockTime = 0;
+        nHeight = -1;
+        nValue = 0;
+    }
+
+    bool IsNull() const
+    {
+        return nHeight == -1;
+    }
+};
+
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB final : public CCoinsView
 {
@@ -84,11 +132,57 @@ public:
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) override;
     CCoinsViewCursor* Cursor() const override;
 
+    //! Write the dirty entries of mapCoins without modifying it, leaving the database consistent with hashBlock.
+    bool WriteCoins(const CCoinsMap& mapCoins, const uint256& hashBlock);
+
     //! Attempt to update from an older database format. Returns whether an error occurred.
     bool Upgrade();
     size_t EstimateSize() const override;
 };
 
+/**
+ * CCoinsView that commits flushed caches to the coin database on a background thread.
+ *
+ * BatchWrite takes over the contents of the flushed map in constant time and
+ * returns, so the caller does not hold cs_main while the database is written.
+ * Until the write has completed, lookups are answered from the taken-over
+ * snapshot first. Only one snapshot is in flight at a time: a further
+ * BatchWrite waits for the previous one to be committed. The database keeps
+ * its DB_HEAD_BLOCKS marker while a snapshot is being written, so a crash
+ * in between is recovered by ReplayBlocks as with a synchronous flush.
+ */
+class CCoinsViewBackgroundFlush final : public CCoinsViewBacked
+{
+private:
+    CCoinsViewDB* db;
+
+    mutable std::mutex cs;
+    mutable std::condition_variable cond;
+    CCoinsMap mapPending;   //!< snapshot being committed; only modified while !fPending
+    uint256 hashPending;
+    bool fPending;
+    bool fFailed;           //!< committing mapPending failed; it stays pending and further writes are refused
+    bool fShutdown;
+    std::thread threadFlush;
+
+    void ThreadFlush();
+
+public:
+    explicit CCoinsViewBackgroundFlush(CCoinsViewDB* dbIn);
+    ~CCoinsViewBackgroundFlush();
+
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const override;
+    bool HaveCoin(const COutPoint& outpoint) const override;
+    uint256 GetBestBlock() const override;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) override;
+    CCoinsViewCursor* Cursor() const override;
+
+    //! Block until the snapshot in flight, if any, is committed. Returns false if committing it failed.
+    bool Wait() const;
+    //! Whether a snapshot is currently being committed
+    bool IsPending() const;
+};
+
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
 class CCoinsViewDBCursor : public CCoinsViewCursor
 {
@@ -126,6 +220,9 @@ public:
     bool ReadReindexing(bool &fReindexing);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &vect);
+    bool ReadStakeInput(const COutPoint &outpoint, CDiskStakeInput &input);
+    bool WriteStakeInputs(const std::vector<std::pair<COutPoint, CDiskStakeInput> > &vect);
+    bool EraseAllStakeInputs();
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex);
@@ -23,6 +23,8 @@ int64_t GetTime();
 int64_t GetTimeMillis();
 int64_t GetTimeMicros();
 int64_t GetSystemTimeInSeconds(); // Like GetTime(), but not mockable
+/** CPU time used by the calling thread in microseconds, or 0 where the platform does not tell */
+int64_t GetThreadCPUTimeMicros();
 void SetMockTime(int64_t nMockTimeIn);
 int64_t GetMockTime();
 void MilliSleep(int64_t n);
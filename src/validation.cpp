@@ -12,9 +12,12 @@
 #include <consensus/merkle.h>
 #include <consensus/tx_verify.h>
 #include <consensus/validation.h>
+#include <crypto/common.h>
 #include <cuckoocache.h>
+#include <galaxycash.h>
 #include <hash.h>
 #include <init.h>
+#include <leveldb/util/crc32c.h>
 #include <masternode.h>
 #include <memory>
 #include <net_processing.h>
@@ -46,8 +49,16 @@
 
 
 #include <future>
+#include <list>
 #include <sstream>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/thread.hpp>
@@ -167,7 +178,7 @@ public:
 
     bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams, std::shared_ptr<const CBlock> pblock);
 
-    bool AcceptBlockHeader(const CBlockHeader& block, bool fProofOfStake, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fOldClient = false);
+    bool AcceptBlockHeader(const CBlockHeader& block, const uint256& hash, bool fProofOfStake, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fOldClient = false);
     bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock, bool fCheckPoS = true);
 
     // Block (dis)connection on a given view:
@@ -223,6 +234,7 @@ bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
+bool fMmapBlocks = DEFAULT_MMAP_BLOCKS;
 size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
@@ -259,6 +271,9 @@ std::set<CBlockIndex*> setDirtyBlockIndex;
 
 /** Dirty block file entries. */
 std::set<int> setDirtyFileInfo;
+
+/** Stake input index entries written (or erased, when null) since the last chainstate flush. */
+std::unordered_map<COutPoint, CDiskStakeInput, SaltedOutpointHasher> mapDirtyStakeInputs;
 } // namespace
 
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator)
@@ -279,6 +294,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 std::unique_ptr<CCoinsViewDB> pcoinsdbview;
+std::unique_ptr<CCoinsViewBackgroundFlush> pcoinsflush;
 std::unique_ptr<CCoinsViewCache> pcoinsTip;
 std::unique_ptr<CBlockTreeDB> pblocktree;
 
@@ -294,6 +310,23 @@ static bool FlushStateToDisk(const CChainParams& chainParams, CValidationState&
 bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck>* pvChecks = nullptr);
 static FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 
+/** Bytes of a blk/rev record, pointing into a memory-mapped block file, the per-thread read buffer or a buffer of its own */
+struct CDiskRecord {
+    std::shared_ptr<const void> mapping; //!< keeps the mapped file or oversized buffer alive while the record is in use
+    const unsigned char* pch;
+    size_t nSize;
+
+    CDiskRecord() : pch(nullptr), nSize(0) {}
+};
+
+static bool ReadDiskRecord(const CDiskBlockPos& pos, const char* prefix, size_t nTrailer, CDiskRecord& record);
+static bool ReadDiskFile(const CDiskBlockPos& pos, const char* prefix, unsigned char* pch, size_t nSize);
+
+//! Per-thread buffer for blk/rev reads, reused across calls to avoid reallocating for every block
+static thread_local std::vector<unsigned char> vchDiskReadBuffer;
+//! Largest read served from vchDiskReadBuffer; larger (undo) records get a buffer of their own
+static const size_t MAX_DISK_READ_BUFFER = MAX_BLOCK_SERIALIZED_SIZE + 64;
+
 bool CheckFinalTx(const CTransaction& tx, int flags)
 {
     AssertLockHeld(cs_main);
@@ -774,17 +807,9 @@ bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (const std::exception& e) {
-                    return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-                }
+                if (!ReadTransactionFromDisk(postx, header, txOut))
+                    return false;
                 hashBlock = header.GetHash();
                 if (txOut->GetHash() != hash)
                     return error("%s: txid mismatch", __func__);
@@ -839,7 +864,13 @@ static bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMes
     if (fileOutPos < 0)
         return error("WriteBlockToDisk: ftell failed");
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+    ssBlock.reserve(nSize);
+    ssBlock << block;
+    fileout.write(ssBlock.data(), ssBlock.size());
+
+    // Write checksum, so reads can skip rehashing the header
+    fileout << leveldb::crc32c::Mask(leveldb::crc32c::Value(ssBlock.data(), ssBlock.size()));
 
     return true;
 }
@@ -848,14 +879,47 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+    // Read block record
+    CDiskRecord record;
+    if (!ReadDiskRecord(pos, "blk", 0, record))
+        return error("ReadBlockFromDisk: failed to read block at %s", pos.ToString());
+
+    try {
+        CVectorReader(SER_DISK, CLIENT_VERSION, record.pch, record.nSize) >> block;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
+/** Cheap check that a header read from disk is the one pindex describes */
+static bool BlockHeaderMatchesIndex(const CBlockHeader& header, const CBlockIndex* pindex)
+{
+    const uint256 hashPrev = pindex->pprev ? pindex->pprev->GetBlockHash() : uint256();
+    return header.nVersion == pindex->nVersion && header.hashPrevBlock == hashPrev && header.hashMerkleRoot == pindex->hashMerkleRoot &&
+           header.nTime == pindex->nTime && header.nBits == pindex->nBits && header.nNonce == pindex->nNonce;
+}
+
+/** Read a block record written with a trailing checksum (BLOCK_HAVE_CHECKSUM) and verify it */
+static bool ReadBlockFromDiskChecked(CBlock& block, const CDiskBlockPos& pos, int32_t nFlags)
+{
+    block.SetNull();
+    // Deserialization hashes the header to work out the block flags unless
+    // they are already known; take them from the index
+    block.nFlags = nFlags;
+    block.fFlags = true;
+
+    CDiskRecord record;
+    if (!ReadDiskRecord(pos, "blk", sizeof(uint32_t), record))
+        return error("%s: failed to read block at %s", __func__, pos.ToString());
+
+    const size_t nSize = record.nSize - sizeof(uint32_t);
+    if (leveldb::crc32c::Unmask(ReadLE32(record.pch + nSize)) != leveldb::crc32c::Value((const char*)record.pch, nSize))
+        return error("%s: checksum mismatch at %s", __func__, pos.ToString());
 
-    // Read block
     try {
-        filein >> block;
+        CVectorReader(SER_DISK, CLIENT_VERSION, record.pch, nSize) >> block;
     } catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
     }
@@ -863,6 +927,80 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    block.clear();
+    if (pindex->GetBlockHash() == consensusParams.hashGenesisBlock) {
+        CVectorWriter(SER_DISK, CLIENT_VERSION, block, 0, Params().GenesisBlock());
+        return true;
+    }
+
+    CDiskBlockPos blockPos;
+    uint32_t nStatus;
+    {
+        LOCK(cs_main);
+        blockPos = pindex->GetBlockPos();
+        nStatus = pindex->nStatus;
+    }
+
+    const bool fChecksum = nStatus & BLOCK_HAVE_CHECKSUM;
+    CDiskRecord record;
+    if (!ReadDiskRecord(blockPos, "blk", fChecksum ? sizeof(uint32_t) : 0, record))
+        return error("%s: failed to read block at %s", __func__, blockPos.ToString());
+    const size_t nSize = record.nSize - (fChecksum ? sizeof(uint32_t) : 0);
+    if (nSize < (size_t)CBlockHeader::NORMAL_SERIALIZE_SIZE)
+        return error("%s: invalid block size %u at %s", __func__, nSize, blockPos.ToString());
+    if (fChecksum && leveldb::crc32c::Unmask(ReadLE32(record.pch + nSize)) != leveldb::crc32c::Value((const char*)record.pch, nSize))
+        return error("%s: checksum mismatch at %s", __func__, blockPos.ToString());
+
+    // Same guarantee as ReadBlockFromDisk: checksummed records only need their
+    // header matched against the index, older ones get the header rehashed.
+    CBlockHeader header;
+    try {
+        CVectorReader(SER_DISK, CLIENT_VERSION, record.pch, CBlockHeader::NORMAL_SERIALIZE_SIZE) >> header;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), blockPos.ToString());
+    }
+    if (fChecksum ? !BlockHeaderMatchesIndex(header, pindex) : header.GetHash() != pindex->GetBlockHash())
+        return error("%s: header doesn't match index for %s at %s", __func__, pindex->ToString(), blockPos.ToString());
+
+    block.assign(record.pch, record.pch + nSize);
+    return true;
+}
+
+bool ReadTransactionFromDisk(const CDiskTxPos& postx, CBlockHeader& header, CTransactionRef& tx)
+{
+    // Block size, from the record header preceding the block
+    unsigned char buf[sizeof(uint32_t)];
+    if (postx.nPos < sizeof(buf) || !ReadDiskFile(CDiskBlockPos(postx.nFile, postx.nPos - sizeof(buf)), "blk", buf, sizeof(buf)))
+        return error("%s: failed to read block size at %s", __func__, postx.ToString());
+    const uint32_t nBlockSize = ReadLE32(buf);
+    const size_t nTxPos = CBlockHeader::NORMAL_SERIALIZE_SIZE + postx.nTxOffset;
+    if (nBlockSize <= nTxPos || nBlockSize > MAX_BLOCK_SERIALIZED_SIZE)
+        return error("%s: invalid block size %u at %s", __func__, nBlockSize, postx.ToString());
+
+    // Header and the transaction, which starts nTxOffset bytes after it. Only
+    // the first few KiB are read, unless the transaction turns out to be larger.
+    std::vector<unsigned char>& vch = vchDiskReadBuffer;
+    size_t nRead = std::min<size_t>(nBlockSize, nTxPos + 4096);
+    while (true) {
+        vch.resize(nRead);
+        if (!ReadDiskFile(postx, "blk", vch.data(), nRead))
+            return error("%s: failed to read transaction at %s", __func__, postx.ToString());
+        try {
+            CVectorReader reader(SER_DISK, CLIENT_VERSION, vch);
+            reader >> header;
+            reader.ignore(postx.nTxOffset);
+            reader >> tx;
+            return true;
+        } catch (const std::exception& e) {
+            if (nRead == nBlockSize)
+                return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), postx.ToString());
+            nRead = nBlockSize;
+        }
+    }
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
 {
     if (pindex->GetBlockHash() == consensusParams.hashGenesisBlock) {
@@ -873,9 +1011,26 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     }
 
     CDiskBlockPos blockPos;
+    uint32_t nStatus;
+    int32_t nFlags;
     {
         LOCK(cs_main);
         blockPos = pindex->GetBlockPos();
+        nStatus = pindex->nStatus;
+        nFlags = pindex->nFlags;
+    }
+
+    // The checksum vouches for the record; comparing the header fields with the
+    // index is enough to know it is the right block, without the slow PoW hash.
+    if (nStatus & BLOCK_HAVE_CHECKSUM) {
+        if (!ReadBlockFromDiskChecked(block, blockPos, nFlags))
+            return false;
+        if (!BlockHeaderMatchesIndex(block, pindex))
+            return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): header doesn't match index for %s at %s",
+                pindex->ToString(), blockPos.ToString());
+        // The fields match the index, so its hash is this block's
+        block.SeedHash(pindex->GetBlockHash());
+        return true;
     }
 
     if (!ReadBlockFromDisk(block, blockPos, consensusParams))
@@ -1131,6 +1286,30 @@ bool CScriptCheck::operator()()
     return VerifyScript(scriptSig, m_tx_out.scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, m_tx_out.nValue, cacheStore, *txdata), &error);
 }
 
+bool CStakeCheck::operator()()
+{
+    if (pblock)
+        return CheckBlockSignature(*pblock);
+
+    TransactionSignatureChecker checker(ptxTo, 0, m_tx_out.nValue, PrecomputedTransactionData(*ptxTo));
+    return VerifyScript(ptxTo->vin[0].scriptSig, m_tx_out.scriptPubKey, SCRIPT_VERIFY_P2SH, checker, nullptr);
+}
+
+bool CBlockCheck::operator()()
+{
+    switch (type) {
+    case CHECK_SCRIPT:
+        return script();
+    case CHECK_STAKE:
+        return stake();
+    case CHECK_GALAXYCASH_TX:
+        return gchtx();
+    case CHECK_HEADER_HASH:
+        return header();
+    }
+    return true;
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -1279,31 +1458,32 @@ static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex)
         return error("%s: no undo data available", __func__);
     }
 
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenUndoFile failed", __func__);
+    // Read undo record and its trailing checksum
+    CDiskRecord record;
+    if (!ReadDiskRecord(pos, "rev", sizeof(uint256), record))
+        return error("%s: failed to read undo data at %s", __func__, pos.ToString());
+    const size_t nSize = record.nSize - sizeof(uint256);
+
+    // Verify checksum over the bytes as stored, as reserializing may lose data
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << pindex->pprev->GetBlockHash();
+    hasher.write((const char*)record.pch, nSize);
+    if (memcmp(hasher.GetHash().begin(), record.pch + nSize, sizeof(uint256)))
+        return error("%s: Checksum mismatch", __func__);
 
-    // Read block
-    uint256 hashChecksum;
-    CHashVerifier<CAutoFile> verifier(&filein); // We need a CHashVerifier as reserializing may lose data
     try {
-        verifier << pindex->pprev->GetBlockHash();
-        verifier >> blockundo;
-        filein >> hashChecksum;
+        CVectorReader(SER_DISK, CLIENT_VERSION, record.pch, nSize) >> blockundo;
     } catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s", __func__, e.what());
     }
 
-    // Verify checksum
-    if (hashChecksum != verifier.GetHash())
-        return error("%s: Checksum mismatch", __func__);
-
     return true;
 }
 
+} // namespace
+
 /** Abort with a message */
-bool AbortNode(const std::string& strMessage, const std::string& userMessage = "")
+bool AbortNode(const std::string& strMessage, const std::string& userMessage)
 {
     SetMiscWarning(strMessage);
     LogPrintf("*** %s\n", strMessage);
@@ -1320,8 +1500,6 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
     return state.Error(strMessage);
 }
 
-} // namespace
-
 /**
  * Restore the UTXO in a Coin at a given COutPoint
  * @param undo The Coin to be restored.
@@ -1481,7 +1659,143 @@ static bool WriteTxIndexDataForBlock(const CBlock& block, CValidationState& stat
     return true;
 }
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+// galaxycash: the stake input index follows the UTXO set. A block erases the
+// entries of the outputs it spends and adds the ones it creates; the changes
+// are kept in mapDirtyStakeInputs and written out with the chainstate.
+static void WriteStakeIndexDataForBlock(const CBlock& block, CBlockIndex* pindex)
+{
+    for (const CTransactionRef& tx : block.vtx) {
+        if (!tx->IsCoinBase()) {
+            for (const CTxIn& txin : tx->vin)
+                mapDirtyStakeInputs[txin.prevout].SetNull();
+        }
+        const uint256& hash = tx->GetHash();
+        for (unsigned int i = 0; i < tx->vout.size(); i++) {
+            if (tx->vout[i].IsEmpty() || tx->vout[i].scriptPubKey.IsUnspendable())
+                continue;
+            mapDirtyStakeInputs[COutPoint(hash, i)] = CDiskStakeInput(tx->nTime, pindex->nTime, pindex->nHeight, tx->vout[i].nValue);
+        }
+    }
+}
+
+// Erase the entries of the block's outputs and bring back the ones of the
+// outputs it spent, which DisconnectBlock has restored into view from the undo data
+static void UndoStakeIndexDataForBlock(const CBlock& block, const CBlockIndex* pindex, const CCoinsViewCache& view)
+{
+    for (auto it = block.vtx.rbegin(); it != block.vtx.rend(); ++it) {
+        const CTransaction& tx = **it;
+        const uint256& hash = tx.GetHash();
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+            mapDirtyStakeInputs[COutPoint(hash, i)].SetNull();
+        if (tx.IsCoinBase())
+            continue;
+        for (const CTxIn& txin : tx.vin) {
+            const Coin& coin = view.AccessCoin(txin.prevout);
+            if (coin.IsSpent() || coin.out.IsEmpty())
+                continue;
+            const CBlockIndex* pindexFrom = pindex->GetAncestor(coin.nHeight);
+            mapDirtyStakeInputs[txin.prevout] = CDiskStakeInput(coin.nTime, pindexFrom->nTime, coin.nHeight, coin.out.nValue);
+        }
+    }
+}
+
+static bool FlushStakeIndex()
+{
+    if (mapDirtyStakeInputs.empty())
+        return true;
+    std::vector<std::pair<COutPoint, CDiskStakeInput>> vInputs(mapDirtyStakeInputs.begin(), mapDirtyStakeInputs.end());
+    if (!pblocktree->WriteStakeInputs(vInputs))
+        return false;
+    mapDirtyStakeInputs.clear();
+    return true;
+}
+
+bool LoadStakeIndex(bool fReset)
+{
+    LOCK(cs_main);
+    bool fBuilt = false;
+    if (!fReset && pblocktree->ReadFlag("stakeindex", fBuilt) && fBuilt)
+        return true;
+
+    // The index is built from the UTXO set, so everything has to be on disk first
+    CValidationState state;
+    if (!FlushStateToDisk(Params(), state, FLUSH_STATE_ALWAYS))
+        return false;
+
+    LogPrintf("Building stake input index...\n");
+    if (!pblocktree->EraseAllStakeInputs())
+        return error("%s: failed to erase stake input index", __func__);
+
+    std::unique_ptr<CCoinsViewCursor> pcursor(pcoinsTip->Cursor());
+    std::vector<std::pair<COutPoint, CDiskStakeInput>> vInputs;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        COutPoint key;
+        Coin coin;
+        if (!pcursor->GetKey(key) || !pcursor->GetValue(coin))
+            return error("%s: unable to read value", __func__);
+        if (!coin.out.IsEmpty() && coin.nHeight <= chainActive.Height())
+            vInputs.emplace_back(key, CDiskStakeInput(coin.nTime, chainActive[coin.nHeight]->nTime, coin.nHeight, coin.out.nValue));
+        if (vInputs.size() >= 100000) {
+            if (!pblocktree->WriteStakeInputs(vInputs))
+                return error("%s: failed to write stake input index", __func__);
+            vInputs.clear();
+        }
+        pcursor->Next();
+    }
+    if (!pblocktree->WriteStakeInputs(vInputs) || !pblocktree->WriteFlag("stakeindex", true))
+        return error("%s: failed to write stake input index", __func__);
+    return true;
+}
+
+bool GetStakeInput(const COutPoint& prevout, CDiskStakeInput& input, CScript* pscriptPubKey)
+{
+    {
+        // The stake minter calls this without holding cs_main
+        LOCK(cs_main);
+        auto it = mapDirtyStakeInputs.find(prevout);
+        bool fFound = it != mapDirtyStakeInputs.end() ? !it->second.IsNull() : pblocktree->ReadStakeInput(prevout, input);
+        if (fFound) {
+            if (it != mapDirtyStakeInputs.end())
+                input = it->second;
+            if (!pscriptPubKey)
+                return true;
+            // Indexed outputs are unspent, so their script is in the UTXO set
+            const Coin& coin = pcoinsTip->AccessCoin(prevout);
+            if (!coin.IsSpent()) {
+                *pscriptPubKey = coin.out.scriptPubKey;
+                return true;
+            }
+        }
+    }
+
+    // Outputs spent on our chain (a block on a side chain may still stake
+    // them) are only reachable through the transaction index
+    if (!fTxIndex)
+        return false;
+
+    CDiskTxPos postx;
+    if (!pblocktree->ReadTxIndex(prevout.hash, postx))
+        return false;
+
+    CBlockHeader header;
+    CTransactionRef txPrev;
+    if (!ReadTransactionFromDisk(postx, header, txPrev))
+        return error("%s: deserialize or I/O error reading %s", __func__, prevout.hash.ToString());
+    if (txPrev->GetHash() != prevout.hash)
+        return error("%s: txid mismatch reading %s", __func__, prevout.hash.ToString());
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(header.GetHash());
+    if (prevout.n >= txPrev->vout.size() || mi == mapBlockIndex.end())
+        return false;
+
+    input = CDiskStakeInput(txPrev->nTime, header.nTime, mi->second->nHeight, txPrev->vout[prevout.n].nValue);
+    if (pscriptPubKey)
+        *pscriptPubKey = txPrev->vout[prevout.n].scriptPubKey;
+    return true;
+}
+
+static CCheckQueue<CBlockCheck> scriptcheckqueue(128);
 
 void ThreadScriptCheck()
 {
@@ -1523,7 +1837,39 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     assert((pindex->phashBlock == nullptr) ||
            (*pindex->phashBlock == block.GetHash()));
     int64_t nTimeStart = GetTimeMicros();
-    if (pindex->bnStakeModifier == 0 && pindex->nStakeModifierChecksum == 0 && !GalaxyCashContextualBlockChecks(block, state, pindex, fJustCheck))
+
+    bool fScriptChecks = true;
+    if (!hashAssumeValid.IsNull()) {
+        // We've been configured with the hash of a block which has been externally verified to have a valid history.
+        // A suitable default value is included with the software and updated from time to time.  Because validity
+        //  relative to a piece of software is an objective fact these defaults can be easily reviewed.
+        // This setting doesn't force the selection of any particular chain but makes validating some faster by
+        //  effectively caching the result of part of the verification.
+        BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+        if (it != mapBlockIndex.end()) {
+            if (it->second->GetAncestor(pindex->nHeight) == pindex &&
+                pindexBestHeader->GetAncestor(pindex->nHeight) == pindex &&
+                pindexBestHeader->nChainTrust >= nMinimumChainWork) {
+                // This block is a member of the assumed verified chain and an ancestor of the best header.
+                // The equivalent time check discourages hash power from extorting the network via DOS attack
+                //  into accepting an invalid block through telling users they must manually set assumevalid.
+                //  Requiring a software change or burying the invalid block, regardless of the setting, makes
+                //  it hard to hide the implication of the demand.  This also avoids having release candidates
+                //  that are hardly doing any signature verification at all in testing without having to
+                //  artificially set the default assumed verified block further back.
+                // The test against nMinimumChainWork prevents the skipping when denied access to any chain at
+                //  least as good as the expected chain.
+                fScriptChecks = (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, chainparams.GetConsensus()) <= 60 * 60 * 24 * 7 * 2);
+            }
+        }
+    }
+
+    // galaxycash: the coinstake and block signatures of a proof-of-stake block
+    // are queued alongside the script checks below
+    const bool fParallelChecks = fScriptChecks && nScriptCheckThreads;
+    CCheckQueueControl<CBlockCheck> control(fParallelChecks ? &scriptcheckqueue : nullptr);
+
+    if (pindex->bnStakeModifier == 0 && pindex->nStakeModifierChecksum == 0 && !GalaxyCashContextualBlockChecks(block, state, pindex, fJustCheck, fParallelChecks ? &control : nullptr))
         return error("%s: failed PoS check %s", __func__, FormatStateMessage(state));
 
 
@@ -1540,9 +1886,21 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     // is enforced in ContextualCheckBlockHeader(); we wouldn't want to
     // re-enforce that rule here (at least until we make it impossible for
     // GetAdjustedTime() to go backward).
-    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck, !fJustCheck))
+    const bool fCheckSignature = !fJustCheck && !block.fChecked && block.IsProofOfStake();
+    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck, false))
         return error("%s: Consensus::CheckBlock: %s", __func__, FormatStateMessage(state));
 
+    if (fCheckSignature) {
+        CStakeCheck check(block);
+        if (!fParallelChecks && !check())
+            return state.DoS(100, error("%s: bad block signature", __func__), REJECT_INVALID, "bad-blk-sign");
+        if (fParallelChecks) {
+            std::vector<CBlockCheck> vChecks;
+            vChecks.emplace_back(check);
+            control.Add(vChecks);
+        }
+    }
+
     // verify that the view's current state corresponds to the previous block
     uint256 hashPrevBlock = pindex->pprev == nullptr ? uint256() : pindex->pprev->GetBlockHash();
     assert(hashPrevBlock == view.GetBestBlock());
@@ -1557,32 +1915,6 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
 
     nBlocksTotal++;
 
-    bool fScriptChecks = true;
-    if (!hashAssumeValid.IsNull()) {
-        // We've been configured with the hash of a block which has been externally verified to have a valid history.
-        // A suitable default value is included with the software and updated from time to time.  Because validity
-        //  relative to a piece of software is an objective fact these defaults can be easily reviewed.
-        // This setting doesn't force the selection of any particular chain but makes validating some faster by
-        //  effectively caching the result of part of the verification.
-        BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
-        if (it != mapBlockIndex.end()) {
-            if (it->second->GetAncestor(pindex->nHeight) == pindex &&
-                pindexBestHeader->GetAncestor(pindex->nHeight) == pindex &&
-                pindexBestHeader->nChainTrust >= nMinimumChainWork) {
-                // This block is a member of the assumed verified chain and an ancestor of the best header.
-                // The equivalent time check discourages hash power from extorting the network via DOS attack
-                //  into accepting an invalid block through telling users they must manually set assumevalid.
-                //  Requiring a software change or burying the invalid block, regardless of the setting, makes
-                //  it hard to hide the implication of the demand.  This also avoids having release candidates
-                //  that are hardly doing any signature verification at all in testing without having to
-                //  artificially set the default assumed verified block further back.
-                // The test against nMinimumChainWork prevents the skipping when denied access to any chain at
-                //  least as good as the expected chain.
-                fScriptChecks = (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, chainparams.GetConsensus()) <= 60 * 60 * 24 * 7 * 2);
-            }
-        }
-    }
-
     int64_t nTime1 = GetTimeMicros();
     nTimeCheck += nTime1 - nTimeStart;
     LogPrint(BCLog::BENCH, "    - Sanity checks: %.2fms [%.2fs (%.2fms/blk)]\n", MILLI * (nTime1 - nTimeStart), nTimeCheck * MICRO, nTimeCheck * MILLI / nBlocksTotal);
@@ -1635,8 +1967,6 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : nullptr);
-
     std::vector<int> prevheights;
     CAmount nFees = 0;
     CAmount nReward = 0;
@@ -1705,7 +2035,11 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
             if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : nullptr))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
-            control.Add(vChecks);
+            std::vector<CBlockCheck> vBlockChecks;
+            vBlockChecks.reserve(vChecks.size());
+            for (CScriptCheck& check : vChecks)
+                vBlockChecks.emplace_back(check);
+            control.Add(vBlockChecks);
         }
 
         CTxUndo undoDummy;
@@ -1761,6 +2095,8 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     if (!WriteTxIndexDataForBlock(block, state, pindex))
         return false;
 
+    WriteStakeIndexDataForBlock(block, pindex);
+
 
     assert(pindex->phashBlock);
     // add this block to the view's block chain
@@ -1777,6 +2113,39 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     return true;
 }
 
+/** Upper bounds in milliseconds of the flush stall histogram buckets, followed by an unbounded one */
+static const int64_t FLUSH_STALL_BUCKETS[] = {1, 10, 100, 1000, 10000};
+static const size_t FLUSH_STALL_BUCKET_COUNT = sizeof(FLUSH_STALL_BUCKETS) / sizeof(FLUSH_STALL_BUCKETS[0]) + 1;
+static uint64_t nFlushStalls[FLUSH_STALL_BUCKET_COUNT] = {}; // guarded by cs_main
+static uint64_t nFlushes = 0;
+static int64_t nFlushStallTime = 0;
+static int64_t nFlushStallMax = 0;
+
+static void RecordFlushStall(int64_t nMicros)
+{
+    AssertLockHeld(cs_main);
+    size_t nBucket = 0;
+    while (nBucket < FLUSH_STALL_BUCKET_COUNT - 1 && nMicros >= FLUSH_STALL_BUCKETS[nBucket] * 1000)
+        nBucket++;
+    nFlushStalls[nBucket]++;
+    nFlushes++;
+    nFlushStallTime += nMicros;
+    nFlushStallMax = std::max(nFlushStallMax, nMicros);
+    LogPrint(BCLog::BENCH, "    - Chainstate flush held cs_main for %.2fms\n", nMicros * 0.001);
+}
+
+FlushStallStats GetFlushStallStats()
+{
+    LOCK(cs_main);
+    FlushStallStats stats;
+    stats.nFlushes = nFlushes;
+    stats.nStallTime = nFlushStallTime;
+    stats.nMaxStall = nFlushStallMax;
+    for (size_t i = 0; i < FLUSH_STALL_BUCKET_COUNT; i++)
+        stats.vHistogram.emplace_back(i < FLUSH_STALL_BUCKET_COUNT - 1 ? FLUSH_STALL_BUCKETS[i] : -1, nFlushStalls[i]);
+    return stats;
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed depending on the mode we're called with
@@ -1807,7 +2176,7 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState&
                 nLastSetChain = nNow;
             }
             int64_t nMempoolSizeMax = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
-            int64_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+            int64_t cacheSize = pcoinsTip->DynamicMemoryUsage() + memusage::DynamicUsage(mapDirtyStakeInputs);
             int64_t nTotalSpace = nCoinCacheUsage + std::max<int64_t>(nMempoolSizeMax - nMempoolUsage, 0);
             // The cache is large and we're within 10% and 10 MiB of the limit, but we have time now (not in the middle of a block processing).
             bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize > std::max((9 * nTotalSpace) / 10, nTotalSpace - MAX_BLOCK_COINSDB_USAGE * 1024 * 1024);
@@ -1856,8 +2225,20 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState&
                 if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                     return state.Error("out of disk space");
                 // Flush the chainstate (which may refer to block index entries).
+                // This only hands the cache over to pcoinsflush, which writes it
+                // out in the background, unless a previous flush is still in flight.
+                int64_t nFlushStart = GetTimeMicros();
+                // galaxycash: tokens added or erased since the last flush go out with the chainstate
+                if (g_galaxycash && !g_galaxycash->pdb->Flush())
+                    return AbortNode(state, "Failed to write to galaxycash database");
+                if (!FlushStakeIndex())
+                    return AbortNode(state, "Failed to write stake input index");
                 if (!pcoinsTip->Flush())
                     return AbortNode(state, "Failed to write to coin database");
+                // Explicit flushes and shutdown expect the database to be up to date on return.
+                if (mode == FLUSH_STATE_ALWAYS && !pcoinsflush->Wait())
+                    return AbortNode(state, "Failed to write to coin database");
+                RecordFlushStall(GetTimeMicros() - nFlushStart);
                 nLastFlush = nNow;
             }
         }
@@ -1963,6 +2344,7 @@ bool CChainState::DisconnectTip(CValidationState& state, const CChainParams& cha
         assert(view.GetBestBlock() == pindexDelete->GetBlockHash());
         if (DisconnectBlock(block, pindexDelete, view) != DISCONNECT_OK)
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+        UndoStakeIndexDataForBlock(block, pindexDelete, view);
         bool flushed = view.Flush();
         assert(flushed);
     }
@@ -2730,10 +3112,10 @@ static bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos,
     return true;
 }
 
-static bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckSignature = true, bool fOldClient = false)
+static bool CheckBlockHeader(const CBlockHeader& block, const uint256& hash, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckSignature = true, bool fOldClient = false)
 {
     // Check proof of work matches claimed amount
-    if (fCheckPOW && !(block.nFlags & CBlockIndex::BLOCK_SUBSIDY) && !CheckProofOfWork(block.GetHash(), block.nBits, consensusParams)) {
+    if (fCheckPOW && !(block.nFlags & CBlockIndex::BLOCK_SUBSIDY) && !CheckProofOfWork(hash, block.nBits, consensusParams)) {
         if (fOldClient)
             return true;
         else
@@ -2994,11 +3376,10 @@ static bool ContextualCheckBlock(const CBlock& block, CValidationState& state, c
     return true;
 }
 
-bool CChainState::AcceptBlockHeader(const CBlockHeader& block, bool fProofOfStake, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fOldClient)
+bool CChainState::AcceptBlockHeader(const CBlockHeader& block, const uint256& hash, bool fProofOfStake, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fOldClient)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex* pindex = nullptr;
     bool fSetAsPos = (block.nFlags & CBlockIndex::BLOCK_PROOF_OF_STAKE) ? true : (block.nFlags & CBlockIndex::BLOCK_SUBSIDY ? false : fProofOfStake);
@@ -3013,7 +3394,7 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, bool fProofOfStak
             return true;
         }
 
-        if (!(block.nFlags & CBlockIndex::BLOCK_SUBSIDY) && !CheckBlockHeader(block, state, chainparams.GetConsensus(), !fProofOfStake, fProofOfStake, fOldClient)) {
+        if (!(block.nFlags & CBlockIndex::BLOCK_SUBSIDY) && !CheckBlockHeader(block, hash, state, chainparams.GetConsensus(), !fProofOfStake, fProofOfStake, fOldClient)) {
             if (fOldClient)
                 fSetAsPos = !fProofOfStake; // our guess was wrong - correct it
             else {
@@ -3068,7 +3449,7 @@ bool ProcessNewBlockHeader(const CBlockHeader& header, bool fOldClient, CValidat
         LOCK(cs_main);
         bool fPoS = header.nFlags & CBlockIndex::BLOCK_PROOF_OF_STAKE;
         CBlockIndex* pindex = nullptr; // Use a temp pindex instead of ppindex to avoid a const_cast
-        if (!g_chainstate.AcceptBlockHeader(header, fPoS, state, chainparams, &pindex, fOldClient)) {
+        if (!g_chainstate.AcceptBlockHeader(header, header.GetHash(), fPoS, state, chainparams, &pindex, fOldClient)) {
             if (ppindex) {
                 *ppindex = nullptr;
             }
@@ -3083,25 +3464,86 @@ bool ProcessNewBlockHeader(const CBlockHeader& header, bool fOldClient, CValidat
     return true;
 }
 
+static std::atomic<uint64_t> nHeaderBatches{0};
+static std::atomic<uint64_t> nHeadersHashed{0};
+static std::atomic<int64_t> nTimeHeaderHash{0};
+static std::atomic<int64_t> nTimeHeaderAccept{0};
+
+void HashBlockHeaders(const std::vector<CBlockHeader>& headers, std::vector<uint256>& hashes)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    hashes.resize(headers.size());
+
+    if (nScriptCheckThreads && headers.size() > 1) {
+        // Header sync and block connection take turns on the script check
+        // threads, which are otherwise idle outside block validation
+        std::vector<CBlockCheck> vChecks;
+        vChecks.reserve(headers.size());
+        for (size_t i = 0; i < headers.size(); i++) {
+            CHeaderHashCheck check(headers[i], hashes[i]);
+            vChecks.emplace_back(check);
+        }
+        CCheckQueueControl<CBlockCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        for (size_t i = 0; i < headers.size(); i++)
+            hashes[i] = headers[i].GetHash();
+    }
+
+    nHeaderBatches++;
+    nHeadersHashed += headers.size();
+    nTimeHeaderHash += GetTimeMicros() - nTimeStart;
+}
+
+HeaderPipelineStats GetHeaderPipelineStats()
+{
+    HeaderPipelineStats stats;
+    stats.nBatches = nHeaderBatches;
+    stats.nHeaders = nHeadersHashed;
+    stats.nHashTime = nTimeHeaderHash;
+    stats.nAcceptTime = nTimeHeaderAccept;
+    return stats;
+}
+
 // Exposed wrapper for AcceptBlockHeader
-bool ProcessNewBlockHeaders(const uint256& lastAcceptedHeader, const std::vector<CBlockHeader>& headers, bool fOldClient, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex, CBlockHeader* first_invalid)
+bool ProcessNewBlockHeaders(const uint256& lastAcceptedHeader, const std::vector<CBlockHeader>& headers, bool fOldClient, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex, CBlockHeader* first_invalid, const std::vector<uint256>* pvHashes)
 {
-    std::vector<CBlockHeader> vOldHeaders;
-    {
-        if (first_invalid != nullptr) first_invalid->SetNull();
-        for (const CBlockHeader& header : headers) {
-            const CBlockIndex* pindex = nullptr; // Use a temp pindex instead of ppindex to avoid a const_cast
-            bool accepted = ProcessNewBlockHeader(header, fOldClient, state, chainparams, &pindex);
+    // The proof-of-work hashes are the expensive part, so compute them for the
+    // whole batch on the worker pool first; the linkage and contextual checks
+    // below are cheap and have to run in order anyway.
+    std::vector<uint256> vHashes;
+    if (pvHashes == nullptr) {
+        HashBlockHeaders(headers, vHashes);
+        pvHashes = &vHashes;
+    }
+    assert(pvHashes->size() == headers.size());
 
-            if (!accepted) {
+    if (first_invalid != nullptr) first_invalid->SetNull();
+    int64_t nTimeStart = GetTimeMicros();
+    bool fAccepted = true;
+    size_t nAccepted = 0;
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < headers.size(); i++) {
+            const CBlockHeader& header = headers[i];
+            bool fPoS = header.nFlags & CBlockIndex::BLOCK_PROOF_OF_STAKE;
+            CBlockIndex* pindex = nullptr; // Use a temp pindex instead of ppindex to avoid a const_cast
+            if (!g_chainstate.AcceptBlockHeader(header, (*pvHashes)[i], fPoS, state, chainparams, &pindex, fOldClient)) {
                 if (first_invalid) *first_invalid = header;
-                return false;
+                fAccepted = false;
+                break;
             }
             if (ppindex)
                 *ppindex = pindex;
+            nAccepted++;
         }
     }
-    return true;
+    nTimeHeaderAccept += GetTimeMicros() - nTimeStart;
+    // As for a single header, the tip only changes when a header was accepted
+    if (nAccepted)
+        NotifyHeaderTip();
+    return fAccepted;
 }
 
 /** Store block on disk. If dbp is non-nullptr, the file is known to already reside on disk */
@@ -3111,7 +3553,10 @@ static CDiskBlockPos SaveBlockToDisk(const CBlock& block, int nHeight, const CCh
     CDiskBlockPos blockPos;
     if (dbp != nullptr)
         blockPos = *dbp;
-    if (!FindBlockPos(blockPos, nBlockSize + 8, nHeight, block.GetBlockTime(), dbp != nullptr)) {
+    // Only newly written records carry a trailing checksum (see WriteBlockToDisk);
+    // blocks found while reindexing are indexed without BLOCK_HAVE_CHECKSUM
+    unsigned int nAddSize = nBlockSize + 8 + (dbp == nullptr ? sizeof(uint32_t) : 0);
+    if (!FindBlockPos(blockPos, nAddSize, nHeight, block.GetBlockTime(), dbp != nullptr)) {
         error("%s: FindBlockPos failed", __func__);
         return CDiskBlockPos();
     }
@@ -3171,7 +3616,7 @@ bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CVali
     CBlockIndex*& pindex = ppindex ? *ppindex : pindexDummy;
 
 
-    if (!AcceptBlockHeader(block, block.IsProofOfStake(), state, chainparams, &pindex))
+    if (!AcceptBlockHeader(block, block.GetHash(), block.IsProofOfStake(), state, chainparams, &pindex))
         return false;
 
     FixIndex(pindex, block);
@@ -3240,10 +3685,16 @@ bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CVali
     }
 
     // check PoS
-    if (fCheckPoS && !GalaxyCashContextualBlockChecks(block, state, pindex, false)) {
-        pindex->nStatus |= BLOCK_FAILED_VALID;
-        setDirtyBlockIndex.insert(pindex);
-        return state.DoS(100, false, REJECT_INVALID, "bad-pos", false, "proof of stake is incorrect");
+    if (fCheckPoS) {
+        // The coinstake signature is queued as soon as the kernel is found and
+        // verified while the stake modifier is computed
+        CCheckQueueControl<CBlockCheck> control(nScriptCheckThreads ? &scriptcheckqueue : nullptr);
+        bool fValid = GalaxyCashContextualBlockChecks(block, state, pindex, false, nScriptCheckThreads ? &control : nullptr);
+        if (!control.Wait() || !fValid) {
+            pindex->nStatus |= BLOCK_FAILED_VALID;
+            setDirtyBlockIndex.insert(pindex);
+            return state.DoS(100, false, REJECT_INVALID, "bad-pos", false, "proof of stake is incorrect");
+        }
     }
 
 
@@ -3259,6 +3710,8 @@ bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CVali
             state.Error(strprintf("%s: Failed to find position to write new block to disk", __func__));
             return false;
         }
+        if (dbp == nullptr)
+            pindex->nStatus |= BLOCK_HAVE_CHECKSUM;
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos, chainparams.GetConsensus()))
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
     } catch (const std::runtime_error& e) {
@@ -3316,14 +3769,17 @@ bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<cons
 
 
 // These checks can only be done when all previous block have been added.
-bool GalaxyCashContextualBlockChecks(const CBlock& block, CValidationState& state, CBlockIndex* pindex, bool fJustCheck)
+bool GalaxyCashContextualBlockChecks(const CBlock& block, CValidationState& state, CBlockIndex* pindex, bool fJustCheck, CCheckQueueControl<CBlockCheck>* pcontrol)
 {
     uint256 hashProofOfStake = uint256();
     // peercoin: verify hash target and signature of coinstake tx
-    if (block.IsProofOfStake() && !CheckProofOfStake(pindex->pprev, block.nBits, *block.vtx[1], hashProofOfStake)) {
+    std::vector<CBlockCheck> vChecks;
+    if (block.IsProofOfStake() && !CheckProofOfStake(pindex->pprev, block.nBits, *block.vtx[1], hashProofOfStake, pcontrol ? &vChecks : nullptr)) {
         LogPrintf("WARNING: %s: check proof-of-stake failed for block %s\n", __func__, block.GetHash().ToString());
         return false; // do not error here as we expect this during initial block download
     }
+    if (pcontrol)
+        pcontrol->Add(vChecks);
 
     // compute stake entropy bit for stake modifier
     unsigned int nEntropyBit = block.GetStakeEntropyBit();
@@ -3442,6 +3898,207 @@ static FILE* OpenDiskFile(const CDiskBlockPos& pos, const char* prefix, bool fRe
     return file;
 }
 
+#ifndef WIN32
+/**
+ * Bounded LRU cache of read-only blk/rev file descriptors. Reads use pread(),
+ * so threads reading the same file share a descriptor without contending on
+ * a file position, and without reopening the file for every block.
+ *
+ * With -mmapblocks, finalized block files (below nLastBlockFile, which are
+ * no longer appended to or truncated) are mapped read-only instead, and
+ * records are parsed straight from the mapping.
+ */
+class CBlockFileReadCache
+{
+private:
+    struct FileHandle {
+        const int fd;
+        const unsigned char* pMap;
+        size_t nMapSize;
+
+        explicit FileHandle(int fdIn) : fd(fdIn), pMap(nullptr), nMapSize(0) {}
+        ~FileHandle()
+        {
+            if (pMap)
+                munmap(const_cast<unsigned char*>(pMap), nMapSize);
+            close(fd);
+        }
+    };
+    typedef std::pair<char, int> FileKey;
+    typedef std::list<FileKey> FileList;
+
+    CCriticalSection cs;
+    FileList lruFiles;
+    std::map<FileKey, std::pair<std::shared_ptr<FileHandle>, FileList::iterator>> mapFiles;
+
+    static bool IsFinalized(const CDiskBlockPos& pos, const char* prefix)
+    {
+        if (!fMmapBlocks || strcmp(prefix, "blk") != 0)
+            return false;
+        LOCK(cs_LastBlockFile);
+        return pos.nFile < nLastBlockFile;
+    }
+
+    static void Map(FileHandle& handle, const fs::path& path)
+    {
+        struct stat st;
+        if (fstat(handle.fd, &st) != 0 || st.st_size <= 0)
+            return;
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, handle.fd, 0);
+        if (p == MAP_FAILED) {
+            LogPrintf("Unable to map file %s, falling back to reads\n", path.string());
+            return;
+        }
+        // Historical blocks are mostly read in order (peers syncing from us, rescans)
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        handle.pMap = static_cast<const unsigned char*>(p);
+        handle.nMapSize = st.st_size;
+    }
+
+    std::shared_ptr<FileHandle> Open(const CDiskBlockPos& pos, const char* prefix)
+    {
+        const bool fMap = IsFinalized(pos, prefix);
+
+        LOCK(cs);
+        const FileKey key(prefix[0], pos.nFile);
+        auto it = mapFiles.find(key);
+        if (it != mapFiles.end()) {
+            if (!fMap || it->second.first->pMap) {
+                lruFiles.splice(lruFiles.begin(), lruFiles, it->second.second);
+                return it->second.first;
+            }
+            // The file has been finalized since it was opened; reopen it mapped
+            lruFiles.erase(it->second.second);
+            mapFiles.erase(it);
+        }
+
+        fs::path path = GetBlockPosFilename(pos, prefix);
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd == -1) {
+            LogPrintf("Unable to open file %s\n", path.string());
+            return nullptr;
+        }
+        std::shared_ptr<FileHandle> handle = std::make_shared<FileHandle>(fd);
+        if (fMap)
+            Map(*handle, path);
+        lruFiles.push_front(key);
+        mapFiles.emplace(key, std::make_pair(handle, lruFiles.begin()));
+        if (mapFiles.size() > MAX_BLOCKFILE_READ_DESCRIPTORS) {
+            // Readers still holding the evicted handle keep it open until they are done
+            mapFiles.erase(lruFiles.back());
+            lruFiles.pop_back();
+        }
+        return handle;
+    }
+
+public:
+    bool Read(const CDiskBlockPos& pos, const char* prefix, unsigned char* pch, size_t nSize)
+    {
+        std::shared_ptr<FileHandle> handle = Open(pos, prefix);
+        if (!handle)
+            return false;
+        if (handle->pMap && pos.nPos <= handle->nMapSize && nSize <= handle->nMapSize - pos.nPos) {
+            memcpy(pch, handle->pMap + pos.nPos, nSize);
+            return true;
+        }
+        size_t nRead = 0;
+        while (nRead < nSize) {
+            ssize_t ret = pread(handle->fd, pch + nRead, nSize - nRead, (off_t)pos.nPos + nRead);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0) {
+                LogPrintf("Unable to read %u bytes at %s from %s file\n", nSize, pos.ToString(), prefix);
+                return false;
+            }
+            nRead += ret;
+        }
+        return true;
+    }
+
+    //! Point record at nSize bytes at pos if the file is mapped; returns false if it has to be read instead
+    bool View(const CDiskBlockPos& pos, const char* prefix, size_t nSize, CDiskRecord& record)
+    {
+        if (!fMmapBlocks)
+            return false;
+        std::shared_ptr<FileHandle> handle = Open(pos, prefix);
+        if (!handle || !handle->pMap || pos.nPos > handle->nMapSize || nSize > handle->nMapSize - pos.nPos)
+            return false;
+        record.mapping = handle;
+        record.pch = handle->pMap + pos.nPos;
+        record.nSize = nSize;
+        return true;
+    }
+
+    //! Forget the handles of a deleted file; readers still holding one keep it until they are done
+    void Drop(int nFile)
+    {
+        LOCK(cs);
+        for (char prefix : {'b', 'r'}) {
+            auto it = mapFiles.find(FileKey(prefix, nFile));
+            if (it == mapFiles.end())
+                continue;
+            lruFiles.erase(it->second.second);
+            mapFiles.erase(it);
+        }
+    }
+
+    //! Close and unmap every cached file
+    void Clear()
+    {
+        LOCK(cs);
+        lruFiles.clear();
+        mapFiles.clear();
+    }
+};
+
+static CBlockFileReadCache blockFileReadCache;
+#endif
+
+/** Read nSize bytes at pos from a block or undo file */
+static bool ReadDiskFile(const CDiskBlockPos& pos, const char* prefix, unsigned char* pch, size_t nSize)
+{
+#ifndef WIN32
+    return blockFileReadCache.Read(pos, prefix, pch, nSize);
+#else
+    CAutoFile filein(OpenDiskFile(pos, prefix, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+    try {
+        filein.read((char*)pch, nSize);
+    } catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    return true;
+#endif
+}
+
+/** Read the record at pos, whose size is stored just before it, followed by nTrailer extra bytes */
+static bool ReadDiskRecord(const CDiskBlockPos& pos, const char* prefix, size_t nTrailer, CDiskRecord& record)
+{
+    unsigned char buf[sizeof(uint32_t)];
+    if (pos.nPos < sizeof(buf) || !ReadDiskFile(CDiskBlockPos(pos.nFile, pos.nPos - sizeof(buf)), prefix, buf, sizeof(buf)))
+        return false;
+    const uint32_t nSize = ReadLE32(buf);
+    if (nSize > MAX_SIZE)
+        return error("%s: invalid record size %u at %s", __func__, nSize, pos.ToString());
+
+#ifndef WIN32
+    if (blockFileReadCache.View(pos, prefix, nSize + nTrailer, record))
+        return true;
+#endif
+    std::shared_ptr<std::vector<unsigned char>> owned;
+    if (nSize + nTrailer > MAX_DISK_READ_BUFFER)
+        owned = std::make_shared<std::vector<unsigned char>>();
+    std::vector<unsigned char>& vch = owned ? *owned : vchDiskReadBuffer;
+    vch.resize(nSize + nTrailer);
+    if (!ReadDiskFile(pos, prefix, vch.data(), vch.size()))
+        return false;
+    record.mapping = owned;
+    record.pch = vch.data();
+    record.nSize = vch.size();
+    return true;
+}
+
 FILE* OpenBlockFile(const CDiskBlockPos& pos, bool fReadOnly)
 {
     return OpenDiskFile(pos, "blk", fReadOnly);
@@ -3458,6 +4115,27 @@ fs::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix)
     return GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
 }
 
+void CloseBlockFiles()
+{
+#ifndef WIN32
+    blockFileReadCache.Clear();
+#endif
+}
+
+void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+#ifndef WIN32
+        // Cached descriptors would keep the space of the deleted files in use
+        blockFileReadCache.Drop(*it);
+#endif
+        fs::remove(GetBlockPosFilename(pos, "blk"));
+        fs::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
 CBlockIndex* CChainState::InsertBlockIndex(const uint256& hash)
 {
     if (hash.IsNull())
@@ -3651,6 +4329,9 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView* coinsview,
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
             return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        // ReadBlockFromDisk skips the PoW rehash for checksummed records, so do it here
+        if (block.GetHash() != pindex->GetBlockHash())
+            return error("VerifyDB(): *** block hash mismatch at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
         // check level 1: verify block validity
         if (nCheckLevel >= 1 && !CheckBlock(block, state, chainparams.GetConsensus()))
             return error("%s: *** found bad block at %d, hash=%s (%s)\n", __func__,
@@ -3898,6 +4579,7 @@ void UnloadBlockIndex()
     nLastBlockFile = 0;
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
+    CloseBlockFiles();
 
     for (BlockMap::value_type& entry : mapBlockIndex) {
         delete entry.second;
@@ -4437,35 +5119,18 @@ bool GetCoinAge(const CTransaction& tx, const CCoinsViewCache& view, uint64_t& n
         if (tx.nTime < coin.nTime)
             return false; // Transaction timestamp violation
 
-        // Transaction index is required to get to block header
-        if (!fTxIndex)
-            return false; // Transaction index not available
+        CDiskStakeInput input;
+        if (!GetStakeInput(prevout, input))
+            return error("%s() : stake input %s not indexed in GetCoinAge()", __PRETTY_FUNCTION__, prevout.ToString());
 
-        CDiskTxPos postx;
-        CTransactionRef txPrev;
-        if (pblocktree->ReadTxIndex(prevout.hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            CBlockHeader header;
-            try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txPrev;
-            } catch (std::exception& e) {
-                return error("%s() : deserialize or I/O error in GetCoinAge()", __PRETTY_FUNCTION__);
-            }
-            if (txPrev->GetHash() != prevout.hash)
-                return error("%s() : txid mismatch in GetCoinAge()", __PRETTY_FUNCTION__);
+        if (input.nBlockTime + Params().GetConsensus().nStakeMinAge > tx.nTime)
+            continue; // only count coins meeting min age requirement
 
-            if (header.GetBlockTime() + Params().GetConsensus().nStakeMinAge > tx.nTime)
-                continue; // only count coins meeting min age requirement
+        int64_t nValueIn = input.nValue;
+        bnCentSecond += arith_uint256(nValueIn) * (tx.nTime - input.nTime) / CENT;
 
-            int64_t nValueIn = txPrev->vout[txin.prevout.n].nValue;
-            bnCentSecond += arith_uint256(nValueIn) * (tx.nTime - txPrev->nTime) / CENT;
-
-            if (gArgs.GetBoolArg("-printcoinage", false))
-                LogPrintf("coin age nValueIn=%-12lld nTimeDiff=%d bnCentSecond=%s\n", nValueIn, tx.nTime - txPrev->nTime, bnCentSecond.ToString());
-        } else
-            return error("%s() : tx missing in tx index in GetCoinAge()", __PRETTY_FUNCTION__);
+        if (gArgs.GetBoolArg("-printcoinage", false))
+            LogPrintf("coin age nValueIn=%-12lld nTimeDiff=%d bnCentSecond=%s\n", nValueIn, tx.nTime - input.nTime, bnCentSecond.ToString());
     }
 
     arith_uint256 bnCoinDay = bnCentSecond * CENT / COIN / (24 * 60 * 60);
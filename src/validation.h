@@ -34,18 +34,25 @@
 class CBlockIndex;
 class CBlockTreeDB;
 class CChainParams;
+class CCoinsViewBackgroundFlush;
 class CCoinsViewDB;
 class CInv;
 class CConnman;
+class CGalaxyCashTransaction;
 class CScriptCheck;
 class CTxMemPool;
 class CValidationState;
 class CKeyStore;
 struct ChainTxData;
+struct CDiskTxPos;
+struct CDiskStakeInput;
 
 struct PrecomputedTransactionData;
 struct LockPoints;
 
+template <typename T>
+class CCheckQueueControl;
+
 /** Default for accepting alerts from the P2P network. */
 static const bool DEFAULT_ALERTS = true;
 /** Default for -whitelistrelay. */
@@ -70,6 +77,8 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Maximum number of blk/rev file descriptors kept open for reading */
+static const unsigned int MAX_BLOCKFILE_READ_DESCRIPTORS = 16;
 
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
@@ -82,6 +91,9 @@ static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Maximum depth of blocks we're willing to serve as compact blocks to peers
+ *  when requested. For older blocks, a regular BLOCK response will be sent. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
 /** Maximum depth of blocks we're willing to respond to GETBLOCKTXN requests for. */
 static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
@@ -105,6 +117,9 @@ static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
 /** Maximum number of inventory items to send per transmission.
  *  Limits the impact of low-fee transaction floods. */
 static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
+/** Maximum number of average transmissions' worth of transactions sent at once
+ *  to a peer that has gone longer than average without one. */
+static const unsigned int INVENTORY_BROADCAST_BURST = 4;
 /** Average delay between feefilter broadcasts in seconds. */
 static const unsigned int AVG_FEEFILTER_BROADCAST_INTERVAL = 10 * 60;
 /** Maximum feefilter broadcast delay after significant change. */
@@ -121,6 +136,8 @@ static const int64_t MAX_FEE_ESTIMATION_TIP_AGE = 3 * 60 * 60;
 /** Default for -permitbaremultisig */
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
+/** Default for -mmapblocks */
+static const bool DEFAULT_MMAP_BLOCKS = false;
 static const bool DEFAULT_TXINDEX = true;  // peercoin: txindex is required for PoS calculations (might change in the future)
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 /** Default for -persistmempool */
@@ -173,6 +190,8 @@ extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
+/** Memory-map finalized block files for reading (-mmapblocks) */
+extern bool fMmapBlocks;
 extern size_t nCoinCacheUsage;
 extern bool fAlerts;
 /** If the tip is older than this (in seconds), the node is considered to be in initial block download. */
@@ -244,14 +263,44 @@ bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<cons
  * @param[in]  chainparams The params for the chain we want to connect to
  * @param[out] ppindex If set, the pointer will be set to point to the last new block index object for the given headers
  * @param[out] first_invalid First header that fails validation, if one exists
+ * @param[in]  pvHashes The hashes of the headers, if the caller already ran HashBlockHeaders on them
  */
-bool ProcessNewBlockHeaders(const uint256& lastAcceptedHeader, const std::vector<CBlockHeader>& block, bool fOldClient, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex = nullptr, CBlockHeader* first_invalid = nullptr);
+bool ProcessNewBlockHeaders(const uint256& lastAcceptedHeader, const std::vector<CBlockHeader>& block, bool fOldClient, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex = nullptr, CBlockHeader* first_invalid = nullptr, const std::vector<uint256>* pvHashes = nullptr);
 bool ProcessNewBlockHeader(const CBlockHeader& block, bool fOldClient, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex = nullptr);
 
+/** Compute the proof-of-work hashes of a batch of headers, spread over the script check threads */
+void HashBlockHeaders(const std::vector<CBlockHeader>& headers, std::vector<uint256>& hashes);
+
+/** Throughput counters of the header verification pipeline, reported by getblockchaininfo */
+struct HeaderPipelineStats {
+    uint64_t nBatches;   //! HEADERS batches hashed
+    uint64_t nHeaders;   //! headers hashed
+    int64_t nHashTime;   //! microseconds spent hashing
+    int64_t nAcceptTime; //! microseconds spent on the sequential linkage and contextual checks
+};
+HeaderPipelineStats GetHeaderPipelineStats();
+
+/** Time cs_main was held to flush the chainstate, reported by getblockchaininfo */
+struct FlushStallStats {
+    uint64_t nFlushes;
+    int64_t nStallTime;                                     //! microseconds, summed over all flushes
+    int64_t nMaxStall;                                      //! microseconds, longest single flush
+    std::vector<std::pair<int64_t, uint64_t>> vHistogram;   //! (upper bound in milliseconds or -1 for none, flushes)
+};
+FlushStallStats GetFlushStallStats();
+
+/** Warn the user, log strMessage and shut down; returns false */
+bool AbortNode(const std::string& strMessage, const std::string& userMessage = "");
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
 FILE* OpenBlockFile(const CDiskBlockPos& pos, bool fReadOnly = false);
+/** Read a transaction and the header of its block from disk, using the position from the transaction index */
+bool ReadTransactionFromDisk(const CDiskTxPos& postx, CBlockHeader& header, CTransactionRef& tx);
+/** Look up the time, height and value of an output for the kernel and coin age checks, and its script if asked for */
+bool GetStakeInput(const COutPoint& prevout, CDiskStakeInput& input, CScript* pscriptPubKey = nullptr);
+/** Build the stake input index from the UTXO set, unless it is already up to date */
+bool LoadStakeIndex(bool fReset);
 /** Translation to a filesystem path */
 fs::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
@@ -292,6 +341,9 @@ void PruneOneBlockFile(const int fileNumber);
  */
 void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune);
 
+/** Close and unmap the block and undo files cached for reading */
+void CloseBlockFiles();
+
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
@@ -377,6 +429,122 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the stateless part of a GalaxyCash transaction check
+ * (format and signature). It does not touch the token state.
+ */
+class CGalaxyCashTxCheck
+{
+private:
+    std::shared_ptr<const CGalaxyCashTransaction> tx;
+
+public:
+    CGalaxyCashTxCheck() {}
+    explicit CGalaxyCashTxCheck(const std::shared_ptr<const CGalaxyCashTransaction>& txIn) : tx(txIn) {}
+
+    bool operator()();
+
+    void swap(CGalaxyCashTxCheck& check)
+    {
+        tx.swap(check.tx);
+    }
+};
+
+/**
+ * Closure representing one signature check of a proof-of-stake block: either
+ * the block signature, or the kernel input of its coinstake.
+ * Note that this stores references to the block or the coinstake
+ */
+class CStakeCheck
+{
+private:
+    const CBlock* pblock;
+    CTxOut m_tx_out;
+    const CTransaction* ptxTo;
+
+public:
+    CStakeCheck() : pblock(nullptr), ptxTo(nullptr) {}
+    explicit CStakeCheck(const CBlock& blockIn) : pblock(&blockIn), ptxTo(nullptr) {}
+    CStakeCheck(const CTxOut& outIn, const CTransaction& txToIn) : pblock(nullptr), m_tx_out(outIn), ptxTo(&txToIn) {}
+
+    bool operator()();
+
+    void swap(CStakeCheck& check)
+    {
+        std::swap(pblock, check.pblock);
+        std::swap(m_tx_out, check.m_tx_out);
+        std::swap(ptxTo, check.ptxTo);
+    }
+};
+
+/**
+ * Closure computing the proof-of-work hash of one header of a HEADERS batch.
+ * Note that this stores references to the header and the output hash
+ */
+class CHeaderHashCheck
+{
+private:
+    const CBlockHeader* pheader;
+    uint256* phash;
+
+public:
+    CHeaderHashCheck() : pheader(nullptr), phash(nullptr) {}
+    CHeaderHashCheck(const CBlockHeader& headerIn, uint256& hashOut) : pheader(&headerIn), phash(&hashOut) {}
+
+    bool operator()()
+    {
+        *phash = pheader->GetHash();
+        return true;
+    }
+
+    void swap(CHeaderHashCheck& check)
+    {
+        std::swap(pheader, check.pheader);
+        std::swap(phash, check.phash);
+    }
+};
+
+/**
+ * One entry of the block check queue. Script checks, proof-of-stake signature
+ * checks and GalaxyCash transaction checks of a block share the -par worker
+ * threads and the same CCheckQueueControl. Header sync hashes its HEADERS
+ * batches on the same threads.
+ */
+class CBlockCheck
+{
+private:
+    enum {
+        CHECK_NONE,
+        CHECK_SCRIPT,
+        CHECK_STAKE,
+        CHECK_GALAXYCASH_TX,
+        CHECK_HEADER_HASH,
+    };
+    int type;
+    CScriptCheck script;
+    CStakeCheck stake;
+    CGalaxyCashTxCheck gchtx;
+    CHeaderHashCheck header;
+
+public:
+    CBlockCheck() : type(CHECK_NONE) {}
+    explicit CBlockCheck(CScriptCheck& check) : type(CHECK_SCRIPT) { script.swap(check); }
+    explicit CBlockCheck(CStakeCheck& check) : type(CHECK_STAKE) { stake.swap(check); }
+    explicit CBlockCheck(CGalaxyCashTxCheck& check) : type(CHECK_GALAXYCASH_TX) { gchtx.swap(check); }
+    explicit CBlockCheck(CHeaderHashCheck& check) : type(CHECK_HEADER_HASH) { header.swap(check); }
+
+    bool operator()();
+
+    void swap(CBlockCheck& check)
+    {
+        std::swap(type, check.type);
+        script.swap(check.script);
+        stake.swap(check.stake);
+        gchtx.swap(check.gchtx);
+        header.swap(check.header);
+    }
+};
+
 /** Initializes the script-execution cache */
 void InitScriptExecutionCache();
 
@@ -384,6 +552,8 @@ void InitScriptExecutionCache();
 /** Functions for disk access for blocks */
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read a block as it is serialized on disk (SER_DISK), without deserializing its transactions */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -429,6 +599,9 @@ extern CChain& chainActive;
 /** Global variable that points to the coins database (protected by cs_main) */
 extern std::unique_ptr<CCoinsViewDB> pcoinsdbview;
 
+/** Global variable that points to the view committing coin cache flushes to pcoinsdbview in the background */
+extern std::unique_ptr<CCoinsViewBackgroundFlush> pcoinsflush;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern std::unique_ptr<CCoinsViewCache> pcoinsTip;
 
@@ -474,7 +647,7 @@ bool CheckBlockSignature(const CBlock& block);
 bool IsDeveloperBlock(const CBlock& block);
 bool CheckDeveloperSignature(const std::vector<unsigned char>& sig, const uint256& hash);
 void MarkDirtyBlockIndex(CBlockIndex *pindex);
-bool GalaxyCashContextualBlockChecks(const CBlock& block, CValidationState& state, CBlockIndex* pindex, bool fJustCheck);
+bool GalaxyCashContextualBlockChecks(const CBlock& block, CValidationState& state, CBlockIndex* pindex, bool fJustCheck, CCheckQueueControl<CBlockCheck>* pcontrol = nullptr);
 int GetActiveChainHeight();
 
 #endif // BITCOIN_VALIDATION_H
@@ -21,6 +21,7 @@
 #include <scheduler.h>
 #include <script/script.h>
 #include <timedata.h>
+#include <txannounce.h>
 #include <txmempool.h>
 #include <util.h>
 #include <utilmoneystr.h>
@@ -1689,10 +1690,7 @@ bool CWalletTx::RelayWalletTransaction(CConnman* connman)
         if (InMempool() || AcceptToMemoryPool(state)) {
             LogPrintf("Relaying wtx %s\n", GetHash().ToString());
             if (connman) {
-                CInv inv(MSG_TX, GetHash());
-                connman->ForEachNode([&inv](CNode* pnode) {
-                    pnode->PushInventory(inv);
-                });
+                txAnnounceQueue.Push(mempool, GetHash());
                 return true;
             }
         }
@@ -4086,25 +4084,35 @@ static int64_t GetStakeCombineThreshold()
 }
 static int64_t GetStakeSplitThreshold() { return 2 * GetStakeCombineThreshold(); }
 
-// galaxycash: create coin stake transaction
-typedef std::vector<unsigned char> valtype;
-bool CWallet::CreateCoinStake(const CKeyStore& keystore, int64_t nFees, int nHeight, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction& txNew, CKey &key)
+// galaxycash: coins the stake minter may search for a kernel
+bool CWallet::GetStakeCandidates(std::vector<CInputCoin>& vCandidates) const
 {
-    // The following split & combine thresholds are important to security
-    // Should not be adjusted if you don't understand the consequences
-    static unsigned int nStakeSplitAge = (60 * 60 * 24 * 90);
+    vCandidates.clear();
+
+    CAmount nBalance = GetBalance();
+    CAmount nReserveBalance = 0;
+    if (gArgs.IsArgSet("-reservebalance") && !ParseMoney(gArgs.GetArg("-reservebalance", ""), nReserveBalance))
+        return error("GetStakeCandidates : invalid reserve balance amount");
+    if (nBalance <= nReserveBalance)
+        return false;
 
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
+    std::set<CInputCoin> setCoins;
+    CAmount nValueIn = 0;
+    if (!SelectCoinsForStaking(nBalance - nReserveBalance, setCoins, nValueIn))
+        return false;
 
-    // Transaction index is required to get to block header
-    if (!fTxIndex)
-        return error("CreateCoinStake : transaction index unavailable");
-    const Consensus::Params& params = Params().GetConsensus();
+    vCandidates.assign(setCoins.begin(), setCoins.end());
+    return !vCandidates.empty();
+}
 
+// galaxycash: create coin stake transaction
+typedef std::vector<unsigned char> valtype;
+bool CWallet::CreateCoinStake(const CKeyStore& keystore, const COutPoint& prevoutKernel, unsigned int nTime, int64_t nFees, int nHeight, CMutableTransaction& txNew, CKey &key)
+{
     LOCK2(cs_main, cs_wallet);
     txNew.vin.clear();
     txNew.vout.clear();
+    txNew.nTime = nTime;
     // Mark coin stake transaction
     CScript scriptEmpty;
     scriptEmpty.clear();
@@ -4117,122 +4125,75 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, int64_t nFees, int nHei
     if (nBalance <= nReserveBalance)
         return false;
     std::set<CInputCoin> setCoins;
-    std::vector<CTransactionRef> vwtxPrev;
+    std::vector<CInputCoin> vwtxPrev;
     CAmount nValueIn = 0;
     // Select coins with suitable depth
     if (!SelectCoinsForStaking(nBalance - nReserveBalance, setCoins, nValueIn))
         return false;
 
-    if (setCoins.empty())
+    // The kernel was searched for without holding the locks; make sure it is still ours to spend
+    auto itKernel = std::find_if(setCoins.begin(), setCoins.end(), [&](const CInputCoin& coin) { return coin.outpoint == prevoutKernel; });
+    if (itKernel == setCoins.end()) {
+        LogPrint(BCLog::STAKE, "CreateCoinStake : kernel %s is no longer available\n", prevoutKernel.ToString());
         return false;
+    }
 
     CAmount nCredit = 0;
     CScript scriptPubKeyKernel;
-    for (const auto& pcoin : setCoins) {
-        CDiskTxPos postx;
-        if (!pblocktree->ReadTxIndex(pcoin.outpoint.hash, postx))
-            continue;
-
-        // Read block header
-        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-        CBlockHeader header;
-        CTransactionRef tx;
-        try {
-            file >> header;
-            fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-            file >> tx;
-        } catch (std::exception& e) {
-            return error("%s() : deserialize or I/O error in CreateCoinStake()", __PRETTY_FUNCTION__);
+    {
+        const CInputCoin& pcoin = *itKernel;
+        std::vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.txout.scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
+            LogPrint(BCLog::STAKE, "CreateCoinStake : failed to parse kernel type=%d\n", whichType);
+            return false;
+        }
+        LogPrint(BCLog::STAKE, "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH) {
+            LogPrint(BCLog::STAKE, "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            return false;
         }
 
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        unsigned int nTxTime = txNew.nTime;
-        for (unsigned int n = 0; n < std::min(nSearchInterval, (int64_t)nMaxStakeSearchInterval) && !fKernelFound; n++) {
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = uint256();
-            COutPoint prevoutStake = pcoin.outpoint;
-            
-            txNew.nTime = nTxTime - n;
-            if (CheckStakeKernelHash(chainActive.Tip(), nBits, header, txNew, *tx, prevoutStake, hashProofOfStake, true)) {
-                // Found a kernel
-                LogPrint(BCLog::STAKE, "CreateCoinStake : kernel found\n");
-                std::vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.txout.scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
-                    LogPrint(BCLog::STAKE, "CreateCoinStake : failed to parse kernel type=%d\n", whichType);
-                    break;
-                }
-                LogPrint(BCLog::STAKE, "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH) {
-                    LogPrint(BCLog::STAKE, "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;
-                }
-
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(CKeyID(uint160(vSolutions[0])), key))
-                    {
-                        LogPrint(BCLog::STAKE, "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-
-                    if (!keystore.GetKey(CKeyID(Hash160(vchPubKey)), key))
-                    {
-                        LogPrint(BCLog::STAKE, "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != CPubKey(vchPubKey))
-                    {
-                        LogPrint(BCLog::STAKE, "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(CKeyID(uint160(vSolutions[0])), key))
+            {
+                LogPrint(BCLog::STAKE, "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
 
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
+            if (!keystore.GetKey(CKeyID(Hash160(vchPubKey)), key))
+            {
+                LogPrint(BCLog::STAKE, "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false;  // unable to find corresponding public key
+            }
 
-                txNew.vin.push_back(CTxIn(pcoin.outpoint.hash, pcoin.outpoint.n));
-                nCredit += pcoin.txout.nValue;
-                vwtxPrev.push_back(tx);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-                LogPrint(BCLog::STAKE, "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != CPubKey(vchPubKey))
+            {
+                LogPrint(BCLog::STAKE, "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                return false; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+
+        txNew.vin.push_back(CTxIn(pcoin.outpoint.hash, pcoin.outpoint.n));
+        nCredit += pcoin.txout.nValue;
+        vwtxPrev.push_back(pcoin);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        LogPrint(BCLog::STAKE, "CreateCoinStake : added kernel type=%d\n", whichType);
     }
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
     for (const auto& pcoin : setCoins) {
-        CDiskTxPos postx;
-        if (!pblocktree->ReadTxIndex(pcoin.outpoint.hash, postx))
-            continue;
-
-        // Read block header
-        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-        CBlockHeader header;
-        CTransactionRef tx;
-        try {
-            file >> header;
-            fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-            file >> tx;
-        } catch (std::exception& e) {
-            return error("%s() : deserialize or I/O error in CreateCoinStake()", __PRETTY_FUNCTION__);
-        }
-
-
         // Attempt to add more inputs
         // Only add coins of the same key/address as kernel
         if (txNew.vout.size() == 2 && ((pcoin.txout.scriptPubKey == scriptPubKeyKernel || pcoin.txout.scriptPubKey == txNew.vout[1].scriptPubKey))
@@ -4251,7 +4212,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, int64_t nFees, int nHei
             txNew.vin.push_back(CTxIn(pcoin.outpoint.hash, pcoin.outpoint.n));
             nCredit += pcoin.txout.nValue;
 
-            vwtxPrev.push_back(tx);
+            vwtxPrev.push_back(pcoin);
         }
     }
 
@@ -4298,7 +4259,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, int64_t nFees, int nHei
 
     int nIn = 0;
     for (const auto& pcoin : vwtxPrev) {
-        if (!SignSignature(*this, *pcoin, txNew, nIn++, SIGHASH_ALL))
+        if (!SignSignature(*this, pcoin.txout.scriptPubKey, txNew, nIn++, pcoin.txout.nValue, SIGHASH_ALL))
             return error("CreateCoinStake : failed to sign coinstake");
     }
 
@@ -991,7 +991,10 @@ public:
      * @note passing nChangePosInOut as -1 will result in setting a random position
      */
     bool CreateTransaction(const std::vector<CRecipient>& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, int& nChangePosInOut, std::string& strFailReason, const CCoinControl& coin_control, bool sign = true);
-    bool CreateCoinStake(const CKeyStore& keystore, int64_t nFees, int nHeight, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction& txNew, CKey &key);
+    /** Coins the stake minter may search for a kernel; takes cs_main and cs_wallet only while collecting them */
+    bool GetStakeCandidates(std::vector<CInputCoin>& vCandidates) const;
+    /** Build and sign the coinstake spending the kernel prevoutKernel, found for timestamp nTime */
+    bool CreateCoinStake(const CKeyStore& keystore, const COutPoint& prevoutKernel, unsigned int nTime, int64_t nFees, int nHeight, CMutableTransaction& txNew, CKey &key);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, CConnman* connman, CValidationState& state);
 
     void ListAccountCreditDebit(const std::string& strAccount, std::list<CAccountingEntry>& entries);
@@ -7,9 +7,13 @@
 
 #include <version.h>
 #include <validation.h>
+#include <scheduler.h>
 #include <streams.h>
 #include <util.h>
 
+//! Milliseconds between NotifyTimer calls of the notifiers
+static const int64_t ZMQ_TIMER_INTERVAL = 1000;
+
 void zmqError(const char *str)
 {
     LogPrint(BCLog::ZMQ, "zmq: Error: %s, errno=%s\n", str, zmq_strerror(errno));
@@ -29,7 +33,7 @@ CZMQNotificationInterface::~CZMQNotificationInterface()
     }
 }
 
-CZMQNotificationInterface* CZMQNotificationInterface::Create()
+CZMQNotificationInterface* CZMQNotificationInterface::Create(CScheduler& scheduler)
 {
     CZMQNotificationInterface* notificationInterface = nullptr;
     std::map<std::string, CZMQNotifierFactory> factories;
@@ -39,6 +43,7 @@ CZMQNotificationInterface* CZMQNotificationInterface::Create()
     factories["pubhashtx"] = CZMQAbstractNotifier::Create<CZMQPublishHashTransactionNotifier>;
     factories["pubrawblock"] = CZMQAbstractNotifier::Create<CZMQPublishRawBlockNotifier>;
     factories["pubrawtx"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionNotifier>;
+    factories["pubblocktemplate"] = CZMQAbstractNotifier::Create<CZMQPublishBlockTemplateNotifier>;
 
     for (const auto& entry : factories)
     {
@@ -64,6 +69,13 @@ CZMQNotificationInterface* CZMQNotificationInterface::Create()
             delete notificationInterface;
             notificationInterface = nullptr;
         }
+        else
+        {
+            // The scheduler thread also runs the validation callbacks, so
+            // notifiers don't see a timer and a notification at the same time.
+            // It is stopped before the interface is deleted.
+            scheduler.scheduleEvery(std::bind(&CZMQNotificationInterface::NotifyTimer, notificationInterface), ZMQ_TIMER_INTERVAL);
+        }
     }
 
     return notificationInterface;
@@ -144,6 +156,23 @@ void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindexNew, co
     }
 }
 
+void CZMQNotificationInterface::NotifyTimer()
+{
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        if (notifier->NotifyTimer())
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
+
 void CZMQNotificationInterface::TransactionAddedToMempool(const CTransactionRef& ptx)
 {
     // Used by BlockConnected and BlockDisconnected as well, because they're
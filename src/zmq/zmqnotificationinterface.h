@@ -11,6 +11,7 @@
 #include <list>
 
 class CBlockIndex;
+class CScheduler;
 class CZMQAbstractNotifier;
 
 class CZMQNotificationInterface final : public CValidationInterface
@@ -18,11 +19,12 @@ class CZMQNotificationInterface final : public CValidationInterface
 public:
     virtual ~CZMQNotificationInterface();
 
-    static CZMQNotificationInterface* Create();
+    static CZMQNotificationInterface* Create(CScheduler& scheduler);
 
 protected:
     bool Initialize();
     void Shutdown();
+    void NotifyTimer();
 
     // CValidationInterface
     void TransactionAddedToMempool(const CTransactionRef& tx) override;
@@ -4,10 +4,12 @@
 
 #include <chain.h>
 #include <chainparams.h>
+#include <miner.h>
 #include <streams.h>
 #include <zmq/zmqpublishnotifier.h>
 #include <validation.h>
 #include <util.h>
+#include <utilmoneystr.h>
 #include <rpc/server.h>
 
 static std::multimap<std::string, CZMQAbstractPublishNotifier*> mapPublishNotifiers;
@@ -16,6 +18,7 @@ static const char *MSG_HASHBLOCK = "hashblock";
 static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_BLOCKTEMPLATE = "blocktemplate";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -195,3 +198,86 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+CZMQPublishBlockTemplateNotifier::CZMQPublishBlockTemplateNotifier() : nFeeDelta(DEFAULT_ZMQ_BLOCKTEMPLATE_FEE_DELTA), nFees(0), fTxArrived(false)
+{
+}
+
+bool CZMQPublishBlockTemplateNotifier::Initialize(void *pcontext)
+{
+    // Checked by AppInitParameterInteraction
+    if (gArgs.IsArgSet("-zmqblocktemplatefeedelta"))
+        ParseMoney(gArgs.GetArg("-zmqblocktemplatefeedelta", ""), nFeeDelta);
+    return CZMQAbstractPublishNotifier::Initialize(pcontext);
+}
+
+/* The body is a proof-of-work template in network serialization:
+     int32 version, uint256 previous block hash, uint32 time, uint32 bits,
+     int32 height, int64 fees of the transactions,
+     the coinbase transaction paying the block value to OP_TRUE,
+     the vector of transaction hashes and the vector of transactions, in block order after the coinbase
+*/
+bool CZMQPublishBlockTemplateNotifier::PublishTemplate()
+{
+    CScript scriptDummy = CScript() << OP_TRUE;
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy);
+    if (!pblocktemplate)
+    {
+        zmqError("Unable to create block template");
+        return false;
+    }
+    const CBlock& block = pblocktemplate->block;
+    CAmount nTemplateFees = -pblocktemplate->vTxFees[0];
+    if (block.hashPrevBlock == hashPrevBlock && nTemplateFees < nFees + nFeeDelta)
+        return true;
+
+    int32_t nHeight;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+            return true;
+        nHeight = mi->second->nHeight + 1;
+    }
+
+    std::vector<uint256> vHashes;
+    std::vector<CTransactionRef> vtx(block.vtx.begin() + 1, block.vtx.end());
+    vHashes.reserve(vtx.size());
+    for (const CTransactionRef& ptx : vtx)
+        vHashes.push_back(ptx->GetHash());
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
+    ss << block.nVersion << block.hashPrevBlock << block.nTime << block.nBits << nHeight << nTemplateFees;
+    ss << *block.vtx[0] << vHashes << vtx;
+
+    LogPrint(BCLog::ZMQ, "zmq: Publish blocktemplate on %s, %d txs, fees %s\n", block.hashPrevBlock.GetHex(), vtx.size(), FormatMoney(nTemplateFees));
+    if (!SendMessage(MSG_BLOCKTEMPLATE, &(*ss.begin()), ss.size()))
+        return false;
+
+    hashPrevBlock = block.hashPrevBlock;
+    nFees = nTemplateFees;
+    return true;
+}
+
+bool CZMQPublishBlockTemplateNotifier::NotifyBlock(const CBlockIndex *pindex)
+{
+    fTxArrived = false;
+    return PublishTemplate();
+}
+
+bool CZMQPublishBlockTemplateNotifier::NotifyTransaction(const CTransaction &transaction)
+{
+    // Also called for the transactions of connected blocks, before NotifyBlock
+    fTxArrived = true;
+    return true;
+}
+
+bool CZMQPublishBlockTemplateNotifier::NotifyTimer()
+{
+    // Check the fees of a new template once a second while transactions arrive,
+    // so the last ones of a burst are not left waiting for the next arrival
+    if (!fTxArrived || IsInitialBlockDownload())
+        return true;
+    fTxArrived = false;
+    return PublishTemplate();
+}
@@ -7,8 +7,14 @@
 
 #include <zmq/zmqabstractnotifier.h>
 
+#include <amount.h>
+#include <uint256.h>
+
 class CBlockIndex;
 
+/** Default fee improvement that has a new block template published without a tip change */
+static const CAmount DEFAULT_ZMQ_BLOCKTEMPLATE_FEE_DELTA = COIN / 1000;
+
 class CZMQAbstractPublishNotifier : public CZMQAbstractNotifier
 {
 private:
@@ -52,4 +58,26 @@ public:
     bool NotifyTransaction(const CTransaction &transaction) override;
 };
 
+/** Publishes a block template when the tip changes or its fees improve by -zmqblocktemplatefeedelta */
+class CZMQPublishBlockTemplateNotifier : public CZMQAbstractPublishNotifier
+{
+private:
+    CAmount nFeeDelta;
+    //! previous block and fees of the last template published
+    uint256 hashPrevBlock;
+    CAmount nFees;
+    //! transactions arrived since the last template
+    bool fTxArrived;
+
+    bool PublishTemplate();
+
+public:
+    CZMQPublishBlockTemplateNotifier();
+
+    bool Initialize(void *pcontext) override;
+    bool NotifyBlock(const CBlockIndex *pindex) override;
+    bool NotifyTransaction(const CTransaction &transaction) override;
+    bool NotifyTimer() override;
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H